@@ -0,0 +1,577 @@
+//
+// Module:
+//      epollserver.cpp
+//
+// Abstract:
+//      This program is an edge-triggered epoll version of the echo server.
+//
+//      iocpserverex feeds every worker from one listening socket through one shared
+//      completion port, so all accepts go through the single listening socket context.
+//      Here every worker thread owns:
+//
+//          - its own epoll instance,
+//          - its own listening socket bound to the same port with SO_REUSEPORT, and
+//          - the connections accepted on that socket.
+//
+//      The kernel spreads new connections across the listening sockets, so there is
+//      no shared accept state and no lock between workers; a connection is only ever
+//      touched by the worker that accepted it.
+//
+//      All sockets are non-blocking and registered once with EPOLLIN | EPOLLOUT |
+//      EPOLLET.  An edge is only reported once, so every handler keeps calling
+//      accept/recv/send until it gets EAGAIN.  Every read fills the next of a
+//      few echo buffers of the socket, and once the socket has nothing more to
+//      read, or the buffers are full, all of it goes back in one sendmsg with an
+//      iovec per buffer, so a burst costs one send however many reads it took.  A
+//      partial send moves through the iovec, nothing is copied.  The buffers are
+//      the socket's backpressure: while they are all full the worker stops
+//      reading from that socket and resumes once EPOLLOUT flushed them.  On exit
+//      the server prints how many reads a send took on average.
+//
+//      Nothing that happens on the I/O paths is printed to the console.  It is
+//      logged with BinaryLog (NetworkLibrary), which only stores a record in a
+//      ring of the worker and formats it on a log thread, into a file (-f) that
+//      is rotated as it grows.  Verbose (-v) also logs every accept, read,
+//      blocked send and close.
+//
+//      On CTRL-C the main thread signals every worker's eventfd, whose epoll data is
+//      NULL, the same way iocpserverex posts a NULL completion key.
+//
+//      Scaling from 1 to N cores is measured by starting the server with -t:1, -t:2,
+//      ... -t:N and running echobenchclient against it, once in echo mode for
+//      throughput and once with -c for the connection rate.
+//
+//  Usage:
+//      Start the server with 4 workers on port 6001
+//          epollserver -e:6001 -t:4
+//      Log every accept, read, blocked send and close to echo.log
+//          epollserver -e:6001 -v -f:echo.log
+//
+//  Build:
+//      g++ -O2 -std=c++17 -I../NetworkLibrary EpollServer.cpp ../NetworkLibrary/BinaryLog.cpp
+//          -lpthread -o epollserver
+//
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "BinaryLog.h"
+#include "EpollServer.h"
+
+#define xmalloc(s) calloc(1, (s))
+#define xfree(p)   free(p)
+
+const char* g_Port = DEFAULT_PORT;
+volatile bool g_bEndServer = false;		// set to true on CTRL-C
+bool g_bVerbose = false;			// log every accept, read, blocked send and close
+const char* g_szLogFile = DEFAULT_LOG_FILE;	// where the I/O paths log (-f)
+BinaryLog g_Log;
+int g_nThreadCount = 0;
+int g_nBacklog = SOMAXCONN;			// listen() backlog of every worker's listener
+WORKER_CONTEXT g_Workers[MAX_WORKER_THREAD];
+
+int main(int argc, char* argv[]) {
+
+	sigset_t sigset;
+	int nSignal = 0;
+	int nStarted = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argc, argv))
+		return(1);
+
+	if ((nRet = g_Log.Init(g_szLogFile, g_bVerbose ? LogLevelDebug : LogLevelInfo)) != 0)
+		printf("BinaryLog::Init(%s) failed, nothing is logged: %d\n", g_szLogFile, nRet);
+
+	if (g_nThreadCount == 0)
+		g_nThreadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (g_nThreadCount > MAX_WORKER_THREAD)
+		g_nThreadCount = MAX_WORKER_THREAD;
+
+	//
+	// CTRL-C and friends are picked up synchronously by the main thread with
+	// sigwait, so block them before any thread is created.
+	//
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	for (int i = 0; i < g_nThreadCount; i++) {
+		g_Workers[i].hEpoll = -1;
+		g_Workers[i].hWakeup = -1;
+		g_Workers[i].sdListen = -1;
+	}
+
+	for (int i = 0; i < g_nThreadCount; i++) {
+		PWORKER_CONTEXT lpWorker = &g_Workers[i];
+
+		if (!CreateWorker(lpWorker))
+			break;
+
+		if (pthread_create(&lpWorker->hThread, NULL, WorkerThread, lpWorker) != 0) {
+			printf("pthread_create() failed to create worker thread\n");
+			break;
+		}
+		lpWorker->bStarted = true;
+		nStarted++;
+	}
+
+	if (nStarted == g_nThreadCount)
+		sigwait(&sigset, &nSignal);
+
+	g_bEndServer = true;
+
+	//
+	// Cause worker threads to exit and make sure they do
+	//
+	for (int i = 0; i < g_nThreadCount; i++) {
+		uint64_t nOne = 1;
+
+		if (g_Workers[i].bStarted && write(g_Workers[i].hWakeup, &nOne, sizeof(nOne)) < 0)
+			printf("write(eventfd) failed: %d\n", errno);
+	}
+
+	uint64_t nSends = 0;
+	uint64_t nSendMessages = 0;
+
+	for (int i = 0; i < g_nThreadCount; i++) {
+		PWORKER_CONTEXT lpWorker = &g_Workers[i];
+
+		if (lpWorker->bStarted)
+			pthread_join(lpWorker->hThread, NULL);
+		lpWorker->bStarted = false;
+		nSends += lpWorker->nSends;
+		nSendMessages += lpWorker->nSendMessages;
+
+		CtxtListFree(lpWorker);
+
+		if (lpWorker->sdListen != -1)
+			close(lpWorker->sdListen);
+		if (lpWorker->hWakeup != -1)
+			close(lpWorker->hWakeup);
+		if (lpWorker->hEpoll != -1)
+			close(lpWorker->hEpoll);
+	}
+
+	printf("Sends: %llu reads echoed in %llu sends (%.2f reads per send)\n",
+		(unsigned long long)nSendMessages, (unsigned long long)nSends,
+		nSends ? (double)nSendMessages / nSends : 0.0);
+	g_Log.Exit();
+
+	return(0);
+} //main
+
+//
+//  Just validate the command line options.
+//
+bool ValidOptions(int argc, char* argv[]) {
+	bool bRet = true;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'e':
+				if (strlen(argv[i]) > 3)
+					g_Port = &argv[i][3];
+				break;
+
+			case 'f':
+				if (strlen(argv[i]) > 3)
+					g_szLogFile = &argv[i][3];
+				break;
+
+			case 'l':
+				if (strlen(argv[i]) > 3)
+					g_nBacklog = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_nThreadCount = atoi(&argv[i][3]);
+				break;
+
+			case 'v':
+				g_bVerbose = true;
+				break;
+
+			case '?':
+				printf("Usage:\n  epollserver [-e:port] [-f:file] [-l:#] [-t:#] [-v] [-?]\n");
+				printf("  -e:port\tSpecify echoing port number\n");
+				printf("  -f:file\tLog file, rotated at %d MB (Def: %s)\n", LOG_FILE_BYTES >> 20, DEFAULT_LOG_FILE);
+				printf("  -l:#\t\tListen backlog per worker (Def: %d)\n", SOMAXCONN);
+				printf("  -t:#\t\tNumber of worker threads (Def: number of CPUs)\n");
+				printf("  -v\t\tVerbose, log every accept, read, blocked send and close\n");
+				printf("  -?\t\tDisplay this help\n");
+				bRet = false;
+				break;
+
+			default:
+				printf("Unknown options flag %s\n", argv[i]);
+				bRet = false;
+				break;
+			}
+		}
+	}
+
+	return(bRet);
+}
+
+//
+//  Create the epoll instance, wakeup event and listening socket of one worker.
+//
+bool CreateWorker(PWORKER_CONTEXT lpWorker) {
+
+	struct epoll_event ev = {};
+
+	lpWorker->hEpoll = epoll_create1(EPOLL_CLOEXEC);
+	if (lpWorker->hEpoll == -1) {
+		printf("epoll_create1() failed: %d\n", errno);
+		return(false);
+	}
+
+	lpWorker->hWakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (lpWorker->hWakeup == -1) {
+		printf("eventfd() failed: %d\n", errno);
+		return(false);
+	}
+
+	//
+	// the wakeup event carries NULL, like the completion key used to stop an IOCP worker
+	//
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(lpWorker->hEpoll, EPOLL_CTL_ADD, lpWorker->hWakeup, &ev) == -1) {
+		printf("epoll_ctl(eventfd) failed: %d\n", errno);
+		return(false);
+	}
+
+	lpWorker->sdListen = CreateListenSocket();
+	if (lpWorker->sdListen == -1)
+		return(false);
+
+	lpWorker->CtxtListenSocket.Socket = lpWorker->sdListen;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &lpWorker->CtxtListenSocket;
+	if (epoll_ctl(lpWorker->hEpoll, EPOLL_CTL_ADD, lpWorker->sdListen, &ev) == -1) {
+		printf("epoll_ctl(listen) failed: %d\n", errno);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+//  Create a non-blocking listening socket that shares the port with the other
+//  workers, bind, and set up its listening backlog.
+//
+int CreateListenSocket(void) {
+
+	int nRet = 0;
+	int nOne = 1;
+	int sdListen = -1;
+	struct addrinfo hints = {};
+	struct addrinfo* addrlocal = NULL;
+
+	//
+	// Resolve the interface
+	//
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_IP;
+
+	if (getaddrinfo(NULL, g_Port, &hints, &addrlocal) != 0 || addrlocal == NULL) {
+		printf("getaddrinfo() failed to resolve/convert the interface\n");
+		return(-1);
+	}
+
+	sdListen = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (sdListen == -1) {
+		printf("socket() failed: %d\n", errno);
+		freeaddrinfo(addrlocal);
+		return(-1);
+	}
+
+	setsockopt(sdListen, SOL_SOCKET, SO_REUSEADDR, (char*)&nOne, sizeof(nOne));
+
+	nRet = setsockopt(sdListen, SOL_SOCKET, SO_REUSEPORT, (char*)&nOne, sizeof(nOne));
+	if (nRet == -1) {
+		printf("setsockopt(SO_REUSEPORT) failed: %d\n", errno);
+		close(sdListen);
+		freeaddrinfo(addrlocal);
+		return(-1);
+	}
+
+	nRet = bind(sdListen, addrlocal->ai_addr, (int)addrlocal->ai_addrlen);
+	if (nRet == -1) {
+		printf("bind() failed: %d\n", errno);
+		close(sdListen);
+		freeaddrinfo(addrlocal);
+		return(-1);
+	}
+
+	nRet = listen(sdListen, g_nBacklog);
+	if (nRet == -1) {
+		printf("listen() failed: %d\n", errno);
+		close(sdListen);
+		freeaddrinfo(addrlocal);
+		return(-1);
+	}
+
+	freeaddrinfo(addrlocal);
+
+	return(sdListen);
+}
+
+//
+// Worker thread that handles all readiness events on the sockets it owns.
+//
+void* WorkerThread(void* WorkThreadContext) {
+
+	PWORKER_CONTEXT lpWorker = (PWORKER_CONTEXT)WorkThreadContext;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	int nEvents = 0;
+
+	while (true) {
+
+		//
+		// continually loop to service readiness events
+		//
+		nEvents = epoll_wait(lpWorker->hEpoll, events, MAX_EPOLL_EVENTS, -1);
+		if (nEvents == -1) {
+			if (errno == EINTR)
+				continue;
+			printf("epoll_wait() failed: %d\n", errno);
+			kill(getpid(), SIGTERM);
+			return(NULL);
+		}
+
+		for (int i = 0; i < nEvents; i++) {
+			lpPerSocketContext = (PPER_SOCKET_CONTEXT)events[i].data.ptr;
+
+			if (lpPerSocketContext == NULL || g_bEndServer) {
+
+				//
+				// main thread signalled the wakeup event.  It is time to exit; the main
+				// thread will do all cleanup needed.
+				//
+				return(NULL);
+			}
+
+			if (lpPerSocketContext == &lpWorker->CtxtListenSocket) {
+				AcceptConnections(lpWorker);
+				continue;
+			}
+
+			if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+
+				//
+				// client connection dropped, continue to service remaining (and possibly
+				// new) client connections
+				//
+				CloseClient(lpWorker, lpPerSocketContext);
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) && !HandleWrite(lpWorker, lpPerSocketContext))
+				continue;
+
+			if (events[i].events & EPOLLIN)
+				HandleRead(lpWorker, lpPerSocketContext);
+		}
+	} //while
+	return(NULL);
+}
+
+//
+// The listening socket is edge-triggered, so accept until the backlog is empty.
+//
+void AcceptConnections(PWORKER_CONTEXT lpWorker) {
+
+	struct epoll_event ev = {};
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	int nOne = 1;
+
+	while (true) {
+		int sdAccept = accept4(lpWorker->sdListen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sdAccept == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LOG_WARNING(g_Log, "accept4() failed: %d", errno);
+			return;
+		}
+
+		setsockopt(sdAccept, IPPROTO_TCP, TCP_NODELAY, (char*)&nOne, sizeof(nOne));
+
+		lpPerSocketContext = (PPER_SOCKET_CONTEXT)xmalloc(sizeof(PER_SOCKET_CONTEXT));
+		if (lpPerSocketContext == NULL) {
+			LOG_ERROR(g_Log, "calloc() PER_SOCKET_CONTEXT failed: %d", errno);
+			close(sdAccept);
+			continue;
+		}
+		lpPerSocketContext->Socket = sdAccept;
+
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = lpPerSocketContext;
+		if (epoll_ctl(lpWorker->hEpoll, EPOLL_CTL_ADD, sdAccept, &ev) == -1) {
+			LOG_ERROR(g_Log, "epoll_ctl(accept) failed: %d", errno);
+			close(sdAccept);
+			xfree(lpPerSocketContext);
+			continue;
+		}
+
+		//
+		// add node to head of the worker's list
+		//
+		lpPerSocketContext->pCtxtBack = lpWorker->pCtxtList;
+		if (lpWorker->pCtxtList)
+			lpWorker->pCtxtList->pCtxtForward = lpPerSocketContext;
+		lpWorker->pCtxtList = lpPerSocketContext;
+
+		LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) accepted",
+			(int)(lpWorker - g_Workers), sdAccept);
+	}
+}
+
+//
+// Read everything that can be read without blocking, each read into the next
+// free echo buffer, and echo it all with one gathered send.  When every buffer is
+// full they are sent first; if the socket cannot take all of that, reading stops
+// until EPOLLOUT, and HandleWrite picks it up again.  Returns false if the
+// connection was closed.
+//
+bool HandleRead(PWORKER_CONTEXT lpWorker, PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	int nSlot = 0;
+
+	while (true) {
+		if (lpPerSocketContext->nSendCount == SEND_QUEUE_SLOTS) {
+			if (!HandleWrite(lpWorker, lpPerSocketContext))
+				return(false);
+			if (lpPerSocketContext->nSendCount == SEND_QUEUE_SLOTS)
+				return(true);
+		}
+
+		nSlot = (lpPerSocketContext->nSendHead + lpPerSocketContext->nSendCount) % SEND_QUEUE_SLOTS;
+		ssize_t nRecv = recv(lpPerSocketContext->Socket, lpPerSocketContext->Buffers[nSlot], MAX_BUFF_SIZE, 0);
+		if (nRecv == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (nRecv == -1 && errno == EINTR)
+			continue;
+		if (nRecv <= 0) {
+			CloseClient(lpWorker, lpPerSocketContext);
+			return(false);
+		}
+
+		lpPerSocketContext->nLengths[nSlot] = (int)nRecv;
+		lpPerSocketContext->nSendCount++;
+
+		LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Recv completed (%d bytes)",
+			(int)(lpWorker - g_Workers), lpPerSocketContext->Socket, (int)nRecv);
+	}
+
+	return(HandleWrite(lpWorker, lpPerSocketContext));
+}
+
+//
+// Send whatever is left in the echo buffers with one sendmsg, an iovec per
+// buffer, the first starting nSentBytes into the oldest.  A partial send only
+// moves nSentBytes and the head along.  Once they are all sent, resume reading:
+// with edge triggering any data that arrived while the send was blocked will not
+// be reported again.  Returns false if the connection was closed.
+//
+bool HandleWrite(PWORKER_CONTEXT lpWorker, PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	struct iovec iov[SEND_QUEUE_SLOTS];
+	struct msghdr msg = {};
+	int nSlot = 0;
+
+	while (lpPerSocketContext->nSendCount) {
+		for (int i = 0; i < lpPerSocketContext->nSendCount; i++) {
+			nSlot = (lpPerSocketContext->nSendHead + i) % SEND_QUEUE_SLOTS;
+			iov[i].iov_base = lpPerSocketContext->Buffers[nSlot];
+			iov[i].iov_len = lpPerSocketContext->nLengths[nSlot];
+		}
+		iov[0].iov_base = (char*)iov[0].iov_base + lpPerSocketContext->nSentBytes;
+		iov[0].iov_len -= lpPerSocketContext->nSentBytes;
+		msg.msg_iov = iov;
+		msg.msg_iovlen = lpPerSocketContext->nSendCount;
+
+		ssize_t nSend = sendmsg(lpPerSocketContext->Socket, &msg, MSG_NOSIGNAL);
+		if (nSend == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Send partially completed, waiting for EPOLLOUT",
+				(int)(lpWorker - g_Workers), lpPerSocketContext->Socket);
+			return(true);
+		}
+		if (nSend == -1 && errno == EINTR)
+			continue;
+		if (nSend <= 0) {
+			CloseClient(lpWorker, lpPerSocketContext);
+			return(false);
+		}
+
+		lpWorker->nSends++;
+		lpPerSocketContext->nSentBytes += (int)nSend;
+		while (lpPerSocketContext->nSendCount &&
+			lpPerSocketContext->nSentBytes >= lpPerSocketContext->nLengths[lpPerSocketContext->nSendHead]) {
+			lpPerSocketContext->nSentBytes -= lpPerSocketContext->nLengths[lpPerSocketContext->nSendHead];
+			lpPerSocketContext->nSendHead = (lpPerSocketContext->nSendHead + 1) % SEND_QUEUE_SLOTS;
+			lpPerSocketContext->nSendCount--;
+			lpWorker->nSendMessages++;
+		}
+	}
+
+	return(true);
+}
+
+//
+//  Close down a connection with a client and free its context.  Closing the socket
+//  also removes it from the epoll instance.
+//
+void CloseClient(PWORKER_CONTEXT lpWorker, PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_SOCKET_CONTEXT pBack = lpPerSocketContext->pCtxtBack;
+	PPER_SOCKET_CONTEXT pForward = lpPerSocketContext->pCtxtForward;
+
+	LOG_DEBUG(g_Log, "CloseClient: Socket(%d) connection closing", lpPerSocketContext->Socket);
+
+	if (pBack)
+		pBack->pCtxtForward = pForward;
+	if (pForward)
+		pForward->pCtxtBack = pBack;
+	else
+		lpWorker->pCtxtList = pBack;
+
+	close(lpPerSocketContext->Socket);
+	xfree(lpPerSocketContext);
+}
+
+//
+//  Free all connections of a worker.  Only called once the worker has exited.
+//
+void CtxtListFree(PWORKER_CONTEXT lpWorker) {
+
+	while (lpWorker->pCtxtList)
+		CloseClient(lpWorker, lpWorker->pCtxtList);
+}
@@ -0,0 +1,97 @@
+//
+// Module:
+//      epollserver.h
+//
+
+#ifndef EPOLLSERVER_H
+#define EPOLLSERVER_H
+
+#include <pthread.h>
+
+#define DEFAULT_PORT        "5001"
+#define DEFAULT_LOG_FILE    "epollserver.log"
+#define MAX_BUFF_SIZE       8192
+#define MAX_WORKER_THREAD   128
+#define MAX_EPOLL_EVENTS    256
+#define SEND_QUEUE_SLOTS    4               // reads a connection gathers into one sendmsg
+
+//
+// data to be associated with every socket added to a worker's epoll instance
+//
+// epoll is a reactor: the worker is told that a socket is readable or writable
+// and performs the recv/send itself, so there is no per-operation context.  The
+// echo buffers live with the socket: every recv fills the next one, and whatever
+// was read goes back in one sendmsg over all of them.  A queue that is not empty
+// once the send would block is waiting for EPOLLOUT.
+//
+typedef struct _PER_SOCKET_CONTEXT {
+    int                         Socket;
+    char                        Buffers[SEND_QUEUE_SLOTS][MAX_BUFF_SIZE];
+    int                         nLengths[SEND_QUEUE_SLOTS];
+    int                         nSendHead;      // oldest buffer not yet fully sent
+    int                         nSendCount;     // buffers holding data
+    int                         nSentBytes;     // how much of the oldest is sent
+
+    //
+    // per-worker list of connections, only touched by the owning worker
+    //
+    struct _PER_SOCKET_CONTEXT* pCtxtBack;
+    struct _PER_SOCKET_CONTEXT* pCtxtForward;
+} PER_SOCKET_CONTEXT, * PPER_SOCKET_CONTEXT;
+
+//
+// every worker owns its epoll instance, its SO_REUSEPORT listening socket and
+// the connections accepted on it; nothing is shared between workers
+//
+typedef struct _WORKER_CONTEXT {
+    int                         hEpoll;
+    int                         hWakeup;        // eventfd used to stop the worker
+    int                         sdListen;
+    PER_SOCKET_CONTEXT          CtxtListenSocket;
+    PPER_SOCKET_CONTEXT         pCtxtList;
+    pthread_t                   hThread;
+    bool                        bStarted;
+
+    //
+    // only written by the worker; read once it has exited
+    //
+    uint64_t                    nSends;         // sendmsg calls that sent anything
+    uint64_t                    nSendMessages;  // reads those sends finished
+} WORKER_CONTEXT, * PWORKER_CONTEXT;
+
+bool ValidOptions(int argc, char* argv[]);
+
+bool CreateWorker(
+    PWORKER_CONTEXT lpWorker
+);
+
+int CreateListenSocket(void);
+
+void* WorkerThread(
+    void* WorkContext
+);
+
+void AcceptConnections(
+    PWORKER_CONTEXT lpWorker
+);
+
+bool HandleRead(
+    PWORKER_CONTEXT lpWorker,
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+bool HandleWrite(
+    PWORKER_CONTEXT lpWorker,
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+void CloseClient(
+    PWORKER_CONTEXT lpWorker,
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+void CtxtListFree(
+    PWORKER_CONTEXT lpWorker
+);
+
+#endif
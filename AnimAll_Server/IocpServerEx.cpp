@@ -16,6 +16,69 @@
 //      in the iocpserver.cpp. But it uses overlapped AcceptEx on the IOCP also. 
 //      AcceptEx allows data to be "returned" from an accepted connection.
 //
+//      Every connection always has a read posted.  What it receives is queued for
+//      sending with SessionSend(), which any thread may call, and the queue is
+//      sent in order, one send at a time, while the next read is already pending.
+//
+//      Every connection is also given a 64-bit session id.  SessionAcquire() finds
+//      the connection for an id without a global lock, and an id outlives its
+//      connection harmlessly: once it is closed the id finds nothing.
+//
+//      With a tick rate (-t) the workers only do network I/O: what they receive
+//      is queued for a tick thread that runs the world at that fixed rate, and
+//      what a tick sends goes out in one batch when it ends, so the cost of the
+//      simulation never delays a completion.
+//
+//      By default the server runs two workers per processor, on a completion port
+//      that lets one per processor run at once, wherever the scheduler puts them.
+//      The worker count (-w) and that concurrency (-c) can be set, and workers can
+//      be pinned (-p): each to a processor of its own, or each to a NUMA node.
+//      Either way workers are dealt out over the NUMA nodes in turn, and within a
+//      node every core gets a worker before any core gets a second.  Contexts and
+//      buffers are carved by the thread that first needs them, so a pinned worker
+//      mostly touches memory of its own node.
+//
+//      With owned sessions (-o) every worker waits on a completion port of its
+//      own, and every connection is given to one worker for its whole life:
+//      whichever worker completes the AcceptEx passes it on to the next owner in
+//      turn, which puts the socket on its port.  From then on every completion of
+//      the connection, and so everything it receives, is handled by that worker
+//      only, so per-session state is only touched from one thread and stays in
+//      the caches of one core.  A send from any other thread, the tick thread or
+//      the worker of another session, is not queued on the connection there: it
+//      goes on a lock-free inbox of the owner, and one completion packet wakes the
+//      owner to queue whatever its inbox holds by then, however many sends were
+//      added meanwhile.  A close from another thread goes the same way, linked
+//      through the connection itself, so the owner is the only thread that ever
+//      posts on the socket or closes it, and it takes no lock to do so.
+//
+//      Nothing that happens on the I/O paths is printed to the console, where
+//      every worker would wait on the same lock and a write.  It is logged with
+//      BinaryLog (NetworkLibrary): a worker only stores a binary record in a ring
+//      of its own, and a log thread formats the records and writes them to a
+//      file (-f) that is rotated as it grows.  Verbose (-v) also logs every
+//      completion.
+//
+//      Every worker counts what it handles, connections, bytes, completions and
+//      partial sends, and with -s or -m keeps three latency histograms: how long
+//      a completion waits behind the others of its batch before its handler
+//      starts, how long it takes from posting a send to handling its completion,
+//      and how long from receiving data to completing the send of what it caused,
+//      echo, broadcast or tick.  The counters and histograms are written by their worker alone,
+//      with relaxed atomic loads and stores and no interlocked operation, and are
+//      only summed over the workers when they are printed (-s) or
+//      scraped: -m serves them on a local port in the Prometheus text format.
+//
+//      Built with PACKET_TRACE=1 the server can also trace single packets (-x):
+//      one completion in every few is followed through its stages, how long it
+//      waited in the completion queue behind its batch, how long its handler ran,
+//      how long the WSASend call of its reply took and how long that send was in
+//      the kernel until its completion was dequeued, and from its receive to that
+//      completion.  The stages are timed with the TSC and kept by PacketTrace
+//      (NetworkLibrary) in a ring per thread, and are served as a Chrome trace
+//      on /trace of the metrics port and written to a file on shutdown.  Without
+//      it nothing of the tracing is compiled in.
+//
 //      Another point worth noting is that the Win32 API CreateThread() does not 
 //      initialize the C Runtime and therefore, C runtime functions such as 
 //      printf() have been avoid or rewritten (see printf()) to use just Win32 APIs.
@@ -25,9 +88,50 @@
 //      Start the server and wait for connections on port 6001
 //          iocpserverex -e:6001
 //
+//      Keep 256 AcceptEx calls pending and ask for a 4096 connection backlog
+//      so a reconnect storm is absorbed without refused connections
+//          iocpserverex -e:6001 -a:256 -l:4096
+//
+//      Hold tens of thousands of mostly idle connections: every connection waits
+//      on a zero-byte read and only borrows a receive buffer from a shared pool
+//      while its data is echoed
+//          iocpserverex -e:6001 -i -s:10
+//
+//      On CTRL-C stop accepting and reading, give every connection up to 30
+//      seconds to receive what is queued for it, then close gracefully
+//          iocpserverex -e:6001 -g:30
+//
+//      Put every connection in one room: what one client sends goes to all of
+//      them, written once into a shared buffer that each send queue references
+//          iocpserverex -e:6001 -r
+//
+//      Run the room at 20 ticks per second: what clients send is collected by
+//      the tick thread and sent on at the end of every tick
+//          iocpserverex -e:6001 -r -t:20 -s:10
+//
+//      On a two-socket host with 32 cores run one worker per core, let all of
+//      them run at once, and keep each on its own core, half on either node
+//          iocpserverex -e:6001 -w:32 -c:32 -p:core
+//
+//      Give every connection to one of 16 workers for its whole life, each worker
+//      on a completion port and a core of its own
+//          iocpserverex -e:6001 -w:16 -o -p:core
+//
+//      Log every completion to a file of its own
+//          iocpserverex -e:6001 -v -f:d:\logs\iocpserverex.log
+//
+//      Serve the worker counters and latency histograms to Prometheus at
+//      http://127.0.0.1:9100/metrics
+//          iocpserverex -e:6001 -m:9100
+//
+//      Trace one packet in 100, and load http://127.0.0.1:9100/trace, or the
+//      iocpserverex.trace.json written on shutdown, in https://ui.perfetto.dev
+//          iocpserverex -e:6001 -m:9100 -x:100
+//
 //  Build:
 //      Use the headers and libs from the April98 Platform SDK or later.
 //      Link with ws2_32.lib and mswsock.lib
+//      Define PACKET_TRACE=1 for -x
 //      
 //
 //
@@ -52,32 +156,110 @@
 #include <stdlib.h>
 #include <strsafe.h>
 #include <process.h>
+#include <psapi.h>
 
 #include "IocpServerEx.h"
+#include "BinaryLog.h"
 
 #pragma comment(lib, "Ws2_32.lib")
 #pragma comment(lib, "Mswsock.lib")
+#pragma comment(lib, "Psapi.lib")
 
 const char* g_Port = DEFAULT_PORT;
-BOOL g_bEndServer = FALSE;			// set to TRUE on CTRL-C
+volatile BOOL g_bEndServer = FALSE;		// set to TRUE on CTRL-C
+volatile BOOL g_bDraining = FALSE;		// shutting down, flushing the send queues
+DWORD g_dwDrainSeconds = DEFAULT_DRAIN_SECONDS;	// longest flush on shutdown, 0 closes right away
+volatile LONG64 g_nSendQueuedBytes = 0;		// bytes on all send queues and worker inboxes
+volatile LONG g_nShutdownDropped = 0;		// connections closed on shutdown with bytes still queued
+volatile LONG64 g_nShutdownDroppedBytes = 0;	// and those bytes
+volatile LONG g_nInboxDropped = 0;		// inbox messages dropped on shutdown
+volatile LONG64 g_nInboxDroppedBytes = 0;	// and their bytes
+HANDLE g_hFlushedEvent = NULL;			// set once the queues are empty while draining
 //BOOL g_bRestart = TRUE;				// set to TRUE to CTRL-BRK
 BOOL g_bVerbose = FALSE;
+const char* g_szLogFile = DEFAULT_LOG_FILE;	// where the I/O paths log (-f)
+BinaryLog g_Log;
+const char* g_MetricsPort = NULL;		// local port the metrics are served on (-m), NULL for none
+SOCKET g_sdMetrics = INVALID_SOCKET;
+HANDLE g_hMetricsThread = NULL;
+BOOL g_bLatency = FALSE;			// workers measure latencies, with -s or -m
+double g_dQpcToNs = 0.0;			// nanoseconds per QueryPerformanceCounter tick
+std::atomic<uint64_t> g_nForeignCloses(0);	// connections closed on threads that are no worker
+PacketTrace g_Trace;
+unsigned g_nTraceRate = 0;			// trace one packet in every #, 0 for none (-x)
+const char* g_szTraceFile = DEFAULT_TRACE_FILE;
+const char* g_TraceStages[] = {			// handler span of every IO_OPERATION
+	"accept", "zero-byte read", "read", "send completion", "handoff", "inbox" };
+ULONG g_nDrainBatch = 1;			// completions removed per GetQueuedCompletionStatusEx call
+DWORD g_dwStatsInterval = 0;			// seconds between worker statistics, 0 for none
+int g_nAcceptPool = DEFAULT_ACCEPT_POOL;	// AcceptEx calls kept pending on the listening socket
+int g_nBacklog = 0;				// listen() backlog, 0 lets the stack pick (SOMAXCONN)
+BOOL g_bSharedBuffers = FALSE;			// idle connections hold no receive buffer
+BOOL g_bRoom = FALSE;				// broadcast to every connection instead of echoing (-r)
+ROOM g_Room;					// every connection when g_bRoom is set
+DWORD g_dwTickRate = 0;				// ticks per second, 0 handles messages on the workers
+HANDLE g_hTickThread = NULL;
+SLIST_HEADER g_TickInbound;			// messages received since the last tick, newest first
+POUTBOUND_MESSAGE g_pTickOutbound = NULL;	// what the running tick sends, tick thread only
+ULONG g_nTickOutbound = 0;
+ULONG g_nTickOutboundCapacity = 0;
+TICK_STATS g_TickStats;
+volatile LONG g_nConnections = 0;		// connections in the session table
+volatile LONG g_nSessionContexts = 0;		// connection contexts not yet recycled
+volatile LONG g_nAcceptsPending = 0;		// AcceptEx calls posted and not yet completed
+HANDLE g_hDrainedEvent = NULL;			// set once both are zero after shutdown started
+SIZE_T g_nBaseWorkingSet = 0;			// working set before the first connection
 HANDLE g_hIOCP = INVALID_HANDLE_VALUE;
+BOOL g_bOwnedSessions = FALSE;			// a completion port per worker, each connection on one (-o)
+HANDLE g_hWorkerPorts[MAX_WORKER_THREAD];	// with -o; the first is g_hIOCP, which accepts
+volatile LONG g_nNextOwner = 0;			// accepted connections dealt out in turn
+WORKER_INBOX g_WorkerInboxes[MAX_WORKER_THREAD];	// sends for the sessions of every worker (-o)
 SOCKET g_sdListen = INVALID_SOCKET;
 HANDLE g_ThreadHandles[MAX_WORKER_THREAD];
+WORKER_STATS g_WorkerStats[MAX_WORKER_THREAD];
+DWORD g_dwThreadCount = 0;
+DWORD g_dwWorkerCount = 0;			// worker threads (-w), 0 for two per processor
+DWORD g_dwConcurrency = 0;			// workers the port runs at once (-c), 0 for one per processor
+WORKER_PLACEMENT g_Placement = PlaceNone;	// where workers may run (-p)
+NUMA_NODE_LAYOUT g_NumaNodes[MAX_NUMA_NODES];	// nodes that have processors
+ULONG g_nNumaNodes = 0;
+PROCESSOR_NUMBER g_LayoutProcessors[MAX_LAYOUT_PROCESSORS];	// per node, see NUMA_NODE_LAYOUT
+ULONG g_nLayoutProcessors = 0;
 WSAEVENT g_hCleanupEvent[1];
 PPER_SOCKET_CONTEXT g_pCtxtListenSocket = NULL;
-PPER_SOCKET_CONTEXT g_pCtxtList = NULL;		// linked list of context info structures
-// maintained to allow the the cleanup 
-// handler to cleanly close all sockets and 
-// free resources.
-
-CRITICAL_SECTION g_CriticalSection;		// guard access to the global context list
+SESSION_SHARD g_SessionTable[SESSION_SHARDS];	// every connection by session id, also
+// walked by the cleanup handler to cleanly
+// close all sockets and free resources.
+
+SLIST_HEADER g_CtxtDepot;			// batches of free contexts handed between threads
+SLIST_HEADER g_CtxtStrays;			// single contexts freed by threads that are not workers
+SLIST_HEADER g_CtxtSlabs;			// every slab carved so far, released at exit
+SLIST_HEADER g_BufferPool;			// free shared receive buffers (-i)
+SLIST_HEADER g_BlockDepot[BLOCK_CLASSES];	// batches of free blocks handed between threads
+SLIST_HEADER g_BlockStrays[BLOCK_CLASSES];	// single blocks freed by threads that are not workers
+SLIST_HEADER g_BlockSlabs;			// every block slab carved so far, released at exit
+const SIZE_T g_BlockSizes[BLOCK_CLASSES] = {	// what a block of every class holds; the last
+	64, 256, 1024, 4096,			// takes a send buffer of a whole read
+	(SIZE_T)FIELD_OFFSET(SEND_BUFFER, Data) + MAX_BUFF_SIZE
+};
+__declspec(thread) BLOCK_CACHE t_BlockCache[BLOCK_CLASSES];	// blocks recycled by this thread
+__declspec(thread) LONG64* t_pRoomScratch = NULL;	// where this thread copies room members, see RoomBroadcast
+__declspec(thread) ULONG t_nRoomScratch = 0;
+__declspec(thread) PPER_SOCKET_CONTEXT t_pCtxtFreeList = NULL;	// contexts recycled by this thread
+__declspec(thread) LONG t_nCtxtFree = 0;
+volatile LONG g_nSessionShards = 0;		// shards handed to threads so far
+__declspec(thread) LONG t_nSessionShard = -1;	// shard this thread registers sessions in
+__declspec(thread) DWORD t_dwWorker = 0;	// index of the worker running on this thread
+__declspec(thread) PWORKER_INBOX t_lpInbox = NULL;	// the inbox this worker takes, NULL on other threads
+__declspec(thread) PWORKER_STATS t_lpStats = NULL;	// the counters of this worker, NULL on other threads
+__declspec(thread) ULONGLONG t_nTraceId = 0;	// the traced packet this thread handles, 0 for none
+__declspec(thread) ULONGLONG t_nTraceReceived = 0;	// TSC when its completion was dequeued
 
 void __cdecl main(int argc, char* argv[]) {
 
-	SYSTEM_INFO systemInfo;
 	WSADATA wsaData;
+	LARGE_INTEGER liFrequency;
+	DWORD dwProcessors = 0;
 	DWORD dwThreadCount = 0;
 	int nRet = 0;
 
@@ -90,14 +272,52 @@ void __cdecl main(int argc, char* argv[]) {
 	if (!ValidOptions(argc, argv))
 		return;
 
+	if ((nRet = g_Log.Init(g_szLogFile, g_bVerbose ? LogLevelDebug : LogLevelInfo)) != 0)
+		printf("BinaryLog::Init(%s) failed, nothing is logged: %d\n", g_szLogFile, nRet);
+
+	g_Trace.Init(g_nTraceRate);
+	if (g_nTraceRate)
+		printf("Tracing one packet in %u\n", g_nTraceRate);
+
+	QueryPerformanceFrequency(&liFrequency);
+	g_dQpcToNs = 1e9 / (double)liFrequency.QuadPart;
+	g_bLatency = (g_dwStatsInterval != 0 || g_MetricsPort != NULL);
+
 	if (!SetConsoleCtrlHandler(CtrlHandler, TRUE)) {
 		printf("SetConsoleCtrlHandler() failed to install console handler: %d\n",
 			GetLastError());
 		return;
 	}
 
-	GetSystemInfo(&systemInfo);
-	dwThreadCount = systemInfo.dwNumberOfProcessors * 2;
+	//
+	// count the processors of every group, GetSystemInfo() only sees the
+	// group this thread runs in
+	//
+	dwProcessors = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+	dwThreadCount = g_dwWorkerCount ? g_dwWorkerCount : dwProcessors * 2;
+	dwThreadCount = min(MAX_WORKER_THREAD, dwThreadCount);
+
+	if (g_Placement != PlaceNone && !WorkerLayoutInit()) {
+		printf("Workers are not pinned, the processor layout is unknown\n");
+		g_Placement = PlaceNone;
+	}
+
+	//
+	// with owned sessions every worker waits on a port of its own, so all of
+	// them run at once
+	//
+	if (g_bOwnedSessions)
+		g_dwConcurrency = dwThreadCount;
+
+	if (g_Placement == PlaceCore)
+		printf("Workers: %d, %d run at once, pinned to a processor each over %d NUMA nodes\n",
+			dwThreadCount, g_dwConcurrency ? g_dwConcurrency : dwProcessors, g_nNumaNodes);
+	else if (g_Placement == PlaceNode)
+		printf("Workers: %d, %d run at once, pinned to one of %d NUMA nodes each\n",
+			dwThreadCount, g_dwConcurrency ? g_dwConcurrency : dwProcessors, g_nNumaNodes);
+	else
+		printf("Workers: %d, %d run at once, not pinned\n",
+			dwThreadCount, g_dwConcurrency ? g_dwConcurrency : dwProcessors);
 
 	if (WSA_INVALID_EVENT == (g_hCleanupEvent[0] = WSACreateEvent()))
 	{
@@ -105,6 +325,16 @@ void __cdecl main(int argc, char* argv[]) {
 		return;
 	}
 
+	if ((g_hDrainedEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL ||
+		(g_hFlushedEvent = CreateEvent(NULL, TRUE, FALSE, NULL)) == NULL) {
+		printf("CreateEvent() failed: %d\n", GetLastError());
+		if (g_hDrainedEvent)
+			CloseHandle(g_hDrainedEvent);
+		WSACloseEvent(g_hCleanupEvent[0]);
+		g_hCleanupEvent[0] = WSA_INVALID_EVENT;
+		return;
+	}
+
 	if ((nRet = WSAStartup(0x202, &wsaData)) != 0) {
 		printf("WSAStartup() failed: %d\n", nRet);
 		SetConsoleCtrlHandler(CtrlHandler, FALSE);
@@ -112,110 +342,288 @@ void __cdecl main(int argc, char* argv[]) {
 			WSACloseEvent(g_hCleanupEvent[0]);
 			g_hCleanupEvent[0] = WSA_INVALID_EVENT;
 		}
+		CloseHandle(g_hDrainedEvent);
+		g_hDrainedEvent = NULL;
+		CloseHandle(g_hFlushedEvent);
+		g_hFlushedEvent = NULL;
 		return;
 	}
 
 
-	InitializeCriticalSection(&g_CriticalSection);
+	SessionTableInit();
+	InitializeSRWLock(&g_Room.Lock);
+	InitializeSListHead(&g_TickInbound);
+	InitializeSListHead(&g_CtxtDepot);
+	InitializeSListHead(&g_CtxtStrays);
+	InitializeSListHead(&g_CtxtSlabs);
+	InitializeSListHead(&g_BufferPool);
+	InitializeSListHead(&g_BlockSlabs);
+	for (int i = 0; i < BLOCK_CLASSES; i++) {
+		InitializeSListHead(&g_BlockDepot[i]);
+		InitializeSListHead(&g_BlockStrays[i]);
+	}
+	for (int i = 0; i < MAX_WORKER_THREAD; i++) {
+		InitializeSListHead(&g_WorkerInboxes[i].Messages);
+		InitializeSListHead(&g_WorkerInboxes[i].Closes);
+		g_WorkerInboxes[i].Wakeup.IOOperation = ClientIoInbox;
+	}
 
 	
 		g_bEndServer = FALSE;
 		WSAResetEvent(g_hCleanupEvent[0]);
+		ResetEvent(g_hDrainedEvent);
+		ResetEvent(g_hFlushedEvent);
+		g_bDraining = FALSE;
+		g_nShutdownDropped = 0;
+		g_nShutdownDroppedBytes = 0;
+		g_nInboxDropped = 0;
+		g_nInboxDroppedBytes = 0;
 
 		__try {
 
 			//
-			// notice that we will create more worker threads (dwThreadCount) than 
-			// the thread concurrency limit on the IOCP.
+			// by default we create more worker threads (dwThreadCount) than the
+			// thread concurrency limit on the IOCP, so a worker that blocks is
+			// covered by another.  With owned sessions every worker gets a port
+			// of its own, and the listening socket goes on the first.
 			//
-			g_hIOCP = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+			g_hIOCP = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, g_dwConcurrency);
 			if (g_hIOCP == NULL) {
 				printf("CreateIoCompletionPort() failed to create I/O completion port: %d\n",
 					GetLastError());
 				__leave;
 			}
 
+			if (g_bOwnedSessions) {
+				g_hWorkerPorts[0] = g_hIOCP;
+				for (DWORD i = 1; i < dwThreadCount; i++) {
+					g_hWorkerPorts[i] = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+					if (g_hWorkerPorts[i] == NULL) {
+						printf("CreateIoCompletionPort() failed to create I/O completion port: %d\n",
+							GetLastError());
+						__leave;
+					}
+				}
+			}
+
 			for (DWORD dwCPU = 0; dwCPU < dwThreadCount; dwCPU++) {
 
 				//
-				// Create worker threads to service the overlapped I/O requests.  The decision
-				// to create 2 worker threads per CPU in the system is a heuristic.  Also,
-				// note that thread handles are closed right away, because we will not need them
-				// and the worker threads will continue to execute.
+				// Create worker threads to service the overlapped I/O requests.  The default
+				// of 2 worker threads per CPU in the system is a heuristic.  A worker is
+				// created suspended so it is pinned before it runs.
 				//
 				HANDLE  hThread;
 				UINT   dwThreadId;
 
-				hThread = (HANDLE)_beginthreadex(NULL, 0, WorkerThread, g_hIOCP, 0, &dwThreadId);
+				hThread = (HANDLE)_beginthreadex(NULL, 0, WorkerThread, (LPVOID)(ULONG_PTR)dwCPU, CREATE_SUSPENDED, &dwThreadId);
 				if (hThread == NULL) {
 					printf("CreateThread() failed to create worker thread: %d\n",
 						GetLastError());
 					__leave;
 				}
+				if (g_Placement != PlaceNone && !WorkerPlace(hThread, dwCPU))
+					printf("SetThreadGroupAffinity() failed, WorkerThread %d is not pinned: %d\n",
+						dwCPU, GetLastError());
+				ResumeThread(hThread);
 				g_ThreadHandles[dwCPU] = hThread;
+				g_dwThreadCount = dwCPU + 1;
 				hThread = INVALID_HANDLE_VALUE;
 			}
 
+			//
+			// the tick thread runs the world; it is not a worker and never waits on
+			// the completion port
+			//
+			if (g_dwTickRate) {
+				UINT dwThreadId;
+
+				g_hTickThread = (HANDLE)_beginthreadex(NULL, 0, TickThread, NULL, 0, &dwThreadId);
+				if (g_hTickThread == NULL) {
+					printf("CreateThread() failed to create tick thread: %d\n",
+						GetLastError());
+					__leave;
+				}
+			}
+
 			if (!CreateListenSocket())
 				__leave;
 
-			if (!CreateAcceptSocket(TRUE))
+			if (!CreateAcceptPool())
 				__leave;
 
+			if (g_MetricsPort) {
+				UINT dwThreadId;
+
+				if (!CreateMetricsSocket())
+					__leave;
+				g_hMetricsThread = (HANDLE)_beginthreadex(NULL, 0, MetricsThread, NULL, 0, &dwThreadId);
+				if (g_hMetricsThread == NULL) {
+					printf("CreateThread() failed to create metrics thread: %d\n",
+						GetLastError());
+					__leave;
+				}
+				printf("Metrics: http://127.0.0.1:%s/metrics\n", g_MetricsPort);
+			}
+
+			if (g_dwStatsInterval) {
+				PROCESS_MEMORY_COUNTERS pmc;
+
+				if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+					g_nBaseWorkingSet = pmc.WorkingSetSize;
+			}
+
 			//  Լ
-			WSAWaitForMultipleEvents(1, g_hCleanupEvent, TRUE, WSA_INFINITE, FALSE);
+			while (WSAWaitForMultipleEvents(1, g_hCleanupEvent, TRUE,
+				g_dwStatsInterval ? g_dwStatsInterval * 1000 : WSA_INFINITE, FALSE) == WSA_WAIT_TIMEOUT)
+				PrintWorkerStats();
 		}
 
 		__finally {
 
+			BOOL bDrained = TRUE;
+			LONG nClosed = 0;
+
+			//
+			// Shut down while the workers are still running.  Closing the listening
+			// socket completes every pending AcceptEx, and closing every session
+			// cancels its operations; the workers handle those completions as usual,
+			// and the last one of a connection recycles its context.  The flag must
+			// be visible before the session table is walked, see the accept path.
+			//
+			// With a drain time (-g) no more reads are posted from here on, and the
+			// send queues get that long to empty first.  A connection that has
+			// flushed and has no read left posted closes itself gracefully; the rest
+			// are closed gracefully once the queues are empty or time is up, and
+			// whatever they still had queued is reported as dropped.
+			//
+			g_bDraining = (g_dwDrainSeconds != 0);
 			g_bEndServer = TRUE;
+			MemoryBarrier();
+
+			if (g_sdListen != INVALID_SOCKET) {
+				closesocket(g_sdListen);
+				g_sdListen = INVALID_SOCKET;
+			}
+
+			//
+			// closing the metrics socket fails the accept the metrics thread waits in
+			//
+			if (g_sdMetrics != INVALID_SOCKET) {
+				closesocket(g_sdMetrics);
+				g_sdMetrics = INVALID_SOCKET;
+			}
+			if (g_hMetricsThread) {
+				if (WaitForSingleObject(g_hMetricsThread, SHUTDOWN_DRAIN_TIMEOUT) != WAIT_OBJECT_0)
+					printf("Shutdown: metrics thread did not stop\n");
+				CloseHandle(g_hMetricsThread);
+				g_hMetricsThread = NULL;
+			}
+
+			//
+			// the tick thread runs one last tick, so what was received before the
+			// shutdown is still sent on and drained with the rest
+			//
+			if (g_hTickThread) {
+				if (WaitForSingleObject(g_hTickThread, SHUTDOWN_DRAIN_TIMEOUT) != WAIT_OBJECT_0)
+					printf("Shutdown: tick thread did not stop\n");
+				CloseHandle(g_hTickThread);
+				g_hTickThread = NULL;
+			}
+
+			//
+			// the count includes what the last tick left on the worker inboxes,
+			// so the wait also covers the owners queueing it on their connections
+			//
+			if (g_bDraining) {
+				if (g_nSendQueuedBytes == 0)
+					SetEvent(g_hFlushedEvent);
+				if (WaitForSingleObject(g_hFlushedEvent, (DWORD)((ULONGLONG)g_dwDrainSeconds * 1000)) != WAIT_OBJECT_0)
+					printf("Drain: %I64d bytes still queued after %d seconds\n",
+						g_nSendQueuedBytes, g_dwDrainSeconds);
+			}
+
+			SessionCloseAll(g_bDraining, &nClosed);
+			SessionCheckDrained();
+
+			if (g_dwThreadCount && WaitForSingleObject(g_hDrainedEvent, SHUTDOWN_DRAIN_TIMEOUT) != WAIT_OBJECT_0) {
+				printf("Shutdown: %d connections and %d AcceptEx still pending, memory is left to the system\n",
+					g_nSessionContexts, g_nAcceptsPending);
+				bDrained = FALSE;
+			}
+			else if (g_dwThreadCount == 0)
+				bDrained = (g_nSessionContexts == 0 && g_nAcceptsPending == 0);
 
 			//
 			// Cause worker threads to exit
 			//
 			if (g_hIOCP) {
-				for (DWORD i = 0; i < dwThreadCount; i++)
-					PostQueuedCompletionStatus(g_hIOCP, 0, 0, NULL);
+				for (DWORD i = 0; i < g_dwThreadCount; i++)
+					PostQueuedCompletionStatus(g_bOwnedSessions ? g_hWorkerPorts[i] : g_hIOCP, 0, 0, NULL);
 			}
 
 			//
-			// Make sure worker threads exits.
+			// Make sure worker threads exits.  One wait takes at most
+			// MAXIMUM_WAIT_OBJECTS handles.
 			//
-			if (WAIT_OBJECT_0 != WaitForMultipleObjects(dwThreadCount, g_ThreadHandles, TRUE, 1000))
-				printf("WaitForMultipleObjects() failed: %d\n", GetLastError());
-			else
-				for (DWORD i = 0; i < dwThreadCount; i++) {
-					if (g_ThreadHandles[i] != INVALID_HANDLE_VALUE)
-						CloseHandle(g_ThreadHandles[i]);
-					g_ThreadHandles[i] = INVALID_HANDLE_VALUE;
-				}
+			for (DWORD i = 0; i < g_dwThreadCount; i += MAXIMUM_WAIT_OBJECTS) {
+				DWORD dwCount = min(MAXIMUM_WAIT_OBJECTS, g_dwThreadCount - i);
 
-			if (g_sdListen != INVALID_SOCKET) {
-				closesocket(g_sdListen);
-				g_sdListen = INVALID_SOCKET;
+				if (WAIT_OBJECT_0 != WaitForMultipleObjects(dwCount, &g_ThreadHandles[i], TRUE, 1000)) {
+					printf("WaitForMultipleObjects() failed: %d\n", GetLastError());
+					continue;
+				}
+				for (DWORD j = i; j < i + dwCount; j++) {
+					CloseHandle(g_ThreadHandles[j]);
+					g_ThreadHandles[j] = INVALID_HANDLE_VALUE;
+				}
 			}
 
-			if (g_pCtxtListenSocket) {
-				//   ؽƮ ϱ  ش Ͽ  i/o ۾ ϷǱ⸦ 
-				while (!HasOverlappedIoCompleted((LPOVERLAPPED)&g_pCtxtListenSocket->pIOContext->Overlapped))
-					Sleep(0); //! ctrl+breakɸ ⼭ ȳѾ
-
-				if (g_pCtxtListenSocket->pIOContext->SocketAccept != INVALID_SOCKET)
-					closesocket(g_pCtxtListenSocket->pIOContext->SocketAccept);
-				g_pCtxtListenSocket->pIOContext->SocketAccept = INVALID_SOCKET;
+			if (g_nTraceRate)
+				TraceWrite();
 
-				//
-				// We know there is only one overlapped I/O on the listening socket
-				//
-				if (g_pCtxtListenSocket->pIOContext)
-					xfree(g_pCtxtListenSocket->pIOContext);
+			//
+			// Every AcceptEx has completed and every connection context has been
+			// recycled, so nothing the system could still write to is released here
+			//
+			if (bDrained) {
+				if (g_pCtxtListenSocket) {
+					CtxtFree(g_pCtxtListenSocket);
+					g_pCtxtListenSocket = NULL;
+				}
 
-				if (g_pCtxtListenSocket)
-					xfree(g_pCtxtListenSocket);
-				g_pCtxtListenSocket = NULL;
+				SessionTableFree();
+				CtxtSlabFreeAll();
+			}
+			TickFreeInbound();
+			InboxFreeAll();
+			printf("Shutdown: %d connections closed, %d of them dropped %I64d unsent bytes, "
+				"%d inbox messages dropped %I64d more\n",
+				nClosed, g_nShutdownDropped, g_nShutdownDroppedBytes, g_nInboxDropped, g_nInboxDroppedBytes);
+			if (g_pTickOutbound) {
+				xfree(g_pTickOutbound);
+				g_pTickOutbound = NULL;
 			}
+			g_nTickOutbound = g_nTickOutboundCapacity = 0;
+			if (g_Room.pMembers) {
+				xfree(g_Room.pMembers);
+				g_Room.pMembers = NULL;
+			}
+			g_Room.nMembers = g_Room.nCapacity = 0;
+
+			//
+			// the last send buffers went with the contexts, the tick and the inboxes
+			//
+			if (bDrained)
+				BlockSlabFreeAll();
 
-			CtxtListFree();
+			for (DWORD i = 1; i < MAX_WORKER_THREAD; i++) {
+				if (g_hWorkerPorts[i]) {
+					CloseHandle(g_hWorkerPorts[i]);
+					g_hWorkerPorts[i] = NULL;
+				}
+			}
+			g_hWorkerPorts[0] = NULL;
 
 			if (g_hIOCP) {
 				CloseHandle(g_hIOCP);
@@ -227,13 +635,17 @@ void __cdecl main(int argc, char* argv[]) {
 
 
 
-	DeleteCriticalSection(&g_CriticalSection);
 	if (g_hCleanupEvent[0] != WSA_INVALID_EVENT) {
 		WSACloseEvent(g_hCleanupEvent[0]);
 		g_hCleanupEvent[0] = WSA_INVALID_EVENT;
 	}
+	CloseHandle(g_hDrainedEvent);
+	g_hDrainedEvent = NULL;
+	CloseHandle(g_hFlushedEvent);
+	g_hFlushedEvent = NULL;
 	WSACleanup();
 	SetConsoleCtrlHandler(CtrlHandler, FALSE);
+	g_Log.Exit();
 } //main
 
 //
@@ -250,14 +662,121 @@ BOOL ValidOptions(int argc, char* argv[]) {
 					g_Port = &argv[i][3];
 				break;
 
+			case 'a':
+				if (strlen(argv[i]) > 3)
+					g_nAcceptPool = min(MAX_ACCEPT_POOL, max(1, atoi(&argv[i][3])));
+				break;
+
+			case 'c':
+				if (strlen(argv[i]) > 3)
+					g_dwConcurrency = max(0, atoi(&argv[i][3]));
+				break;
+
+			case 'b':
+				if (strlen(argv[i]) > 3)
+					g_nDrainBatch = min(MAX_DRAIN_BATCH, max(1, atoi(&argv[i][3])));
+				break;
+
+			case 'f':
+				if (strlen(argv[i]) > 3)
+					g_szLogFile = &argv[i][3];
+				break;
+
+			case 'g':
+				if (strlen(argv[i]) > 3) {
+					char* lpEnd = NULL;
+					unsigned long nSeconds = strtoul(&argv[i][3], &lpEnd, 10);
+
+					if (!isdigit((unsigned char)argv[i][3]) || *lpEnd || nSeconds > MAX_DRAIN_SECONDS) {
+						printf("Drain time %s is not 0 to %d seconds\n", &argv[i][3], MAX_DRAIN_SECONDS);
+						bRet = FALSE;
+					}
+					else
+						g_dwDrainSeconds = nSeconds;
+				}
+				break;
+
+			case 'i':
+				g_bSharedBuffers = TRUE;
+				break;
+
+			case 'l':
+				if (strlen(argv[i]) > 3)
+					g_nBacklog = max(0, atoi(&argv[i][3]));
+				break;
+
+			case 'm':
+				if (strlen(argv[i]) > 3)
+					g_MetricsPort = &argv[i][3];
+				break;
+
+			case 'o':
+				g_bOwnedSessions = TRUE;
+				break;
+
+			case 'p':
+				if (strlen(argv[i]) <= 3 || _stricmp(&argv[i][3], "core") == 0)
+					g_Placement = PlaceCore;
+				else if (_stricmp(&argv[i][3], "node") == 0)
+					g_Placement = PlaceNode;
+				else {
+					printf("Unknown placement %s, use core or node\n", &argv[i][3]);
+					bRet = FALSE;
+				}
+				break;
+
+			case 'r':
+				g_bRoom = TRUE;
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_dwStatsInterval = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_dwTickRate = min(MAX_TICK_RATE, max(0, atoi(&argv[i][3])));
+				break;
+
 			case 'v':
 				g_bVerbose = TRUE;
 				break;
 
+			case 'w':
+				if (strlen(argv[i]) > 3)
+					g_dwWorkerCount = min(MAX_WORKER_THREAD, max(0, atoi(&argv[i][3])));
+				break;
+
+			case 'x':
+#if PACKET_TRACE
+				g_nTraceRate = (strlen(argv[i]) > 3) ? max(0, atoi(&argv[i][3])) : TRACE_SAMPLE_RATE;
+#else
+				printf("Packet tracing is not compiled in, build with PACKET_TRACE=1\n");
+#endif
+				break;
+
 			case '?':
-				printf("Usage:\n  iocpserver [-p:port] [-v] [-?]\n");
+				printf("Usage:\n  iocpserver [-e:port] [-a:#] [-b:#] [-c:#] [-f:file] [-g:#] [-i] [-l:#] [-m:port] [-o] [-p[:core|node]] [-r] [-s:#] [-t:#] [-v] [-w:#] [-x[:#]] [-?]\n");
 				printf("  -e:port\tSpecify echoing port number\n");
-				printf("  -v\t\tVerbose\n");
+				printf("  -a:#\t\tAcceptEx calls kept pending (Def: %d, max: %d)\n", DEFAULT_ACCEPT_POOL, MAX_ACCEPT_POOL);
+				printf("  -b:#\t\tCompletions dequeued per call (Def: 1, max: %d)\n", MAX_DRAIN_BATCH);
+				printf("  -c:#\t\tWorkers the completion port runs at once (Def: one per processor)\n");
+				printf("  -f:file\tLog file, rotated at %d MB (Def: %s)\n", LOG_FILE_BYTES >> 20, DEFAULT_LOG_FILE);
+				printf("  -g:#\t\tSeconds queued sends get to flush on shutdown, 0 for none (Def: %d, max: %d)\n",
+					DEFAULT_DRAIN_SECONDS, MAX_DRAIN_SECONDS);
+				printf("  -i\t\tIdle connections wait on a zero-byte read and share receive buffers\n");
+				printf("  -l:#\t\tListen backlog (Def: SOMAXCONN)\n");
+				printf("  -m:port\tServe counters and latencies for Prometheus on 127.0.0.1:port\n");
+				printf("  -o\t\tOwned sessions: a completion port per worker, each connection on one\n");
+				printf("  -p[:core|node]\tPin every worker to a processor (Def) or a NUMA node of its own\n");
+				printf("  -r\t\tOne room: broadcast what a client sends to every client\n");
+				printf("  -s:#\t\tPrint worker statistics and latencies every # seconds\n");
+				printf("  -t:#\t\tRun a tick thread at # Hz that handles what clients send (max: %d)\n", MAX_TICK_RATE);
+				printf("  -v\t\tVerbose, log every completion\n");
+				printf("  -w:#\t\tWorker threads (Def: two per processor, max: %d)\n", MAX_WORKER_THREAD);
+				printf("  -x[:#]\t\tTrace one packet in # to %s and /trace (Def: %d, needs PACKET_TRACE=1)\n",
+					DEFAULT_TRACE_FILE, TRACE_SAMPLE_RATE);
 				printf("  -?\t\tDisplay this help\n");
 				bRet = FALSE;
 				break;
@@ -273,6 +792,119 @@ BOOL ValidOptions(int argc, char* argv[]) {
 	return(bRet);
 }
 
+//
+//  Find the NUMA nodes that have processors and list the processors of each,
+//  the first of every core before any core's second hyperthread.  Returns FALSE
+//  if the layout cannot be read.
+//
+BOOL WorkerLayoutInit(VOID) {
+
+	PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX lpInfo = NULL;
+	PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX lpEntry = NULL;
+	DWORD dwLength = 0;
+
+	GetLogicalProcessorInformationEx(RelationAll, NULL, &dwLength);
+	if (GetLastError() != ERROR_INSUFFICIENT_BUFFER ||
+		(lpInfo = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)xmalloc(dwLength)) == NULL) {
+		printf("GetLogicalProcessorInformationEx() failed: %d\n", GetLastError());
+		return(FALSE);
+	}
+	if (!GetLogicalProcessorInformationEx(RelationAll, lpInfo, &dwLength)) {
+		printf("GetLogicalProcessorInformationEx() failed: %d\n", GetLastError());
+		xfree(lpInfo);
+		return(FALSE);
+	}
+
+	g_nNumaNodes = 0;
+	g_nLayoutProcessors = 0;
+	for (DWORD dwNode = 0; dwNode < dwLength; dwNode += lpEntry->Size) {
+		PNUMA_NODE_LAYOUT lpNode = &g_NumaNodes[g_nNumaNodes];
+
+		lpEntry = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)((char*)lpInfo + dwNode);
+		if (lpEntry->Relationship != RelationNumaNode || g_nNumaNodes == MAX_NUMA_NODES)
+			continue;
+
+		lpNode->Affinity = lpEntry->NumaNode.GroupMask;
+		lpNode->nNode = lpEntry->NumaNode.NodeNumber;
+		lpNode->nFirst = g_nLayoutProcessors;
+
+		//
+		// one pass over the cores of the node per hyperthread, each pass taking
+		// the next processor of every core
+		//
+		for (ULONG nSibling = 0; ; nSibling++) {
+			ULONG nAdded = 0;
+			PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX lpCore = NULL;
+
+			for (DWORD dwCore = 0; dwCore < dwLength; dwCore += lpCore->Size) {
+				KAFFINITY Mask = 0;
+				BYTE nNumber = 0;
+
+				lpCore = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)((char*)lpInfo + dwCore);
+				if (lpCore->Relationship != RelationProcessorCore ||
+					lpCore->Processor.GroupMask[0].Group != lpNode->Affinity.Group)
+					continue;
+
+				Mask = lpCore->Processor.GroupMask[0].Mask & lpNode->Affinity.Mask;
+				for (ULONG k = 0; k < nSibling && Mask; k++)
+					Mask &= Mask - 1;
+				if (Mask == 0 || g_nLayoutProcessors == MAX_LAYOUT_PROCESSORS)
+					continue;
+
+				while (!(Mask & ((KAFFINITY)1 << nNumber)))
+					nNumber++;
+				g_LayoutProcessors[g_nLayoutProcessors].Group = lpNode->Affinity.Group;
+				g_LayoutProcessors[g_nLayoutProcessors].Number = nNumber;
+				g_LayoutProcessors[g_nLayoutProcessors].Reserved = 0;
+				g_nLayoutProcessors++;
+				nAdded++;
+			}
+
+			if (nAdded == 0)
+				break;
+		}
+
+		//
+		// a node with memory only gets no workers
+		//
+		lpNode->nProcessors = g_nLayoutProcessors - lpNode->nFirst;
+		if (lpNode->nProcessors)
+			g_nNumaNodes++;
+	}
+
+	xfree(lpInfo);
+	return(g_nNumaNodes != 0);
+}
+
+//
+//  Pin a worker before it runs.  Workers are dealt out over the NUMA nodes in
+//  turn; with PlaceCore the worker then takes the next processor of its node,
+//  wrapping around once every processor has one.
+//
+BOOL WorkerPlace(HANDLE hThread, DWORD dwWorker) {
+
+	PNUMA_NODE_LAYOUT lpNode = &g_NumaNodes[dwWorker % g_nNumaNodes];
+	GROUP_AFFINITY Affinity = lpNode->Affinity;
+
+	if (g_Placement == PlaceCore) {
+		PPROCESSOR_NUMBER lpProcessor =
+			&g_LayoutProcessors[lpNode->nFirst + (dwWorker / g_nNumaNodes) % lpNode->nProcessors];
+
+		ZeroMemory(&Affinity, sizeof(Affinity));
+		Affinity.Group = lpProcessor->Group;
+		Affinity.Mask = (KAFFINITY)1 << lpProcessor->Number;
+	}
+
+	if (!SetThreadGroupAffinity(hThread, &Affinity, NULL))
+		return(FALSE);
+
+	if (g_bVerbose)
+		printf("WorkerThread %d: NUMA node %d, group %d, processors 0x%Ix\n",
+			dwWorker, lpNode->nNode, Affinity.Group, Affinity.Mask);
+
+	return(TRUE);
+}
+
 //
 //  Intercept CTRL-C or CTRL-BRK events and cause the server to initiate shutdown.
 //  CTRL-BRK resets the restart flag, and after cleanup the server restarts.
@@ -315,7 +947,7 @@ SOCKET CreateSocket(void) {
 
 	sdSocket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_IP, NULL, 0, WSA_FLAG_OVERLAPPED);
 	if (sdSocket == INVALID_SOCKET) {
-		printf("WSASocket(sdSocket) failed: %d\n", WSAGetLastError());
+		LOG_ERROR(g_Log, "WSASocket(sdSocket) failed: %d", WSAGetLastError());
 		return(sdSocket);
 	}
 
@@ -335,7 +967,7 @@ SOCKET CreateSocket(void) {
 	nZero = 0;
 	nRet = setsockopt(sdSocket, SOL_SOCKET, SO_SNDBUF, (char*)&nZero, sizeof(nZero));
 	if (nRet == SOCKET_ERROR) {
-		printf("setsockopt(SNDBUF) failed: %d\n", WSAGetLastError());
+		LOG_ERROR(g_Log, "setsockopt(SNDBUF) failed: %d", WSAGetLastError());
 		return(sdSocket);
 	}
 
@@ -419,7 +1051,12 @@ BOOL CreateListenSocket(void) {
 		return(FALSE);
 	}
 
-	nRet = listen(g_sdListen, 5);
+	//
+	// Keep the backlog high even with a large AcceptEx pool: the stack completes
+	// handshakes into the backlog while the workers are too busy to re-post.
+	// SOMAXCONN_HINT lets an explicit value go past the SOMAXCONN clamp.
+	//
+	nRet = listen(g_sdListen, g_nBacklog ? SOMAXCONN_HINT(g_nBacklog) : SOMAXCONN);
 	if (nRet == SOCKET_ERROR) {
 		printf("listen() failed: %d\n", WSAGetLastError());
 		freeaddrinfo(addrlocal);
@@ -448,13 +1085,17 @@ BOOL CreateListenSocket(void) {
 // ׷  listen() α   ϴ  ߿մϴ.
 // ̴ Ʈ  Ͽ ø̼  ٸ AcceptEx Խ ŭ CPU Ŭ  ϴ     ֵ ϱ Դϴ.
 //
-//   ̷    ͵  ,    ۿ մϴ.
+//      մϴ. AcceptEx g_nAcceptPool(-a:#) Խ ΰ  Ϸῡ
+//  i/o ؽƮ ٽ Խϸ, listen() α״ -l:#   ֽϴ.
+//
+// Add the listening socket to the IOCP and post the pool of AcceptEx calls.  Every
+// pending AcceptEx owns one PER_IO_CONTEXT, chained on the listening socket context.
 //
-BOOL CreateAcceptSocket(BOOL fUpdateIOCP) {
+BOOL CreateAcceptPool(void) {
 
 	int nRet = 0;
-	DWORD dwRecvNumBytes = 0;
 	DWORD bytes = 0;
+	PPER_IO_CONTEXT lpIOContext = NULL;
 
 	//
 	// GUID to Microsoft specific extensions
@@ -465,379 +1106,1964 @@ BOOL CreateAcceptSocket(BOOL fUpdateIOCP) {
 	//The context for listening socket uses the SockAccept member to store the
 	//socket for client connection. 
 	//
-	if (fUpdateIOCP) 
+	g_pCtxtListenSocket = UpdateCompletionPort(g_sdListen, ClientIoAccept, FALSE);
+	if (g_pCtxtListenSocket == NULL) {
+		printf("failed to update listen socket to IOCP\n");
+		return(FALSE);
+	}
+
+	// Load the AcceptEx extension function from the provider for this socket
+	nRet = WSAIoctl(
+		g_sdListen,
+		SIO_GET_EXTENSION_FUNCTION_POINTER,
+		&acceptex_guid,
+		sizeof(acceptex_guid),
+		&g_pCtxtListenSocket->fnAcceptEx,
+		sizeof(g_pCtxtListenSocket->fnAcceptEx),
+		&bytes,
+		NULL,
+		NULL
+	);
+	if (nRet == SOCKET_ERROR)
 	{
-		g_pCtxtListenSocket = UpdateCompletionPort(g_sdListen, ClientIoAccept, FALSE);
-		if (g_pCtxtListenSocket == NULL) {
-			printf("failed to update listen socket to IOCP\n");
+		printf("failed to load AcceptEx: %d\n", WSAGetLastError());
+		return (FALSE);
+	}
+
+	//
+	// UpdateCompletionPort already gave the listening socket its first i/o context.
+	// AcceptEx always needs room for the addresses, so with shared buffers that
+	// context borrows one from the pool for the life of the server.  The others
+	// carry their buffer right behind them.
+	//
+	if (g_pCtxtListenSocket->pIOContext->Buffer == NULL) {
+		g_pCtxtListenSocket->pIOContext->Buffer = BufAllocate();
+		if (g_pCtxtListenSocket->pIOContext->Buffer == NULL)
 			return(FALSE);
-		}
+	}
 
-		// Load the AcceptEx extension function from the provider for this socket
-		nRet = WSAIoctl(
-			g_sdListen,
-			SIO_GET_EXTENSION_FUNCTION_POINTER,
-			&acceptex_guid,
-			sizeof(acceptex_guid),
-			&g_pCtxtListenSocket->fnAcceptEx,
-			sizeof(g_pCtxtListenSocket->fnAcceptEx),
-			&bytes,
-			NULL,
-			NULL
-		);
-		if (nRet == SOCKET_ERROR)
-		{
-			printf("failed to load AcceptEx: %d\n", WSAGetLastError());
-			return (FALSE);
+	for (int i = 1; i < g_nAcceptPool; i++) {
+		lpIOContext = (PPER_IO_CONTEXT)xmalloc(sizeof(PER_IO_CONTEXT) + MAX_BUFF_SIZE);
+		if (lpIOContext == NULL) {
+			printf("HeapAlloc() PER_IO_CONTEXT failed: %d\n", GetLastError());
+			return(FALSE);
 		}
+		lpIOContext->IOOperation = ClientIoAccept;
+		lpIOContext->SocketAccept = INVALID_SOCKET;
+		lpIOContext->Buffer = (char*)(lpIOContext + 1);
+		lpIOContext->wsabuf.buf = lpIOContext->Buffer;
+		lpIOContext->wsabuf.len = MAX_BUFF_SIZE;
+		lpIOContext->pIOContextForward = g_pCtxtListenSocket->pIOContext->pIOContextForward;
+		g_pCtxtListenSocket->pIOContext->pIOContextForward = lpIOContext;
 	}
 
-	g_pCtxtListenSocket->pIOContext->SocketAccept = CreateSocket();
-	if (g_pCtxtListenSocket->pIOContext->SocketAccept == INVALID_SOCKET) {
-		printf("failed to create new accept socket\n");
+	for (lpIOContext = g_pCtxtListenSocket->pIOContext; lpIOContext; lpIOContext = lpIOContext->pIOContextForward) {
+		if (!CreateAcceptSocket(lpIOContext))
+			return(FALSE);
+	}
+
+	if (g_bVerbose)
+		printf("CreateAcceptPool: %d AcceptEx posted\n", g_nAcceptPool);
+
+	return(TRUE);
+}
+
+//
+// Create a socket and post one AcceptEx on the given i/o context of the listening
+// socket.  Called for every context of the pool at startup, and again from the
+// accept completion so the pool stays full.  A posted AcceptEx is counted in
+// g_nAcceptsPending until its completion has been handled, see AcceptIoDone.
+//
+BOOL CreateAcceptSocket(PPER_IO_CONTEXT lpIOContext) {
+
+	int nRet = 0;
+	DWORD dwRecvNumBytes = 0;
+
+	lpIOContext->SocketAccept = CreateSocket();
+	if (lpIOContext->SocketAccept == INVALID_SOCKET) {
+		LOG_ERROR(g_Log, "failed to create new accept socket");
 		return(FALSE);
 	}
 
 	//
-	// pay close attention to these parameters and buffer lengths
+	// counted before it is posted: the completion may be handled on another
+	// thread before AcceptEx even returns
+	//
+	InterlockedIncrement(&g_nAcceptsPending);
+
+	//
+	// pay close attention to these parameters and buffer lengths.  With shared
+	// buffers the accept completes as soon as the connection is made, so the new
+	// connection does not need a buffer of its own to receive the first data.
 	//
-	nRet = g_pCtxtListenSocket->fnAcceptEx(g_sdListen, g_pCtxtListenSocket->pIOContext->SocketAccept,
-		(LPVOID)(g_pCtxtListenSocket->pIOContext->Buffer),
-		MAX_BUFF_SIZE - (2 * (sizeof(SOCKADDR_STORAGE) + 16)), //  ּ    
+	nRet = g_pCtxtListenSocket->fnAcceptEx(g_sdListen, lpIOContext->SocketAccept,
+		(LPVOID)(lpIOContext->Buffer),
+		g_bSharedBuffers ? 0 : MAX_BUFF_SIZE - (2 * (sizeof(SOCKADDR_STORAGE) + 16)), //  ּ    
 		sizeof(SOCKADDR_STORAGE) + 16, sizeof(SOCKADDR_STORAGE) + 16, 
 		&dwRecvNumBytes,
-		(LPOVERLAPPED) & (g_pCtxtListenSocket->pIOContext->Overlapped));
+		(LPOVERLAPPED) & (lpIOContext->Overlapped));
 	if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
-		printf("AcceptEx() failed: %d\n", WSAGetLastError());
+		if (!g_bEndServer)
+			LOG_ERROR(g_Log, "AcceptEx() failed: %d", WSAGetLastError());
+		InterlockedDecrement(&g_nAcceptsPending);
+		closesocket(lpIOContext->SocketAccept);
+		lpIOContext->SocketAccept = INVALID_SOCKET;
 		return(FALSE);
 	}
 
 	return(TRUE);
 }
 
+//
+// Add to a counter of the calling worker.  A worker alone writes its counters, so
+// a relaxed load and store are enough, as in LatencyHistogram; the atomic only
+// keeps a reader on another thread from seeing half of a 64-bit value.
+//
+static VOID StatAdd(std::atomic<uint64_t>& Counter, ULONGLONG nValue) {
+
+	Counter.store(Counter.load(std::memory_order_relaxed) + nValue, std::memory_order_relaxed);
+}
+
+//
+// Take and drop the lock of a connection.  With owned sessions (-o) no thread but
+// the owner touches the socket or the queues: SessionQueue and CloseClient hand
+// what other threads ask for to the owner's inbox.  No lock is taken then.
+//
+static VOID CtxtLock(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	if (!g_bOwnedSessions)
+		AcquireSRWLockExclusive(&lpPerSocketContext->Lock);
+}
+
+static VOID CtxtUnlock(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	if (!g_bOwnedSessions)
+		ReleaseSRWLockExclusive(&lpPerSocketContext->Lock);
+}
+
 //
 // Worker thread that handles all I/O requests on any socket handle added to the IOCP.
 //
 UINT WINAPI WorkerThread(LPVOID WorkThreadContext) {
 
-	HANDLE hIOCP = (HANDLE)WorkThreadContext;
+	HANDLE hIOCP = g_bOwnedSessions ? g_hWorkerPorts[(ULONG_PTR)WorkThreadContext] : g_hIOCP;
+	PWORKER_STATS lpStats = &g_WorkerStats[(ULONG_PTR)WorkThreadContext];
+	OVERLAPPED_ENTRY CompletionEntries[MAX_DRAIN_BATCH];
+	ULONG nEntries = 0;
 	BOOL bSuccess = FALSE;
 	int nRet = 0;
 	LPWSAOVERLAPPED lpOverlapped = NULL;
 	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
 	PPER_SOCKET_CONTEXT lpAcceptSocketContext = NULL;
 	PPER_IO_CONTEXT lpIOContext = NULL;
-	WSABUF buffRecv;
-	WSABUF buffSend;
-	DWORD dwRecvNumBytes = 0;
-	DWORD dwSendNumBytes = 0;
-	DWORD dwFlags = 0;
+	PSEND_BUFFER lpSendBuffer = NULL;
+	PSEND_BUFFER SentBuffers[SEND_QUEUE_SLOTS];
+	LARGE_INTEGER liNow = { 0 };
+	LONGLONG nDequeued = 0;				// when the batch was removed from the port, with -s or -m
+	LONGLONG nHandled = 0;				// when the completion being handled was reached, with -s or -m
+	ULONG nSendMessages = 0;
+	LONG nSendMessageBytes = 0;
+	BOOL bRecvPaused = FALSE;
+	BOOL bResumeRecv = FALSE;
 	DWORD dwIoSize = 0;
-	HRESULT hRet;
+	DWORD dwOwner = 0;
+#if PACKET_TRACE
+	ULONGLONG nTraceDequeued = 0;			// TSC when the batch was dequeued
+	ULONGLONG nTraceDispatched = 0;			// and when the completion being handled was reached
+	ULONGLONG nTraceId = 0;				// the traced packet of that completion, 0 for none
+	const char* lpTraceStage = NULL;
+	DWORD dwTraceSize = 0;
+	char szTraceName[TRACE_THREAD_NAME];
+#endif
+
+	t_dwWorker = (DWORD)(ULONG_PTR)WorkThreadContext;
+	t_lpStats = lpStats;
+	if (g_bOwnedSessions)
+		t_lpInbox = &g_WorkerInboxes[t_dwWorker];
+#if PACKET_TRACE
+	if (g_nTraceRate) {
+		_snprintf_s(szTraceName, sizeof(szTraceName), _TRUNCATE, "WorkerThread %d", t_dwWorker);
+		g_Trace.NameThread(szTraceName);
+	}
+#endif
 
 	while (TRUE) {
 
+#if PACKET_TRACE
+		if (nTraceId) {
+			TRACE_SPAN(g_Trace, lpTraceStage, nTraceDispatched, TRACE_NOW(), nTraceId, dwTraceSize);
+			nTraceId = 0;
+		}
+#endif
+
 		//
-		// continually loop to service io completion packets
+		// continually loop to service io completion packets.  Up to g_nDrainBatch
+		// packets are removed from the port with a single call, so under load one
+		// kernel transition serves many completions.
 		//
-		bSuccess = GetQueuedCompletionStatus(
+		bSuccess = GetQueuedCompletionStatusEx(
 			hIOCP,
-			&dwIoSize,
-			(PDWORD_PTR)&lpPerSocketContext,
-			(LPOVERLAPPED*)&lpOverlapped,
-			INFINITE
+			CompletionEntries,
+			g_nDrainBatch,
+			&nEntries,
+			INFINITE,
+			FALSE
 		);
-		if (!bSuccess)
-			printf("GetQueuedCompletionStatus() failed: %d\n", GetLastError());
-
-		if (lpPerSocketContext == NULL) {
-
-			//
-			// CTRL-C handler used PostQueuedCompletionStatus to post an I/O packet with
-			// a NULL CompletionKey (or if we get one for any reason).  It is time to exit.
-			//
+		StatAdd(lpStats->nDequeueCalls, 1);
+		if (!bSuccess) {
+			printf("GetQueuedCompletionStatusEx() failed: %d\n", GetLastError());
 			return(0);
 		}
+		StatAdd(lpStats->nCompletions, nEntries);
 
-		if (g_bEndServer) {
-
-			//
-			// main thread will do all cleanup needed - see finally block
-			//
-			return(0);
+		//
+		// every entry of the batch left the port with this one call
+		//
+		if (g_bLatency) {
+			QueryPerformanceCounter(&liNow);
+			nDequeued = liNow.QuadPart;
 		}
+#if PACKET_TRACE
+		nTraceDequeued = TRACE_NOW();
+#endif
 
-		lpIOContext = (PPER_IO_CONTEXT)lpOverlapped;
+		for (ULONG nEntry = 0; nEntry < nEntries; nEntry++) {
 
-		//
-		//We should never skip the loop and not post another AcceptEx if the current
-		//completion packet is for previous AcceptEx
-		//
-		if (lpIOContext->IOOperation != ClientIoAccept) {
-			if (!bSuccess || (bSuccess && (0 == dwIoSize))) {
+#if PACKET_TRACE
+			if (nTraceId) {
+				TRACE_SPAN(g_Trace, lpTraceStage, nTraceDispatched, TRACE_NOW(), nTraceId, dwTraceSize);
+				nTraceId = 0;
+			}
+#endif
+
+			lpPerSocketContext = (PPER_SOCKET_CONTEXT)CompletionEntries[nEntry].lpCompletionKey;
+			lpOverlapped = CompletionEntries[nEntry].lpOverlapped;
+			dwIoSize = CompletionEntries[nEntry].dwNumberOfBytesTransferred;
+
+			if (lpPerSocketContext == NULL) {
 
 				//
-				// client connection dropped, continue to service remaining (and possibly 
-				// new) client connections
-				//
-				CloseClient(lpPerSocketContext, FALSE);
-				continue;
+				// CTRL-C handler used PostQueuedCompletionStatus to post an I/O packet with
+				// a NULL CompletionKey (or if we get one for any reason).  It is time to exit.
+				//
+				return(0);
 			}
-		}
-
-		//
-		// determine what type of IO packet has completed by checking the PER_IO_CONTEXT 
-		// associated with this socket.  This will determine what action to take.
-		//
-		switch (lpIOContext->IOOperation) {
-		case ClientIoAccept:
 
 			//
-			// AcceptEx Լ ȯǸ, sAcceptSocket    ⺻ ¿ ֽϴ.
-			// sAcceptSocket  sListenSocket Ű   Ӽ ӹ , ̴ SO_UPDATE_ACCEPT_CONTEXT Ͽ   ˴ϴ.
-			// setsockopt Լ Ͽ SO_UPDATE_ACCEPT_CONTEXT ɼ ؾ մϴ.
-			// ̶, sAcceptSocket  ڵ ϰ sListenSocket ɼ  մϴ.
-			// 
-			// acceptSocket   Ӽ ӹ޾ƾ Ѵ.  ɼ ϰ ,  ùٸ  ,  ȭ,   ϰ 
+			// how long the completion waited behind those before it in the batch
 			//
-			nRet = setsockopt(
-				lpPerSocketContext->pIOContext->SocketAccept,
-				SOL_SOCKET,
-				SO_UPDATE_ACCEPT_CONTEXT,
-				(char*)&g_sdListen,
-				sizeof(g_sdListen)
-			);
+			if (g_bLatency) {
+				QueryPerformanceCounter(&liNow);
+				nHandled = liNow.QuadPart;
+				lpStats->HandlerLatency.Record((ULONGLONG)((nHandled - nDequeued) * g_dQpcToNs));
+			}
 
-			if (nRet == SOCKET_ERROR) {
+#if PACKET_TRACE
+			//
+			// The completion of a send that carries a traced packet goes on with
+			// that packet: the send was in the kernel from its post to the dequeue.
+			// Any other completion is traced if it is sampled, and what its handler
+			// sends carries it on, see SessionReceived.  The handler span ends when
+			// the next completion is reached.
+			//
+			nTraceDispatched = TRACE_NOW();
+			lpIOContext = (PPER_IO_CONTEXT)lpOverlapped;
+			lpTraceStage = g_TraceStages[lpIOContext->IOOperation];
+			dwTraceSize = dwIoSize;
+			if (lpIOContext->IOOperation == ClientIoWrite && lpIOContext->nTraceId) {
+				nTraceId = lpIOContext->nTraceId;
+				lpIOContext->nTraceId = 0;
+				TRACE_ASYNC_SPAN(g_Trace, "send in kernel", lpIOContext->nTracePosted, nTraceDequeued, nTraceId, dwIoSize);
+			}
+			else if (TRACE_SAMPLE(g_Trace))
+				nTraceId = g_Trace.NextId();
+			if (nTraceId)
+				TRACE_SPAN(g_Trace, "queued", nTraceDequeued, nTraceDispatched, nTraceId, nEntry);
+			t_nTraceId = nTraceId;
+			t_nTraceReceived = nTraceDequeued;
+#endif
 
-				//
-				//just warn user here.
-				//
-				printf("setsockopt(SO_UPDATE_ACCEPT_CONTEXT) failed to update accept socket\n");
-				WSASetEvent(g_hCleanupEvent[0]);
-				return(0);
+			//
+			// other threads queued sends for connections this worker owns (-o); the
+			// key is the inbox, not a connection
+			//
+			if (((PPER_IO_CONTEXT)lpOverlapped)->IOOperation == ClientIoInbox) {
+				InboxDrain((PWORKER_INBOX)CompletionEntries[nEntry].lpCompletionKey, lpStats);
+				continue;
 			}
 
-			lpAcceptSocketContext = UpdateCompletionPort(
-				lpPerSocketContext->pIOContext->SocketAccept,
-				ClientIoAccept, TRUE);
+			//
+			// GetQueuedCompletionStatusEx only fails as a whole.  Whether this particular
+			// operation succeeded is the NTSTATUS the system left in the OVERLAPPED.
+			//
+			bSuccess = ((LONG)lpOverlapped->Internal >= 0);
+			if (!bSuccess && (ULONG)lpOverlapped->Internal != STATUS_CANCELLED)
+				LOG_WARNING(g_Log, "I/O operation failed: 0x%08x", (ULONG)lpOverlapped->Internal);
+
+			lpIOContext = (PPER_IO_CONTEXT)lpOverlapped;
 
-			if (lpAcceptSocketContext == NULL) {
+			//
+			//We should never skip the loop and not post another AcceptEx if the current
+			//completion packet is for previous AcceptEx
+			//
+			//A zero-byte read always completes with 0 bytes; the read that follows it
+			//tells whether the client closed.
+			//
+			if (lpIOContext->IOOperation != ClientIoAccept && lpIOContext->IOOperation != ClientIoHandoff) {
+				if (!bSuccess || (lpIOContext->IOOperation != ClientIoZeroRead && 0 == dwIoSize)) {
+
+					//
+					// client connection dropped, continue to service remaining (and possibly 
+					// new) client connections.  The other direction may still have an
+					// operation posted; the context goes once that one completes too.
+					//
+					CloseClient(lpPerSocketContext, FALSE);
+					SessionIoDone(lpPerSocketContext);
+					continue;
+				}
+			}
+
+			//
+			// determine what type of IO packet has completed by checking the PER_IO_CONTEXT 
+			// associated with this socket.  This will determine what action to take.
+			//
+			switch (lpIOContext->IOOperation) {
+			case ClientIoHandoff:
+			case ClientIoAccept:
+
+				if (!bSuccess || g_bEndServer) {
+					lpIOContext->IOOperation = ClientIoAccept;
+
+					//
+					// the peer went away before the connection was accepted, which is
+					// routine during a connect storm.  Recycle the context right away,
+					// unless the listening socket was closed for shutdown.  AcceptEx
+					// also fails if it is closed meanwhile, which is no error then.
+					//
+					closesocket(lpIOContext->SocketAccept);
+					lpIOContext->SocketAccept = INVALID_SOCKET;
+					if (!g_bEndServer && !CreateAcceptSocket(lpIOContext) && !g_bEndServer) {
+						printf("Please shut down and reboot the server.\n");
+						WSASetEvent(g_hCleanupEvent[0]);
+						AcceptIoDone();
+						return(0);
+					}
+					AcceptIoDone();
+					break;
+				}
 
 				//
-				//just warn user here.
+				// with owned sessions (-o) the connection is set up by the worker that
+				// will own it, so the completion goes on to that worker's port first.
+				// It arrives there as a handoff, with the status and the received
+				// bytes of the accept.
 				//
-				printf("failed to update accept socket to IOCP\n");
-				WSASetEvent(g_hCleanupEvent[0]);
-				return(0);
-			}
+				if (g_bOwnedSessions && lpIOContext->IOOperation == ClientIoAccept) {
+					dwOwner = (DWORD)(InterlockedIncrement(&g_nNextOwner) - 1) % g_dwThreadCount;
+					if (dwOwner != t_dwWorker) {
+						lpIOContext->IOOperation = ClientIoHandoff;
+						if (PostQueuedCompletionStatus(g_hWorkerPorts[dwOwner], dwIoSize,
+							(ULONG_PTR)lpPerSocketContext, &lpIOContext->Overlapped))
+							break;
+						LOG_WARNING(g_Log, "PostQueuedCompletionStatus() failed, WorkerThread %d keeps the connection: %d",
+							t_dwWorker, GetLastError());
+					}
+				}
+				lpIOContext->IOOperation = ClientIoAccept;
 
-			// Accept Բ Recv ̷ٸ
-			if (dwIoSize) {
-				lpAcceptSocketContext->pIOContext->IOOperation = ClientIoWrite;
-				lpAcceptSocketContext->pIOContext->nTotalBytes = dwIoSize;
-				lpAcceptSocketContext->pIOContext->nSentBytes = 0;
-				lpAcceptSocketContext->pIOContext->wsabuf.len = dwIoSize;
-				hRet = StringCbCopyN((STRSAFE_LPWSTR)lpAcceptSocketContext->pIOContext->Buffer,
-					MAX_BUFF_SIZE,
-					(STRSAFE_PCNZWCH)lpPerSocketContext->pIOContext->Buffer,
-					sizeof(lpPerSocketContext->pIOContext->Buffer)
+				//
+				// AcceptEx Լ ȯǸ, sAcceptSocket    ⺻ ¿ ֽϴ.
+				// sAcceptSocket  sListenSocket Ű   Ӽ ӹ , ̴ SO_UPDATE_ACCEPT_CONTEXT Ͽ   ˴ϴ.
+				// setsockopt Լ Ͽ SO_UPDATE_ACCEPT_CONTEXT ɼ ؾ մϴ.
+				// ̶, sAcceptSocket  ڵ ϰ sListenSocket ɼ  մϴ.
+				// 
+				// acceptSocket   Ӽ ӹ޾ƾ Ѵ.  ɼ ϰ ,  ùٸ  ,  ȭ,   ϰ 
+				//
+				nRet = setsockopt(
+					lpIOContext->SocketAccept,
+					SOL_SOCKET,
+					SO_UPDATE_ACCEPT_CONTEXT,
+					(char*)&g_sdListen,
+					sizeof(g_sdListen)
 				);
-				lpAcceptSocketContext->pIOContext->wsabuf.buf = lpAcceptSocketContext->pIOContext->Buffer;
 
-				nRet = WSASend(
-					lpPerSocketContext->pIOContext->SocketAccept,
-					&lpAcceptSocketContext->pIOContext->wsabuf, 1,
-					&dwSendNumBytes,
-					0,
-					&(lpAcceptSocketContext->pIOContext->Overlapped), NULL);
+				if (nRet == SOCKET_ERROR) {
 
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
-					printf("WSASend() failed: %d\n", WSAGetLastError());
-					CloseClient(lpAcceptSocketContext, FALSE);
+					//
+					//just warn user here.
+					//
+					printf("setsockopt(SO_UPDATE_ACCEPT_CONTEXT) failed to update accept socket\n");
+					WSASetEvent(g_hCleanupEvent[0]);
+					AcceptIoDone();
+					return(0);
 				}
-				else if (g_bVerbose) {
-					printf("WorkerThread %d: Socket(%d) AcceptEx completed (%d bytes), Send posted\n",
-						GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
+
+				lpAcceptSocketContext = UpdateCompletionPort(
+					lpIOContext->SocketAccept,
+					ClientIoAccept, TRUE);
+
+				if (lpAcceptSocketContext == NULL) {
+
+					//
+					//just warn user here.
+					//
+					printf("failed to update accept socket to IOCP\n");
+					WSASetEvent(g_hCleanupEvent[0]);
+					AcceptIoDone();
+					return(0);
 				}
-			}
-			else {
+				StatAdd(lpStats->nAccepts, 1);
+				StatAdd(lpStats->nBytesIn, dwIoSize);
+
+				//
+				// the connection may have been registered after the main thread
+				// closed every session for shutdown, or the room may be full; then
+				// it is closed here and nothing of it is handled or read
+				//
+				if (g_bEndServer)
+					CloseClient(lpAcceptSocketContext, FALSE);
+				else if (g_bRoom && !RoomJoin(&g_Room, lpAcceptSocketContext->SessionId))
+					CloseClient(lpAcceptSocketContext, FALSE);
 
+				// Accept Բ Recv ̷ٸ
 				//
-				// AcceptEx completes but doesn't read any data so we need to post
-				// an outstanding overlapped read.
+				// the data is binary, and this AcceptEx buffer is reused for the next
+				// connection as soon as it is re-posted below, so it is queued as a copy
 				//
-				lpAcceptSocketContext->pIOContext->IOOperation = ClientIoRead;
-				dwRecvNumBytes = 0;
-				dwFlags = 0;
-				buffRecv.buf = lpAcceptSocketContext->pIOContext->Buffer,
-					buffRecv.len = MAX_BUFF_SIZE;
-				nRet = WSARecv(
-					lpAcceptSocketContext->Socket,
-					&buffRecv, 1,
-					&dwRecvNumBytes,
-					&dwFlags,
-					&lpAcceptSocketContext->pIOContext->Overlapped, NULL);
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
-					printf("WSARecv() failed: %d\n", WSAGetLastError());
+				else if (dwIoSize && !SessionReceived(lpAcceptSocketContext, lpIOContext->Buffer, dwIoSize, nHandled))
 					CloseClient(lpAcceptSocketContext, FALSE);
+
+				//
+				// the receive side runs on its own from here on, whether or not the
+				// accept brought data with it
+				//
+				else {
+					if (dwIoSize)
+						LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) AcceptEx completed (%d bytes), Send posted",
+							GetCurrentThreadId(), lpAcceptSocketContext->Socket, dwIoSize);
+					if (!PostRecv(lpAcceptSocketContext))
+						CloseClient(lpAcceptSocketContext, FALSE);
 				}
-			}
 
-			//
-			//Time to post another outstanding AcceptEx
-			//
-			if (!CreateAcceptSocket(FALSE)) {
-				printf("Please shut down and reboot the server.\n");
-				WSASetEvent(g_hCleanupEvent[0]);
-				return(0);
-			}
-			break;
+				//
+				// the set up is done; drop the reference CtxtAllocate gave this thread
+				//
+				SessionIoDone(lpAcceptSocketContext);
+
+				//
+				//Time to post another outstanding AcceptEx.  The accepted socket now
+				//belongs to lpAcceptSocketContext, so the i/o context is free to reuse.
+				//The new AcceptEx is counted before this one is taken off the count, so
+				//the count does not touch zero in between.
+				//
+				if (!g_bEndServer && !CreateAcceptSocket(lpIOContext) && !g_bEndServer) {
+					printf("Please shut down and reboot the server.\n");
+					WSASetEvent(g_hCleanupEvent[0]);
+					AcceptIoDone();
+					return(0);
+				}
+				AcceptIoDone();
+				break;
 
 
-		case ClientIoRead:
+			case ClientIoZeroRead:
 
-			//
-			// a read operation has completed, post a write operation to echo the
-			// data back to the client using the same data buffer.
-			//
-			lpIOContext->IOOperation = ClientIoWrite;
-			lpIOContext->nTotalBytes = dwIoSize;
-			lpIOContext->nSentBytes = 0;
-			lpIOContext->wsabuf.len = dwIoSize;
-			dwFlags = 0;
-			nRet = WSASend(
-				lpPerSocketContext->Socket,
-				&lpIOContext->wsabuf, 1, &dwSendNumBytes,
-				dwFlags,
-				&(lpIOContext->Overlapped), NULL);
-			if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
-				printf("WSASend() failed: %d\n", WSAGetLastError());
-				CloseClient(lpPerSocketContext, FALSE);
-			}
-			else if (g_bVerbose) {
-				printf("WorkerThread %d: Socket(%d) Recv completed (%d bytes), Send posted\n",
+				//
+				// data is waiting on an idle connection.  Borrow a shared buffer only
+				// now and read into it; the read completes right away.
+				//
+				lpIOContext->Buffer = BufAllocate();
+				if (lpIOContext->Buffer == NULL || !PostRecv(lpPerSocketContext))
+					CloseClient(lpPerSocketContext, FALSE);
+				SessionIoDone(lpPerSocketContext);
+				break;
+
+			case ClientIoRead:
+
+				//
+				// a read operation has completed.  Hand the data on, see
+				// SessionReceived, and post the next read right away, so the connection
+				// keeps receiving while the echo is being sent.  A client that does not
+				// read its echoes only gets MAX_SEND_QUEUE bytes, or SEND_QUEUE_SLOTS
+				// messages, ahead before reads pause.
+				//
+				StatAdd(lpStats->nBytesIn, dwIoSize);
+				if (!SessionReceived(lpPerSocketContext, lpIOContext->Buffer, dwIoSize, nHandled)) {
+					CloseClient(lpPerSocketContext, FALSE);
+					SessionIoDone(lpPerSocketContext);
+					break;
+				}
+				LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Recv completed (%d bytes), Send queued",
 					GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
-			}
-			break;
 
-		case ClientIoWrite:
+				if (g_bSharedBuffers) {
+					BufFree(lpIOContext->Buffer);
+					lpIOContext->Buffer = NULL;
+				}
+
+				CtxtLock(lpPerSocketContext);
+				lpPerSocketContext->bRecvPaused = (lpPerSocketContext->nSendQueued >= MAX_SEND_QUEUE ||
+					lpPerSocketContext->nSendCount == SEND_QUEUE_SLOTS);
+				bRecvPaused = lpPerSocketContext->bRecvPaused;
+				CtxtUnlock(lpPerSocketContext);
 
-			//
-			// a write operation has completed, determine if all the data intended to be
-			// sent actually was sent.
-			//
-			lpIOContext->IOOperation = ClientIoWrite;
-			lpIOContext->nSentBytes += dwIoSize;
-			dwFlags = 0;
-			if (lpIOContext->nSentBytes < lpIOContext->nTotalBytes) {
+				if (!bRecvPaused && !PostRecv(lpPerSocketContext))
+					CloseClient(lpPerSocketContext, FALSE);
+				SessionIoDone(lpPerSocketContext);
+				break;
+
+			case ClientIoWrite:
 
 				//
-				// the previous write operation didn't send all the data,
-				// post another send to complete the operation
+				// a write operation has completed.  Take every message it sent in full
+				// off the queue; nSentBytes keeps how far it got into the next one, so
+				// a partial send resumes inside the same vector.  Resume reading once
+				// the queue has drained.  The buffers are released once the lock is
+				// dropped; a broadcast buffer is only freed by its last recipient.
 				//
-				buffSend.buf = lpIOContext->Buffer + lpIOContext->nSentBytes;
-				buffSend.len = lpIOContext->nTotalBytes - lpIOContext->nSentBytes;
-				nRet = WSASend(
-					lpPerSocketContext->Socket,
-					&buffSend, 1, &dwSendNumBytes,
-					dwFlags,
-					&(lpIOContext->Overlapped), NULL);
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
-					printf("WSASend() failed: %d\n", WSAGetLastError());
-					CloseClient(lpPerSocketContext, FALSE);
+				nSendMessages = 0;
+				nSendMessageBytes = 0;
+				bResumeRecv = FALSE;
+				//
+				// the time the send spent in the kernel and then in the port
+				//
+				if (g_bLatency)
+					lpStats->SendPostLatency.Record((ULONGLONG)((nHandled - lpIOContext->nPostTime) * g_dQpcToNs));
+				if ((int)dwIoSize < lpIOContext->nTotalBytes)
+					StatAdd(lpStats->nSendPartials, 1);
+
+				CtxtLock(lpPerSocketContext);
+				lpIOContext->nSentBytes += dwIoSize;
+				while (lpPerSocketContext->nSendCount &&
+					lpIOContext->nSentBytes >= lpPerSocketContext->SendQueue[lpPerSocketContext->nSendHead]->nLength) {
+					lpSendBuffer = lpPerSocketContext->SendQueue[lpPerSocketContext->nSendHead];
+					lpPerSocketContext->SendQueue[lpPerSocketContext->nSendHead] = NULL;
+					lpPerSocketContext->nSendHead = (lpPerSocketContext->nSendHead + 1) % SEND_QUEUE_SLOTS;
+					lpPerSocketContext->nSendCount--;
+					lpIOContext->nSentBytes -= lpSendBuffer->nLength;
+					lpPerSocketContext->nSendQueued -= lpSendBuffer->nLength;
+					nSendMessageBytes += lpSendBuffer->nLength;
+					SentBuffers[nSendMessages++] = lpSendBuffer;
 				}
-				else if (g_bVerbose) {
-					printf("WorkerThread %d: Socket(%d) Send partially completed (%d bytes), Recv posted\n",
-						GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
+
+				if (lpPerSocketContext->bRecvPaused && lpPerSocketContext->nSendQueued < MAX_SEND_QUEUE &&
+					lpPerSocketContext->nSendCount < SEND_QUEUE_SLOTS) {
+					lpPerSocketContext->bRecvPaused = FALSE;
+					bResumeRecv = TRUE;
+				}
+
+				if (lpPerSocketContext->nSendCount) {
+					bSuccess = PostSend(lpPerSocketContext);
+				}
+				else {
+					lpPerSocketContext->bSendPosted = FALSE;
+					bSuccess = TRUE;
+				}
+				CtxtUnlock(lpPerSocketContext);
+
+				StatAdd(lpStats->nSends, 1);
+				StatAdd(lpStats->nSendMessages, nSendMessages);
+				StatAdd(lpStats->nBytesOut, dwIoSize);
+				SendQueuedDone(nSendMessageBytes);
+
+				//
+				// a message that carries received data finishes its receive to send
+				// latency here, once for every recipient
+				//
+				if (g_bLatency)
+					QueryPerformanceCounter(&liNow);
+				for (ULONG i = 0; i < nSendMessages; i++) {
+					if (g_bLatency && SentBuffers[i]->nRecvTime)
+						lpStats->SendLatency.Record((ULONGLONG)((liNow.QuadPart - SentBuffers[i]->nRecvTime) * g_dQpcToNs));
+#if PACKET_TRACE
+					if (SentBuffers[i]->nTraceId)
+						TRACE_ASYNC_SPAN(g_Trace, "received to sent", SentBuffers[i]->nTraceReceived, TRACE_NOW(),
+							SentBuffers[i]->nTraceId, SentBuffers[i]->nLength);
+#endif
+					SendBufferRelease(SentBuffers[i]);
 				}
+
+				if (!bSuccess || (bResumeRecv && !PostRecv(lpPerSocketContext)))
+					CloseClient(lpPerSocketContext, FALSE);
+				else
+					LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Send completed (%d bytes)",
+						GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
+				SessionIoDone(lpPerSocketContext);
+				break;
+
+			} //switch
+		} //for
+	} //while
+	return(0);
+}
+
+//
+//  Run the world at g_dwTickRate ticks per second.  Ticks are due a fixed period
+//  apart, counted from the first one, so a slow tick does not push every later
+//  one back.  A tick that ends after the next one was due is an overrun and the
+//  next one starts right away; once the thread is more than a whole period
+//  behind, the ticks it missed are skipped rather than run back to back.  After
+//  the server is told to end one last tick sends on what is still queued.
+//
+UINT WINAPI TickThread(LPVOID TickContext) {
+
+	HANDLE hTimer = NULL;
+	LARGE_INTEGER liFrequency;
+	LARGE_INTEGER liStart;
+	LARGE_INTEGER liNow;
+	LARGE_INTEGER liDue;
+	LONGLONG nPeriod = 0;
+	LONGLONG nNext = 0;
+	LONGLONG nBehind = 0;
+	ULONGLONG nUs = 0;
+
+	UNREFERENCED_PARAMETER(TickContext);
+#if PACKET_TRACE
+	if (g_nTraceRate)
+		g_Trace.NameThread("TickThread");
+#endif
+
+	//
+	// a high resolution timer wakes the thread well within a millisecond; where
+	// the system does not have one the ordinary timer has to do
+	//
+	hTimer = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+	if (hTimer == NULL)
+		hTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	if (hTimer == NULL) {
+		printf("CreateWaitableTimer() failed: %d\n", GetLastError());
+		WSASetEvent(g_hCleanupEvent[0]);
+		return(0);
+	}
+
+	QueryPerformanceFrequency(&liFrequency);
+	nPeriod = liFrequency.QuadPart / g_dwTickRate;
+	QueryPerformanceCounter(&liNow);
+	nNext = liNow.QuadPart;
+
+	while (!g_bEndServer) {
+		QueryPerformanceCounter(&liStart);
+		TickRun();
+		QueryPerformanceCounter(&liNow);
+
+		nUs = (ULONGLONG)((liNow.QuadPart - liStart.QuadPart) * 1000000 / liFrequency.QuadPart);
+		g_TickStats.nTicks++;
+		g_TickStats.nTotalUs += nUs;
+		if (nUs > g_TickStats.nMaxUs)
+			g_TickStats.nMaxUs = nUs;
+
+		nNext += nPeriod;
+		nBehind = liNow.QuadPart - nNext;
+		if (nBehind >= 0) {
+			g_TickStats.nOverruns++;
+			if (nBehind >= nPeriod) {
+				g_TickStats.nSkipped += nBehind / nPeriod;
+				nNext += (nBehind / nPeriod) * nPeriod;
 			}
-			else {
+			continue;
+		}
+
+		//
+		// due time in 100 ns units, negative for relative
+		//
+		liDue.QuadPart = nBehind * 10000000 / liFrequency.QuadPart;
+		if (liDue.QuadPart == 0)
+			continue;
+		if (!SetWaitableTimer(hTimer, &liDue, 0, NULL, NULL, FALSE)) {
+			printf("SetWaitableTimer() failed: %d\n", GetLastError());
+			break;
+		}
+		WaitForSingleObject(hTimer, INFINITE);
+	}
+
+	TickRun();
+	CloseHandle(hTimer);
+
+	return(0);
+}
+
+//
+//  One tick: take everything the workers received since the last tick, step the
+//  world, and publish what the tick sent in one batch at the end, so nothing of
+//  a tick goes out before all of it is decided.  The world here is the echo:
+//  every message goes back to its sender, or to the room (-r), without a copy.
+//
+VOID TickRun(VOID) {
+
+	PSLIST_ENTRY pEntry = NULL;
+	PSLIST_ENTRY pNext = NULL;
+	PSLIST_ENTRY pOldest = NULL;
+	PINBOUND_MESSAGE lpInbound = NULL;
+	ULONG nInbound = 0;
+
+	//
+	// the list is newest first; turn it around to handle messages in the order
+	// they arrived
+	//
+	pEntry = InterlockedFlushSList(&g_TickInbound);
+	while (pEntry) {
+		pNext = pEntry->Next;
+		pEntry->Next = pOldest;
+		pOldest = pEntry;
+		pEntry = pNext;
+	}
+
+	for (pEntry = pOldest; pEntry; pEntry = pNext) {
+		pNext = pEntry->Next;
+		lpInbound = CONTAINING_RECORD(pEntry, INBOUND_MESSAGE, Entry);
+		nInbound++;
+
+		if (!TickQueueOutbound(g_bRoom ? 0 : lpInbound->SessionId, lpInbound->lpSendBuffer))
+			LOG_WARNING(g_Log, "TickRun: message of session %I64x dropped", lpInbound->SessionId);
+		SendBufferRelease(lpInbound->lpSendBuffer);
+		BlockFree(lpInbound);
+	}
+
+	for (ULONG i = 0; i < g_nTickOutbound; i++) {
+		if (g_pTickOutbound[i].SessionId)
+			SessionBroadcast(&g_pTickOutbound[i].SessionId, 1, g_pTickOutbound[i].lpSendBuffer);
+		else
+			RoomBroadcast(&g_Room, g_pTickOutbound[i].lpSendBuffer);
+		SendBufferRelease(g_pTickOutbound[i].lpSendBuffer);
+	}
+
+	g_TickStats.nInbound += nInbound;
+	g_TickStats.nOutbound += g_nTickOutbound;
+	g_TickStats.nLastInbound = nInbound;
+	g_nTickOutbound = 0;
+
+	return;
+}
+
+//
+//  Queue what a connection received for the next tick.  The message takes its
+//  own reference to the buffer.  Called by the workers.  Returns FALSE if there
+//  was no memory for it.
+//
+BOOL TickQueueInbound(LONG64 SessionId, PSEND_BUFFER lpSendBuffer) {
+
+	PINBOUND_MESSAGE lpInbound = NULL;
+
+	lpInbound = (PINBOUND_MESSAGE)BlockAllocate(sizeof(INBOUND_MESSAGE));
+	if (lpInbound == NULL)
+		return(FALSE);
+
+	InterlockedIncrement(&lpSendBuffer->nRefs);
+	lpInbound->lpSendBuffer = lpSendBuffer;
+	lpInbound->SessionId = SessionId;
+
+	InterlockedPushEntrySList(&g_TickInbound, &lpInbound->Entry);
+
+	return(TRUE);
+}
+
+//
+//  Add a message to what the running tick publishes when it ends; SessionId 0
+//  sends it to the room.  The batch takes its own reference to the buffer.
+//  Called by the tick thread only.  Returns FALSE if the batch could not grow.
+//
+BOOL TickQueueOutbound(LONG64 SessionId, PSEND_BUFFER lpSendBuffer) {
+
+	POUTBOUND_MESSAGE pOutbound = NULL;
+	ULONG nCapacity = 0;
+
+	if (g_nTickOutbound == g_nTickOutboundCapacity) {
+		nCapacity = g_nTickOutboundCapacity ? 2 * g_nTickOutboundCapacity : TICK_INITIAL_SIZE;
+		pOutbound = (POUTBOUND_MESSAGE)xmalloc(nCapacity * sizeof(OUTBOUND_MESSAGE));
+		if (pOutbound == NULL) {
+			LOG_ERROR(g_Log, "HeapAlloc() outbound messages failed: %d", GetLastError());
+			return(FALSE);
+		}
+		if (g_pTickOutbound) {
+			CopyMemory(pOutbound, g_pTickOutbound, g_nTickOutbound * sizeof(OUTBOUND_MESSAGE));
+			xfree(g_pTickOutbound);
+		}
+		g_pTickOutbound = pOutbound;
+		g_nTickOutboundCapacity = nCapacity;
+	}
+
+	InterlockedIncrement(&lpSendBuffer->nRefs);
+	g_pTickOutbound[g_nTickOutbound].SessionId = SessionId;
+	g_pTickOutbound[g_nTickOutbound].lpSendBuffer = lpSendBuffer;
+	g_nTickOutbound++;
+
+	return(TRUE);
+}
+
+//
+//  Release whatever the workers queued after the last tick ran, at exit.
+//
+VOID TickFreeInbound(VOID) {
+
+	PSLIST_ENTRY pEntry = NULL;
+	PINBOUND_MESSAGE lpInbound = NULL;
+
+	pEntry = InterlockedFlushSList(&g_TickInbound);
+	while (pEntry) {
+		lpInbound = CONTAINING_RECORD(pEntry, INBOUND_MESSAGE, Entry);
+		pEntry = pEntry->Next;
+		SendBufferRelease(lpInbound->lpSendBuffer);
+		BlockFree(lpInbound);
+	}
+
+	return;
+}
+
+//
+//  Queue a message for a session another worker owns (-o): it goes on the inbox
+//  of the owner, which queues it on the connection the next time it takes its
+//  inbox.  Only the push that finds no wakeup pending posts one, so the owner is
+//  woken once for a whole burst.  The inbox takes its own reference to the
+//  buffer, and the message counts as queued from here on, so a drain waits for
+//  it.  Any thread may call this while it holds a reference to the connection.
+//  Returns FALSE if there was no memory for the message.
+//
+BOOL InboxPost(PPER_SOCKET_CONTEXT lpPerSocketContext, PSEND_BUFFER lpSendBuffer) {
+
+	PWORKER_INBOX lpInbox = &g_WorkerInboxes[lpPerSocketContext->dwOwner];
+	PINBOX_MESSAGE lpMessage = NULL;
+
+	lpMessage = (PINBOX_MESSAGE)BlockAllocate(sizeof(INBOX_MESSAGE));
+	if (lpMessage == NULL)
+		return(FALSE);
+
+	InterlockedIncrement(&lpSendBuffer->nRefs);
+	lpMessage->SessionId = lpPerSocketContext->SessionId;
+	lpMessage->lpSendBuffer = lpSendBuffer;
+	InterlockedExchangeAdd64(&g_nSendQueuedBytes, lpSendBuffer->nLength);
+	InterlockedPushEntrySList(&lpInbox->Messages, &lpMessage->Entry);
+	InboxWake(lpPerSocketContext->dwOwner);
+
+	return(TRUE);
+}
+
+//
+//  Ask the owner of a session (-o) to close it.  The request is linked through
+//  the context itself, so it needs no memory and cannot fail, and it holds a
+//  reference that keeps the context until the owner has closed it.  Only the
+//  first request of a connection is queued.  Any thread may call this while it
+//  holds a reference to the connection.
+//
+VOID InboxClose(PPER_SOCKET_CONTEXT lpPerSocketContext, BOOL bGraceful) {
+
+	if (InterlockedExchange(&lpPerSocketContext->bCloseRequested, TRUE))
+		return;
+
+	lpPerSocketContext->bCloseGraceful = bGraceful;
+	InterlockedIncrement(&lpPerSocketContext->nIoPending);
+	InterlockedPushEntrySList(&g_WorkerInboxes[lpPerSocketContext->dwOwner].Closes, &lpPerSocketContext->CloseEntry);
+	InboxWake(lpPerSocketContext->dwOwner);
+
+	return;
+}
+
+//
+//  Post the wakeup of a worker's inbox unless one is pending already.  What was
+//  pushed is in the inbox either way; if the owner cannot be woken now, the next
+//  push tries again.
+//
+VOID InboxWake(DWORD dwOwner) {
+
+	PWORKER_INBOX lpInbox = &g_WorkerInboxes[dwOwner];
+
+	if (InterlockedExchange(&lpInbox->bWakePending, TRUE))
+		return;
+
+	if (!PostQueuedCompletionStatus(g_hWorkerPorts[dwOwner], 0,
+		(ULONG_PTR)lpInbox, &lpInbox->Wakeup.Overlapped)) {
+		LOG_ERROR(g_Log, "PostQueuedCompletionStatus() failed to wake WorkerThread %d: %d",
+			dwOwner, GetLastError());
+		InterlockedExchange(&lpInbox->bWakePending, FALSE);
+	}
+
+	return;
+}
+
+//
+//  Queue everything in a worker's inbox on the connections it is for, then close
+//  the connections other threads asked to close.  Called by the owning worker
+//  when the wakeup arrives.  Sessions that are gone are skipped;
+//  a session that cannot take the message is closed, as in SessionBroadcast.
+//  The message stops counting as queued only once the connection queue counts
+//  it, so the count does not touch zero in between; what is dropped on shutdown
+//  goes into the report.
+//
+VOID InboxDrain(PWORKER_INBOX lpInbox, PWORKER_STATS lpStats) {
+
+	PSLIST_ENTRY pEntry = NULL;
+	PSLIST_ENTRY pNext = NULL;
+	PSLIST_ENTRY pOldest = NULL;
+	PINBOX_MESSAGE lpMessage = NULL;
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	ULONG nMessages = 0;
+	BOOL bQueued = FALSE;
+
+	//
+	// The flag is cleared before the messages are taken: a push that finds it
+	// clear posts a new wakeup, and any push before that is taken here.  The list
+	// is newest first; turn it around to queue messages in the order they came.
+	//
+	InterlockedExchange(&lpInbox->bWakePending, FALSE);
+	pEntry = InterlockedFlushSList(&lpInbox->Messages);
+	while (pEntry) {
+		pNext = pEntry->Next;
+		pEntry->Next = pOldest;
+		pOldest = pEntry;
+		pEntry = pNext;
+	}
+
+	for (pEntry = pOldest; pEntry; pEntry = pNext) {
+		pNext = pEntry->Next;
+		lpMessage = CONTAINING_RECORD(pEntry, INBOX_MESSAGE, Entry);
+		nMessages++;
+
+		bQueued = FALSE;
+		lpPerSocketContext = SessionAcquire(lpMessage->SessionId);
+		if (lpPerSocketContext) {
+			bQueued = SessionQueue(lpPerSocketContext, lpMessage->lpSendBuffer);
+			if (!bQueued)
+				CloseClient(lpPerSocketContext, FALSE);
+			SessionIoDone(lpPerSocketContext);
+		}
+		if (!bQueued && g_bEndServer) {
+			InterlockedIncrement(&g_nInboxDropped);
+			InterlockedExchangeAdd64(&g_nInboxDroppedBytes, lpMessage->lpSendBuffer->nLength);
+		}
+		SendQueuedDone(lpMessage->lpSendBuffer->nLength);
+		SendBufferRelease(lpMessage->lpSendBuffer);
+		BlockFree(lpMessage);
+	}
+
+	//
+	// a close comes after what was queued before it
+	//
+	pEntry = InterlockedFlushSList(&lpInbox->Closes);
+	while (pEntry) {
+		lpPerSocketContext = CONTAINING_RECORD(pEntry, PER_SOCKET_CONTEXT, CloseEntry);
+		pEntry = pEntry->Next;
+		CloseClient(lpPerSocketContext, lpPerSocketContext->bCloseGraceful);
+		SessionIoDone(lpPerSocketContext);
+	}
+
+	StatAdd(lpStats->nInboxWakeups, 1);
+	StatAdd(lpStats->nInboxMessages, nMessages);
+
+	return;
+}
+
+//
+//  Release whatever is left in the inboxes once the workers have exited; it
+//  counts as dropped on shutdown.
+//
+VOID InboxFreeAll(VOID) {
+
+	PSLIST_ENTRY pEntry = NULL;
+	PINBOX_MESSAGE lpMessage = NULL;
+
+	for (int i = 0; i < MAX_WORKER_THREAD; i++) {
+		pEntry = InterlockedFlushSList(&g_WorkerInboxes[i].Messages);
+		while (pEntry) {
+			lpMessage = CONTAINING_RECORD(pEntry, INBOX_MESSAGE, Entry);
+			pEntry = pEntry->Next;
+			g_nInboxDropped++;
+			g_nInboxDroppedBytes += lpMessage->lpSendBuffer->nLength;
+			SendQueuedDone(lpMessage->lpSendBuffer->nLength);
+			SendBufferRelease(lpMessage->lpSendBuffer);
+			BlockFree(lpMessage);
+		}
+		//
+		// a close request still here holds its context, which is then left to
+		// the system with the others that did not drain
+		//
+		InterlockedFlushSList(&g_WorkerInboxes[i].Closes);
+		g_WorkerInboxes[i].bWakePending = FALSE;
+	}
+
+	return;
+}
+
+//
+//  Print how many completions every worker removed per dequeue call.  The counters
+//  are only written by their own worker, so reading them here without a lock can
+//  at worst be off by the packets currently being handled.
+//
+VOID PrintWorkerStats(VOID) {
+
+	ULONGLONG nTotalCompletions = 0;
+	ULONGLONG nTotalDequeueCalls = 0;
+	ULONGLONG nTotalSends = 0;
+	ULONGLONG nTotalSendMessages = 0;
+	ULONGLONG nTotalInboxWakeups = 0;
+	ULONGLONG nTotalInboxMessages = 0;
+	ULONGLONG nTotalSendPartials = 0;
+	ULONGLONG nTotalAccepts = 0;
+	ULONGLONG nTotalCloses = g_nForeignCloses.load(std::memory_order_relaxed);
+	ULONGLONG nTotalBytesIn = 0;
+	ULONGLONG nTotalBytesOut = 0;
+	LatencyHistogram HandlerLatency;
+	LatencyHistogram SendPostLatency;
+	LatencyHistogram SendLatency;
+	PROCESS_MEMORY_COUNTERS pmc;
+	LONG nConnections = g_nConnections;
+	LONG nMinOwned = MAXLONG;
+	LONG nMaxOwned = 0;
+
+	for (DWORD i = 0; i < g_dwThreadCount; i++) {
+		ULONGLONG nCompletions = g_WorkerStats[i].nCompletions.load(std::memory_order_relaxed);
+		ULONGLONG nDequeueCalls = g_WorkerStats[i].nDequeueCalls.load(std::memory_order_relaxed);
+		LONG nOwned = g_WorkerStats[i].nSessions;
+
+		if (g_bVerbose)
+			printf("WorkerThread %d: %I64u completions in %I64u calls (%.2f per call)\n",
+				i, nCompletions, nDequeueCalls,
+				nDequeueCalls ? (double)nCompletions / nDequeueCalls : 0.0);
+
+		nMinOwned = min(nMinOwned, nOwned);
+		nMaxOwned = max(nMaxOwned, nOwned);
+
+		nTotalCompletions += nCompletions;
+		nTotalDequeueCalls += nDequeueCalls;
+		nTotalSends += g_WorkerStats[i].nSends.load(std::memory_order_relaxed);
+		nTotalSendMessages += g_WorkerStats[i].nSendMessages.load(std::memory_order_relaxed);
+		nTotalInboxWakeups += g_WorkerStats[i].nInboxWakeups.load(std::memory_order_relaxed);
+		nTotalInboxMessages += g_WorkerStats[i].nInboxMessages.load(std::memory_order_relaxed);
+		nTotalSendPartials += g_WorkerStats[i].nSendPartials.load(std::memory_order_relaxed);
+		nTotalAccepts += g_WorkerStats[i].nAccepts.load(std::memory_order_relaxed);
+		nTotalCloses += g_WorkerStats[i].nCloses.load(std::memory_order_relaxed);
+		nTotalBytesIn += g_WorkerStats[i].nBytesIn.load(std::memory_order_relaxed);
+		nTotalBytesOut += g_WorkerStats[i].nBytesOut.load(std::memory_order_relaxed);
+		HandlerLatency.Add(g_WorkerStats[i].HandlerLatency);
+		SendPostLatency.Add(g_WorkerStats[i].SendPostLatency);
+		SendLatency.Add(g_WorkerStats[i].SendLatency);
+	}
+
+	printf("Workers: %I64u completions in %I64u calls (%.2f completions per call)\n",
+		nTotalCompletions, nTotalDequeueCalls,
+		nTotalDequeueCalls ? (double)nTotalCompletions / nTotalDequeueCalls : 0.0);
+
+	printf("Sends: %I64u messages in %I64u sends (%.2f messages per send), %I64u partial\n",
+		nTotalSendMessages, nTotalSends,
+		nTotalSends ? (double)nTotalSendMessages / nTotalSends : 0.0, nTotalSendPartials);
+
+	printf("Traffic: %I64u accepted  %I64u closed  %I64u bytes in  %I64u bytes out\n",
+		nTotalAccepts, nTotalCloses, nTotalBytesIn, nTotalBytesOut);
+
+	//
+	// since the server started; percentiles are the top of their bucket, within 1/32
+	//
+	printf("Completion to handler: p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+		HandlerLatency.Percentile(0.5) / 1000.0, HandlerLatency.Percentile(0.99) / 1000.0,
+		HandlerLatency.Percentile(0.999) / 1000.0, HandlerLatency.Max() / 1000.0);
+	printf("Send post to completion: p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+		SendPostLatency.Percentile(0.5) / 1000.0, SendPostLatency.Percentile(0.99) / 1000.0,
+		SendPostLatency.Percentile(0.999) / 1000.0, SendPostLatency.Max() / 1000.0);
+	printf("Receive to send: p50 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+		SendLatency.Percentile(0.5) / 1000.0, SendLatency.Percentile(0.99) / 1000.0,
+		SendLatency.Percentile(0.999) / 1000.0, SendLatency.Max() / 1000.0);
+
+	if (g_bOwnedSessions && g_dwThreadCount)
+		printf("Owned: %d to %d connections per worker, %I64u sends from other threads in %I64u wakeups (%.2f per wakeup)\n",
+			nMinOwned, nMaxOwned, nTotalInboxMessages, nTotalInboxWakeups,
+			nTotalInboxWakeups ? (double)nTotalInboxMessages / nTotalInboxWakeups : 0.0);
+
+	//
+	// the longest tick is reset with every report, so it is the worst of the
+	// last interval
+	//
+	if (g_dwTickRate) {
+		ULONGLONG nTicks = g_TickStats.nTicks;
+
+		printf("Ticks: %I64u at %d Hz  avg %.1f us  max %I64u us  %I64u overruns  %I64u skipped  %I64u messages in, %I64u out\n",
+			nTicks, g_dwTickRate, nTicks ? (double)g_TickStats.nTotalUs / nTicks : 0.0,
+			g_TickStats.nMaxUs, g_TickStats.nOverruns, g_TickStats.nSkipped,
+			g_TickStats.nInbound, g_TickStats.nOutbound);
+		g_TickStats.nMaxUs = 0;
+	}
+
+	//
+	// what every connection costs, measured as the growth of the working set since
+	// the server started listening
+	//
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+		printf("Connections: %d  working set: %.1f MB  (%.2f KB per connection)\n",
+			nConnections, pmc.WorkingSetSize / (1024.0 * 1024.0),
+			nConnections && pmc.WorkingSetSize > g_nBaseWorkingSet ?
+			(pmc.WorkingSetSize - g_nBaseWorkingSet) / 1024.0 / nConnections : 0.0);
+}
+
+//
+//  Create the socket the metrics are served on (-m).  It only listens on the
+//  loopback interface: the endpoint is for a local agent or scraper, and takes
+//  no more care than that.
+//
+BOOL CreateMetricsSocket(VOID) {
+
+	struct addrinfo hints = { 0 };
+	struct addrinfo* addrlocal = NULL;
+	int nRet = 0;
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo("127.0.0.1", g_MetricsPort, &hints, &addrlocal) != 0 || addrlocal == NULL) {
+		printf("getaddrinfo() failed for metrics port %s: %d\n", g_MetricsPort, WSAGetLastError());
+		return(FALSE);
+	}
+
+	g_sdMetrics = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (g_sdMetrics == INVALID_SOCKET) {
+		printf("socket() failed for metrics: %d\n", WSAGetLastError());
+		freeaddrinfo(addrlocal);
+		return(FALSE);
+	}
+
+	nRet = bind(g_sdMetrics, addrlocal->ai_addr, (int)addrlocal->ai_addrlen);
+	freeaddrinfo(addrlocal);
+	if (nRet == SOCKET_ERROR || listen(g_sdMetrics, SOMAXCONN) == SOCKET_ERROR) {
+		printf("bind() or listen() failed for metrics port %s: %d\n", g_MetricsPort, WSAGetLastError());
+		closesocket(g_sdMetrics);
+		g_sdMetrics = INVALID_SOCKET;
+		return(FALSE);
+	}
+
+	return(TRUE);
+}
+
+//
+//  Serve the metrics, one scrape at a time, until the socket is closed for
+//  shutdown.  Every scrape sums the counters of the workers afresh, so the
+//  workers never do anything for it.  A client gets METRICS_TIMEOUT to send
+//  its request and to take the reply, so a stuck one cannot hold up shutdown.
+//
+UINT WINAPI MetricsThread(LPVOID MetricsContext) {
+
+	METRICS_TEXT Text;
+	char szRequest[METRICS_REQUEST_SIZE];
+	SOCKET sdClient = INVALID_SOCKET;
+	DWORD dwTimeout = METRICS_TIMEOUT;
+	std::string Trace;
+	int nRequest = 0;
+	int nRet = 0;
+
+	UNREFERENCED_PARAMETER(MetricsContext);
+	ZeroMemory(&Text, sizeof(Text));
+
+	while (!g_bEndServer) {
+		sdClient = accept(g_sdMetrics, NULL, NULL);
+		if (sdClient == INVALID_SOCKET) {
+			if (g_bEndServer)
+				break;
+			LOG_WARNING(g_Log, "accept() on the metrics socket failed: %d", WSAGetLastError());
+			if (WSAGetLastError() != WSAECONNRESET)
+				break;
+			continue;
+		}
+		setsockopt(sdClient, SOL_SOCKET, SO_RCVTIMEO, (char*)&dwTimeout, sizeof(dwTimeout));
+		setsockopt(sdClient, SOL_SOCKET, SO_SNDTIMEO, (char*)&dwTimeout, sizeof(dwTimeout));
+
+		//
+		// the request line is all that matters; read up to the end of the headers
+		//
+		nRequest = 0;
+		szRequest[0] = '\0';
+		while (nRequest < (int)sizeof(szRequest) - 1 && strstr(szRequest, "\r\n\r\n") == NULL) {
+			nRet = recv(sdClient, szRequest + nRequest, (int)sizeof(szRequest) - 1 - nRequest, 0);
+			if (nRet <= 0)
+				break;
+			nRequest += nRet;
+			szRequest[nRequest] = '\0';
+		}
+
+		//
+		// /trace dumps the spans the threads hold right now, while they go on
+		// tracing (-x)
+		//
+		if (strncmp(szRequest, "GET /trace ", 11) == 0 && g_nTraceRate) {
+			Trace.clear();
+			g_Trace.Dump(&Trace);
+			MetricsReply(sdClient, "200 OK", "application/json", Trace.data(), Trace.size());
+		}
+		else if (strncmp(szRequest, "GET /metrics ", 13) != 0 && strncmp(szRequest, "GET / ", 6) != 0)
+			MetricsReply(sdClient, "404 Not Found", METRICS_TEXT_TYPE, "Not found, try /metrics\n", 24);
+		else if (!MetricsRender(&Text))
+			MetricsReply(sdClient, "500 Internal Server Error", METRICS_TEXT_TYPE, "Out of memory\n", 14);
+		else
+			MetricsReply(sdClient, "200 OK", METRICS_TEXT_TYPE, Text.pText, Text.nLength);
+		closesocket(sdClient);
+	}
+
+	if (Text.pText)
+		xfree(Text.pText);
+
+	return(0);
+}
+
+//
+//  Send one HTTP response and have the client close after it.  Returns FALSE if
+//  the client went away first.
+//
+BOOL MetricsReply(SOCKET sd, const char* lpStatus, const char* lpContentType, const char* lpBody, size_t nLength) {
+
+	char szHeader[256];
+	int nHeader = 0;
+	int nRet = 0;
+
+	nHeader = _snprintf_s(szHeader, sizeof(szHeader), _TRUNCATE,
+		"HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %Iu\r\nConnection: close\r\n\r\n",
+		lpStatus, lpContentType, nLength);
+	if (nHeader < 0 || send(sd, szHeader, nHeader, 0) != nHeader)
+		return(FALSE);
+
+	while (nLength) {
+		nRet = send(sd, lpBody, (int)min(nLength, (size_t)MAXINT), 0);
+		if (nRet <= 0)
+			return(FALSE);
+		lpBody += nRet;
+		nLength -= nRet;
+	}
+
+	return(TRUE);
+}
+
+//
+//  Write every metric in the Prometheus text format.  Counters are per worker,
+//  summed by whoever scrapes them; the histograms are summed over the workers
+//  here, since a histogram per worker would be far too many series.  Returns
+//  FALSE if there was no memory for the text.
+//
+BOOL MetricsRender(PMETRICS_TEXT lpText) {
+
+	static const struct {
+		const char* lpName;
+		const char* lpHelp;
+		LONG nOffset;
+	} Counters[] = {
+		{ "completions_total", "Completion packets removed from the port", FIELD_OFFSET(WORKER_STATS, nCompletions) },
+		{ "dequeue_calls_total", "GetQueuedCompletionStatusEx calls", FIELD_OFFSET(WORKER_STATS, nDequeueCalls) },
+		{ "accepts_total", "Connections set up", FIELD_OFFSET(WORKER_STATS, nAccepts) },
+		{ "closes_total", "Connections closed", FIELD_OFFSET(WORKER_STATS, nCloses) },
+		{ "received_bytes_total", "Bytes received", FIELD_OFFSET(WORKER_STATS, nBytesIn) },
+		{ "sent_bytes_total", "Bytes sent", FIELD_OFFSET(WORKER_STATS, nBytesOut) },
+		{ "sends_total", "Send completions", FIELD_OFFSET(WORKER_STATS, nSends) },
+		{ "send_messages_total", "Queued messages the sends finished", FIELD_OFFSET(WORKER_STATS, nSendMessages) },
+		{ "send_partials_total", "Sends that completed short of what was posted", FIELD_OFFSET(WORKER_STATS, nSendPartials) },
+		{ "inbox_wakeups_total", "Times a worker took its inbox (-o)", FIELD_OFFSET(WORKER_STATS, nInboxWakeups) },
+		{ "inbox_messages_total", "Sends from other threads found in the inbox (-o)", FIELD_OFFSET(WORKER_STATS, nInboxMessages) },
+	};
+	LatencyHistogram HandlerLatency;
+	LatencyHistogram SendPostLatency;
+	LatencyHistogram SendLatency;
+	BOOL bRet = TRUE;
+
+	lpText->nLength = 0;
+
+	for (size_t c = 0; c < _countof(Counters); c++) {
+		bRet = bRet && MetricsPrintf(lpText, "# HELP iocpserverex_%s %s\n# TYPE iocpserverex_%s counter\n",
+			Counters[c].lpName, Counters[c].lpHelp, Counters[c].lpName);
+		for (DWORD i = 0; i < g_dwThreadCount; i++) {
+			bRet = bRet && MetricsPrintf(lpText, "iocpserverex_%s{worker=\"%d\"} %I64u\n", Counters[c].lpName, i,
+				((std::atomic<uint64_t>*)((char*)&g_WorkerStats[i] + Counters[c].nOffset))->load(std::memory_order_relaxed));
+		}
+
+		//
+		// the tick thread and the main thread close connections too
+		//
+		if (Counters[c].nOffset == FIELD_OFFSET(WORKER_STATS, nCloses))
+			bRet = bRet && MetricsPrintf(lpText, "iocpserverex_%s{worker=\"other\"} %I64u\n", Counters[c].lpName,
+				g_nForeignCloses.load(std::memory_order_relaxed));
+	}
+
+	bRet = bRet && MetricsPrintf(lpText,
+		"# HELP iocpserverex_connections Connections in the session table\n"
+		"# TYPE iocpserverex_connections gauge\n"
+		"iocpserverex_connections %d\n"
+		"# HELP iocpserverex_accepts_pending AcceptEx calls posted and not yet completed\n"
+		"# TYPE iocpserverex_accepts_pending gauge\n"
+		"iocpserverex_accepts_pending %d\n"
+		"# HELP iocpserverex_send_queued_bytes Bytes on all send queues\n"
+		"# TYPE iocpserverex_send_queued_bytes gauge\n"
+		"iocpserverex_send_queued_bytes %I64d\n",
+		g_nConnections, g_nAcceptsPending, g_nSendQueuedBytes);
+
+	if (g_bOwnedSessions) {
+		bRet = bRet && MetricsPrintf(lpText,
+			"# HELP iocpserverex_owned_sessions Connections a worker owns\n"
+			"# TYPE iocpserverex_owned_sessions gauge\n");
+		for (DWORD i = 0; i < g_dwThreadCount; i++)
+			bRet = bRet && MetricsPrintf(lpText, "iocpserverex_owned_sessions{worker=\"%d\"} %d\n",
+				i, g_WorkerStats[i].nSessions);
+	}
+
+	if (g_dwTickRate)
+		bRet = bRet && MetricsPrintf(lpText,
+			"# HELP iocpserverex_tick_inbound_messages Messages the last tick found queued\n"
+			"# TYPE iocpserverex_tick_inbound_messages gauge\n"
+			"iocpserverex_tick_inbound_messages %u\n",
+			g_TickStats.nLastInbound);
+
+	for (DWORD i = 0; i < g_dwThreadCount; i++) {
+		HandlerLatency.Add(g_WorkerStats[i].HandlerLatency);
+		SendPostLatency.Add(g_WorkerStats[i].SendPostLatency);
+		SendLatency.Add(g_WorkerStats[i].SendLatency);
+	}
+	bRet = bRet && MetricsHistogram(lpText, "iocpserverex_completion_to_handler_seconds",
+		"Time a completion waited behind the others of its batch", &HandlerLatency);
+	bRet = bRet && MetricsHistogram(lpText, "iocpserverex_send_post_to_completion_seconds",
+		"Time from posting a send to handling its completion", &SendPostLatency);
+	bRet = bRet && MetricsHistogram(lpText, "iocpserverex_receive_to_send_seconds",
+		"Time from receiving data to completing the send of what it caused", &SendLatency);
+
+	return(bRet);
+}
+
+//
+//  Append to the metrics text, growing it as needed.  Returns FALSE if there was
+//  no memory to grow it.
+//
+BOOL MetricsPrintf(PMETRICS_TEXT lpText, const char* lpFormat, ...) {
+
+	va_list args;
+	char* pText = NULL;
+	size_t nCapacity = 0;
+	int nRet = 0;
+
+	while (TRUE) {
+		if (lpText->nCapacity - lpText->nLength > 1) {
+			va_start(args, lpFormat);
+			nRet = _vsnprintf_s(lpText->pText + lpText->nLength, lpText->nCapacity - lpText->nLength,
+				_TRUNCATE, lpFormat, args);
+			va_end(args);
+			if (nRet >= 0) {
+				lpText->nLength += nRet;
+				return(TRUE);
+			}
+		}
+
+		//
+		// it did not fit; the text is kept between scrapes, so it only grows
+		// until it holds one
+		//
+		nCapacity = lpText->nCapacity ? 2 * lpText->nCapacity : METRICS_INITIAL_SIZE;
+		pText = (char*)xmalloc(nCapacity);
+		if (pText == NULL) {
+			LOG_ERROR(g_Log, "HeapAlloc() metrics text failed: %d", GetLastError());
+			return(FALSE);
+		}
+		if (lpText->pText) {
+			CopyMemory(pText, lpText->pText, lpText->nLength);
+			xfree(lpText->pText);
+		}
+		lpText->pText = pText;
+		lpText->nCapacity = nCapacity;
+	}
+}
+
+//
+//  Append a latency histogram, kept in nanoseconds, in seconds.  Only the powers
+//  of two from 2^METRICS_LOW_BIT to 2^METRICS_HIGH_BIT ns are exported as bounds;
+//  they are bucket boundaries, so the counts below them are exact.
+//
+BOOL MetricsHistogram(PMETRICS_TEXT lpText, const char* lpName, const char* lpHelp,
+	const LatencyHistogram* lpHistogram) {
+
+	BOOL bRet = TRUE;
+
+	bRet = bRet && MetricsPrintf(lpText, "# HELP %s %s\n# TYPE %s histogram\n", lpName, lpHelp, lpName);
+	for (int nBit = METRICS_LOW_BIT; nBit <= METRICS_HIGH_BIT; nBit++)
+		bRet = bRet && MetricsPrintf(lpText, "%s_bucket{le=\"%.9g\"} %I64u\n", lpName,
+			(double)(1ull << nBit) / 1e9, lpHistogram->CountBelow(1ull << nBit));
+	bRet = bRet && MetricsPrintf(lpText, "%s_bucket{le=\"+Inf\"} %I64u\n%s_sum %.9f\n%s_count %I64u\n",
+		lpName, lpHistogram->Count(), lpName, lpHistogram->Sum() / 1e9, lpName, lpHistogram->Count());
+
+	return(bRet);
+}
+
+//
+//  Write what the threads still hold of the packet trace (-x) to a file, in the
+//  Chrome trace format; chrome://tracing and https://ui.perfetto.dev load it.
+//  Called on shutdown, once the workers are gone.
+//
+VOID TraceWrite(VOID) {
+
+	std::string Trace;
+	FILE* pFile = NULL;
+	size_t nSpans = 0;
+
+	nSpans = g_Trace.Dump(&Trace);
+	if (fopen_s(&pFile, g_szTraceFile, "wb") != 0 || pFile == NULL) {
+		printf("fopen_s(%s) failed, the trace is lost\n", g_szTraceFile);
+		return;
+	}
+	if (fwrite(Trace.data(), 1, Trace.size(), pFile) != Trace.size())
+		printf("fwrite(%s) failed, the trace is cut short\n", g_szTraceFile);
+	fclose(pFile);
+	printf("Trace: %Iu spans written to %s\n", nSpans, g_szTraceFile);
+
+	return;
+}
+
+//
+//  Post the next read on a connection.  With shared buffers (-i) a connection that
+//  holds no buffer waits on a zero-byte read instead, which holds no memory until
+//  data arrives.  Nothing is posted once the connection is closed, nor while the
+//  server drains on shutdown.  Returns FALSE if the read could not be posted.
+//
+BOOL PostRecv(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_IO_CONTEXT lpIOContext = lpPerSocketContext->pIOContext;
+	DWORD dwRecvNumBytes = 0;
+	DWORD dwFlags = 0;
+	int nRet = 0;
+	BOOL bRet = TRUE;
+
+	if (g_bDraining)
+		return(TRUE);
+
+	if (lpIOContext->Buffer) {
+		lpIOContext->IOOperation = ClientIoRead;
+		lpIOContext->wsabuf.buf = lpIOContext->Buffer;
+		lpIOContext->wsabuf.len = MAX_BUFF_SIZE;
+	}
+	else {
+		lpIOContext->IOOperation = ClientIoZeroRead;
+		lpIOContext->wsabuf.buf = NULL;
+		lpIOContext->wsabuf.len = 0;
+	}
+
+	CtxtLock(lpPerSocketContext);
+	if (lpPerSocketContext->Socket != INVALID_SOCKET) {
+		InterlockedIncrement(&lpPerSocketContext->nIoPending);
+		nRet = WSARecv(
+			lpPerSocketContext->Socket,
+			&lpIOContext->wsabuf, 1,
+			&dwRecvNumBytes,
+			&dwFlags,
+			&lpIOContext->Overlapped, NULL);
+		if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
+			LOG_WARNING(g_Log, "WSARecv() failed: %d", WSAGetLastError());
+			InterlockedDecrement(&lpPerSocketContext->nIoPending);
+			bRet = FALSE;
+		}
+	}
+	CtxtUnlock(lpPerSocketContext);
+
+	return(bRet);
+}
+
+//
+//  Post one send gathering up to MAX_SEND_WSABUF messages from the head of the
+//  send queue, starting nSentBytes into the head message.  The messages are sent
+//  straight from the queue, nothing is copied.  Called with the connection's lock
+//  held and a message on the queue.  Nothing is posted once the connection is
+//  closed.  Returns FALSE if the send could not be posted.
+//
+BOOL PostSend(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_IO_CONTEXT lpIOContext = lpPerSocketContext->pSendContext;
+	PSEND_BUFFER lpSendBuffer = lpPerSocketContext->SendQueue[lpPerSocketContext->nSendHead];
+	LPWSABUF lpWsabuf = lpPerSocketContext->SendWsabuf;
+	DWORD dwBufferCount = 0;
+	DWORD dwSendNumBytes = 0;
+	LARGE_INTEGER liPosted;
+	int nRet = 0;
+#if PACKET_TRACE
+	ULONGLONG nTraceId = lpSendBuffer->nTraceId;	// the first traced packet the send carries
+	ULONGLONG nTracePosted = 0;
+#endif
+
+	if (lpPerSocketContext->Socket == INVALID_SOCKET) {
+		lpPerSocketContext->bSendPosted = FALSE;
+		return(TRUE);
+	}
+
+	lpIOContext->IOOperation = ClientIoWrite;
+	lpIOContext->nTotalBytes = 0;
+
+	lpWsabuf[0].buf = lpSendBuffer->Data + lpIOContext->nSentBytes;
+	lpWsabuf[0].len = lpSendBuffer->nLength - lpIOContext->nSentBytes;
+	lpIOContext->nTotalBytes += lpWsabuf[0].len;
+	for (dwBufferCount = 1;
+		dwBufferCount < MAX_SEND_WSABUF && dwBufferCount < lpPerSocketContext->nSendCount;
+		dwBufferCount++) {
+		lpSendBuffer = lpPerSocketContext->SendQueue[(lpPerSocketContext->nSendHead + dwBufferCount) % SEND_QUEUE_SLOTS];
+		lpWsabuf[dwBufferCount].buf = lpSendBuffer->Data;
+		lpWsabuf[dwBufferCount].len = lpSendBuffer->nLength;
+		lpIOContext->nTotalBytes += lpSendBuffer->nLength;
+#if PACKET_TRACE
+		if (nTraceId == 0)
+			nTraceId = lpSendBuffer->nTraceId;
+#endif
+	}
+
+#if PACKET_TRACE
+	//
+	// the completion may be dequeued before WSASend even returns, so it learns
+	// what it carries first
+	//
+	if (nTraceId)
+		nTracePosted = lpIOContext->nTracePosted = TRACE_NOW();
+	lpIOContext->nTraceId = nTraceId;
+#endif
+	if (g_bLatency) {
+		QueryPerformanceCounter(&liPosted);
+		lpIOContext->nPostTime = liPosted.QuadPart;
+	}
+	InterlockedIncrement(&lpPerSocketContext->nIoPending);
+	nRet = WSASend(
+		lpPerSocketContext->Socket,
+		lpWsabuf, dwBufferCount, &dwSendNumBytes,
+		0,
+		&lpIOContext->Overlapped, NULL);
+	if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
+		LOG_WARNING(g_Log, "WSASend() failed: %d", WSAGetLastError());
+		InterlockedDecrement(&lpPerSocketContext->nIoPending);
+		lpPerSocketContext->bSendPosted = FALSE;
+#if PACKET_TRACE
+		lpIOContext->nTraceId = 0;
+#endif
+		return(FALSE);
+	}
+#if PACKET_TRACE
+	if (nTraceId)
+		TRACE_SPAN(g_Trace, "WSASend", nTracePosted, TRACE_NOW(), nTraceId, lpIOContext->nTotalBytes);
+#endif
+
+	return(TRUE);
+}
+
+//
+//  Allocate a send buffer for a message of nLength bytes, to be written by the
+//  caller.  The caller holds the one reference it starts with, and drops it with
+//  SendBufferRelease once the buffer is queued wherever it is going.
+//
+//  The buffer comes from the block pool and is not zeroed: every field is set
+//  here, and the caller writes all of Data.
+//
+PSEND_BUFFER SendBufferAlloc(int nLength) {
+
+	PSEND_BUFFER lpSendBuffer = NULL;
+
+	lpSendBuffer = (PSEND_BUFFER)BlockAllocate(FIELD_OFFSET(SEND_BUFFER, Data) + nLength);
+	if (lpSendBuffer == NULL)
+		return(NULL);
+	lpSendBuffer->nRefs = 1;
+	lpSendBuffer->nLength = nLength;
+	lpSendBuffer->nRecvTime = 0;
+#if PACKET_TRACE
+	lpSendBuffer->nTraceId = 0;
+	lpSendBuffer->nTraceReceived = 0;
+#endif
+
+	return(lpSendBuffer);
+}
+
+//
+//  Drop one reference to a send buffer; the last one returns it to the pool.
+//
+VOID SendBufferRelease(PSEND_BUFFER lpSendBuffer) {
+
+	if (InterlockedDecrement(&lpSendBuffer->nRefs) == 0)
+		BlockFree(lpSendBuffer);
+
+	return;
+}
+
+//
+//  Queue a message for a connection; messages go out in the order they were
+//  queued, one send at a time, and whatever queues up while a send is in flight
+//  goes out together with the next one.  The queue takes its own reference to the
+//  buffer, nothing is copied.  Any thread may call this while it holds a reference
+//  to the connection.  Returns FALSE if the connection is closed, its queue is
+//  full because it does not keep up, or the send could not be posted, in which
+//  case the caller closes it.
+//
+//  With owned sessions (-o) any thread but the owner only puts the message on the
+//  owner's inbox, see InboxPost, and the owner closes the connection if its queue
+//  turns out to be full then.
+//
+BOOL SessionQueue(PPER_SOCKET_CONTEXT lpPerSocketContext, PSEND_BUFFER lpSendBuffer) {
+
+	BOOL bRet = TRUE;
+
+	if (g_bOwnedSessions && t_lpInbox != &g_WorkerInboxes[lpPerSocketContext->dwOwner])
+		return(InboxPost(lpPerSocketContext, lpSendBuffer));
+
+	CtxtLock(lpPerSocketContext);
+	if (lpPerSocketContext->Socket == INVALID_SOCKET ||
+		lpPerSocketContext->nSendCount == SEND_QUEUE_SLOTS) {
+		CtxtUnlock(lpPerSocketContext);
+		return(FALSE);
+	}
+
+	InterlockedIncrement(&lpSendBuffer->nRefs);
+	lpPerSocketContext->SendQueue[(lpPerSocketContext->nSendHead + lpPerSocketContext->nSendCount) % SEND_QUEUE_SLOTS] =
+		lpSendBuffer;
+	lpPerSocketContext->nSendCount++;
+	lpPerSocketContext->nSendQueued += lpSendBuffer->nLength;
+	InterlockedExchangeAdd64(&g_nSendQueuedBytes, lpSendBuffer->nLength);
+
+	if (!lpPerSocketContext->bSendPosted) {
+		lpPerSocketContext->bSendPosted = TRUE;
+		bRet = PostSend(lpPerSocketContext);
+	}
+	CtxtUnlock(lpPerSocketContext);
+
+	return(bRet);
+}
+
+//
+//  Queue a copy of a message for one connection, see SessionQueue.
+//
+BOOL SessionSend(PPER_SOCKET_CONTEXT lpPerSocketContext, const char* lpData, int nLength) {
+
+	PSEND_BUFFER lpSendBuffer = NULL;
+	BOOL bRet = FALSE;
+
+	lpSendBuffer = SendBufferAlloc(nLength);
+	if (lpSendBuffer == NULL)
+		return(FALSE);
+	CopyMemory(lpSendBuffer->Data, lpData, nLength);
+
+	bRet = SessionQueue(lpPerSocketContext, lpSendBuffer);
+	SendBufferRelease(lpSendBuffer);
+
+	return(bRet);
+}
+
+//
+//  Queue a copy of a message for a session by id, from any thread, such as the
+//  tick thread or a database thread that holds no reference to the connection.
+//  Returns FALSE if the session is gone or could not take the message.
+//
+BOOL SessionSendTo(LONG64 SessionId, const char* lpData, int nLength) {
+
+	PSEND_BUFFER lpSendBuffer = NULL;
+	ULONG nQueued = 0;
+
+	lpSendBuffer = SendBufferAlloc(nLength);
+	if (lpSendBuffer == NULL)
+		return(FALSE);
+	CopyMemory(lpSendBuffer->Data, lpData, nLength);
+
+	nQueued = SessionBroadcast(&SessionId, 1, lpSendBuffer);
+	SendBufferRelease(lpSendBuffer);
+
+	return(nQueued == 1);
+}
+
+//
+//  Hand on what a connection received.  It is copied once into a send buffer,
+//  stamped with nRecvTime, when it was received, for the receive to send latency.
+//  With a tick thread (-t) it is queued for the next tick.  Otherwise it is
+//  handled right here on the worker: echoed to the sender, or, in a room (-r),
+//  queued for every member.  With owned sessions (-o) this is always the worker
+//  that owns the connection.  Returns FALSE if the connection should be closed.
+//
+BOOL SessionReceived(PPER_SOCKET_CONTEXT lpPerSocketContext, const char* lpData, int nLength,
+	LONGLONG nRecvTime) {
+
+	PSEND_BUFFER lpSendBuffer = NULL;
+	BOOL bRet = TRUE;
+
+	lpSendBuffer = SendBufferAlloc(nLength);
+	if (lpSendBuffer == NULL)
+		return(FALSE);
+	CopyMemory(lpSendBuffer->Data, lpData, nLength);
+	lpSendBuffer->nRecvTime = nRecvTime;
+#if PACKET_TRACE
+	lpSendBuffer->nTraceId = t_nTraceId;
+	lpSendBuffer->nTraceReceived = t_nTraceReceived;
+#endif
+
+	if (g_dwTickRate)
+		bRet = TickQueueInbound(lpPerSocketContext->SessionId, lpSendBuffer);
+	else if (!g_bRoom)
+		bRet = SessionQueue(lpPerSocketContext, lpSendBuffer);
+	else
+		RoomBroadcast(&g_Room, lpSendBuffer);
+	SendBufferRelease(lpSendBuffer);
+
+	return(bRet);
+}
+
+//
+//  Queue one message for every session in pSessionIds.  The message is written
+//  into lpSendBuffer once and every recipient only takes a reference to it, so
+//  fanning out costs no allocation and no copy per recipient.  Sessions that are
+//  gone are skipped; a session that cannot take the message is closed.  Returns
+//  the number of sessions the message was queued for.
+//
+ULONG SessionBroadcast(const LONG64* pSessionIds, ULONG nSessions, PSEND_BUFFER lpSendBuffer) {
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	ULONG nQueued = 0;
+
+	for (ULONG i = 0; i < nSessions; i++) {
+		lpPerSocketContext = SessionAcquire(pSessionIds[i]);
+		if (lpPerSocketContext == NULL)
+			continue;
+
+		if (SessionQueue(lpPerSocketContext, lpSendBuffer))
+			nQueued++;
+		else
+			CloseClient(lpPerSocketContext, FALSE);
+		SessionIoDone(lpPerSocketContext);
+	}
+
+	return(nQueued);
+}
+
+//
+//  Add a session to a room.  Returns FALSE if the member list could not grow.
+//
+BOOL RoomJoin(PROOM lpRoom, LONG64 SessionId) {
+
+	LONG64* pMembers = NULL;
+	ULONG nCapacity = 0;
+
+	AcquireSRWLockExclusive(&lpRoom->Lock);
+	if (lpRoom->nMembers == lpRoom->nCapacity) {
+		nCapacity = lpRoom->nCapacity ? 2 * lpRoom->nCapacity : ROOM_INITIAL_SIZE;
+		pMembers = (LONG64*)xmalloc(nCapacity * sizeof(LONG64));
+		if (pMembers == NULL) {
+			ReleaseSRWLockExclusive(&lpRoom->Lock);
+			LOG_ERROR(g_Log, "HeapAlloc() room members failed: %d", GetLastError());
+			return(FALSE);
+		}
+		if (lpRoom->pMembers) {
+			CopyMemory(pMembers, lpRoom->pMembers, lpRoom->nMembers * sizeof(LONG64));
+			xfree(lpRoom->pMembers);
+		}
+		lpRoom->pMembers = pMembers;
+		lpRoom->nCapacity = nCapacity;
+	}
+	lpRoom->pMembers[lpRoom->nMembers++] = SessionId;
+	ReleaseSRWLockExclusive(&lpRoom->Lock);
+
+	return(TRUE);
+}
+
+//
+//  Remove a session from a room, if it is a member.  The last member takes its
+//  place, so the order of the members is not kept.
+//
+VOID RoomLeave(PROOM lpRoom, LONG64 SessionId) {
+
+	AcquireSRWLockExclusive(&lpRoom->Lock);
+	for (ULONG i = 0; i < lpRoom->nMembers; i++) {
+		if (lpRoom->pMembers[i] == SessionId) {
+			lpRoom->pMembers[i] = lpRoom->pMembers[--lpRoom->nMembers];
+			break;
+		}
+	}
+	ReleaseSRWLockExclusive(&lpRoom->Lock);
+
+	return;
+}
+
+//
+//  Queue one message for every member of a room, see SessionBroadcast.  The
+//  members are copied out first and the room lock is not held while the message
+//  is queued, because a member that cannot take it is closed, which leaves the
+//  room.  They are copied to a scratch array of the calling thread, which only
+//  grows, to the capacity of the room, when the room has outgrown it, and is kept
+//  for as long as the thread runs.  Returns the number of members the message was
+//  queued for.
+//
+ULONG RoomBroadcast(PROOM lpRoom, PSEND_BUFFER lpSendBuffer) {
+
+	LONG64* pScratch = NULL;
+	ULONG nCapacity = 0;
+	ULONG nMembers = 0;
+
+	AcquireSRWLockShared(&lpRoom->Lock);
+	while (lpRoom->nMembers > t_nRoomScratch) {
+		nCapacity = lpRoom->nCapacity;
+		ReleaseSRWLockShared(&lpRoom->Lock);
+
+		pScratch = (LONG64*)HeapAlloc(GetProcessHeap(), 0, nCapacity * sizeof(LONG64));
+		if (pScratch == NULL) {
+			LOG_ERROR(g_Log, "HeapAlloc() room scratch of %u members failed", nCapacity);
+			return(0);
+		}
+		if (t_pRoomScratch)
+			xfree(t_pRoomScratch);
+		t_pRoomScratch = pScratch;
+		t_nRoomScratch = nCapacity;
+
+		AcquireSRWLockShared(&lpRoom->Lock);
+	}
+	nMembers = lpRoom->nMembers;
+	if (nMembers)
+		CopyMemory(t_pRoomScratch, lpRoom->pMembers, nMembers * sizeof(LONG64));
+	ReleaseSRWLockShared(&lpRoom->Lock);
+
+	if (nMembers == 0)
+		return(0);
+
+	return(SessionBroadcast(t_pRoomScratch, nMembers, lpSendBuffer));
+}
+
+//
+//  Drop one reference to a connection: a completed operation, the thread that set
+//  the connection up, or one taken by SessionAcquire.  The last one recycles the
+//  context, closing the connection first if nobody did.  Nothing else ever frees
+//  a connection context, so no completion can arrive for one that was recycled.
+//
+VOID SessionIoDone(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	if (InterlockedDecrement(&lpPerSocketContext->nIoPending) != 0)
+		return;
+
+	//
+	// while draining this is a connection that has sent everything it had queued
+	//
+	if (lpPerSocketContext->Socket != INVALID_SOCKET)
+		CloseClientNow(lpPerSocketContext, g_bDraining);
+	CtxtFree(lpPerSocketContext);
+
+	if (InterlockedDecrement(&g_nSessionContexts) == 0)
+		SessionCheckDrained();
+
+	return;
+}
+
+//
+//  Take bytes that were sent, or dropped with their connection, off the count of
+//  queued ones, and wake the main thread once the queues are empty while draining.
+//
+VOID SendQueuedDone(LONG nBytes) {
+
+	if (nBytes && InterlockedExchangeAdd64(&g_nSendQueuedBytes, -nBytes) == nBytes && g_bDraining)
+		SetEvent(g_hFlushedEvent);
+
+	return;
+}
+
+//
+//  Take a handled AcceptEx completion off the count of pending ones.
+//
+VOID AcceptIoDone(VOID) {
+
+	if (InterlockedDecrement(&g_nAcceptsPending) == 0)
+		SessionCheckDrained();
+
+	return;
+}
+
+//
+//  Wake the main thread once shutdown has started and the last AcceptEx and the
+//  last connection are gone.
+//
+VOID SessionCheckDrained(VOID) {
 
-				//
-				// previous write operation completed for this socket, post another recv
-				//
-				lpIOContext->IOOperation = ClientIoRead;
-				dwRecvNumBytes = 0;
-				dwFlags = 0;
-				buffRecv.buf = lpIOContext->Buffer,
-					buffRecv.len = MAX_BUFF_SIZE;
-				nRet = WSARecv(
-					lpPerSocketContext->Socket,
-					&buffRecv, 1, &dwRecvNumBytes,
-					&dwFlags,
-					&lpIOContext->Overlapped, NULL);
-				if (nRet == SOCKET_ERROR && (ERROR_IO_PENDING != WSAGetLastError())) {
-					printf("WSARecv() failed: %d\n", WSAGetLastError());
-					CloseClient(lpPerSocketContext, FALSE);
-				}
-				else if (g_bVerbose) {
-					printf("WorkerThread %d: Socket(%d) Send completed (%d bytes), Recv posted\n",
-						GetCurrentThreadId(), lpPerSocketContext->Socket, dwIoSize);
-				}
-			}
-			break;
+	if (g_bEndServer && g_nAcceptsPending == 0 && g_nSessionContexts == 0)
+		SetEvent(g_hDrainedEvent);
 
-		} //switch
-	} //while
-	return(0);
+	return;
 }
 
 //
 //  Allocate a context structures for the socket and add the socket to the IOCP.  
-//  Additionally, add the context structure to the global list of context structures.
+//  Additionally, give the connection a session id in the session table.
 //
 PPER_SOCKET_CONTEXT UpdateCompletionPort(SOCKET sd, IO_OPERATION ClientIo,
 	BOOL bAddToList) {
 
 	PPER_SOCKET_CONTEXT lpPerSocketContext;
+	HANDLE hIOCP = g_hIOCP;
 
 	lpPerSocketContext = CtxtAllocate(sd, ClientIo);
 	if (lpPerSocketContext == NULL)
 		return(NULL);
 
-	g_hIOCP = CreateIoCompletionPort((HANDLE)sd, g_hIOCP, (DWORD_PTR)lpPerSocketContext, 0);
-	if (g_hIOCP == NULL) {
-		printf("CreateIoCompletionPort() failed: %d\n", GetLastError());
-		if (lpPerSocketContext->pIOContext)
-			xfree(lpPerSocketContext->pIOContext);
-		xfree(lpPerSocketContext);
+	//
+	// with owned sessions a connection goes on the port of the worker setting it
+	// up, which is the one it was handed to
+	//
+	lpPerSocketContext->dwOwner = t_dwWorker;
+	if (g_bOwnedSessions && bAddToList)
+		hIOCP = g_hWorkerPorts[t_dwWorker];
+
+	if (CreateIoCompletionPort((HANDLE)sd, hIOCP, (DWORD_PTR)lpPerSocketContext, 0) == NULL) {
+		LOG_ERROR(g_Log, "CreateIoCompletionPort() failed: %d", GetLastError());
+		CtxtFree(lpPerSocketContext);
 		return(NULL);
 	}
 
 	//
-	//The listening socket context (bAddToList is FALSE) is not added to the list.
-	//All other socket contexts are added to the list.
+	//The listening socket context (bAddToList is FALSE) is not added to the table.
+	//All other socket contexts are added to the table.
 	//
-	if (bAddToList) CtxtListAddTo(lpPerSocketContext);
+	if (bAddToList && !SessionRegister(lpPerSocketContext)) {
+		CtxtFree(lpPerSocketContext);
+		return(NULL);
+	}
+	if (bAddToList)
+		InterlockedIncrement(&g_nSessionContexts);
 
-	if (g_bVerbose)
-		printf("UpdateCompletionPort: Socket(%d) added to IOCP\n", lpPerSocketContext->Socket);
+	LOG_DEBUG(g_Log, "UpdateCompletionPort: Socket(%d) added to IOCP, session %I64x",
+		lpPerSocketContext->Socket, lpPerSocketContext->SessionId);
 
 	return(lpPerSocketContext);
 }
 
 //
 //  Close down a connection with a client.  This involves closing the socket (when 
-//  initiated as a result of a CTRL-C the socket closure is not graceful).  Additionally, 
-//  any context data associated with that socket is free'd.
+//  initiated as a result of a CTRL-C the socket closure is not graceful).  The session
+//  id stops finding the connection, and the context is recycled by SessionIoDone once
+//  the operations still posted on the socket have completed.  Closing a connection
+//  twice is harmless.  With owned sessions (-o) any thread but the owner only asks
+//  the owner to close it, see InboxClose.  What a connection closed on shutdown
+//  still had queued counts as dropped.
 //
 VOID CloseClient(PPER_SOCKET_CONTEXT lpPerSocketContext, BOOL bGraceful) {
 
-	__try
-	{
-		EnterCriticalSection(&g_CriticalSection);
-	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
-	{
-		printf("EnterCriticalSection raised an exception.\n");
-		return;
-	}
+	if (lpPerSocketContext && g_bOwnedSessions && t_lpInbox != &g_WorkerInboxes[lpPerSocketContext->dwOwner])
+		InboxClose(lpPerSocketContext, bGraceful);
+	else
+		CloseClientNow(lpPerSocketContext, bGraceful);
+
+	return;
+}
+
+//
+//  Close a connection on the calling thread, see CloseClient.  Called by the owner,
+//  with no owned sessions by any thread, and by SessionIoDone when it drops the
+//  last reference, which no other thread can touch the context through.
+//
+VOID CloseClientNow(PPER_SOCKET_CONTEXT lpPerSocketContext, BOOL bGraceful) {
+
+	SOCKET sdClose = INVALID_SOCKET;
+	int nUnsent = 0;
 
 	if (lpPerSocketContext) {
-		if (g_bVerbose)
-			printf("CloseClient: Socket(%d) connection closing (graceful=%s)\n",
-				lpPerSocketContext->Socket, (bGraceful ? "TRUE" : "FALSE"));
+
+		//
+		// no operation is posted on the socket after this.  The head message may
+		// be partly sent already.
+		//
+		CtxtLock(lpPerSocketContext);
+		sdClose = lpPerSocketContext->Socket;
+		lpPerSocketContext->Socket = INVALID_SOCKET;
+		nUnsent = lpPerSocketContext->nSendQueued;
+		if (nUnsent)
+			nUnsent -= lpPerSocketContext->pSendContext->nSentBytes;
+		CtxtUnlock(lpPerSocketContext);
+	}
+
+	if (lpPerSocketContext && sdClose != INVALID_SOCKET) {
+		if (g_bEndServer && nUnsent) {
+			InterlockedIncrement(&g_nShutdownDropped);
+			InterlockedExchangeAdd64(&g_nShutdownDroppedBytes, nUnsent);
+		}
+		LOG_DEBUG(g_Log, "CloseClient: Socket(%d) connection closing (graceful=%s)",
+			sdClose, (bGraceful ? "TRUE" : "FALSE"));
+		if (t_lpStats)
+			StatAdd(t_lpStats->nCloses, 1);
+		else
+			g_nForeignCloses.fetch_add(1, std::memory_order_relaxed);
 		if (!bGraceful) {
 
 			//
@@ -847,7 +3073,7 @@ VOID CloseClient(PPER_SOCKET_CONTEXT lpPerSocketContext, BOOL bGraceful) {
 
 			lingerStruct.l_onoff = 1;
 			lingerStruct.l_linger = 0;
-			setsockopt(lpPerSocketContext->Socket, SOL_SOCKET, SO_LINGER,
+			setsockopt(sdClose, SOL_SOCKET, SO_LINGER,
 				(char*)&lingerStruct, sizeof(lingerStruct));
 		}
 		if (lpPerSocketContext->pIOContext->SocketAccept != INVALID_SOCKET) {
@@ -855,234 +3081,651 @@ VOID CloseClient(PPER_SOCKET_CONTEXT lpPerSocketContext, BOOL bGraceful) {
 			lpPerSocketContext->pIOContext->SocketAccept = INVALID_SOCKET;
 		};
 
-		closesocket(lpPerSocketContext->Socket);
-		lpPerSocketContext->Socket = INVALID_SOCKET;
-		CtxtListDeleteFrom(lpPerSocketContext);
-		lpPerSocketContext = NULL;
+		//
+		// every operation still posted completes with STATUS_CANCELLED and drops
+		// its reference; the context is recycled by whichever completes last
+		//
+		CancelIoEx((HANDLE)sdClose, NULL);
+		closesocket(sdClose);
+		if (g_bRoom)
+			RoomLeave(&g_Room, lpPerSocketContext->SessionId);
+		SessionUnregister(lpPerSocketContext);
 	}
-	else {
-		printf("CloseClient: lpPerSocketContext is NULL\n");
+	else if (lpPerSocketContext == NULL) {
+		LOG_ERROR(g_Log, "CloseClient: lpPerSocketContext is NULL");
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
-
 	return;
 }
 
 //
-// Allocate a socket context for the new connection.  
+// Take a socket context for the new connection from this thread's free list.  No
+// lock is taken and the payload buffer is handed out as it was left: every read
+// overwrites it before it is echoed.  With shared buffers there is none yet.
 //
 PPER_SOCKET_CONTEXT CtxtAllocate(SOCKET sd, IO_OPERATION ClientIO) {
 
 	PPER_SOCKET_CONTEXT lpPerSocketContext;
 
-	__try
-	{
-		EnterCriticalSection(&g_CriticalSection);
+	if (t_pCtxtFreeList == NULL && !CtxtFreeListRefill())
+		return(NULL);
+
+	lpPerSocketContext = t_pCtxtFreeList;
+	t_pCtxtFreeList = lpPerSocketContext->pCtxtForward;
+	t_nCtxtFree--;
+
+	lpPerSocketContext->Socket = sd;
+	lpPerSocketContext->fnAcceptEx = NULL;
+	lpPerSocketContext->pCtxtForward = NULL;
+
+	ZeroMemory(&lpPerSocketContext->pIOContext->Overlapped, sizeof(WSAOVERLAPPED));
+	lpPerSocketContext->pIOContext->IOOperation = ClientIO;
+	lpPerSocketContext->pIOContext->pIOContextForward = NULL;
+	lpPerSocketContext->pIOContext->nTotalBytes = 0;
+	lpPerSocketContext->pIOContext->nSentBytes = 0;
+	lpPerSocketContext->pIOContext->wsabuf.buf = lpPerSocketContext->pIOContext->Buffer;
+	lpPerSocketContext->pIOContext->wsabuf.len = lpPerSocketContext->pIOContext->Buffer ? MAX_BUFF_SIZE : 0;
+	lpPerSocketContext->pIOContext->SocketAccept = INVALID_SOCKET;
+
+	ZeroMemory(&lpPerSocketContext->pSendContext->Overlapped, sizeof(WSAOVERLAPPED));
+	lpPerSocketContext->pSendContext->IOOperation = ClientIoWrite;
+	lpPerSocketContext->pSendContext->nTotalBytes = 0;
+	lpPerSocketContext->pSendContext->nSentBytes = 0;
+	lpPerSocketContext->pSendContext->SocketAccept = INVALID_SOCKET;
+	lpPerSocketContext->pSendContext->nPostTime = 0;
+#if PACKET_TRACE
+	lpPerSocketContext->pSendContext->nTraceId = 0;
+#endif
+
+	InitializeSRWLock(&lpPerSocketContext->Lock);
+	InterlockedExchange(&lpPerSocketContext->nIoPending, 1);
+	lpPerSocketContext->nSendHead = 0;
+	lpPerSocketContext->nSendCount = 0;
+	lpPerSocketContext->nSendQueued = 0;
+	lpPerSocketContext->bSendPosted = FALSE;
+	lpPerSocketContext->bRecvPaused = FALSE;
+	lpPerSocketContext->bCloseRequested = FALSE;
+
+	return(lpPerSocketContext);
+}
+
+//
+// Return a socket context, together with its i/o context, to this thread's free
+// list.  Connections are closed by whichever worker sees the last completion, so
+// a thread that mostly frees hands every surplus batch of CTXT_SLAB_COUNT to the
+// lock-free depot, where a thread that mostly allocates picks it up.  A thread
+// that is no worker (the tick thread, main at shutdown) never allocates again, so
+// it keeps nothing: the context goes straight to the strays.  Additional i/o
+// contexts (the AcceptEx pool of the listening socket) came from the heap.
+// A shared buffer still held by the connection goes back to the pool, and
+// messages still on the send queue are dropped.
+//
+VOID CtxtFree(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_IO_CONTEXT pTempIO = lpPerSocketContext->pIOContext->pIOContextForward;
+	PPER_IO_CONTEXT pNextIO = NULL;
+	PPER_SOCKET_CONTEXT pBatch = NULL;
+
+	for (; lpPerSocketContext->nSendCount; lpPerSocketContext->nSendCount--) {
+		SendBufferRelease(lpPerSocketContext->SendQueue[lpPerSocketContext->nSendHead]);
+		lpPerSocketContext->SendQueue[lpPerSocketContext->nSendHead] = NULL;
+		lpPerSocketContext->nSendHead = (lpPerSocketContext->nSendHead + 1) % SEND_QUEUE_SLOTS;
 	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
-	{
-		printf("EnterCriticalSection raised an exception.\n");
-		return NULL;
+	SendQueuedDone(lpPerSocketContext->nSendQueued);
+	lpPerSocketContext->nSendQueued = 0;
+
+	while (pTempIO) {
+		pNextIO = pTempIO->pIOContextForward;
+		xfree(pTempIO);
+		pTempIO = pNextIO;
 	}
+	lpPerSocketContext->pIOContext->pIOContextForward = NULL;
 
-	lpPerSocketContext = (PPER_SOCKET_CONTEXT)xmalloc(sizeof(PER_SOCKET_CONTEXT));
-	if (lpPerSocketContext) {
-		lpPerSocketContext->pIOContext = (PPER_IO_CONTEXT)xmalloc(sizeof(PER_IO_CONTEXT));
-		if (lpPerSocketContext->pIOContext) {
-			lpPerSocketContext->Socket = sd;
-			lpPerSocketContext->pCtxtBack = NULL;
-			lpPerSocketContext->pCtxtForward = NULL;
-
-			lpPerSocketContext->pIOContext->Overlapped.Internal = 0;
-			lpPerSocketContext->pIOContext->Overlapped.InternalHigh = 0;
-			lpPerSocketContext->pIOContext->Overlapped.Offset = 0;
-			lpPerSocketContext->pIOContext->Overlapped.OffsetHigh = 0;
-			lpPerSocketContext->pIOContext->Overlapped.hEvent = NULL;
-			lpPerSocketContext->pIOContext->IOOperation = ClientIO;
-			lpPerSocketContext->pIOContext->pIOContextForward = NULL;
-			lpPerSocketContext->pIOContext->nTotalBytes = 0;
-			lpPerSocketContext->pIOContext->nSentBytes = 0;
-			lpPerSocketContext->pIOContext->wsabuf.buf = lpPerSocketContext->pIOContext->Buffer;
-			lpPerSocketContext->pIOContext->wsabuf.len = sizeof(lpPerSocketContext->pIOContext->Buffer);
-			lpPerSocketContext->pIOContext->SocketAccept = INVALID_SOCKET;
+	if (g_bSharedBuffers && lpPerSocketContext->pIOContext->Buffer) {
+		BufFree(lpPerSocketContext->pIOContext->Buffer);
+		lpPerSocketContext->pIOContext->Buffer = NULL;
+	}
 
-			ZeroMemory(lpPerSocketContext->pIOContext->wsabuf.buf, lpPerSocketContext->pIOContext->wsabuf.len);
-		}
-		else {
-			xfree(lpPerSocketContext);
-			printf("HeapAlloc() PER_IO_CONTEXT failed: %d\n", GetLastError());
+	if (t_lpStats == NULL) {
+		InterlockedPushEntrySList(&g_CtxtStrays, &lpPerSocketContext->DepotEntry);
+		return;
+	}
+
+	lpPerSocketContext->pCtxtForward = t_pCtxtFreeList;
+	t_pCtxtFreeList = lpPerSocketContext;
+	t_nCtxtFree++;
+
+	if (t_nCtxtFree >= 2 * CTXT_SLAB_COUNT) {
+		pBatch = t_pCtxtFreeList;
+		for (int i = 1; i < CTXT_SLAB_COUNT; i++)
+			t_pCtxtFreeList = t_pCtxtFreeList->pCtxtForward;
+		lpPerSocketContext = t_pCtxtFreeList;
+		t_pCtxtFreeList = lpPerSocketContext->pCtxtForward;
+		lpPerSocketContext->pCtxtForward = NULL;
+		t_nCtxtFree -= CTXT_SLAB_COUNT;
+
+		InterlockedPushEntrySList(&g_CtxtDepot, &pBatch->DepotEntry);
+	}
+
+	return;
+}
+
+//
+// Refill this thread's empty free list, preferably with a batch other threads
+// released to the depot, then with whatever strays there are, otherwise with a
+// new slab of preconstructed contexts.
+// The slab comes straight from VirtualAlloc, so its payload buffers are never
+// touched before they are first used.  With shared buffers the slab has none.
+//
+BOOL CtxtFreeListRefill(VOID) {
+
+	PSLIST_ENTRY pEntry = NULL;
+	PCTXT_SLAB pSlab = NULL;
+	char* pBuffers = NULL;
+
+	pEntry = InterlockedPopEntrySList(&g_CtxtDepot);
+	if (pEntry) {
+		t_pCtxtFreeList = CONTAINING_RECORD(pEntry, PER_SOCKET_CONTEXT, DepotEntry);
+		t_nCtxtFree = CTXT_SLAB_COUNT;
+		return(TRUE);
+	}
+
+	pEntry = InterlockedFlushSList(&g_CtxtStrays);
+	if (pEntry) {
+		for (; pEntry; pEntry = pEntry->Next) {
+			PPER_SOCKET_CONTEXT lpPerSocketContext = CONTAINING_RECORD(pEntry, PER_SOCKET_CONTEXT, DepotEntry);
+
+			lpPerSocketContext->pCtxtForward = t_pCtxtFreeList;
+			t_pCtxtFreeList = lpPerSocketContext;
+			t_nCtxtFree++;
 		}
+		return(TRUE);
+	}
 
+	pSlab = (PCTXT_SLAB)VirtualAlloc(NULL,
+		sizeof(CTXT_SLAB) + (g_bSharedBuffers ? 0 : CTXT_SLAB_COUNT * MAX_BUFF_SIZE),
+		MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pSlab == NULL) {
+		LOG_ERROR(g_Log, "VirtualAlloc() CTXT_SLAB failed: %d", GetLastError());
+		return(FALSE);
 	}
-	else {
-		printf("HeapAlloc() PER_SOCKET_CONTEXT failed: %d\n", GetLastError());
+	if (!g_bSharedBuffers)
+		pBuffers = (char*)(pSlab + 1);
+
+	for (int i = CTXT_SLAB_COUNT - 1; i >= 0; i--) {
+		pSlab->IOContext[i].Buffer = pBuffers ? pBuffers + i * MAX_BUFF_SIZE : NULL;
+		pSlab->SocketContext[i].pIOContext = &pSlab->IOContext[i];
+		pSlab->SocketContext[i].pSendContext = &pSlab->SendContext[i];
+		pSlab->SocketContext[i].pCtxtForward = t_pCtxtFreeList;
+		t_pCtxtFreeList = &pSlab->SocketContext[i];
+	}
+	t_nCtxtFree = CTXT_SLAB_COUNT;
+
+	InterlockedPushEntrySList(&g_CtxtSlabs, &pSlab->SlabEntry);
+
+	return(TRUE);
+}
+
+//
+// Release every slab, context and buffer slabs alike.  Only called once the
+// worker threads have exited and every context has been freed.
+//
+VOID CtxtSlabFreeAll(VOID) {
+
+	PSLIST_ENTRY pEntry = NULL;
+
+	InterlockedFlushSList(&g_CtxtDepot);
+	InterlockedFlushSList(&g_CtxtStrays);
+	InterlockedFlushSList(&g_BufferPool);
+
+	while ((pEntry = InterlockedPopEntrySList(&g_CtxtSlabs)) != NULL)
+		VirtualFree(pEntry, 0, MEM_RELEASE);
+
+	t_pCtxtFreeList = NULL;
+	t_nCtxtFree = 0;
+
+	return;
+}
+
+//
+// Take a receive buffer from the shared pool, carving a new slab of buffers when
+// the pool is empty.  The pool only grows to the number of connections that have
+// data in flight at the same time.
+//
+char* BufAllocate(VOID) {
+
+	PSLIST_ENTRY pEntry = NULL;
+	PBUFFER_SLAB pSlab = NULL;
+
+	pEntry = InterlockedPopEntrySList(&g_BufferPool);
+	if (pEntry)
+		return((char*)pEntry);
+
+	pSlab = (PBUFFER_SLAB)VirtualAlloc(NULL, sizeof(BUFFER_SLAB), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pSlab == NULL) {
+		LOG_ERROR(g_Log, "VirtualAlloc() BUFFER_SLAB failed: %d", GetLastError());
 		return(NULL);
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
+	for (int i = 1; i < CTXT_SLAB_COUNT; i++)
+		InterlockedPushEntrySList(&g_BufferPool, (PSLIST_ENTRY)pSlab->Buffers[i]);
 
-	return(lpPerSocketContext);
+	InterlockedPushEntrySList(&g_CtxtSlabs, &pSlab->SlabEntry);
+
+	return(pSlab->Buffers[0]);
 }
 
 //
-//  Add a client connection context structure to the global list of context structures.
+// Return a receive buffer to the shared pool.
 //
-VOID CtxtListAddTo(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+VOID BufFree(char* lpBuffer) {
 
-	PPER_SOCKET_CONTEXT pTemp;
+	InterlockedPushEntrySList(&g_BufferPool, (PSLIST_ENTRY)lpBuffer);
 
-	__try
-	{
-		EnterCriticalSection(&g_CriticalSection);
+	return;
+}
+
+//
+// The stride of a block of class nClass, its header included, so that every
+// block in a slab stays aligned for its SLIST_ENTRY.
+//
+static SIZE_T BlockStride(ULONG nClass) {
+
+	return((sizeof(BLOCK_HEADER) + g_BlockSizes[nClass] + MEMORY_ALLOCATION_ALIGNMENT - 1) &
+		~(SIZE_T)(MEMORY_ALLOCATION_ALIGNMENT - 1));
+}
+
+//
+// Take a block of at least nSize bytes from the smallest class it fits, from this
+// thread's free list the way CtxtAllocate takes a context.  A thread that is no
+// worker takes a stray first, since what it frees goes there.  The block is not
+// zeroed.  Anything larger than the largest class comes from the heap.
+//
+PVOID BlockAllocate(SIZE_T nSize) {
+
+	PBLOCK_HEADER lpBlock = NULL;
+	PBLOCK_CACHE lpCache = NULL;
+	PSLIST_ENTRY pEntry = NULL;
+	ULONG nClass = 0;
+
+	while (nClass < BLOCK_CLASSES && nSize > g_BlockSizes[nClass])
+		nClass++;
+
+	if (nClass == BLOCK_CLASSES) {
+		lpBlock = (PBLOCK_HEADER)HeapAlloc(GetProcessHeap(), 0, sizeof(BLOCK_HEADER) + nSize);
+		if (lpBlock == NULL) {
+			LOG_ERROR(g_Log, "HeapAlloc() %Iu byte block failed", nSize);
+			return(NULL);
+		}
+		lpBlock->nClass = BLOCK_CLASSES;
+		return(lpBlock + 1);
 	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
-	{
-		printf("EnterCriticalSection raised an exception.\n");
+
+	lpCache = &t_BlockCache[nClass];
+	if (lpCache->pFree == NULL && t_lpStats == NULL) {
+		pEntry = InterlockedPopEntrySList(&g_BlockStrays[nClass]);
+		if (pEntry)
+			return(CONTAINING_RECORD(pEntry, BLOCK_HEADER, DepotEntry) + 1);
+	}
+	if (lpCache->pFree == NULL && !BlockCacheRefill(nClass))
+		return(NULL);
+
+	lpBlock = lpCache->pFree;
+	lpCache->pFree = lpBlock->pForward;
+	lpCache->nFree--;
+
+	return(lpBlock + 1);
+}
+
+//
+// Return a block to this thread's free list, handing every surplus batch of
+// BLOCK_SLAB_COUNT to the depot of its class, or, on a thread that is no worker,
+// straight to the strays, as CtxtFree does with contexts.
+//
+VOID BlockFree(PVOID lpBlock) {
+
+	PBLOCK_HEADER lpHeader = (PBLOCK_HEADER)lpBlock - 1;
+	PBLOCK_HEADER pBatch = NULL;
+	PBLOCK_CACHE lpCache = NULL;
+
+	if (lpHeader->nClass == BLOCK_CLASSES) {
+		HeapFree(GetProcessHeap(), 0, lpHeader);
 		return;
 	}
 
-	if (g_pCtxtList == NULL) {
+	if (t_lpStats == NULL) {
+		InterlockedPushEntrySList(&g_BlockStrays[lpHeader->nClass], &lpHeader->DepotEntry);
+		return;
+	}
 
-		//
-		// add the first node to the linked list
-		//
-		lpPerSocketContext->pCtxtBack = NULL;
-		lpPerSocketContext->pCtxtForward = NULL;
-		g_pCtxtList = lpPerSocketContext;
+	lpCache = &t_BlockCache[lpHeader->nClass];
+	lpHeader->pForward = lpCache->pFree;
+	lpCache->pFree = lpHeader;
+	lpCache->nFree++;
+
+	if (lpCache->nFree >= 2 * BLOCK_SLAB_COUNT) {
+		pBatch = lpCache->pFree;
+		for (int i = 1; i < BLOCK_SLAB_COUNT; i++)
+			lpCache->pFree = lpCache->pFree->pForward;
+		lpHeader = lpCache->pFree;
+		lpCache->pFree = lpHeader->pForward;
+		lpHeader->pForward = NULL;
+		lpCache->nFree -= BLOCK_SLAB_COUNT;
+
+		InterlockedPushEntrySList(&g_BlockDepot[pBatch->nClass], &pBatch->DepotEntry);
 	}
-	else {
 
-		//
-		// add node to head of list
-		//
-		pTemp = g_pCtxtList;
+	return;
+}
 
-		g_pCtxtList = lpPerSocketContext;
-		lpPerSocketContext->pCtxtBack = pTemp;
-		lpPerSocketContext->pCtxtForward = NULL;
+//
+// Refill this thread's empty free list of class nClass: a batch from the depot,
+// otherwise the strays, otherwise a new slab.
+//
+BOOL BlockCacheRefill(ULONG nClass) {
+
+	PBLOCK_CACHE lpCache = &t_BlockCache[nClass];
+	PBLOCK_HEADER lpBlock = NULL;
+	PSLIST_ENTRY pEntry = NULL;
+	PBLOCK_SLAB pSlab = NULL;
+	SIZE_T nStride = BlockStride(nClass);
+
+	pEntry = InterlockedPopEntrySList(&g_BlockDepot[nClass]);
+	if (pEntry) {
+		lpCache->pFree = CONTAINING_RECORD(pEntry, BLOCK_HEADER, DepotEntry);
+		lpCache->nFree = BLOCK_SLAB_COUNT;
+		return(TRUE);
+	}
 
-		pTemp->pCtxtForward = lpPerSocketContext;
+	pEntry = InterlockedFlushSList(&g_BlockStrays[nClass]);
+	if (pEntry) {
+		for (; pEntry; pEntry = pEntry->Next) {
+			lpBlock = CONTAINING_RECORD(pEntry, BLOCK_HEADER, DepotEntry);
+			lpBlock->pForward = lpCache->pFree;
+			lpCache->pFree = lpBlock;
+			lpCache->nFree++;
+		}
+		return(TRUE);
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
+	pSlab = (PBLOCK_SLAB)VirtualAlloc(NULL, sizeof(BLOCK_SLAB) + BLOCK_SLAB_COUNT * nStride,
+		MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	if (pSlab == NULL) {
+		LOG_ERROR(g_Log, "VirtualAlloc() BLOCK_SLAB failed: %d", GetLastError());
+		return(FALSE);
+	}
 
-	return;
+	for (int i = BLOCK_SLAB_COUNT - 1; i >= 0; i--) {
+		lpBlock = (PBLOCK_HEADER)((char*)(pSlab + 1) + i * nStride);
+		lpBlock->nClass = nClass;
+		lpBlock->pForward = lpCache->pFree;
+		lpCache->pFree = lpBlock;
+	}
+	lpCache->nFree = BLOCK_SLAB_COUNT;
+
+	InterlockedPushEntrySList(&g_BlockSlabs, &pSlab->SlabEntry);
+
+	return(TRUE);
 }
 
 //
-//  Remove a client context structure from the global list of context structures.
+// Release every block slab.  Only called once every thread that could hold a
+// block has exited and every block has been freed.
 //
-VOID CtxtListDeleteFrom(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+VOID BlockSlabFreeAll(VOID) {
 
-	PPER_SOCKET_CONTEXT pBack;
-	PPER_SOCKET_CONTEXT pForward;
-	PPER_IO_CONTEXT     pNextIO = NULL;
-	PPER_IO_CONTEXT     pTempIO = NULL;
+	PSLIST_ENTRY pEntry = NULL;
 
-	__try
-	{
-		EnterCriticalSection(&g_CriticalSection);
+	for (int i = 0; i < BLOCK_CLASSES; i++) {
+		InterlockedFlushSList(&g_BlockDepot[i]);
+		InterlockedFlushSList(&g_BlockStrays[i]);
+		t_BlockCache[i].pFree = NULL;
+		t_BlockCache[i].nFree = 0;
 	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
-	{
-		printf("EnterCriticalSection raised an exception.\n");
-		return;
+
+	while ((pEntry = InterlockedPopEntrySList(&g_BlockSlabs)) != NULL)
+		VirtualFree(pEntry, 0, MEM_RELEASE);
+
+	return;
+}
+
+
+//
+//  Set up the empty session table.  Chunks of slots are added as connections come in.
+//
+VOID SessionTableInit(VOID) {
+
+	for (int i = 0; i < SESSION_SHARDS; i++) {
+		InitializeSRWLock(&g_SessionTable[i].Lock);
+		g_SessionTable[i].nSlots = 0;
+		g_SessionTable[i].nFreeHead = SESSION_NO_SLOT;
+		ZeroMemory((PVOID)g_SessionTable[i].Chunks, sizeof(g_SessionTable[i].Chunks));
 	}
 
-	if (lpPerSocketContext) {
-		pBack = lpPerSocketContext->pCtxtBack;
-		pForward = lpPerSocketContext->pCtxtForward;
+	return;
+}
 
-		if (pBack == NULL && pForward == NULL) {
+//
+//  The slot nSlot of a shard, or NULL if its chunk has not been added yet.  Takes
+//  no lock.
+//
+static PSESSION_SLOT SessionSlot(PSESSION_SHARD pShard, ULONG nSlot) {
 
-			//
-			// This is the only node in the list to delete
-			//
-			g_pCtxtList = NULL;
-		}
-		else if (pBack == NULL && pForward != NULL) {
+	PSESSION_SLOT pChunk = NULL;
 
-			//
-			// This is the start node in the list to delete
-			//
-			pForward->pCtxtBack = NULL;
-			g_pCtxtList = pForward;
-		}
-		else if (pBack != NULL && pForward == NULL) {
+	if (nSlot >= SESSION_MAX_CHUNKS * SESSION_CHUNK_SLOTS)
+		return(NULL);
 
-			//
-			// This is the end node in the list to delete
-			//
-			pBack->pCtxtForward = NULL;
-		}
-		else if (pBack && pForward) {
+	pChunk = pShard->Chunks[nSlot / SESSION_CHUNK_SLOTS];
+	if (pChunk == NULL)
+		return(NULL);
 
-			//
-			// Neither start node nor end node in the list
-			//
-			pBack->pCtxtForward = pForward;
-			pForward->pCtxtBack = pBack;
-		}
+	return(&pChunk[nSlot % SESSION_CHUNK_SLOTS]);
+}
 
-		//
-		// Free all i/o context structures per socket
-		//
-		pTempIO = (PPER_IO_CONTEXT)(lpPerSocketContext->pIOContext);
-		do {
-			pNextIO = (PPER_IO_CONTEXT)(pTempIO->pIOContextForward);
-			if (pTempIO) {
+//
+//  Give a new connection a slot, and so a session id, in the shard of the calling
+//  thread.  Every thread is handed a shard of its own the first time it registers
+//  a connection, so the shard lock is shared by few threads.  Returns FALSE if the
+//  shard is full or a chunk of slots could not be allocated.
+//
+BOOL SessionRegister(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PSESSION_SHARD pShard = NULL;
+	PSESSION_SLOT pSlot = NULL;
+	PSESSION_SLOT pChunk = NULL;
+	ULONG nSlot = SESSION_NO_SLOT;
+
+	if (t_nSessionShard < 0)
+		t_nSessionShard = (InterlockedIncrement(&g_nSessionShards) - 1) & (SESSION_SHARDS - 1);
+	pShard = &g_SessionTable[t_nSessionShard];
+
+	AcquireSRWLockExclusive(&pShard->Lock);
+	if (pShard->nFreeHead != SESSION_NO_SLOT) {
+		nSlot = pShard->nFreeHead;
+		pSlot = SessionSlot(pShard, nSlot);
+		pShard->nFreeHead = pSlot->nNextFree;
+	}
+	else if (pShard->nSlots < SESSION_MAX_CHUNKS * SESSION_CHUNK_SLOTS) {
+		nSlot = pShard->nSlots;
+		if (nSlot % SESSION_CHUNK_SLOTS == 0) {
 
-				//
-				//The overlapped structure is safe to free when only the posted i/o has
-				//completed. Here we only need to test those posted but not yet received 
-				//by PQCS in the shutdown process.
-				//
-				if (g_bEndServer)
-					while (!HasOverlappedIoCompleted((LPOVERLAPPED)pTempIO)) 
-						Sleep(0);
-				xfree(pTempIO);
-				pTempIO = NULL;
+			//
+			// a lookup may read the chunk pointer as soon as it is stored, so
+			// the chunk is published zeroed: every slot in it reads as free
+			//
+			pChunk = (PSESSION_SLOT)VirtualAlloc(NULL, SESSION_CHUNK_SLOTS * sizeof(SESSION_SLOT),
+				MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+			if (pChunk == NULL) {
+				ReleaseSRWLockExclusive(&pShard->Lock);
+				LOG_ERROR(g_Log, "VirtualAlloc() SESSION_SLOT chunk failed: %d", GetLastError());
+				return(FALSE);
 			}
-			pTempIO = pNextIO;
-		} while (pNextIO);
-
-		xfree(lpPerSocketContext);
-		lpPerSocketContext = NULL;
+			InterlockedExchangePointer((PVOID volatile*)&pShard->Chunks[nSlot / SESSION_CHUNK_SLOTS], pChunk);
+		}
+		pShard->nSlots++;
+		pSlot = SessionSlot(pShard, nSlot);
 	}
 	else {
-		printf("CtxtListDeleteFrom: lpPerSocketContext is NULL\n");
+		ReleaseSRWLockExclusive(&pShard->Lock);
+		LOG_ERROR(g_Log, "SessionRegister: session table shard %d is full", t_nSessionShard);
+		return(FALSE);
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
+	if (pSlot->nGeneration == 0)
+		pSlot->nGeneration = 1;
+	pSlot->nNextFree = SESSION_NO_SLOT;
+
+	InterlockedExchange64(&lpPerSocketContext->SessionId,
+		((LONG64)pSlot->nGeneration << 32) | ((LONG64)nSlot << SESSION_SHARD_BITS) | t_nSessionShard);
+	InterlockedExchangePointer((PVOID volatile*)&pSlot->pContext, lpPerSocketContext);
+	ReleaseSRWLockExclusive(&pShard->Lock);
+
+	InterlockedIncrement(&g_nConnections);
+	InterlockedIncrement(&g_WorkerStats[lpPerSocketContext->dwOwner].nSessions);
+
+	return(TRUE);
+}
+
+//
+//  Take a connection out of the session table.  Its slot gets a new generation
+//  before it is reused, so the old id finds nothing from here on.  Only the first
+//  call for a connection does anything.
+//
+VOID SessionUnregister(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	LONG64 SessionId = InterlockedExchange64(&lpPerSocketContext->SessionId, 0);
+	PSESSION_SHARD pShard = NULL;
+	PSESSION_SLOT pSlot = NULL;
+	ULONG nSlot = 0;
+
+	if (SessionId == 0)
+		return;
+
+	pShard = &g_SessionTable[SessionId & (SESSION_SHARDS - 1)];
+	nSlot = (ULONG)SessionId >> SESSION_SHARD_BITS;
+
+	AcquireSRWLockExclusive(&pShard->Lock);
+	pSlot = SessionSlot(pShard, nSlot);
+	InterlockedExchangePointer((PVOID volatile*)&pSlot->pContext, NULL);
+	if (++pSlot->nGeneration == 0)
+		pSlot->nGeneration = 1;
+	pSlot->nNextFree = pShard->nFreeHead;
+	pShard->nFreeHead = nSlot;
+	ReleaseSRWLockExclusive(&pShard->Lock);
+
+	InterlockedDecrement(&g_nConnections);
+	InterlockedDecrement(&g_WorkerStats[lpPerSocketContext->dwOwner].nSessions);
 
 	return;
 }
 
 //
-//  Free all context structure in the global list of context structures.
+//  Find a connection by session id without taking any lock.  The connection is
+//  returned with a reference held, so it stays valid until the caller drops it
+//  with SessionIoDone; it may still be closed meanwhile, and SessionSend then
+//  fails.  Returns NULL if the session is closed or the id was never handed out.
 //
-VOID CtxtListFree() {
-	PPER_SOCKET_CONTEXT pTemp1, pTemp2;
+//  Contexts are only ever recycled, never returned to the system while the server
+//  runs, so the context read from the slot can be touched even if it was closed
+//  and reused in between.  A reference is only taken while the count is not zero,
+//  and the id is checked again once it is held.
+//
+PPER_SOCKET_CONTEXT SessionAcquire(LONG64 SessionId) {
 
-	__try
-	{
-		EnterCriticalSection(&g_CriticalSection);
+	PSESSION_SLOT pSlot = NULL;
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	LONG nIoPending = 0;
+	LONG nPrevious = 0;
+
+	pSlot = SessionSlot(&g_SessionTable[SessionId & (SESSION_SHARDS - 1)],
+		(ULONG)SessionId >> SESSION_SHARD_BITS);
+	if (pSlot == NULL)
+		return(NULL);
+
+	lpPerSocketContext = pSlot->pContext;
+	if (lpPerSocketContext == NULL)
+		return(NULL);
+
+	nIoPending = lpPerSocketContext->nIoPending;
+	while (TRUE) {
+		if (nIoPending == 0)
+			return(NULL);
+		nPrevious = InterlockedCompareExchange(&lpPerSocketContext->nIoPending, nIoPending + 1, nIoPending);
+		if (nPrevious == nIoPending)
+			break;
+		nIoPending = nPrevious;
 	}
-	__except (EXCEPTION_EXECUTE_HANDLER)
-	{
-		printf("EnterCriticalSection raised an exception.\n");
-		return;
+
+	if (lpPerSocketContext->SessionId != SessionId) {
+		SessionIoDone(lpPerSocketContext);
+		return(NULL);
 	}
 
-	pTemp1 = g_pCtxtList;
-	while (pTemp1) {
-		pTemp2 = pTemp1->pCtxtBack;
-		CloseClient(pTemp1, FALSE);
-		pTemp1 = pTemp2;
+	return(lpPerSocketContext);
+}
+
+//
+//  Close every connection in the session table, at shutdown.  Each one is taken
+//  through SessionAcquire, so this can run while the workers are still handling
+//  completions; the contexts are recycled by the completions of the cancelled
+//  operations.  A connection registered while this runs sees g_bEndServer and
+//  closes itself.  Counts the connections closed; what they still had queued is
+//  counted as dropped by CloseClientNow.
+//
+VOID SessionCloseAll(BOOL bGraceful, LONG* pnClosed) {
+
+	PSESSION_SHARD pShard = NULL;
+	PSESSION_SLOT pSlot = NULL;
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	ULONG nSlots = 0;
+
+	*pnClosed = 0;
+
+	for (int i = 0; i < SESSION_SHARDS; i++) {
+		pShard = &g_SessionTable[i];
+
+		AcquireSRWLockShared(&pShard->Lock);
+		nSlots = pShard->nSlots;
+		ReleaseSRWLockShared(&pShard->Lock);
+
+		for (ULONG nSlot = 0; nSlot < nSlots; nSlot++) {
+			pSlot = SessionSlot(pShard, nSlot);
+			lpPerSocketContext = pSlot->pContext;
+			if (lpPerSocketContext == NULL)
+				continue;
+
+			lpPerSocketContext = SessionAcquire(lpPerSocketContext->SessionId);
+			if (lpPerSocketContext == NULL)
+				continue;
+
+			(*pnClosed)++;
+			CloseClient(lpPerSocketContext, bGraceful);
+			SessionIoDone(lpPerSocketContext);
+		}
 	}
 
-	LeaveCriticalSection(&g_CriticalSection);
+	return;
+}
+
+//
+//  Release the chunks of the session table.  Only called once every connection
+//  context has been recycled.
+//
+VOID SessionTableFree(VOID) {
+
+	PSESSION_SHARD pShard = NULL;
+
+	for (int i = 0; i < SESSION_SHARDS; i++) {
+		pShard = &g_SessionTable[i];
+
+		for (int j = 0; j < SESSION_MAX_CHUNKS && pShard->Chunks[j]; j++) {
+			VirtualFree(pShard->Chunks[j], 0, MEM_RELEASE);
+			pShard->Chunks[j] = NULL;
+		}
+		pShard->nSlots = 0;
+		pShard->nFreeHead = SESSION_NO_SLOT;
+	}
 
 	return;
-}
\ No newline at end of file
+}
@@ -14,14 +14,69 @@
 
 #include <mswsock.h>
 
+#include <atomic>
+
+#include "LatencyHistogram.h"
+#include "PacketTrace.h"
+
 #define DEFAULT_PORT        "5001"
 #define MAX_BUFF_SIZE       8192
 #define MAX_WORKER_THREAD   128
+#define MAX_NUMA_NODES      64
+#define MAX_LAYOUT_PROCESSORS   2048        // logical processors worker placement knows of
+#define MAX_DRAIN_BATCH     256
+#define DEFAULT_ACCEPT_POOL 64
+#define MAX_ACCEPT_POOL     4096
+#define CTXT_SLAB_COUNT     64
+#define BLOCK_CLASSES       5               // sizes BlockAllocate keeps free lists of
+#define BLOCK_SLAB_COUNT    64              // blocks carved at once, and handed between threads
+#define MAX_SEND_QUEUE      (4 * MAX_BUFF_SIZE)
+#define MAX_SEND_WSABUF     16
+#define SEND_QUEUE_SLOTS    32              // messages a session's send queue holds
+#define ROOM_INITIAL_SIZE   64
+#define MAX_TICK_RATE       1000            // ticks per second (-t)
+#define TICK_INITIAL_SIZE   256             // outbound messages a tick has room for at first
+#define SESSION_SHARD_BITS  4
+#define SESSION_SHARDS      (1 << SESSION_SHARD_BITS)
+#define SESSION_CHUNK_SLOTS 1024
+#define SESSION_MAX_CHUNKS  256
+#define SESSION_NO_SLOT     ((ULONG)-1)
+#define SHUTDOWN_DRAIN_TIMEOUT  5000        // ms to wait for cancelled operations to complete
+#define DEFAULT_DRAIN_SECONDS   5           // time queued sends get to flush on shutdown (-g)
+#define MAX_DRAIN_SECONDS   3600
+#define DEFAULT_LOG_FILE    "iocpserverex.log"
+#define METRICS_REQUEST_SIZE    4096        // longest request the metrics endpoint reads
+#define METRICS_INITIAL_SIZE    65536       // room the metrics text has at first
+#define METRICS_TIMEOUT     1000            // ms a scrape gets to send its request or take the reply
+#define METRICS_LOW_BIT     10              // histogram buckets exported, 2^10 ns (1 us)
+#define METRICS_HIGH_BIT    34              // to 2^34 ns (17 s)
+#define METRICS_TEXT_TYPE   "text/plain; version=0.0.4"
+#define DEFAULT_TRACE_FILE  "iocpserverex.trace.json"
+
+#ifndef STATUS_CANCELLED
+#define STATUS_CANCELLED    ((ULONG)0xC0000120L)
+#endif
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION   0x00000002
+#endif
+
+//
+// where worker threads may run (-p)
+//
+typedef enum _WORKER_PLACEMENT {
+    PlaceNone,                                      // anywhere, the scheduler decides
+    PlaceCore,                                      // each on one logical processor
+    PlaceNode                                       // each on every processor of one NUMA node
+} WORKER_PLACEMENT;
 
 typedef enum _IO_OPERATION {
     ClientIoAccept,
+    ClientIoZeroRead,
     ClientIoRead,
-    ClientIoWrite
+    ClientIoWrite,
+    ClientIoHandoff,                                // an accept on its way to its owner (-o)
+    ClientIoInbox                                   // wakes a worker to take its inbox (-o)
 } IO_OPERATION, * PIO_OPERATION;
 
 //
@@ -29,16 +84,41 @@ typedef enum _IO_OPERATION {
 //
 typedef struct _PER_IO_CONTEXT {
     WSAOVERLAPPED               Overlapped;
-    char                        Buffer[MAX_BUFF_SIZE];
+    char*                       Buffer;             // MAX_BUFF_SIZE bytes, NULL while an idle
+                                                    // connection waits on a zero-byte read (-i)
     WSABUF                      wsabuf;
     int                         nTotalBytes;
     int                         nSentBytes;
     IO_OPERATION                IOOperation;
     SOCKET                      SocketAccept;
+    LONGLONG                    nPostTime;          // QueryPerformanceCounter when the send was posted,
+                                                    // with -s or -m
+#if PACKET_TRACE
+    ULONGLONG                   nTraceId;           // the traced packet a posted send carries, 0 for none
+    ULONGLONG                   nTracePosted;       // TSC when that send was posted
+#endif
 
     struct _PER_IO_CONTEXT* pIOContextForward;
 } PER_IO_CONTEXT, * PPER_IO_CONTEXT;
 
+//
+// One outbound message.  It is written once, before it is queued anywhere, and
+// never changes after that, so the same buffer can sit on the send queues of any
+// number of sessions; nRefs counts those plus whoever holds it to queue it, and
+// the last release frees it.
+//
+typedef struct _SEND_BUFFER {
+    volatile LONG               nRefs;
+    int                         nLength;
+    LONGLONG                    nRecvTime;          // QueryPerformanceCounter when the data it
+                                                    // carries was received, 0 if not measured
+#if PACKET_TRACE
+    ULONGLONG                   nTraceId;           // the traced packet it carries, 0 for none
+    ULONGLONG                   nTraceReceived;     // TSC when that packet was dequeued
+#endif
+    char                        Data[1];
+} SEND_BUFFER, * PSEND_BUFFER;
+
 //
 //AcceptEx , IOCP Ű   PER_SOCKET_CONTEXTԴϴ.
 // PER_IO_CONTEXT SocketAccept  ٸ ʵ尡 ʿմϴ.
@@ -49,18 +129,254 @@ typedef struct _PER_IO_CONTEXT {
 // data to be associated with every socket added to the IOCP
 //
 typedef struct _PER_SOCKET_CONTEXT {
+    //
+    // links a batch of free contexts into the shared depot, or a single one into
+    // the strays, see CtxtFree
+    //
+    SLIST_ENTRY                 DepotEntry;
+
     SOCKET                      Socket;
 
+    //
+    // the id game logic addresses the connection by, see SessionAcquire.  Zero
+    // while the context is not in the session table.
+    //
+    volatile LONG64             SessionId;
+
+    //
+    // the worker whose completion port the socket is on.  With owned sessions
+    // (-o) every completion of the connection, and so everything it receives, is
+    // handled by that worker alone.
+    //
+    DWORD                       dwOwner;
+
     LPFN_ACCEPTEX               fnAcceptEx;
 
     //
-    //linked list for all outstanding i/o on the socket
+    //linked list for all outstanding i/o on the socket.  For a connection this is
+    //the receive context, which always has a read posted, and pSendContext carries
+    //the one send in flight for the head of the send queue.
     //
     PPER_IO_CONTEXT             pIOContext;
-    struct _PER_SOCKET_CONTEXT* pCtxtBack;
-    struct _PER_SOCKET_CONTEXT* pCtxtForward;
+    PPER_IO_CONTEXT             pSendContext;
+
+    //
+    // Lock serializes every post and the close of Socket, so any thread may queue a
+    // message.  With owned sessions (-o) only the owner does either, and the lock
+    // is not taken, see CtxtLock.  nIoPending counts the posted operations plus one held by whoever
+    // set the connection up or looked it up; the context is recycled when it drops
+    // to zero, never before, so closing only has to cancel what is posted.
+    //
+    SRWLOCK                     Lock;
+    volatile LONG               nIoPending;
+    PSEND_BUFFER                SendQueue[SEND_QUEUE_SLOTS];    // ring, oldest at nSendHead
+    ULONG                       nSendHead;
+    ULONG                       nSendCount;
+    int                         nSendQueued;        // bytes on the queue, head included
+    BOOL                        bSendPosted;
+    BOOL                        bRecvPaused;        // reads wait for the queue to drain
+    SLIST_ENTRY                 CloseEntry;         // on the owner's inbox, see InboxClose
+    volatile LONG               bCloseRequested;
+    BOOL                        bCloseGraceful;
+    WSABUF                      SendWsabuf[MAX_SEND_WSABUF];    // the queue as one gathered send
+    struct _PER_SOCKET_CONTEXT* pCtxtForward;      // next on a free list
 } PER_SOCKET_CONTEXT, * PPER_SOCKET_CONTEXT;
 
+//
+// contexts are carved out of slabs, each socket context paired with the i/o
+// context that follows it through its life, and are recycled instead of being
+// returned to the heap.  A free context is chained through pCtxtForward on the
+// free list of the thread that released it.  Unless buffers are shared (-i) the
+// slab is followed by one MAX_BUFF_SIZE buffer per i/o context.
+//
+typedef struct _CTXT_SLAB {
+    SLIST_ENTRY                 SlabEntry;
+    PER_SOCKET_CONTEXT          SocketContext[CTXT_SLAB_COUNT];
+    PER_IO_CONTEXT              IOContext[CTXT_SLAB_COUNT];
+    PER_IO_CONTEXT              SendContext[CTXT_SLAB_COUNT];
+} CTXT_SLAB, * PCTXT_SLAB;
+
+//
+// buffers shared by all connections when -i is given.  A connection only holds
+// one between the moment its data arrives and the moment the echo is sent; a
+// free buffer is itself the SLIST_ENTRY that links it into g_BufferPool.
+// SlabEntry leads both slab kinds so g_CtxtSlabs can hold either.
+//
+typedef struct _BUFFER_SLAB {
+    SLIST_ENTRY                 SlabEntry;
+    DECLSPEC_ALIGN(MEMORY_ALLOCATION_ALIGNMENT)
+    char                        Buffers[CTXT_SLAB_COUNT][MAX_BUFF_SIZE];
+} BUFFER_SLAB, * PBUFFER_SLAB;
+
+//
+// The header in front of every block BlockAllocate hands out.  A free block is
+// on the free list of a thread, in a batch on the depot of its size or a stray,
+// the way socket contexts are, see CtxtFree.
+//
+typedef struct _BLOCK_HEADER {
+    SLIST_ENTRY                 DepotEntry;         // links a batch into the depot, or a stray
+    struct _BLOCK_HEADER*       pForward;           // next on a thread's free list, or in a batch
+    ULONG                       nClass;             // BLOCK_CLASSES for a block from the heap
+} BLOCK_HEADER, * PBLOCK_HEADER;
+
+//
+// BLOCK_SLAB_COUNT blocks of one size follow the slab, each behind its header.
+// The slab comes straight from VirtualAlloc and is never zeroed by us: a block
+// is written by whoever takes it.
+//
+typedef struct _BLOCK_SLAB {
+    SLIST_ENTRY                 SlabEntry;
+} BLOCK_SLAB, * PBLOCK_SLAB;
+
+//
+// the free blocks of one size a thread keeps
+//
+typedef struct _BLOCK_CACHE {
+    PBLOCK_HEADER               pFree;
+    LONG                        nFree;
+} BLOCK_CACHE, * PBLOCK_CACHE;
+
+//
+// Sessions are found by a 64-bit id: the generation of the slot in the high 32
+// bits, and the slot number and the shard in the low 32.  Releasing a slot bumps
+// its generation, so the id of a closed session never finds the one that reuses
+// the slot.  Generations start at 1, so 0 is never a valid id.
+//
+typedef struct _SESSION_SLOT {
+    PER_SOCKET_CONTEXT* volatile pContext;          // NULL while the slot is free
+    ULONG                       nGeneration;
+    ULONG                       nNextFree;
+} SESSION_SLOT, * PSESSION_SLOT;
+
+//
+// One shard of the session table.  Lock is only taken to take or release a slot,
+// and a worker takes slots from its own shard, so connects and disconnects on
+// different workers do not contend.  Lookups take no lock at all: chunks are
+// only ever added, and stay put until the server exits.
+//
+typedef struct DECLSPEC_ALIGN(64) _SESSION_SHARD {
+    SRWLOCK                     Lock;
+    ULONG                       nSlots;             // slots carved out of the chunks so far
+    ULONG                       nFreeHead;          // SESSION_NO_SLOT when none is free
+    PSESSION_SLOT volatile      Chunks[SESSION_MAX_CHUNKS];
+} SESSION_SHARD, * PSESSION_SHARD;
+
+//
+// A set of sessions that receive the same messages, such as the players in one
+// room.  Members are kept by session id, so a member that disconnects is simply
+// skipped until it is removed.
+//
+typedef struct _ROOM {
+    SRWLOCK                     Lock;
+    LONG64*                     pMembers;
+    ULONG                       nMembers;
+    ULONG                       nCapacity;
+} ROOM, * PROOM;
+
+//
+// A message a worker received, waiting for the next tick.  The data is kept in
+// a send buffer, so a tick that sends it on, as the echo does, needs no copy.
+//
+typedef struct _INBOUND_MESSAGE {
+    SLIST_ENTRY                 Entry;
+    LONG64                      SessionId;          // the sender
+    PSEND_BUFFER                lpSendBuffer;
+} INBOUND_MESSAGE, * PINBOUND_MESSAGE;
+
+//
+// A message a tick produced, published when the tick ends.  SessionId 0 sends
+// it to the room.
+//
+typedef struct _OUTBOUND_MESSAGE {
+    LONG64                      SessionId;
+    PSEND_BUFFER                lpSendBuffer;
+} OUTBOUND_MESSAGE, * POUTBOUND_MESSAGE;
+
+//
+// A message queued from another thread for a session a worker owns (-o),
+// waiting in that worker's inbox.
+//
+typedef struct _INBOX_MESSAGE {
+    SLIST_ENTRY                 Entry;
+    LONG64                      SessionId;          // the recipient
+    PSEND_BUFFER                lpSendBuffer;
+} INBOX_MESSAGE, * PINBOX_MESSAGE;
+
+//
+// What other threads send to the sessions of one worker (-o), and the sessions
+// they want closed.  Any thread pushes on Messages and Closes without a lock; only
+// the worker takes them off.  Wakeup is posted to the worker's port by whoever
+// sets bWakePending, so a burst of messages costs one packet however many threads
+// add to it.
+//
+typedef struct DECLSPEC_ALIGN(64) _WORKER_INBOX {
+    SLIST_HEADER                Messages;           // newest first
+    SLIST_HEADER                Closes;             // sessions to close, see InboxClose
+    volatile LONG               bWakePending;       // Wakeup is posted and not yet handled
+    PER_IO_CONTEXT              Wakeup;             // IOOperation is ClientIoInbox
+} WORKER_INBOX, * PWORKER_INBOX;
+
+//
+// counters kept by the tick thread; durations are in microseconds
+//
+typedef struct DECLSPEC_ALIGN(64) _TICK_STATS {
+    volatile ULONGLONG          nTicks;
+    volatile ULONGLONG          nOverruns;          // ticks that ended after the next was due
+    volatile ULONGLONG          nSkipped;           // ticks dropped to catch up after overruns
+    volatile ULONGLONG          nTotalUs;
+    volatile ULONGLONG          nMaxUs;             // longest tick since the last report
+    volatile ULONGLONG          nInbound;           // messages the ticks consumed
+    volatile ULONGLONG          nOutbound;          // messages the ticks published
+    volatile ULONG              nLastInbound;       // messages the last tick found queued
+} TICK_STATS, * PTICK_STATS;
+
+//
+// A NUMA node and its logical processors.  The processors are listed in
+// g_LayoutProcessors from nFirst on, the first of every core before any second
+// hyperthread, so as many workers as there are cores each get a core of their own.
+//
+typedef struct _NUMA_NODE_LAYOUT {
+    GROUP_AFFINITY              Affinity;           // every processor of the node
+    ULONG                       nNode;
+    ULONG                       nFirst;
+    ULONG                       nProcessors;
+} NUMA_NODE_LAYOUT, * PNUMA_NODE_LAYOUT;
+
+//
+// counters kept by every worker thread, each on its own cache line so that
+// workers never write to a line another worker is writing to.  Only the worker
+// writes them, with a relaxed load and store (StatAdd), atomic so that a 32-bit
+// build never reads half of a value; they are summed over the workers when
+// they are printed or scraped (-m).  Latencies are in nanoseconds and only
+// measured with -s or -m.
+//
+typedef struct DECLSPEC_ALIGN(64) _WORKER_STATS {
+    std::atomic<uint64_t>       nCompletions;       // packets removed from the port
+    std::atomic<uint64_t>       nDequeueCalls;      // GetQueuedCompletionStatusEx calls
+    std::atomic<uint64_t>       nSends;             // send completions
+    std::atomic<uint64_t>       nSendMessages;      // queued messages those sends finished
+    std::atomic<uint64_t>       nSendPartials;      // sends that completed short of what was posted
+    std::atomic<uint64_t>       nAccepts;           // connections set up
+    std::atomic<uint64_t>       nCloses;            // connections closed on this worker
+    std::atomic<uint64_t>       nBytesIn;
+    std::atomic<uint64_t>       nBytesOut;
+    volatile LONG               nSessions;          // connections the worker owns (-o)
+    std::atomic<uint64_t>       nInboxWakeups;      // times the worker took its inbox (-o)
+    std::atomic<uint64_t>       nInboxMessages;     // messages it found there
+    LatencyHistogram            HandlerLatency;     // from the dequeue of a batch to the handler of each completion
+    LatencyHistogram            SendPostLatency;    // from posting a send to handling its completion
+    LatencyHistogram            SendLatency;        // from a receive to the send of what it caused
+} WORKER_STATS, * PWORKER_STATS;
+
+//
+// text the metrics endpoint (-m) answers with, grown as it is written
+//
+typedef struct _METRICS_TEXT {
+    char*                       pText;
+    size_t                      nLength;
+    size_t                      nCapacity;
+} METRICS_TEXT, * PMETRICS_TEXT;
+
 BOOL ValidOptions(int argc, char* argv[]);
 
 BOOL WINAPI CtrlHandler(
@@ -69,14 +385,97 @@ BOOL WINAPI CtrlHandler(
 
 BOOL CreateListenSocket(void);
 
+BOOL CreateAcceptPool(void);
+
 BOOL CreateAcceptSocket(
-    BOOL fUpdateIOCP
+    PPER_IO_CONTEXT lpIOContext
 );
 
 UINT WINAPI WorkerThread(
     LPVOID WorkContext
 );
 
+BOOL WorkerLayoutInit(VOID);
+
+BOOL WorkerPlace(
+    HANDLE hThread,
+    DWORD dwWorker
+);
+
+UINT WINAPI TickThread(
+    LPVOID TickContext
+);
+
+VOID TickRun(VOID);
+
+BOOL TickQueueInbound(
+    LONG64 SessionId,
+    PSEND_BUFFER lpSendBuffer
+);
+
+BOOL TickQueueOutbound(
+    LONG64 SessionId,
+    PSEND_BUFFER lpSendBuffer
+);
+
+VOID TickFreeInbound(VOID);
+
+BOOL InboxPost(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    PSEND_BUFFER lpSendBuffer
+);
+
+VOID InboxDrain(
+    PWORKER_INBOX lpInbox,
+    PWORKER_STATS lpStats
+);
+
+VOID InboxClose(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    BOOL bGraceful
+);
+
+VOID InboxWake(
+    DWORD dwOwner
+);
+
+VOID InboxFreeAll(VOID);
+
+VOID PrintWorkerStats(VOID);
+
+BOOL CreateMetricsSocket(VOID);
+
+UINT WINAPI MetricsThread(
+    LPVOID MetricsContext
+);
+
+BOOL MetricsReply(
+    SOCKET sd,
+    const char* lpStatus,
+    const char* lpContentType,
+    const char* lpBody,
+    size_t nLength
+);
+
+BOOL MetricsRender(
+    PMETRICS_TEXT lpText
+);
+
+BOOL MetricsPrintf(
+    PMETRICS_TEXT lpText,
+    const char* lpFormat,
+    ...
+);
+
+VOID TraceWrite(VOID);
+
+BOOL MetricsHistogram(
+    PMETRICS_TEXT lpText,
+    const char* lpName,
+    const char* lpHelp,
+    const LatencyHistogram* lpHistogram
+);
+
 PPER_SOCKET_CONTEXT UpdateCompletionPort(
     SOCKET s,
     IO_OPERATION ClientIo,
@@ -85,7 +484,7 @@ PPER_SOCKET_CONTEXT UpdateCompletionPort(
 //
 // bAddToList is FALSE for listening socket, and TRUE for connection sockets.
 // As we maintain the context for listening socket in a global structure, we
-// don't need to add it to the list.
+// don't need to add it to the session table.
 //
 
 VOID CloseClient(
@@ -93,20 +492,136 @@ VOID CloseClient(
     BOOL bGraceful
 );
 
+VOID CloseClientNow(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    BOOL bGraceful
+);
+
 PPER_SOCKET_CONTEXT CtxtAllocate(
     SOCKET s,
     IO_OPERATION ClientIO
 );
 
-VOID CtxtListFree(
+VOID CtxtFree(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
 );
 
-VOID CtxtListAddTo(
+BOOL CtxtFreeListRefill(VOID);
+
+VOID CtxtSlabFreeAll(VOID);
+
+char* BufAllocate(VOID);
+
+VOID BufFree(
+    char* lpBuffer
+);
+
+PVOID BlockAllocate(
+    SIZE_T nSize
+);
+
+VOID BlockFree(
+    PVOID lpBlock
+);
+
+BOOL BlockCacheRefill(
+    ULONG nClass
+);
+
+VOID BlockSlabFreeAll(VOID);
+
+BOOL PostRecv(
     PPER_SOCKET_CONTEXT lpPerSocketContext
 );
 
-VOID CtxtListDeleteFrom(
+BOOL PostSend(
     PPER_SOCKET_CONTEXT lpPerSocketContext
 );
 
+PSEND_BUFFER SendBufferAlloc(
+    int nLength
+);
+
+VOID SendBufferRelease(
+    PSEND_BUFFER lpSendBuffer
+);
+
+BOOL SessionQueue(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    PSEND_BUFFER lpSendBuffer
+);
+
+BOOL SessionSend(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    const char* lpData,
+    int nLength
+);
+
+BOOL SessionSendTo(
+    LONG64 SessionId,
+    const char* lpData,
+    int nLength
+);
+
+BOOL SessionReceived(
+    PPER_SOCKET_CONTEXT lpPerSocketContext,
+    const char* lpData,
+    int nLength,
+    LONGLONG nRecvTime
+);
+
+ULONG SessionBroadcast(
+    const LONG64* pSessionIds,
+    ULONG nSessions,
+    PSEND_BUFFER lpSendBuffer
+);
+
+BOOL RoomJoin(
+    PROOM lpRoom,
+    LONG64 SessionId
+);
+
+VOID RoomLeave(
+    PROOM lpRoom,
+    LONG64 SessionId
+);
+
+ULONG RoomBroadcast(
+    PROOM lpRoom,
+    PSEND_BUFFER lpSendBuffer
+);
+
+VOID SessionIoDone(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+VOID SendQueuedDone(
+    LONG nBytes
+);
+
+VOID AcceptIoDone(VOID);
+
+VOID SessionCheckDrained(VOID);
+
+VOID SessionTableInit(VOID);
+
+VOID SessionTableFree(VOID);
+
+VOID SessionCloseAll(
+    BOOL bGraceful,
+    LONG* pnClosed
+);
+
+BOOL SessionRegister(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+VOID SessionUnregister(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+PPER_SOCKET_CONTEXT SessionAcquire(
+    LONG64 SessionId
+);
+
 #endif
\ No newline at end of file
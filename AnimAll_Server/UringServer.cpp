@@ -0,0 +1,1191 @@
+//
+// Module:
+//      uringserver.cpp
+//
+// Abstract:
+//      This program is the Linux counterpart of iocpserverex.cpp.  It is the same
+//      echo server built on the same ClientIoAccept/ClientIoRead/ClientIoWrite state
+//      machine, but completions are delivered by io_uring instead of an IOCP.  Like
+//      IOCP, io_uring is a proactor: the accept, recv and send are started by the
+//      server and the worker is only woken once the operation has finished, so there
+//      is no readiness notification followed by a second system call.
+//
+//      Unlike an IOCP, a ring is not meant to be shared between threads.  Every
+//      worker thread therefore owns one ring, keeps its own multishot accept armed
+//      on the shared listening socket, and handles every completion of the
+//      connections it accepted.  The kernel picks which of the armed accepts gets
+//      a new connection.  A multishot accept posts one completion per connection
+//      without being re-submitted, which is what a pool of pending AcceptEx calls
+//      achieves on Windows, so a connect storm never waits for a worker to re-post.
+//
+//      The user_data of a submission is the PER_IO_CONTEXT, which carries a pointer
+//      back to its PER_SOCKET_CONTEXT (the IOCP completion key).  On CTRL-C the main
+//      thread posts a completion with a user_data of 0 to every ring, which is the
+//      io_uring version of posting a NULL completion key with
+//      PostQueuedCompletionStatus.
+//
+//      A recv whose completion says the socket still has data waiting
+//      (IORING_CQE_F_SOCK_NONEMPTY) is followed by another recv into the next of a
+//      few segments instead of a send.  Once the socket is drained, or the segments
+//      are full, they all go back in one IORING_OP_SENDMSG with an iovec per
+//      segment, so a burst costs one send however many recvs it took.  The
+//      statistics (-s) include how many recvs a send echoed on average.
+//
+//      With -i an idle connection holds no receive buffer at all.  Its recv is
+//      posted against the worker's provided-buffer ring and the kernel only picks
+//      one of the shared buffers when data arrives; the buffer goes back to the
+//      ring as soon as the data has been echoed.  Memory then grows with the
+//      number of busy connections rather than with the number of connections.
+//
+//      With -k a connection that sends nothing for that many seconds is shut
+//      down.  Every connection has an idle timer on its worker's timing wheel,
+//      restarted whenever data arrives; a timeout on the ring wakes the worker
+//      every IDLE_CHECK_MS to advance the wheel.  Shutting the socket down makes
+//      the recv it has posted complete, and the usual path closes it.
+//
+//      Nothing that happens on the I/O paths is printed to the console.  It is
+//      logged with BinaryLog (NetworkLibrary), which only stores a record in a
+//      ring of the worker and formats it on a log thread, into a file (-f) that
+//      is rotated as it grows.  Verbose (-v) also logs every completion.
+//
+//      For comparison the server can also be run as a plain blocking
+//      thread-per-connection echo server (-b).  Use echobenchclient to measure both
+//      on loopback.
+//
+//  Usage:
+//      Start the server and wait for connections on port 6001
+//          uringserver -e:6001
+//      Start the blocking baseline on the same port
+//          uringserver -e:6001 -b
+//      Ask for a 4096 connection backlog to absorb a reconnect storm
+//          uringserver -e:6001 -l:4096
+//      Share 4096 receive buffers per worker and print resident memory per
+//      connection every 5 seconds
+//          uringserver -e:6001 -i:4096 -s:5
+//      Shut down connections that stay silent for 30 seconds
+//          uringserver -e:6001 -k:30
+//      Log every completion to echo.log
+//          uringserver -e:6001 -v -f:echo.log
+//
+//  Build:
+//      Linux 5.19 or later (IORING_OP_MSG_RING).
+//      g++ -O2 -std=c++17 -I../NetworkLibrary UringServer.cpp ../NetworkLibrary/IoUring.cpp
+//          ../NetworkLibrary/TimerWheel.cpp ../NetworkLibrary/BinaryLog.cpp -lpthread -o uringserver
+//
+
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "BinaryLog.h"
+#include "UringServer.h"
+
+const char* g_Port = DEFAULT_PORT;
+volatile bool g_bEndServer = false;		// set to true on CTRL-C
+bool g_bVerbose = false;			// log every completion
+const char* g_szLogFile = DEFAULT_LOG_FILE;	// where the I/O paths log (-f)
+BinaryLog g_Log;
+bool g_bBlocking = false;			// run the blocking baseline instead
+bool g_bSharedBuffers = false;			// idle sockets hold no buffer (-i)
+unsigned g_nSharedBuffers = SHARED_BUFFERS;	// shared receive buffers per worker
+unsigned g_nDrainBatch = 1;			// completions handled per io_uring_enter call
+int g_nStatsInterval = 0;			// seconds between worker statistics, 0 for none
+int g_nBacklog = SOMAXCONN;			// listen() backlog, capped by net.core.somaxconn
+int g_nIdleSeconds = 0;				// silence before a socket is shut down, 0 for never
+int g_nThreadCount = 0;
+int g_sdListen = -1;
+int g_nConnections = 0;				// sockets in g_pCtxtList
+long g_nBaseResident = 0;			// resident bytes before the first connection
+WORKER_CONTEXT g_Workers[MAX_WORKER_THREAD];
+PPER_SOCKET_CONTEXT g_pCtxtList = NULL;		// linked list of context info structures
+// maintained to allow the the cleanup
+// handler to cleanly close all sockets and
+// free resources.
+PCTXT_SLAB g_pCtxtSlabs = NULL;			// every slab carved so far, released at exit
+thread_local PPER_SOCKET_CONTEXT t_pCtxtFreeList = NULL;	// contexts recycled by this thread
+
+pthread_mutex_t g_CriticalSection = PTHREAD_MUTEX_INITIALIZER;	// guard access to the global context list
+
+int main(int argc, char* argv[]) {
+
+	sigset_t sigset;
+	int nSignal = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argc, argv))
+		return(1);
+
+	if ((nRet = g_Log.Init(g_szLogFile, g_bVerbose ? LogLevelDebug : LogLevelInfo)) != 0)
+		printf("BinaryLog::Init(%s) failed, nothing is logged: %d\n", g_szLogFile, nRet);
+
+	if (g_nThreadCount == 0)
+		g_nThreadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (g_nThreadCount > MAX_WORKER_THREAD)
+		g_nThreadCount = MAX_WORKER_THREAD;
+
+	//
+	// CTRL-C and friends are picked up synchronously by the main thread with
+	// sigwait, so block them before any thread is created.  A peer that resets
+	// the connection must not kill the server either.  A signal that was ignored
+	// when we were started in the background is discarded instead of queued for
+	// sigwait, so restore the default dispositions first.
+	//
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGTERM);
+	sigaddset(&sigset, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	//
+	// every connection is a descriptor; idle benchmarks need far more than the default
+	//
+	{
+		struct rlimit limit;
+
+		if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+			limit.rlim_cur = limit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	if (!CreateListenSocket())
+		return(1);
+
+	if (g_bBlocking) {
+		pthread_t hThread;
+
+		if (pthread_create(&hThread, NULL, RunBlockingServer, NULL) != 0) {
+			printf("pthread_create() failed to create accept thread\n");
+			close(g_sdListen);
+			return(1);
+		}
+
+		sigwait(&sigset, &nSignal);
+		g_bEndServer = true;
+
+		//
+		// unblock accept(); connection threads are detached and die with the process
+		//
+		shutdown(g_sdListen, SHUT_RDWR);
+		pthread_join(hThread, NULL);
+		close(g_sdListen);
+		g_Log.Exit();
+		return(0);
+	}
+
+	for (int i = 0; i < g_nThreadCount; i++) {
+		PWORKER_CONTEXT lpWorker = &g_Workers[i];
+
+		nRet = lpWorker->Ring.Init(URING_ENTRIES);
+		if (nRet < 0) {
+			printf("io_uring_setup() failed: %d\n", -nRet);
+			break;
+		}
+
+		if (g_bSharedBuffers) {
+			nRet = lpWorker->BufRing.Init(lpWorker->Ring, g_nSharedBuffers, MAX_BUFF_SIZE, URING_BUFFER_GROUP);
+			if (nRet < 0) {
+				printf("IORING_REGISTER_PBUF_RING failed: %d\n", -nRet);
+				break;
+			}
+		}
+
+		if (!CreateAcceptSocket(lpWorker))
+			break;
+
+		if (g_nIdleSeconds && !PostTimer(lpWorker))
+			break;
+
+		if (pthread_create(&lpWorker->hThread, NULL, WorkerThread, lpWorker) != 0) {
+			printf("pthread_create() failed to create worker thread\n");
+			break;
+		}
+		lpWorker->bStarted = true;
+	}
+
+	if (nRet >= 0 && g_Workers[g_nThreadCount - 1].bStarted) {
+		struct timespec interval = { g_nStatsInterval, 0 };
+
+		g_nBaseResident = GetResidentBytes();
+
+		if (g_nStatsInterval == 0)
+			sigwait(&sigset, &nSignal);
+		else while (sigtimedwait(&sigset, NULL, &interval) == -1)
+			PrintWorkerStats();
+	}
+
+	g_bEndServer = true;
+
+	//
+	// Cause worker threads to exit
+	//
+	{
+		IoUring ring;
+
+		if (ring.Init(MAX_WORKER_THREAD) == 0) {
+			for (int i = 0; i < g_nThreadCount; i++) {
+				if (g_Workers[i].bStarted)
+					IoUringPrepMsgRing(ring.GetSqe(), g_Workers[i].Ring.Fd(), 0, 0);
+			}
+			ring.Submit();
+		}
+	}
+
+	//
+	// Make sure worker threads exits.
+	//
+	for (int i = 0; i < g_nThreadCount; i++) {
+		if (g_Workers[i].bStarted)
+			pthread_join(g_Workers[i].hThread, NULL);
+		g_Workers[i].bStarted = false;
+	}
+
+	if (g_sdListen != -1) {
+		close(g_sdListen);
+		g_sdListen = -1;
+	}
+
+	//
+	// Tearing down a ring cancels whatever is still outstanding on it, so the
+	// contexts can be released afterwards.
+	//
+	for (int i = 0; i < g_nThreadCount; i++)
+		g_Workers[i].Ring.Exit();
+
+	CtxtListFree();
+
+	for (int i = 0; i < g_nThreadCount; i++) {
+		if (g_Workers[i].pCtxtListenSocket) {
+			CtxtFree(g_Workers[i].pCtxtListenSocket);
+			g_Workers[i].pCtxtListenSocket = NULL;
+		}
+		g_Workers[i].BufRing.Exit();
+	}
+
+	CtxtSlabFreeAll();
+	g_Log.Exit();
+
+	return(0);
+} //main
+
+//
+//  Just validate the command line options.
+//
+bool ValidOptions(int argc, char* argv[]) {
+	bool bRet = true;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'b':
+				g_bBlocking = true;
+				break;
+
+			case 'd':
+				if (strlen(argv[i]) > 3) {
+					g_nDrainBatch = atoi(&argv[i][3]);
+					if (g_nDrainBatch < 1)
+						g_nDrainBatch = 1;
+					if (g_nDrainBatch > MAX_DRAIN_BATCH)
+						g_nDrainBatch = MAX_DRAIN_BATCH;
+				}
+				break;
+
+			case 'i':
+				g_bSharedBuffers = true;
+				if (strlen(argv[i]) > 3) {
+
+					//
+					// a provided-buffer ring holds a power of two entries
+					//
+					unsigned nBuffers = (unsigned)atoi(&argv[i][3]);
+					for (g_nSharedBuffers = 1; g_nSharedBuffers < nBuffers && g_nSharedBuffers < 32768; )
+						g_nSharedBuffers <<= 1;
+				}
+				break;
+
+			case 'l':
+				if (strlen(argv[i]) > 3)
+					g_nBacklog = atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_nStatsInterval = atoi(&argv[i][3]);
+				break;
+
+			case 'e':
+				if (strlen(argv[i]) > 3)
+					g_Port = &argv[i][3];
+				break;
+
+			case 'f':
+				if (strlen(argv[i]) > 3)
+					g_szLogFile = &argv[i][3];
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_nThreadCount = atoi(&argv[i][3]);
+				break;
+
+			case 'k':
+				if (strlen(argv[i]) > 3)
+					g_nIdleSeconds = atoi(&argv[i][3]);
+				break;
+
+			case 'v':
+				g_bVerbose = true;
+				break;
+
+			case '?':
+				printf("Usage:\n  uringserver [-e:port] [-t:#] [-b] [-d:#] [-f:file] [-i[:#]] [-k:#] [-l:#] [-s:#] [-v] [-?]\n");
+				printf("  -e:port\tSpecify echoing port number\n");
+				printf("  -t:#\t\tNumber of worker threads (rings) (Def: number of CPUs)\n");
+				printf("  -b\t\tRun the blocking thread-per-connection baseline\n");
+				printf("  -d:#\t\tCompletions drained per io_uring_enter (Def: 1, max: %d)\n", MAX_DRAIN_BATCH);
+				printf("  -f:file\tLog file, rotated at %d MB (Def: %s)\n", LOG_FILE_BYTES >> 20, DEFAULT_LOG_FILE);
+				printf("  -i[:#]\t\tIdle sockets hold no buffer; # shared buffers per worker (Def: %d)\n", SHARED_BUFFERS);
+				printf("  -k:#\t\tShut down connections silent for # seconds (Def: never)\n");
+				printf("  -l:#\t\tListen backlog (Def: %d)\n", SOMAXCONN);
+				printf("  -s:#\t\tPrint worker statistics every # seconds\n");
+				printf("  -v\t\tVerbose, log every completion\n");
+				printf("  -?\t\tDisplay this help\n");
+				bRet = false;
+				break;
+
+			default:
+				printf("Unknown options flag %s\n", argv[i]);
+				bRet = false;
+				break;
+			}
+		}
+	}
+
+	return(bRet);
+}
+
+//
+//  Create a listening socket, bind, and set up its listening backlog.
+//
+bool CreateListenSocket(void) {
+
+	int nRet = 0;
+	int nOne = 1;
+	struct addrinfo hints = {};
+	struct addrinfo* addrlocal = NULL;
+
+	//
+	// Resolve the interface
+	//
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_IP;
+
+	if (getaddrinfo(NULL, g_Port, &hints, &addrlocal) != 0) {
+		printf("getaddrinfo() failed with error %d\n", errno);
+		return(false);
+	}
+
+	if (addrlocal == NULL) {
+		printf("getaddrinfo() failed to resolve/convert the interface\n");
+		return(false);
+	}
+
+	g_sdListen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (g_sdListen == -1) {
+		printf("socket() failed: %d\n", errno);
+		freeaddrinfo(addrlocal);
+		return(false);
+	}
+
+	setsockopt(g_sdListen, SOL_SOCKET, SO_REUSEADDR, (char*)&nOne, sizeof(nOne));
+
+	nRet = bind(g_sdListen, addrlocal->ai_addr, (int)addrlocal->ai_addrlen);
+	if (nRet == -1) {
+		printf("bind() failed: %d\n", errno);
+		freeaddrinfo(addrlocal);
+		return(false);
+	}
+
+	nRet = listen(g_sdListen, g_nBacklog);
+	if (nRet == -1) {
+		printf("listen() failed: %d\n", errno);
+		freeaddrinfo(addrlocal);
+		return(false);
+	}
+
+	freeaddrinfo(addrlocal);
+
+	return(true);
+}
+
+//
+// Arm a multishot accept on the listening socket from the given worker's ring.  The
+// first call for a worker allocates the listening socket context of that worker;
+// later calls only happen when the kernel reports the accept is no longer armed.
+//
+// io_uring has no equivalent of the AcceptEx receive buffer, so the accept always
+// completes without data and an initial recv is posted for the new connection.
+//
+bool CreateAcceptSocket(PWORKER_CONTEXT lpWorker) {
+
+	io_uring_sqe* sqe = NULL;
+
+	if (lpWorker->pCtxtListenSocket == NULL) {
+		lpWorker->pCtxtListenSocket = CtxtAllocate(g_sdListen, lpWorker, ClientIoAccept);
+		if (lpWorker->pCtxtListenSocket == NULL) {
+			LOG_ERROR(g_Log, "failed to allocate listen socket context");
+			return(false);
+		}
+	}
+
+	sqe = lpWorker->Ring.GetSqe();
+	if (sqe == NULL) {
+		LOG_ERROR(g_Log, "io_uring submission queue is full, failed to post accept");
+		return(false);
+	}
+
+	IoUringPrepMultishotAccept(sqe, g_sdListen, (uint64_t)(uintptr_t)lpWorker->pCtxtListenSocket->pIOContext);
+
+	return(true);
+}
+
+//
+// Worker thread that handles all I/O requests on the sockets owned by its ring.
+//
+void* WorkerThread(void* WorkThreadContext) {
+
+	PWORKER_CONTEXT lpWorker = (PWORKER_CONTEXT)WorkThreadContext;
+	IoUring* pRing = &lpWorker->Ring;
+	io_uring_cqe* cqes[MAX_DRAIN_BATCH];
+	unsigned nCqes = 0;
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+	PPER_SOCKET_CONTEXT lpAcceptSocketContext = NULL;
+	PPER_IO_CONTEXT lpIOContext = NULL;
+	int nIoSize = 0;
+	unsigned nCqeFlags = 0;
+	int nRet = 0;
+
+	while (true) {
+
+		//
+		// continually loop to service io completion packets.  Every recv and send
+		// queued while handling the previous batch is handed to the kernel by this
+		// same call, so the follow-ups of a batch go out together.
+		//
+		nRet = pRing->SubmitAndWait(1);
+		lpWorker->nDequeueCalls++;
+		if (nRet < 0 && nRet != -EAGAIN && nRet != -EBUSY) {
+			printf("io_uring_enter() failed: %d\n", -nRet);
+			kill(getpid(), SIGTERM);
+			return(NULL);
+		}
+
+		//
+		// then drain up to g_nDrainBatch completions without entering the kernel again
+		//
+		nCqes = pRing->PeekBatchCqe(cqes, g_nDrainBatch);
+		lpWorker->nCompletions += nCqes;
+
+		for (unsigned nEntry = 0; nEntry < nCqes; nEntry++) {
+
+			lpIOContext = (PPER_IO_CONTEXT)(uintptr_t)cqes[nEntry]->user_data;
+			nIoSize = cqes[nEntry]->res;
+			nCqeFlags = cqes[nEntry]->flags;
+
+			if (lpIOContext == NULL) {
+
+				//
+				// main thread posted a completion with a user_data of 0.  It is time to exit.
+				//
+				return(NULL);
+			}
+
+			if (g_bEndServer) {
+
+				//
+				// main thread will do all cleanup needed
+				//
+				return(NULL);
+			}
+
+			if (lpIOContext->IOOperation == ClientIoTimer) {
+				CheckIdle(lpWorker);
+				continue;
+			}
+
+			lpPerSocketContext = lpIOContext->pSocketContext;
+
+			//
+			// a recv against the buffer group says which shared buffer it was given
+			//
+			if (nCqeFlags & IORING_CQE_F_BUFFER) {
+				int nSegment = lpIOContext->nSegments;
+
+				lpIOContext->nBufferIds[nSegment] = IoUringBufRing::BufferId(cqes[nEntry]);
+				lpIOContext->Buffers[nSegment] = lpWorker->BufRing.Buffer((unsigned short)lpIOContext->nBufferIds[nSegment]);
+			}
+			else if (lpIOContext->IOOperation == ClientIoRead && nIoSize == -ENOBUFS) {
+
+				//
+				// every shared buffer is being echoed right now.  A socket that
+				// already holds some echoes those and reads again after that,
+				// otherwise the recv is posted again once one of them is recycled.
+				//
+				if (lpIOContext->nSegments) {
+					lpIOContext->nSentBytes = 0;
+					if (!PostSend(lpPerSocketContext))
+						CloseClient(lpPerSocketContext);
+					continue;
+				}
+				lpPerSocketContext->pStarvedForward = NULL;
+				if (lpWorker->pStarvedTail)
+					lpWorker->pStarvedTail->pStarvedForward = lpPerSocketContext;
+				else
+					lpWorker->pStarvedHead = lpPerSocketContext;
+				lpWorker->pStarvedTail = lpPerSocketContext;
+				continue;
+			}
+
+			//
+			//We should never skip the loop and not post another accept if the current
+			//completion packet is for previous accept
+			//
+			if (lpIOContext->IOOperation != ClientIoAccept) {
+				if (nIoSize <= 0) {
+
+					//
+					// client connection dropped, continue to service remaining (and possibly
+					// new) client connections
+					//
+					CloseClient(lpPerSocketContext);
+					continue;
+				}
+			}
+
+			//
+			// determine what type of IO packet has completed by checking the PER_IO_CONTEXT
+			// associated with this socket.  This will determine what action to take.
+			//
+			switch (lpIOContext->IOOperation) {
+			case ClientIoAccept:
+
+				if (nIoSize < 0) {
+
+					//
+					//just warn user here, the next accept is posted below.
+					//
+					LOG_WARNING(g_Log, "accept() failed: %d", -nIoSize);
+				}
+				else {
+					int nOne = 1;
+
+					setsockopt(nIoSize, IPPROTO_TCP, TCP_NODELAY, (char*)&nOne, sizeof(nOne));
+
+					lpAcceptSocketContext = CtxtAllocate(nIoSize, lpWorker, ClientIoRead);
+					if (lpAcceptSocketContext == NULL) {
+						close(nIoSize);
+					}
+					else {
+						CtxtListAddTo(lpAcceptSocketContext);
+						if (g_nIdleSeconds)
+							lpWorker->Timers.Schedule(&lpAcceptSocketContext->IdleTimer,
+								lpWorker->Timers.Now() + g_nIdleSeconds * 1000ull);
+
+						LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) accept completed, Recv posted",
+							(int)(lpWorker - g_Workers), nIoSize);
+
+						//
+						// accept completes but doesn't read any data so we need to post
+						// an outstanding read.
+						//
+						if (!PostRecv(lpAcceptSocketContext))
+							CloseClient(lpAcceptSocketContext);
+					}
+				}
+
+				//
+				//The multishot accept stays armed as long as IORING_CQE_F_MORE is set;
+				//otherwise (an error, or the kernel ran out of room) arm it again
+				//
+				if (!(nCqeFlags & IORING_CQE_F_MORE) && !CreateAcceptSocket(lpWorker)) {
+					printf("Please shut down and reboot the server.\n");
+					kill(getpid(), SIGTERM);
+					return(NULL);
+				}
+				break;
+
+
+			case ClientIoRead:
+
+				//
+				// a read operation has completed into the next segment.  If the socket
+				// has more waiting, read that into the segment after it; otherwise post
+				// a write operation to echo every segment back to the client from the
+				// same data buffers.  The socket is not idle, its timer starts over.
+				//
+				if (g_nIdleSeconds)
+					lpWorker->Timers.Schedule(&lpPerSocketContext->IdleTimer,
+						lpWorker->Timers.Now() + g_nIdleSeconds * 1000ull);
+				lpIOContext->nLengths[lpIOContext->nSegments++] = nIoSize;
+				lpIOContext->nTotalBytes += nIoSize;
+				if ((nCqeFlags & IORING_CQE_F_SOCK_NONEMPTY) && lpIOContext->nSegments < SEND_QUEUE_SLOTS) {
+					if (!PostRecv(lpPerSocketContext))
+						CloseClient(lpPerSocketContext);
+					else
+						LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Recv completed (%d bytes), Recv posted",
+							(int)(lpWorker - g_Workers), lpPerSocketContext->Socket, nIoSize);
+					break;
+				}
+
+				lpIOContext->nSentBytes = 0;
+				if (!PostSend(lpPerSocketContext))
+					CloseClient(lpPerSocketContext);
+				else
+					LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Recv completed (%d bytes), Send posted (%d segments)",
+						(int)(lpWorker - g_Workers), lpPerSocketContext->Socket, nIoSize, lpIOContext->nSegments);
+				break;
+
+			case ClientIoWrite:
+
+				//
+				// a write operation has completed, determine if all the data intended to be
+				// sent actually was sent.
+				//
+				lpWorker->nSends++;
+				lpIOContext->nSentBytes += nIoSize;
+				if (lpIOContext->nSentBytes < lpIOContext->nTotalBytes) {
+
+					//
+					// the previous write operation didn't send all the data,
+					// post another send to complete the operation
+					//
+					if (!PostSend(lpPerSocketContext))
+						CloseClient(lpPerSocketContext);
+					else
+						LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Send partially completed (%d bytes), Send posted",
+							(int)(lpWorker - g_Workers), lpPerSocketContext->Socket, nIoSize);
+				}
+				else {
+
+					//
+					// previous write operation completed for this socket, post another recv
+					// into the first segment.  With shared buffers the socket goes back to
+					// holding none.
+					//
+					lpWorker->nSendMessages += lpIOContext->nSegments;
+					CtxtReleaseBuffer(lpPerSocketContext);
+					if (!PostRecv(lpPerSocketContext))
+						CloseClient(lpPerSocketContext);
+					else
+						LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) Send completed (%d bytes), Recv posted",
+							(int)(lpWorker - g_Workers), lpPerSocketContext->Socket, nIoSize);
+				}
+				break;
+
+			case ClientIoTimer:
+
+				//
+				// handled before the socket is looked at
+				//
+				break;
+
+			} //switch
+		} //for
+
+		pRing->CqeSeen(nCqes);
+	} //while
+	return(NULL);
+}
+
+//
+//  Print how many completions every worker handled per io_uring_enter call.
+//
+void PrintWorkerStats(void) {
+
+	uint64_t nTotalCompletions = 0;
+	uint64_t nTotalDequeueCalls = 0;
+	uint64_t nSends = 0;
+	uint64_t nSendMessages = 0;
+
+	for (int i = 0; i < g_nThreadCount; i++) {
+		uint64_t nCompletions = g_Workers[i].nCompletions;
+		uint64_t nDequeueCalls = g_Workers[i].nDequeueCalls;
+
+		if (g_bVerbose)
+			printf("WorkerThread %d: %llu completions in %llu calls (%.2f per call)\n",
+				i, (unsigned long long)nCompletions, (unsigned long long)nDequeueCalls,
+				nDequeueCalls ? (double)nCompletions / nDequeueCalls : 0.0);
+
+		nTotalCompletions += nCompletions;
+		nTotalDequeueCalls += nDequeueCalls;
+		nSends += g_Workers[i].nSends;
+		nSendMessages += g_Workers[i].nSendMessages;
+	}
+
+	printf("Workers: %llu completions in %llu calls (%.2f completions per call)\n",
+		(unsigned long long)nTotalCompletions, (unsigned long long)nTotalDequeueCalls,
+		nTotalDequeueCalls ? (double)nTotalCompletions / nTotalDequeueCalls : 0.0);
+	printf("Sends: %llu recvs echoed in %llu sends (%.2f recvs per send)\n",
+		(unsigned long long)nSendMessages, (unsigned long long)nSends,
+		nSends ? (double)nSendMessages / nSends : 0.0);
+
+	if (g_nIdleSeconds) {
+		uint64_t nIdleKicks = 0;
+
+		for (int i = 0; i < g_nThreadCount; i++)
+			nIdleKicks += g_Workers[i].nIdleKicks;
+		printf("Idle: %llu connections shut down after %d seconds of silence\n",
+			(unsigned long long)nIdleKicks, g_nIdleSeconds);
+	}
+
+	//
+	// memory the connections added on top of the idle server
+	//
+	int nConnections = g_nConnections;
+	long nResident = GetResidentBytes();
+
+	printf("Connections: %d  resident: %.1f MB  (%.2f KB per connection)\n",
+		nConnections, nResident / (1024.0 * 1024.0),
+		nConnections ? (nResident - g_nBaseResident) / 1024.0 / nConnections : 0.0);
+	fflush(stdout);
+}
+
+//
+//  Arm the timeout that wakes the worker to advance its idle timers.  The first
+//  call starts the worker's clock.
+//
+bool PostTimer(PWORKER_CONTEXT lpWorker) {
+
+	io_uring_sqe* sqe = lpWorker->Ring.GetSqe();
+
+	if (sqe == NULL) {
+		LOG_ERROR(g_Log, "io_uring submission queue is full, failed to post timeout");
+		return(false);
+	}
+
+	if (lpWorker->TimerContext.IOOperation != ClientIoTimer) {
+		lpWorker->Timers.Init(NowMs());
+		lpWorker->TimerContext.IOOperation = ClientIoTimer;
+		lpWorker->TimerContext.pSocketContext = NULL;
+		lpWorker->TimerInterval.tv_sec = 0;
+		lpWorker->TimerInterval.tv_nsec = IDLE_CHECK_MS * 1000000ll;
+	}
+
+	IoUringPrepTimeout(sqe, &lpWorker->TimerInterval, (uint64_t)(uintptr_t)&lpWorker->TimerContext);
+
+	return(true);
+}
+
+//
+//  Shut down every socket of this worker whose idle timer fired, and arm the
+//  timeout again.  The socket is only shut down here: the recv it has posted
+//  completes with 0, or the send with an error, and that closes it as usual.
+//
+void CheckIdle(PWORKER_CONTEXT lpWorker) {
+
+	TimerWheelEntry* pEntry = lpWorker->Timers.Advance(NowMs());
+	PPER_SOCKET_CONTEXT lpPerSocketContext = NULL;
+
+	while (pEntry) {
+		lpPerSocketContext = (PPER_SOCKET_CONTEXT)((char*)pEntry - offsetof(PER_SOCKET_CONTEXT, IdleTimer));
+		pEntry = pEntry->next;
+
+		LOG_DEBUG(g_Log, "WorkerThread %d: Socket(%d) idle for %d seconds, shutting down",
+			(int)(lpWorker - g_Workers), lpPerSocketContext->Socket, g_nIdleSeconds);
+		shutdown(lpPerSocketContext->Socket, SHUT_RDWR);
+		lpWorker->nIdleKicks++;
+	}
+
+	if (!PostTimer(lpWorker)) {
+		printf("Please shut down and reboot the server.\n");
+		kill(getpid(), SIGTERM);
+	}
+}
+
+//
+//  Milliseconds on the monotonic clock, the tick of the idle timers.
+//
+uint64_t NowMs(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+//
+//  Resident set size of the process in bytes.
+//
+long GetResidentBytes(void) {
+
+	long nPages = 0;
+	FILE* fp = fopen("/proc/self/statm", "r");
+
+	if (fp) {
+		if (fscanf(fp, "%*s %ld", &nPages) != 1)
+			nPages = 0;
+		fclose(fp);
+	}
+
+	return(nPages * sysconf(_SC_PAGESIZE));
+}
+
+//
+// Queue a recv into the next segment of the socket's i/o context.  It is handed to the kernel the next
+// time the owning worker waits for completions.
+//
+bool PostRecv(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_IO_CONTEXT lpIOContext = lpPerSocketContext->pIOContext;
+	io_uring_sqe* sqe = lpPerSocketContext->pRing->GetSqe();
+
+	if (sqe == NULL) {
+		LOG_ERROR(g_Log, "io_uring submission queue is full, failed to post recv");
+		return(false);
+	}
+
+	lpIOContext->IOOperation = ClientIoRead;
+	if (g_bSharedBuffers)
+		IoUringPrepRecvSelect(sqe, lpPerSocketContext->Socket, URING_BUFFER_GROUP,
+			(uint64_t)(uintptr_t)lpIOContext);
+	else
+		IoUringPrepRecv(sqe, lpPerSocketContext->Socket, lpIOContext->Buffers[lpIOContext->nSegments], MAX_BUFF_SIZE,
+			(uint64_t)(uintptr_t)lpIOContext);
+
+	return(true);
+}
+
+//
+// Queue one gathered send of every segment of the socket's i/o context, an iovec
+// per segment, less the nSentBytes a previous send already sent.
+//
+bool PostSend(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_IO_CONTEXT lpIOContext = lpPerSocketContext->pIOContext;
+	io_uring_sqe* sqe = lpPerSocketContext->pRing->GetSqe();
+	int nSkip = lpIOContext->nSentBytes;
+	int nIov = 0;
+
+	if (sqe == NULL) {
+		LOG_ERROR(g_Log, "io_uring submission queue is full, failed to post send");
+		return(false);
+	}
+
+	for (int i = 0; i < lpIOContext->nSegments; i++) {
+		if (nSkip >= lpIOContext->nLengths[i]) {
+			nSkip -= lpIOContext->nLengths[i];
+			continue;
+		}
+		lpIOContext->SendIov[nIov].iov_base = lpIOContext->Buffers[i] + nSkip;
+		lpIOContext->SendIov[nIov].iov_len = lpIOContext->nLengths[i] - nSkip;
+		nSkip = 0;
+		nIov++;
+	}
+	memset(&lpIOContext->SendMsg, 0, sizeof(lpIOContext->SendMsg));
+	lpIOContext->SendMsg.msg_iov = lpIOContext->SendIov;
+	lpIOContext->SendMsg.msg_iovlen = nIov;
+
+	lpIOContext->IOOperation = ClientIoWrite;
+	IoUringPrepSendMsg(sqe, lpPerSocketContext->Socket, &lpIOContext->SendMsg,
+		(uint64_t)(uintptr_t)lpIOContext);
+
+	return(true);
+}
+
+//
+// Blocking baseline: accept on the main listening socket and serve each
+// connection on its own thread with plain recv/send.
+//
+void* RunBlockingServer(void* Context) {
+
+	(void)Context;
+
+	while (!g_bEndServer) {
+		int sdAccept = accept(g_sdListen, NULL, NULL);
+		if (sdAccept == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (!g_bEndServer)
+				LOG_WARNING(g_Log, "accept() failed: %d", errno);
+			break;
+		}
+
+		int nOne = 1;
+		setsockopt(sdAccept, IPPROTO_TCP, TCP_NODELAY, (char*)&nOne, sizeof(nOne));
+
+		pthread_t hThread;
+		if (pthread_create(&hThread, NULL, BlockingEchoThread, (void*)(intptr_t)sdAccept) != 0) {
+			LOG_ERROR(g_Log, "pthread_create() failed to create echo thread");
+			close(sdAccept);
+			continue;
+		}
+		pthread_detach(hThread);
+	}
+
+	return(NULL);
+}
+
+void* BlockingEchoThread(void* Context) {
+
+	int sd = (int)(intptr_t)Context;
+	char Buffer[MAX_BUFF_SIZE];
+
+	while (true) {
+		ssize_t nRecv = recv(sd, Buffer, sizeof(Buffer), 0);
+		if (nRecv <= 0)
+			break;
+
+		ssize_t nSent = 0;
+		while (nSent < nRecv) {
+			ssize_t n = send(sd, Buffer + nSent, nRecv - nSent, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			nSent += n;
+		}
+		if (nSent < nRecv)
+			break;
+	}
+
+	close(sd);
+	return(NULL);
+}
+
+//
+//  Close down a connection with a client.  Only one i/o is ever outstanding per
+//  connection and it has just completed, so the context can be released at once.
+//
+void CloseClient(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	if (lpPerSocketContext) {
+		LOG_DEBUG(g_Log, "CloseClient: Socket(%d) connection closing", lpPerSocketContext->Socket);
+
+		close(lpPerSocketContext->Socket);
+		lpPerSocketContext->Socket = -1;
+		lpPerSocketContext->pWorker->Timers.Cancel(&lpPerSocketContext->IdleTimer);
+		CtxtReleaseBuffer(lpPerSocketContext);
+		CtxtListDeleteFrom(lpPerSocketContext);
+		CtxtFree(lpPerSocketContext);
+	}
+	else {
+		LOG_ERROR(g_Log, "CloseClient: lpPerSocketContext is NULL");
+	}
+}
+
+//
+// Take a socket context for the new connection from this thread's free list.  A
+// connection is closed by the worker that accepted it, so a worker allocates from
+// and releases to its own list and never needs a lock.  The payload buffers are
+// handed out as they were left: every read overwrites one before it is echoed.
+//
+PPER_SOCKET_CONTEXT CtxtAllocate(int sd, PWORKER_CONTEXT lpWorker, IO_OPERATION ClientIO) {
+
+	PPER_SOCKET_CONTEXT lpPerSocketContext;
+
+	if (t_pCtxtFreeList == NULL && !CtxtSlabAllocate())
+		return(NULL);
+
+	lpPerSocketContext = t_pCtxtFreeList;
+	t_pCtxtFreeList = lpPerSocketContext->pCtxtForward;
+
+	lpPerSocketContext->Socket = sd;
+	lpPerSocketContext->pRing = &lpWorker->Ring;
+	lpPerSocketContext->pWorker = lpWorker;
+	lpPerSocketContext->pStarvedForward = NULL;
+	TimerWheel::InitEntry(&lpPerSocketContext->IdleTimer);
+	lpPerSocketContext->pCtxtBack = NULL;
+	lpPerSocketContext->pCtxtForward = NULL;
+
+	lpPerSocketContext->pIOContext->IOOperation = ClientIO;
+	lpPerSocketContext->pIOContext->pSocketContext = lpPerSocketContext;
+	lpPerSocketContext->pIOContext->pIOContextForward = NULL;
+	lpPerSocketContext->pIOContext->nSegments = 0;
+	lpPerSocketContext->pIOContext->nTotalBytes = 0;
+	lpPerSocketContext->pIOContext->nSentBytes = 0;
+
+	return(lpPerSocketContext);
+}
+
+//
+// Empty the segments of the socket.  Every shared buffer it holds goes back to
+// its worker's buffer ring, and for each one the oldest socket that found the
+// ring empty tries again.
+//
+void CtxtReleaseBuffer(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	PPER_IO_CONTEXT lpIOContext = lpPerSocketContext->pIOContext;
+	PWORKER_CONTEXT lpWorker = lpPerSocketContext->pWorker;
+	PPER_SOCKET_CONTEXT lpStarved = NULL;
+
+	lpIOContext->nSegments = 0;
+	lpIOContext->nTotalBytes = 0;
+	if (!g_bSharedBuffers)
+		return;
+
+	for (int i = 0; i < SEND_QUEUE_SLOTS; i++) {
+		if (lpIOContext->nBufferIds[i] < 0)
+			continue;
+
+		lpWorker->BufRing.Recycle((unsigned short)lpIOContext->nBufferIds[i]);
+		lpIOContext->nBufferIds[i] = -1;
+		lpIOContext->Buffers[i] = NULL;
+
+		//
+		// nothing may be submitted once the main thread has started tearing down the rings
+		//
+		lpStarved = lpWorker->pStarvedHead;
+		if (lpStarved && !g_bEndServer) {
+			lpWorker->pStarvedHead = lpStarved->pStarvedForward;
+			if (lpWorker->pStarvedHead == NULL)
+				lpWorker->pStarvedTail = NULL;
+			lpStarved->pStarvedForward = NULL;
+
+			if (!PostRecv(lpStarved))
+				CloseClient(lpStarved);
+		}
+	}
+}
+
+//
+// Return a socket context, together with its i/o context, to this thread's free list.
+//
+void CtxtFree(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	lpPerSocketContext->pCtxtForward = t_pCtxtFreeList;
+	t_pCtxtFreeList = lpPerSocketContext;
+}
+
+//
+// Carve a new slab of preconstructed contexts onto this thread's free list.  The
+// slab is allocated with malloc rather than calloc so the payload buffers stay
+// untouched until they are first used.
+//
+bool CtxtSlabAllocate(void) {
+
+	//
+	// without shared buffers every context keeps its own segments, carved out of
+	// the same slab right behind the contexts; a segment past the first is only
+	// touched when a burst needs it
+	//
+	size_t nBufferBytes = g_bSharedBuffers ? 0 : (size_t)CTXT_SLAB_COUNT * SEND_QUEUE_SLOTS * MAX_BUFF_SIZE;
+	PCTXT_SLAB pSlab = (PCTXT_SLAB)malloc(sizeof(CTXT_SLAB) + nBufferBytes);
+
+	if (pSlab == NULL) {
+		LOG_ERROR(g_Log, "malloc() CTXT_SLAB failed: %d", errno);
+		return(false);
+	}
+
+	for (int i = CTXT_SLAB_COUNT - 1; i >= 0; i--) {
+		for (int j = 0; j < SEND_QUEUE_SLOTS; j++) {
+			pSlab->IOContext[i].Buffers[j] = nBufferBytes ?
+				(char*)(pSlab + 1) + ((size_t)i * SEND_QUEUE_SLOTS + j) * MAX_BUFF_SIZE : NULL;
+			pSlab->IOContext[i].nBufferIds[j] = -1;
+		}
+		pSlab->SocketContext[i].pIOContext = &pSlab->IOContext[i];
+		pSlab->SocketContext[i].pCtxtForward = t_pCtxtFreeList;
+		t_pCtxtFreeList = &pSlab->SocketContext[i];
+	}
+
+	//
+	// the slab list is only walked at exit; push without a lock
+	//
+	pSlab->pSlabNext = __atomic_load_n(&g_pCtxtSlabs, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&g_pCtxtSlabs, &pSlab->pSlabNext, pSlab,
+		true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+	return(true);
+}
+
+//
+// Release every slab.  Only called once the workers have exited and every
+// context has been freed.
+//
+void CtxtSlabFreeAll(void) {
+
+	PCTXT_SLAB pSlab = g_pCtxtSlabs;
+
+	while (pSlab) {
+		PCTXT_SLAB pSlabNext = pSlab->pSlabNext;
+		free(pSlab);
+		pSlab = pSlabNext;
+	}
+	g_pCtxtSlabs = NULL;
+	t_pCtxtFreeList = NULL;
+}
+
+//
+//  Add a client connection context structure to the global list of context structures.
+//
+void CtxtListAddTo(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	pthread_mutex_lock(&g_CriticalSection);
+
+	//
+	// add node to head of list
+	//
+	lpPerSocketContext->pCtxtBack = g_pCtxtList;
+	lpPerSocketContext->pCtxtForward = NULL;
+	if (g_pCtxtList)
+		g_pCtxtList->pCtxtForward = lpPerSocketContext;
+	g_pCtxtList = lpPerSocketContext;
+	g_nConnections++;
+
+	pthread_mutex_unlock(&g_CriticalSection);
+}
+
+//
+//  Remove a client context structure from the global list of context structures.
+//
+void CtxtListDeleteFrom(PPER_SOCKET_CONTEXT lpPerSocketContext) {
+
+	pthread_mutex_lock(&g_CriticalSection);
+
+	PPER_SOCKET_CONTEXT pBack = lpPerSocketContext->pCtxtBack;
+	PPER_SOCKET_CONTEXT pForward = lpPerSocketContext->pCtxtForward;
+
+	if (pBack)
+		pBack->pCtxtForward = pForward;
+	if (pForward)
+		pForward->pCtxtBack = pBack;
+	else
+		g_pCtxtList = pBack;
+	g_nConnections--;
+
+	lpPerSocketContext->pCtxtBack = NULL;
+	lpPerSocketContext->pCtxtForward = NULL;
+
+	pthread_mutex_unlock(&g_CriticalSection);
+}
+
+//
+//  Free all context structure in the global list of context structures.  Only
+//  called once the workers have exited.
+//
+void CtxtListFree() {
+
+	PPER_SOCKET_CONTEXT pTemp1, pTemp2;
+
+	pTemp1 = g_pCtxtList;
+	while (pTemp1) {
+		pTemp2 = pTemp1->pCtxtBack;
+		CloseClient(pTemp1);
+		pTemp1 = pTemp2;
+	}
+}
@@ -0,0 +1,225 @@
+//
+// Module:
+//      uringserver.h
+//
+
+#ifndef URINGSERVER_H
+#define URINGSERVER_H
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "IoUring.h"
+#include "TimerWheel.h"
+
+#define DEFAULT_PORT        "5001"
+#define DEFAULT_LOG_FILE    "uringserver.log"
+#define MAX_BUFF_SIZE       8192
+#define MAX_WORKER_THREAD   128
+#define URING_ENTRIES       1024
+#define MAX_DRAIN_BATCH     256
+#define CTXT_SLAB_COUNT     64
+#define SHARED_BUFFERS      1024            // default receive buffers per worker with -i
+#define URING_BUFFER_GROUP  0
+#define IDLE_CHECK_MS       100             // how often a worker looks for idle sockets (-k)
+#define SEND_QUEUE_SLOTS    4               // recvs a connection gathers into one sendmsg
+
+typedef enum _IO_OPERATION {
+    ClientIoAccept,
+    ClientIoRead,
+    ClientIoWrite,
+    ClientIoTimer
+} IO_OPERATION, * PIO_OPERATION;
+
+struct _PER_SOCKET_CONTEXT;
+struct _WORKER_CONTEXT;
+
+//
+// data to be associated for every I/O operation on a socket
+//
+// io_uring has no completion key, so the user_data of every submission is
+// the PER_IO_CONTEXT and the owning socket context is reached through
+// pSocketContext.  A user_data of 0 plays the role of the NULL completion key
+// and tells the worker to exit.
+//
+// A connection echoes in segments: every recv fills the next of Buffers, and
+// while the kernel says the socket has more to read (IORING_CQE_F_SOCK_NONEMPTY)
+// another recv is posted into the one after it.  Then all nSegments go back in
+// one IORING_OP_SENDMSG through SendIov and SendMsg, which must stay put until
+// the send completes.
+//
+// Every segment normally points at MAX_BUFF_SIZE bytes carved out of the
+// context's slab together with it.  With shared buffers (-i) a segment is NULL
+// until data arrives, and points at the shared buffer nBufferIds of the worker's
+// buffer group from then on until it has been echoed.
+//
+typedef struct _PER_IO_CONTEXT {
+    char*                       Buffers[SEND_QUEUE_SLOTS];
+    int                         nBufferIds[SEND_QUEUE_SLOTS];  // -1 unless a shared buffer
+    int                         nLengths[SEND_QUEUE_SLOTS];
+    int                         nSegments;      // segments holding data
+    int                         nTotalBytes;    // of every segment
+    int                         nSentBytes;
+    struct iovec                SendIov[SEND_QUEUE_SLOTS];
+    struct msghdr               SendMsg;
+    IO_OPERATION                IOOperation;
+
+    struct _PER_SOCKET_CONTEXT* pSocketContext;
+    struct _PER_IO_CONTEXT*     pIOContextForward;
+} PER_IO_CONTEXT, * PPER_IO_CONTEXT;
+
+//
+// data to be associated with every socket owned by a ring
+//
+typedef struct _PER_SOCKET_CONTEXT {
+    int                         Socket;
+
+    //
+    // ring of the worker that owns every i/o on this socket
+    //
+    IoUring*                    pRing;
+    struct _WORKER_CONTEXT*     pWorker;
+
+    //
+    // next socket waiting for a shared buffer, see CtxtReleaseBuffer
+    //
+    struct _PER_SOCKET_CONTEXT* pStarvedForward;
+
+    //
+    // restarted whenever data arrives; when it fires the socket has been silent
+    // for g_nIdleSeconds and is shut down (-k)
+    //
+    TimerWheelEntry             IdleTimer;
+
+    //
+    //linked list for all outstanding i/o on the socket
+    //
+    PPER_IO_CONTEXT             pIOContext;
+    struct _PER_SOCKET_CONTEXT* pCtxtBack;
+    struct _PER_SOCKET_CONTEXT* pCtxtForward;
+} PER_SOCKET_CONTEXT, * PPER_SOCKET_CONTEXT;
+
+//
+// contexts are carved out of slabs, each socket context paired with the i/o
+// context that follows it through its life, and are recycled instead of being
+// returned to the heap.  A free context is chained through pCtxtForward on the
+// free list of the thread that released it.
+//
+typedef struct _CTXT_SLAB {
+    struct _CTXT_SLAB*          pSlabNext;
+    PER_SOCKET_CONTEXT          SocketContext[CTXT_SLAB_COUNT];
+    PER_IO_CONTEXT              IOContext[CTXT_SLAB_COUNT];
+} CTXT_SLAB, * PCTXT_SLAB;
+
+//
+// every worker owns one ring and keeps one accept outstanding on it
+//
+typedef struct _WORKER_CONTEXT {
+    IoUring                     Ring;
+    IoUringBufRing              BufRing;        // shared receive buffers with -i
+    PPER_SOCKET_CONTEXT         pCtxtListenSocket;
+
+    //
+    // sockets whose recv found every shared buffer in use, oldest first
+    //
+    PPER_SOCKET_CONTEXT         pStarvedHead;
+    PPER_SOCKET_CONTEXT         pStarvedTail;
+
+    //
+    // the idle timers of this worker's sockets, in milliseconds, and the timeout
+    // that wakes the worker every IDLE_CHECK_MS to advance them (-k)
+    //
+    TimerWheel                  Timers;
+    PER_IO_CONTEXT              TimerContext;
+    __kernel_timespec           TimerInterval;
+
+    pthread_t                   hThread;
+    bool                        bStarted;
+
+    //
+    // only written by the worker; read without a lock for statistics
+    //
+    alignas(64) volatile uint64_t nCompletions;     // completions handled
+    volatile uint64_t           nDequeueCalls;      // io_uring_enter calls that waited
+    volatile uint64_t           nIdleKicks;         // sockets shut down for being idle
+    volatile uint64_t           nSends;             // sendmsg completions that sent anything
+    volatile uint64_t           nSendMessages;      // recvs echoed by those sends
+} WORKER_CONTEXT, * PWORKER_CONTEXT;
+
+bool ValidOptions(int argc, char* argv[]);
+
+bool CreateListenSocket(void);
+
+bool CreateAcceptSocket(
+    PWORKER_CONTEXT lpWorker
+);
+
+void* WorkerThread(
+    void* WorkContext
+);
+
+void* BlockingEchoThread(
+    void* Context
+);
+
+bool PostTimer(
+    PWORKER_CONTEXT lpWorker
+);
+
+void CheckIdle(
+    PWORKER_CONTEXT lpWorker
+);
+
+uint64_t NowMs(void);
+
+void PrintWorkerStats(void);
+
+long GetResidentBytes(void);
+
+void* RunBlockingServer(
+    void* Context
+);
+
+bool PostRecv(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+bool PostSend(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+void CloseClient(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+PPER_SOCKET_CONTEXT CtxtAllocate(
+    int s,
+    PWORKER_CONTEXT lpWorker,
+    IO_OPERATION ClientIO
+);
+
+void CtxtReleaseBuffer(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+void CtxtFree(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+bool CtxtSlabAllocate(void);
+
+void CtxtSlabFreeAll(void);
+
+void CtxtListFree(
+);
+
+void CtxtListAddTo(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+void CtxtListDeleteFrom(
+    PPER_SOCKET_CONTEXT lpPerSocketContext
+);
+
+#endif
@@ -0,0 +1,339 @@
+//
+// Module:
+//      broadcastbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Fan-out microbenchmark of the room broadcast in iocpserverex (-r).  Every
+//      tick a number of PositionUpdate messages are built with their Builder and
+//      each one is queued for every member of a room, the way RoomBroadcast does:
+//      on a send queue per session that holds SEND_QUEUE_SLOTS messages.  After
+//      the tick every queue is gathered into one send, as PostSend does, and the
+//      completion releases what was sent.  The server itself needs Windows, so
+//      this runs the same queueing in one process with the socket left out.
+//
+//      The fan-out is done twice: once copying the message into a buffer of its
+//      own for every recipient, as the echo path used to, and once queueing one
+//      reference-counted buffer on every recipient.  Reported are queued messages
+//      per second, CPU time per recipient, and the share of one core a room takes
+//      at the tick rate.  The bytes every session "sent" are checked to be the
+//      same in both, otherwise the exit code is 1.
+//
+//          broadcastbench -n:1000 -m:16 -z:20
+//
+//  Build:
+//      g++ -O2 -std=c++14 -I../NetworkLibrary BroadcastBench.cpp ../NetworkLibrary/PacketRingBuffer.cpp -o broadcastbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "WireSchema.h"
+
+#define SEND_QUEUE_SLOTS    32
+#define MAX_SEND_WSABUF     16
+
+typedef struct _OPTIONS {
+	int nSessions;
+	int nMessages;
+	int nTicks;
+	int nTickRate;
+	int nRounds;
+} OPTIONS;
+
+//
+// the server's SEND_BUFFER: immutable once queued, freed by the last release
+//
+typedef struct _SEND_BUFFER {
+	volatile long nRefs;
+	int nLength;
+	char Data[1];
+} SEND_BUFFER;
+
+//
+// the part of PER_SOCKET_CONTEXT the send path uses
+//
+typedef struct _SESSION {
+	SEND_BUFFER* SendQueue[SEND_QUEUE_SLOTS];
+	unsigned nSendHead;
+	unsigned nSendCount;
+	uint64_t nSentBytes;
+	uint64_t nChecksum;
+	uint64_t nDropped;
+} SESSION;
+
+static OPTIONS default_options = { 1000, 16, 200, 20, 5 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static SEND_BUFFER* SendBufferAlloc(int nLength) {
+	SEND_BUFFER* pSendBuffer = (SEND_BUFFER*)malloc(offsetof(SEND_BUFFER, Data) + nLength);
+
+	if (pSendBuffer == NULL) {
+		printf("malloc() failed\n");
+		exit(1);
+	}
+	pSendBuffer->nRefs = 1;
+	pSendBuffer->nLength = nLength;
+	return(pSendBuffer);
+}
+
+static void SendBufferRelease(SEND_BUFFER* pSendBuffer) {
+	if (__atomic_sub_fetch(&pSendBuffer->nRefs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(pSendBuffer);
+}
+
+//
+// SessionQueue without the lock, which is never contended here either
+//
+static bool SessionQueue(SESSION* pSession, SEND_BUFFER* pSendBuffer) {
+	if (pSession->nSendCount == SEND_QUEUE_SLOTS) {
+		pSession->nDropped++;
+		return(false);
+	}
+	__atomic_add_fetch(&pSendBuffer->nRefs, 1, __ATOMIC_RELAXED);
+	pSession->SendQueue[(pSession->nSendHead + pSession->nSendCount) % SEND_QUEUE_SLOTS] = pSendBuffer;
+	pSession->nSendCount++;
+	return(true);
+}
+
+//
+// gather up to MAX_SEND_WSABUF messages into one "send" that completes in full,
+// then take them off the queue and release them, as PostSend and the write
+// completion do; repeated until the queue is empty
+//
+static void SessionFlush(SESSION* pSession) {
+	while (pSession->nSendCount) {
+		unsigned nBuffers = pSession->nSendCount < MAX_SEND_WSABUF ? pSession->nSendCount : MAX_SEND_WSABUF;
+
+		for (unsigned i = 0; i < nBuffers; i++) {
+			SEND_BUFFER* pSendBuffer = pSession->SendQueue[pSession->nSendHead];
+
+			pSession->nSentBytes += pSendBuffer->nLength;
+			pSession->nChecksum += (unsigned char)pSendBuffer->Data[pSendBuffer->nLength - 1];
+			pSession->nSendHead = (pSession->nSendHead + 1) % SEND_QUEUE_SLOTS;
+			pSession->nSendCount--;
+			SendBufferRelease(pSendBuffer);
+		}
+	}
+}
+
+static void BuildPosition(char* pPacket, uint32_t nEntityId, uint32_t nTick) {
+	PositionUpdate::Builder(pPacket)
+		.SetEntityId(nEntityId)
+		.SetTick(nTick)
+		.SetX((float)nEntityId)
+		.SetY((float)nTick)
+		.SetZ(1.0f)
+		.SetYaw((float)(nEntityId & 0xff));
+}
+
+//
+// one tick: every message is built once, then queued for every session either
+// as a copy of its own or as a reference to the one buffer
+//
+static void Tick(SESSION* pSessions, uint32_t nTick, bool bShared) {
+	char Packet[PositionUpdate::PacketSize];
+
+	for (int m = 0; m < g_Options.nMessages; m++) {
+		BuildPosition(Packet, (uint32_t)m, nTick);
+
+		if (bShared) {
+			SEND_BUFFER* pSendBuffer = SendBufferAlloc(PositionUpdate::PacketSize);
+
+			memcpy(pSendBuffer->Data, Packet, PositionUpdate::PacketSize);
+			for (int s = 0; s < g_Options.nSessions; s++)
+				SessionQueue(&pSessions[s], pSendBuffer);
+			SendBufferRelease(pSendBuffer);
+		}
+		else {
+			for (int s = 0; s < g_Options.nSessions; s++) {
+				SEND_BUFFER* pSendBuffer = SendBufferAlloc(PositionUpdate::PacketSize);
+
+				memcpy(pSendBuffer->Data, Packet, PositionUpdate::PacketSize);
+				SessionQueue(&pSessions[s], pSendBuffer);
+				SendBufferRelease(pSendBuffer);
+			}
+		}
+
+		//
+		// sends complete while the tick goes on; a queue is flushed once it has
+		// a full gather's worth
+		//
+		if ((m + 1) % MAX_SEND_WSABUF == 0)
+			for (int s = 0; s < g_Options.nSessions; s++)
+				SessionFlush(&pSessions[s]);
+	}
+
+	for (int s = 0; s < g_Options.nSessions; s++)
+		SessionFlush(&pSessions[s]);
+}
+
+//
+// run every tick, keeping the best CPU time of g_Options.nRounds
+//
+static uint64_t Run(SESSION* pSessions, bool bShared, uint64_t* pnWallNs) {
+	uint64_t nBestNs = 0;
+
+	for (int r = 0; r < g_Options.nRounds; r++) {
+		memset(pSessions, 0, sizeof(SESSION) * g_Options.nSessions);
+
+		uint64_t nWallStart = NowNs(CLOCK_MONOTONIC);
+		uint64_t nStart = NowNs(CLOCK_PROCESS_CPUTIME_ID);
+		for (int t = 0; t < g_Options.nTicks; t++)
+			Tick(pSessions, (uint32_t)t, bShared);
+		uint64_t nNs = NowNs(CLOCK_PROCESS_CPUTIME_ID) - nStart;
+		uint64_t nWallNs = NowNs(CLOCK_MONOTONIC) - nWallStart;
+
+		if (nBestNs == 0 || nNs < nBestNs) {
+			nBestNs = nNs;
+			*pnWallNs = nWallNs;
+		}
+	}
+	return(nBestNs);
+}
+
+static void Report(const char* szName, uint64_t nNs, uint64_t nWallNs) {
+	double dQueued = (double)g_Options.nTicks * g_Options.nMessages * g_Options.nSessions;
+	double dTickNs = (double)nNs / g_Options.nTicks;
+
+	printf("%-14s %10.0f messages/s  %6.2f ns CPU per recipient  %8.1f us per tick  %5.1f%% of a core at %d Hz\n",
+		szName, dQueued / (nWallNs / 1e9), nNs / dQueued, dTickNs / 1e3,
+		dTickNs * g_Options.nTickRate / 1e7, g_Options.nTickRate);
+}
+
+int main(int argc, char* argv[]) {
+
+	SESSION* pCopied = NULL;
+	SESSION* pShared = NULL;
+	uint64_t nWallNs = 0;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	pCopied = (SESSION*)calloc(g_Options.nSessions, sizeof(SESSION));
+	pShared = (SESSION*)calloc(g_Options.nSessions, sizeof(SESSION));
+	if (pCopied == NULL || pShared == NULL) {
+		printf("calloc() failed\n");
+		return(1);
+	}
+
+	printf("recipients: %d  messages per tick: %d  ticks: %d  rounds: %d  message: %d bytes\n",
+		g_Options.nSessions, g_Options.nMessages, g_Options.nTicks, g_Options.nRounds,
+		PositionUpdate::PacketSize);
+
+	uint64_t nNs = Run(pCopied, false, &nWallNs);
+	Report("copy each", nNs, nWallNs);
+	nNs = Run(pShared, true, &nWallNs);
+	Report("shared buffer", nNs, nWallNs);
+
+	for (int s = 0; s < g_Options.nSessions; s++) {
+		if (pCopied[s].nSentBytes != pShared[s].nSentBytes ||
+			pCopied[s].nChecksum != pShared[s].nChecksum ||
+			pCopied[s].nDropped || pShared[s].nDropped ||
+			pShared[s].nSentBytes != (uint64_t)g_Options.nTicks * g_Options.nMessages * PositionUpdate::PacketSize) {
+			printf("session %d sent %llu/%llu bytes, dropped %llu/%llu\n", s,
+				(unsigned long long)pCopied[s].nSentBytes, (unsigned long long)pShared[s].nSentBytes,
+				(unsigned long long)pCopied[s].nDropped, (unsigned long long)pShared[s].nDropped);
+			nFailures++;
+			break;
+		}
+	}
+
+	free(pCopied);
+	free(pShared);
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nSessions = atoi(&argv[i][3]);
+				break;
+
+			case 'm':
+				if (strlen(argv[i]) > 3)
+					g_Options.nMessages = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nTicks = atoi(&argv[i][3]);
+				break;
+
+			case 'z':
+				if (strlen(argv[i]) > 3)
+					g_Options.nTickRate = atoi(&argv[i][3]);
+				break;
+
+			case 'r':
+				if (strlen(argv[i]) > 3)
+					g_Options.nRounds = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nSessions < 1 || g_Options.nMessages < 1 || g_Options.nTicks < 1 ||
+		g_Options.nTickRate < 1 || g_Options.nRounds < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-n:#] [-m:#] [-t:#] [-z:#] [-r:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -n:#\t\tRecipients in the room (Def:%d)\n",
+		pOptions->nSessions);
+	printf("  -m:#\t\tMessages broadcast per tick (Def:%d)\n",
+		pOptions->nMessages);
+	printf("  -t:#\t\tTicks per round (Def:%d)\n",
+		pOptions->nTicks);
+	printf("  -z:#\t\tTick rate in Hz, for the share of a core (Def:%d)\n",
+		pOptions->nTickRate);
+	printf("  -r:#\t\tRounds, the best one is reported (Def:%d)\n",
+		pOptions->nRounds);
+}
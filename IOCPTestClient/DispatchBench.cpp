@@ -0,0 +1,253 @@
+//
+// Module:
+//      dispatchbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Microbenchmark of packet dispatch.  The same handlers are reached once
+//      through the compile-time table of PacketDispatch.h and once through the
+//      usual std::unordered_map<id, std::function>, for a stream of packets with
+//      random ids.  Both paths copy the payload out of the packet the same way, so
+//      the difference is the cost of finding and calling the handler.  Both must
+//      produce the same result, otherwise the exit code is 1.
+//
+//          dispatchbench -n:1000000 -k:32
+//
+//  Build:
+//      g++ -O2 -std=c++14 -I../NetworkLibrary DispatchBench.cpp -o dispatchbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <functional>
+#include <unordered_map>
+
+#include "PacketDispatch.h"
+
+#define PACKET_KINDS    32
+
+typedef struct _OPTIONS {
+	int nPackets;
+	int nKinds;
+	int nRounds;
+	unsigned nSeed;
+} OPTIONS;
+
+typedef struct _BENCH_CONTEXT {
+	uint64_t nSum;
+} BENCH_CONTEXT;
+
+static OPTIONS default_options = { 1000000, PACKET_KINDS, 5, 1 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+//
+// PACKET_KINDS payload types that differ only in their id, each with its own
+// handler, so neither path can fold the handlers into one
+//
+template <int N>
+struct BenchPacket {
+	static const uint16_t Id = N;
+	uint32_t nValue;
+};
+
+template <int N>
+static bool OnBenchPacket(BENCH_CONTEXT& Context, const BenchPacket<N>& Packet) {
+	Context.nSum += (uint64_t)Packet.nValue * (N + 1);
+	return(true);
+}
+
+template <int N>
+using BenchBind = PacketBind<BenchPacket<N>, BENCH_CONTEXT, OnBenchPacket<N>>;
+
+static constexpr auto g_Dispatch = MakePacketDispatchTable<BENCH_CONTEXT,
+	BenchBind<0>, BenchBind<1>, BenchBind<2>, BenchBind<3>,
+	BenchBind<4>, BenchBind<5>, BenchBind<6>, BenchBind<7>,
+	BenchBind<8>, BenchBind<9>, BenchBind<10>, BenchBind<11>,
+	BenchBind<12>, BenchBind<13>, BenchBind<14>, BenchBind<15>,
+	BenchBind<16>, BenchBind<17>, BenchBind<18>, BenchBind<19>,
+	BenchBind<20>, BenchBind<21>, BenchBind<22>, BenchBind<23>,
+	BenchBind<24>, BenchBind<25>, BenchBind<26>, BenchBind<27>,
+	BenchBind<28>, BenchBind<29>, BenchBind<30>, BenchBind<31>>();
+
+static_assert(g_Dispatch.Count() == PACKET_KINDS, "one table entry per packet kind");
+
+typedef std::unordered_map<uint16_t, std::function<bool(BENCH_CONTEXT&, const PacketView&)>> HANDLER_MAP;
+
+template <int N>
+static void MapBind(HANDLER_MAP& Map) {
+	Map[N] = [](BENCH_CONTEXT& Context, const PacketView& View) {
+		BenchPacket<N> Packet;
+
+		if (View.bodyLength != sizeof(Packet))
+			return(false);
+		memcpy(&Packet, View.body, sizeof(Packet));
+		return(OnBenchPacket<N>(Context, Packet));
+	};
+}
+
+template <int... N>
+static void MapBindAll(HANDLER_MAP& Map, std::integer_sequence<int, N...>) {
+	const int unused[] = { (MapBind<N>(Map), 0)... };
+	(void)unused;
+}
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+int main(int argc, char* argv[]) {
+
+	PacketView* pViews = NULL;
+	uint32_t* pBodies = NULL;
+	HANDLER_MAP Map;
+	BENCH_CONTEXT TableContext = { 0 };
+	BENCH_CONTEXT MapContext = { 0 };
+	uint64_t nTableNs = 0;
+	uint64_t nMapNs = 0;
+	uint64_t nStart = 0;
+	uint64_t nRejected = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	MapBindAll(Map, std::make_integer_sequence<int, PACKET_KINDS>());
+
+	srand(g_Options.nSeed);
+
+	pViews = (PacketView*)malloc(g_Options.nPackets * sizeof(PacketView));
+	pBodies = (uint32_t*)malloc(g_Options.nPackets * sizeof(uint32_t));
+	if (pViews == NULL || pBodies == NULL) {
+		printf("malloc() failed\n");
+		return(1);
+	}
+
+	for (int i = 0; i < g_Options.nPackets; i++) {
+		pBodies[i] = (uint32_t)rand();
+		pViews[i].id = (uint16_t)(rand() % g_Options.nKinds);
+		pViews[i].bodyLength = sizeof(uint32_t);
+		pViews[i].body = (const char*)&pBodies[i];
+	}
+
+	for (int r = 0; r < g_Options.nRounds; r++) {
+		TableContext.nSum = 0;
+		nStart = NowNs();
+		for (int i = 0; i < g_Options.nPackets; i++)
+			if (!g_Dispatch.Dispatch(TableContext, pViews[i]))
+				nRejected++;
+		nStart = NowNs() - nStart;
+		if (nTableNs == 0 || nStart < nTableNs)
+			nTableNs = nStart;
+
+		MapContext.nSum = 0;
+		nStart = NowNs();
+		for (int i = 0; i < g_Options.nPackets; i++) {
+			HANDLER_MAP::const_iterator it = Map.find(pViews[i].id);
+			if (it == Map.end() || !it->second(MapContext, pViews[i]))
+				nRejected++;
+		}
+		nStart = NowNs() - nStart;
+		if (nMapNs == 0 || nStart < nMapNs)
+			nMapNs = nStart;
+	}
+
+	printf("packets: %d  kinds: %d  rounds: %d\n", g_Options.nPackets, g_Options.nKinds, g_Options.nRounds);
+	printf("constexpr table:        %6.2f ns per packet  (%.0f packets/s)\n",
+		(double)nTableNs / g_Options.nPackets, g_Options.nPackets / (nTableNs / 1e9));
+	printf("unordered_map+function: %6.2f ns per packet  (%.0f packets/s)\n",
+		(double)nMapNs / g_Options.nPackets, g_Options.nPackets / (nMapNs / 1e9));
+
+	free(pViews);
+	free(pBodies);
+
+	if (nRejected || TableContext.nSum != MapContext.nSum) {
+		printf("results differ: table %llu  map %llu  rejected %llu\n",
+			(unsigned long long)TableContext.nSum, (unsigned long long)MapContext.nSum,
+			(unsigned long long)nRejected);
+		return(1);
+	}
+
+	return(0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'k':
+				if (strlen(argv[i]) > 3)
+					g_Options.nKinds = atoi(&argv[i][3]);
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPackets = atoi(&argv[i][3]);
+				break;
+
+			case 'r':
+				if (strlen(argv[i]) > 3)
+					g_Options.nRounds = atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.nSeed = (unsigned)atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nPackets < 1 || g_Options.nKinds < 1 || g_Options.nKinds > PACKET_KINDS ||
+		g_Options.nRounds < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-k:#] [-n:#] [-r:#] [-s:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -k:#\t\tNumber of packet kinds in the stream (Def:%d, max:%d)\n",
+		pOptions->nKinds, PACKET_KINDS);
+	printf("  -n:#\t\tNumber of packets dispatched per round (Def:%d)\n",
+		pOptions->nPackets);
+	printf("  -r:#\t\tRounds, the best one is reported (Def:%d)\n",
+		pOptions->nRounds);
+	printf("  -s:#\t\tRandom seed (Def:%u)\n",
+		pOptions->nSeed);
+}
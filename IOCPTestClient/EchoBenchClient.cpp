@@ -0,0 +1,876 @@
+//
+// Module:
+//      echobenchclient.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      This is the Linux load generator for uringserver and epollserver.  It works
+//      like iocpclient: every thread owns one connection, sends a buffer, waits for
+//      the server to echo it back in full and compares the first and last byte.
+//      Instead of running until CTRL-C it runs for a fixed time (-d) and then prints
+//      the echo rate, throughput and round trip latency, so the io_uring server and
+//      the blocking baseline (uringserver -b) can be compared on loopback:
+//
+//          uringserver -e:6001 &          echobenchclient -e:6001 -t:64 -d:10
+//          uringserver -e:6001 -b &       echobenchclient -e:6001 -t:64 -d:10
+//
+//      With -c every thread instead keeps opening a new connection, does a single
+//      echo on it and closes it again, which measures the connection rate the
+//      server can sustain.
+//
+//      With -s:# the client simulates a reconnect storm after a server restart:
+//      the threads open # connections between them as fast as they can, keep them
+//      all open, and each connection does a single echo.  The accepted connection
+//      rate is the number of echoed connections divided by the time until the last
+//      one was echoed, so connections the server refused, or left waiting in a full
+//      backlog for a SYN retransmit, show up directly:
+//
+//          uringserver -e:6001 -l:4096 &  echobenchclient -e:6001 -t:16 -s:10000
+//
+//      Adding -i:# holds the storm connections idle for # seconds before they are
+//      closed, long enough to read the server's resident memory per connection:
+//
+//          uringserver -e:6001 -i -s:5 &  echobenchclient -e:6001 -t:16 -s:10000 -i:15
+//
+//      With -x:command the client compares worker layouts of a server on this
+//      host.  For every layout it starts the command with -e's port and the
+//      layout's arguments, waits until the server accepts, runs the echo
+//      measurement and stops the server again (SIGINT, then SIGKILL if it is
+//      still running after 15 seconds).  It prints one row per layout with the
+//      echo rate, throughput, average and p99 round trip time, and the
+//      connections that failed.  Every -l:args adds a layout; without any, the
+//      -w, -c, -p and -o layouts of iocpserverex are swept for the processors of
+//      this host.  iocpserverex runs on Windows, so there the client is built
+//      with the g++ of MSYS2 or Cygwin; it shares the processors with the server,
+//      which every row pays for alike:
+//
+//          echobenchclient -e:6001 -t:64 -d:10 -x:./iocpserverex.exe
+//          echobenchclient -e:6001 -t:64 -x:./iocpserverex.exe -l:"-w:16 -c:16" -l:"-w:16 -c:16 -p:node"
+//
+//      The same works for the Linux servers with layouts they know, for example
+//      the io_uring server against its blocking baseline:
+//
+//          echobenchclient -e:6001 -t:64 -x:./uringserver -l: -l:-b
+//
+//      Latencies are kept in a LatencyHistogram (NetworkLibrary), so the p99 is
+//      within 1/32 of the true value.
+//
+//  Build:
+//      g++ -O2 -std=c++17 -I../NetworkLibrary EchoBenchClient.cpp ../NetworkLibrary/LatencyHistogram.cpp -lpthread -o echobenchclient
+//
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "LatencyHistogram.h"
+
+#define MAXTHREADS      1024
+#define MAXLAYOUTS      32
+#define MAXSERVERWORKERS    128	// MAX_WORKER_THREAD of iocpserverex
+#define SERVER_START_MS     10000	// time a server gets to accept its first connection
+#define SERVER_STOP_MS      15000	// time it gets to exit on SIGINT, drain included
+
+typedef struct _OPTIONS {
+	char szHostname[64];
+	const char* port;
+	int nTotalThreads;
+	int nBufSize;
+	int nSeconds;
+	int nStormConnections;
+	int nIdleSeconds;
+	bool bConnectMode;
+	bool bVerbose;
+	const char* szServerCommand;	// -x: sweep the layouts of this server
+	int nLayouts;
+	const char* Layouts[MAXLAYOUTS];	// server arguments of every layout (-l)
+} OPTIONS;
+
+typedef struct _THREADINFO {
+	pthread_t hThread;
+	int sd;
+	int nThreadNum;
+	uint64_t nEchoes;
+	uint64_t nConnections;
+	uint64_t nFailures;
+	uint64_t nFinishNs;
+	uint64_t nTotalLatencyNs;
+	LatencyHistogram Latency;
+	bool bFailed;
+} THREADINFO;
+
+//
+// what one echo measurement adds up to over all threads
+//
+typedef struct _ECHO_RESULT {
+	int nConnected;
+	int nFailed;			// connections that could not be opened or broke off
+	double dSeconds;
+	uint64_t nEchoes;
+	uint64_t nConnections;
+	uint64_t nTotalLatencyNs;
+	LatencyHistogram Latency;
+} ECHO_RESULT;
+
+static OPTIONS default_options = { "localhost", "5001", 1, 64, 10, 0, 0, false, false, NULL, 0, {} };
+static OPTIONS g_Options;
+static THREADINFO g_ThreadInfo[MAXTHREADS];
+static volatile bool g_bEndClient = false;
+static pthread_barrier_t g_StormBarrier;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+static void* EchoThread(void* lpParameter);
+static void* ConnectThread(void* lpParameter);
+static void* StormThread(void* lpParameter);
+static int RunConnectStorm(void);
+static bool RunEcho(ECHO_RESULT* pResult);
+static int RunLayoutSweep(void);
+static pid_t StartServer(const char* szLayout);
+static bool WaitForServer(pid_t pid);
+static void StopServer(pid_t pid);
+static bool CreateConnectedSocket(THREADINFO* pInfo);
+static bool SendBuffer(THREADINFO* pInfo, char* outbuf);
+static bool RecvBuffer(THREADINFO* pInfo, char* inbuf);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+int main(int argc, char* argv[]) {
+
+	ECHO_RESULT Result;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	if (g_Options.nStormConnections)
+		return(RunConnectStorm());
+
+	if (g_Options.szServerCommand)
+		return(RunLayoutSweep());
+
+	RunEcho(&Result);
+
+	printf("connections: %d  buffer: %d bytes  time: %.2f s\n",
+		Result.nConnected, g_Options.nBufSize, Result.dSeconds);
+	if (g_Options.bConnectMode)
+		printf("connections/s: %.0f\n", Result.nConnections / Result.dSeconds);
+	printf("echoes/s: %.0f  throughput: %.2f MB/s (each way)\n",
+		Result.nEchoes / Result.dSeconds, Result.nEchoes * (double)g_Options.nBufSize / Result.dSeconds / (1024 * 1024));
+	printf("rtt avg: %.1f us  p99: %.1f us\n",
+		Result.nEchoes ? Result.nTotalLatencyNs / (double)Result.nEchoes / 1000.0 : 0.0,
+		Result.Latency.Percentile(0.99) / 1000.0);
+
+	return(0);
+}
+
+//
+// Abstract:
+//     Run the echo (or with -c the connection rate) measurement once and add up
+//     what every thread counted.  Returns false if no connection could be opened.
+//
+static bool RunEcho(ECHO_RESULT* pResult)
+{
+	uint64_t nStart = 0;
+	int nConnected = 0;
+
+	g_bEndClient = false;
+	pResult->nFailed = 0;
+	pResult->nEchoes = 0;
+	pResult->nConnections = 0;
+	pResult->nTotalLatencyNs = 0;
+	pResult->Latency.Reset();
+
+	//
+	// connect everything first so connection setup is not part of the measurement.
+	// In connection mode every thread connects by itself.
+	//
+	for (int i = 0; i < g_Options.nTotalThreads; i++) {
+		g_ThreadInfo[i].nThreadNum = i;
+		g_ThreadInfo[i].sd = -1;
+		g_ThreadInfo[i].nEchoes = 0;
+		g_ThreadInfo[i].nConnections = 0;
+		g_ThreadInfo[i].nTotalLatencyNs = 0;
+		g_ThreadInfo[i].Latency.Reset();
+		g_ThreadInfo[i].bFailed = false;
+		if (!g_Options.bConnectMode && !CreateConnectedSocket(&g_ThreadInfo[i]))
+			break;
+		nConnected++;
+	}
+	pResult->nConnected = nConnected;
+	pResult->nFailed = g_Options.nTotalThreads - nConnected;
+	pResult->dSeconds = 0;
+	if (nConnected == 0)
+		return(false);
+
+	nStart = NowNs();
+	for (int i = 0; i < nConnected; i++) {
+		if (pthread_create(&g_ThreadInfo[i].hThread, NULL,
+			g_Options.bConnectMode ? ConnectThread : EchoThread, &g_ThreadInfo[i]) != 0) {
+			printf("pthread_create(%d) failed: %d\n", i, errno);
+			close(g_ThreadInfo[i].sd);
+			g_ThreadInfo[i].sd = -1;
+		}
+	}
+
+	sleep(g_Options.nSeconds);
+	g_bEndClient = true;
+
+	for (int i = 0; i < nConnected; i++) {
+		if (!g_Options.bConnectMode && g_ThreadInfo[i].sd == -1)
+			continue;
+		pthread_join(g_ThreadInfo[i].hThread, NULL);
+		if (g_ThreadInfo[i].sd != -1) {
+			close(g_ThreadInfo[i].sd);
+			g_ThreadInfo[i].sd = -1;
+		}
+		if (g_ThreadInfo[i].bFailed)
+			pResult->nFailed++;
+
+		pResult->nEchoes += g_ThreadInfo[i].nEchoes;
+		pResult->nConnections += g_ThreadInfo[i].nConnections;
+		pResult->nTotalLatencyNs += g_ThreadInfo[i].nTotalLatencyNs;
+		pResult->Latency.Add(g_ThreadInfo[i].Latency);
+	}
+	pResult->dSeconds = (NowNs() - nStart) / 1e9;
+
+	return(true);
+}
+
+//
+// Abstract:
+//     This is the thread that continually sends and receives a specific size
+//     buffer to the server and records the round trip time of every echo.
+//
+static void* EchoThread(void* lpParameter)
+{
+	THREADINFO* pInfo = (THREADINFO*)lpParameter;
+	char* inbuf = (char*)calloc(1, g_Options.nBufSize);
+	char* outbuf = (char*)calloc(1, g_Options.nBufSize);
+
+	if ((inbuf) && (outbuf)) {
+
+		memset(outbuf, (unsigned char)pInfo->nThreadNum, g_Options.nBufSize);
+
+		while (!g_bEndClient) {
+			uint64_t nSendTime = NowNs();
+
+			if (!SendBuffer(pInfo, outbuf) || !RecvBuffer(pInfo, inbuf)) {
+				pInfo->bFailed = true;
+				break;
+			}
+
+			uint64_t nLatency = NowNs() - nSendTime;
+
+			if ((inbuf[0] != outbuf[0]) ||
+				(inbuf[g_Options.nBufSize - 1] != outbuf[g_Options.nBufSize - 1])) {
+				printf("nak(%d) in[0]=%d, out[0]=%d\n", pInfo->nThreadNum, inbuf[0], outbuf[0]);
+				pInfo->bFailed = true;
+				break;
+			}
+
+			pInfo->nEchoes++;
+			pInfo->nTotalLatencyNs += nLatency;
+			pInfo->Latency.Record(nLatency);
+
+			if (g_Options.bVerbose)
+				printf("ack(%d)\n", pInfo->nThreadNum);
+		}
+	}
+
+	free(inbuf);
+	free(outbuf);
+
+	return(NULL);
+}
+
+//
+// Abstract:
+//     Connection rate mode: open a connection, do one echo and close it, over
+//     and over.  The round trip time includes the connect.
+//
+static void* ConnectThread(void* lpParameter)
+{
+	THREADINFO* pInfo = (THREADINFO*)lpParameter;
+	char* inbuf = (char*)calloc(1, g_Options.nBufSize);
+	char* outbuf = (char*)calloc(1, g_Options.nBufSize);
+
+	if ((inbuf) && (outbuf)) {
+
+		memset(outbuf, (unsigned char)pInfo->nThreadNum, g_Options.nBufSize);
+
+		while (!g_bEndClient) {
+			uint64_t nConnectTime = NowNs();
+
+			if (!CreateConnectedSocket(pInfo))
+				break;
+
+			bool bOk = SendBuffer(pInfo, outbuf) && RecvBuffer(pInfo, inbuf);
+
+			close(pInfo->sd);
+			pInfo->sd = -1;
+			if (!bOk) {
+				pInfo->bFailed = true;
+				break;
+			}
+
+			uint64_t nLatency = NowNs() - nConnectTime;
+
+			pInfo->nConnections++;
+			pInfo->nEchoes++;
+			pInfo->nTotalLatencyNs += nLatency;
+			pInfo->Latency.Record(nLatency);
+		}
+	}
+
+	free(inbuf);
+	free(outbuf);
+
+	return(NULL);
+}
+
+//
+// Abstract:
+//     Connect storm: every thread gets its share of the -s connections and the
+//     threads start together, so the server sees one burst of connects.
+//
+static int RunConnectStorm(void) {
+
+	struct rlimit limit;
+	uint64_t nStart = 0;
+	uint64_t nFinish = 0;
+	uint64_t nConnections = 0;
+	uint64_t nFailures = 0;
+	uint64_t nTotalLatencyNs = 0;
+	LatencyHistogram Latency;
+	int nThreads = g_Options.nTotalThreads;
+
+	if (nThreads > g_Options.nStormConnections)
+		nThreads = g_Options.nStormConnections;
+
+	//
+	// every connection stays open until the storm is over
+	//
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	//
+	// the main thread joins the barrier too: the threads wait on it once when their
+	// results are in and once more before closing their connections
+	//
+	pthread_barrier_init(&g_StormBarrier, NULL, nThreads + 1);
+
+	nStart = NowNs();
+	for (int i = 0; i < nThreads; i++) {
+		g_ThreadInfo[i].nThreadNum = i;
+		g_ThreadInfo[i].sd = -1;
+		g_ThreadInfo[i].nConnections = g_Options.nStormConnections / nThreads +
+			(i < g_Options.nStormConnections % nThreads ? 1 : 0);
+		if (pthread_create(&g_ThreadInfo[i].hThread, NULL, StormThread, &g_ThreadInfo[i]) != 0) {
+			printf("pthread_create(%d) failed: %d\n", i, errno);
+			return(1);
+		}
+	}
+
+	pthread_barrier_wait(&g_StormBarrier);
+
+	for (int i = 0; i < nThreads; i++) {
+		if (g_ThreadInfo[i].nFinishNs > nFinish)
+			nFinish = g_ThreadInfo[i].nFinishNs;
+		nConnections += g_ThreadInfo[i].nEchoes;
+		nFailures += g_ThreadInfo[i].nFailures;
+		nTotalLatencyNs += g_ThreadInfo[i].nTotalLatencyNs;
+		Latency.Add(g_ThreadInfo[i].Latency);
+	}
+
+	double dSeconds = (nFinish - nStart) / 1e9;
+	printf("storm: %d connections from %d threads  time: %.3f s\n",
+		g_Options.nStormConnections, nThreads, dSeconds);
+	printf("accepted connections/s: %.0f  accepted: %llu  failed: %llu\n",
+		dSeconds > 0 ? nConnections / dSeconds : 0.0,
+		(unsigned long long)nConnections, (unsigned long long)nFailures);
+	printf("connect to first echo avg: %.1f us  p99: %.1f us\n",
+		nConnections ? nTotalLatencyNs / (double)nConnections / 1000.0 : 0.0, Latency.Percentile(0.99) / 1000.0);
+	fflush(stdout);
+
+	if (g_Options.nIdleSeconds) {
+		printf("holding %llu connections idle for %d s\n",
+			(unsigned long long)nConnections, g_Options.nIdleSeconds);
+		fflush(stdout);
+		sleep(g_Options.nIdleSeconds);
+	}
+	pthread_barrier_wait(&g_StormBarrier);
+
+	for (int i = 0; i < nThreads; i++)
+		pthread_join(g_ThreadInfo[i].hThread, NULL);
+
+	pthread_barrier_destroy(&g_StormBarrier);
+
+	return(nFailures ? 1 : 0);
+}
+
+//
+// Abstract:
+//     Open this thread's share of the storm connections back to back and send one
+//     buffer on each, then collect the echoes.  A connection counts as accepted
+//     once its echo is back; the latency runs from its connect to that echo.
+//
+static void* StormThread(void* lpParameter)
+{
+	THREADINFO* pInfo = (THREADINFO*)lpParameter;
+	int nCount = (int)pInfo->nConnections;
+	int* sds = (int*)calloc(nCount ? nCount : 1, sizeof(int));
+	uint64_t* nConnectTime = (uint64_t*)calloc(nCount ? nCount : 1, sizeof(uint64_t));
+	char* inbuf = (char*)calloc(1, g_Options.nBufSize);
+	char* outbuf = (char*)calloc(1, g_Options.nBufSize);
+
+	pInfo->nConnections = 0;
+
+	if ((sds) && (nConnectTime) && (inbuf) && (outbuf)) {
+
+		memset(outbuf, (unsigned char)pInfo->nThreadNum, g_Options.nBufSize);
+
+		for (int i = 0; i < nCount; i++) {
+			nConnectTime[i] = NowNs();
+			sds[i] = -1;
+			if (!CreateConnectedSocket(pInfo)) {
+				pInfo->nFailures++;
+				continue;
+			}
+			sds[i] = pInfo->sd;
+			pInfo->nConnections++;
+			if (!SendBuffer(pInfo, outbuf)) {
+				close(sds[i]);
+				sds[i] = -1;
+				pInfo->nFailures++;
+			}
+		}
+
+		for (int i = 0; i < nCount; i++) {
+			if (sds[i] == -1)
+				continue;
+
+			pInfo->sd = sds[i];
+			if (!RecvBuffer(pInfo, inbuf) || inbuf[0] != outbuf[0]) {
+				pInfo->nFailures++;
+				continue;
+			}
+
+			uint64_t nLatency = NowNs() - nConnectTime[i];
+
+			pInfo->nEchoes++;
+			pInfo->nTotalLatencyNs += nLatency;
+			pInfo->Latency.Record(nLatency);
+		}
+		pInfo->sd = -1;
+	}
+	pInfo->nFinishNs = NowNs();
+
+	//
+	// hold every connection until all threads are done and the main thread has
+	// finished holding them idle, as reconnected players would
+	//
+	pthread_barrier_wait(&g_StormBarrier);
+	pthread_barrier_wait(&g_StormBarrier);
+
+	for (int i = 0; sds && i < nCount; i++) {
+		if (sds[i] != -1)
+			close(sds[i]);
+	}
+
+	free(sds);
+	free(nConnectTime);
+	free(inbuf);
+	free(outbuf);
+
+	return(NULL);
+}
+
+//
+// Abstract:
+//     Layout sweep (-x): start the server once per layout, measure it as a plain
+//     run would, stop it, and print a row for it.  Without -l the layouts are
+//     those of iocpserverex for the processors of this host: its defaults, one
+//     worker per processor with the port running all of them, the same pinned
+//     to processors and to NUMA nodes, twice the workers, half of them, and owned
+//     sessions.  Returns 1 if a server did not start.
+//
+static int RunLayoutSweep(void)
+{
+	static char DefaultLayouts[8][64];
+	static ECHO_RESULT Result;
+	long nProcessors = sysconf(_SC_NPROCESSORS_ONLN);
+	int nWorkers = 0;
+	int nRet = 0;
+	pid_t pid = -1;
+
+	if (nProcessors < 1)
+		nProcessors = 1;
+	nWorkers = nProcessors < MAXSERVERWORKERS ? (int)nProcessors : MAXSERVERWORKERS;
+
+	if (g_Options.nLayouts == 0) {
+		snprintf(DefaultLayouts[0], sizeof(DefaultLayouts[0]), "%s", "");
+		snprintf(DefaultLayouts[1], sizeof(DefaultLayouts[1]), "-w:%d -c:%d", nWorkers, nWorkers);
+		snprintf(DefaultLayouts[2], sizeof(DefaultLayouts[2]), "-w:%d -c:%d -p:core", nWorkers, nWorkers);
+		snprintf(DefaultLayouts[3], sizeof(DefaultLayouts[3]), "-w:%d -c:%d -p:node", nWorkers, nWorkers);
+		snprintf(DefaultLayouts[4], sizeof(DefaultLayouts[4]), "-w:%d -c:%d -p:core",
+			2 * nWorkers < MAXSERVERWORKERS ? 2 * nWorkers : MAXSERVERWORKERS, nWorkers);
+		snprintf(DefaultLayouts[5], sizeof(DefaultLayouts[5]), "-w:%d -o -p:core", nWorkers);
+		for (int i = 0; i < 6; i++)
+			g_Options.Layouts[g_Options.nLayouts++] = DefaultLayouts[i];
+		if (nWorkers >= 2) {
+			snprintf(DefaultLayouts[6], sizeof(DefaultLayouts[6]), "-w:%d -c:%d -p:core", nWorkers / 2, nWorkers / 2);
+			g_Options.Layouts[g_Options.nLayouts++] = DefaultLayouts[6];
+		}
+	}
+
+	printf("server: %s -e:%s  connections: %d  buffer: %d bytes  time: %d s per layout\n",
+		g_Options.szServerCommand, g_Options.port, g_Options.nTotalThreads, g_Options.nBufSize, g_Options.nSeconds);
+	printf("%-28s %10s %9s %9s %9s %7s\n", "layout", "echoes/s", "MB/s", "avg us", "p99 us", "failed");
+	fflush(stdout);
+
+	for (int i = 0; i < g_Options.nLayouts; i++) {
+		const char* szLayout = g_Options.Layouts[i][0] ? g_Options.Layouts[i] : "(server defaults)";
+
+		pid = StartServer(g_Options.Layouts[i]);
+		if (pid == -1 || !WaitForServer(pid)) {
+			printf("%-28s did not start\n", szLayout);
+			fflush(stdout);
+			if (pid != -1)
+				StopServer(pid);
+			nRet = 1;
+			continue;
+		}
+
+		RunEcho(&Result);
+		StopServer(pid);
+
+		printf("%-28s %10.0f %9.2f %9.1f %9.1f %7d\n", szLayout,
+			Result.dSeconds > 0 ? Result.nEchoes / Result.dSeconds : 0.0,
+			Result.dSeconds > 0 ? Result.nEchoes * (double)g_Options.nBufSize / Result.dSeconds / (1024 * 1024) : 0.0,
+			Result.nEchoes ? Result.nTotalLatencyNs / (double)Result.nEchoes / 1000.0 : 0.0,
+			Result.Latency.Percentile(0.99) / 1000.0, Result.nFailed);
+		fflush(stdout);
+	}
+
+	return(nRet);
+}
+
+//
+// Abstract:
+//     Start the sweep's server with one layout through the shell, so the command
+//     may carry arguments of its own.  What the server prints goes to /dev/null.
+//     Returns its process id, or -1.
+//
+static pid_t StartServer(const char* szLayout)
+{
+	char szCommand[1024];
+	pid_t pid = -1;
+	int fd = -1;
+
+	snprintf(szCommand, sizeof(szCommand), "exec %s -e:%s %s", g_Options.szServerCommand, g_Options.port, szLayout);
+
+	pid = fork();
+	if (pid == -1) {
+		printf("fork() failed: %d\n", errno);
+		return(-1);
+	}
+	if (pid == 0) {
+		fd = open("/dev/null", O_RDWR);
+		if (fd != -1) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		execl("/bin/sh", "sh", "-c", szCommand, (char*)NULL);
+		_exit(127);
+	}
+
+	return(pid);
+}
+
+//
+// Abstract:
+//     Wait until the server accepts a connection, without printing the connects
+//     that are refused until it listens.  Returns false if it exited or did not
+//     listen within SERVER_START_MS.
+//
+static bool WaitForServer(pid_t pid)
+{
+	struct addrinfo hints = {};
+	struct addrinfo* addr_srv = NULL;
+	int sd = -1;
+	bool bRet = false;
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(g_Options.szHostname, g_Options.port, &hints, &addr_srv) != 0 || addr_srv == NULL) {
+		printf("getaddrinfo() failed to resolve/convert the interface\n");
+		return(false);
+	}
+
+	for (int nWaited = 0; nWaited < SERVER_START_MS && !bRet; nWaited += 100) {
+		if (waitpid(pid, NULL, WNOHANG) == pid)
+			break;
+
+		sd = socket(addr_srv->ai_family, addr_srv->ai_socktype, addr_srv->ai_protocol);
+		if (sd == -1)
+			break;
+		bRet = (connect(sd, addr_srv->ai_addr, addr_srv->ai_addrlen) == 0);
+		close(sd);
+		if (!bRet)
+			usleep(100 * 1000);
+	}
+
+	freeaddrinfo(addr_srv);
+
+	return(bRet);
+}
+
+//
+// Abstract:
+//     Stop the sweep's server as CTRL-C would, and kill it if it has not exited
+//     within SERVER_STOP_MS, so the next layout gets the port.
+//
+static void StopServer(pid_t pid)
+{
+	kill(pid, SIGINT);
+	for (int nWaited = 0; nWaited < SERVER_STOP_MS; nWaited += 100) {
+		if (waitpid(pid, NULL, WNOHANG) != 0)
+			return;
+		usleep(100 * 1000);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+static bool CreateConnectedSocket(THREADINFO* pInfo)
+{
+	bool bRet = true;
+	int nOne = 1;
+	struct addrinfo hints = {};
+	struct addrinfo* addr_srv = NULL;
+
+	//
+	// Resolve the interface
+	//
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+
+	if (getaddrinfo(g_Options.szHostname, g_Options.port, &hints, &addr_srv) != 0 || addr_srv == NULL) {
+		printf("getaddrinfo() failed to resolve/convert the interface\n");
+		return(false);
+	}
+
+	pInfo->sd = socket(addr_srv->ai_family, addr_srv->ai_socktype, addr_srv->ai_protocol);
+	if (pInfo->sd == -1) {
+		printf("socket() failed: %d\n", errno);
+		bRet = false;
+	}
+	else if (connect(pInfo->sd, addr_srv->ai_addr, addr_srv->ai_addrlen) == -1) {
+		printf("connect(thread %d) failed: %d\n", pInfo->nThreadNum, errno);
+		close(pInfo->sd);
+		pInfo->sd = -1;
+		bRet = false;
+	}
+	else {
+		setsockopt(pInfo->sd, IPPROTO_TCP, TCP_NODELAY, (char*)&nOne, sizeof(nOne));
+		if (g_Options.bVerbose)
+			printf("connected(thread %d)\n", pInfo->nThreadNum);
+	}
+
+	freeaddrinfo(addr_srv);
+
+	return(bRet);
+}
+
+//
+// Abstract:
+//     Send a buffer - keep send'ing until the requested amount of
+//     data has been sent or the socket has been closed or error.
+//
+static bool SendBuffer(THREADINFO* pInfo, char* outbuf) {
+
+	int nTotalSend = 0;
+
+	while (nTotalSend < g_Options.nBufSize) {
+		ssize_t nSend = send(pInfo->sd, outbuf + nTotalSend, g_Options.nBufSize - nTotalSend, MSG_NOSIGNAL);
+		if (nSend <= 0) {
+			printf("send(thread=%d) failed: %d\n", pInfo->nThreadNum, nSend ? errno : 0);
+			return(false);
+		}
+		nTotalSend += (int)nSend;
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//     Receive a buffer - keep recv'ing until the requested amount of
+//     data has been received or the socket has been closed or error.
+//
+static bool RecvBuffer(THREADINFO* pInfo, char* inbuf) {
+
+	int nTotalRecv = 0;
+
+	while (nTotalRecv < g_Options.nBufSize) {
+		ssize_t nRecv = recv(pInfo->sd, inbuf + nTotalRecv, g_Options.nBufSize - nTotalRecv, 0);
+		if (nRecv <= 0) {
+			printf("recv(thread=%d) failed: %d\n", pInfo->nThreadNum, nRecv ? errno : 0);
+			return(false);
+		}
+		nTotalRecv += (int)nRecv;
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Verify options passed in and set options structure accordingly.
+//
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'b':
+				if (strlen(argv[i]) > 3)
+					g_Options.nBufSize = atoi(&argv[i][3]);
+				break;
+
+			case 'c':
+				g_Options.bConnectMode = true;
+				break;
+
+			case 'd':
+				if (strlen(argv[i]) > 3)
+					g_Options.nSeconds = atoi(&argv[i][3]);
+				break;
+
+			case 'e':
+				if (strlen(argv[i]) > 3)
+					g_Options.port = &argv[i][3];
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					snprintf(g_Options.szHostname, sizeof(g_Options.szHostname), "%s", &argv[i][3]);
+				break;
+
+			case 'i':
+				if (strlen(argv[i]) > 3)
+					g_Options.nIdleSeconds = atoi(&argv[i][3]);
+				break;
+
+			case 'l':
+				if (g_Options.nLayouts == MAXLAYOUTS) {
+					printf("  more than %d layouts\n", MAXLAYOUTS);
+					return(false);
+				}
+				g_Options.Layouts[g_Options.nLayouts++] = (strlen(argv[i]) > 3) ? &argv[i][3] : "";
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.nStormConnections = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3) {
+					g_Options.nTotalThreads = atoi(&argv[i][3]);
+					if (g_Options.nTotalThreads > MAXTHREADS)
+						g_Options.nTotalThreads = MAXTHREADS;
+				}
+				break;
+
+			case 'v':
+				g_Options.bVerbose = true;
+				break;
+
+			case 'x':
+				if (strlen(argv[i]) > 3)
+					g_Options.szServerCommand = &argv[i][3];
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nBufSize < 1 || g_Options.nTotalThreads < 1 || g_Options.nSeconds < 1 ||
+		g_Options.nStormConnections < 0 || (g_Options.nLayouts && !g_Options.szServerCommand)) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-b:#] [-c] [-d:#] [-e:#] [-i:#] [-l:args] [-n:host] [-s:#] [-t:#] [-v] [-x:command]\n",
+		szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -b:bufsize\tSize of send/recv buffer in bytes (Def:%d)\n",
+		pOptions->nBufSize);
+	printf("  -c\t\tMeasure the connection rate: connect, echo once, close\n");
+	printf("  -d:seconds\tDuration of the measurement (Def:%d)\n",
+		pOptions->nSeconds);
+	printf("  -e:port\tEndpoint number (port) to use (Def:%s)\n",
+		pOptions->port);
+	printf("  -i:seconds\tWith -s, hold the connections idle this long before closing\n");
+	printf("  -l:args\tWith -x, a layout: server arguments to measure, may be repeated\n");
+	printf("\t\t(Def: the -w, -c, -p and -o layouts of iocpserverex for this host)\n");
+	printf("  -n:host\tAct as the client and connect to 'host' (Def:%s)\n",
+		pOptions->szHostname);
+	printf("  -s:#\t\tConnect storm: open # connections at once, echo once on each\n");
+	printf("  -t:#\t\tNumber of threads (connections) to use (Def:%d)\n",
+		pOptions->nTotalThreads);
+	printf("  -v\t\tVerbose, print an ack when echo received and verified\n");
+	printf("  -x:command\tStart this server on -e's port for every layout and print a row for each\n");
+}
@@ -0,0 +1,293 @@
+//
+// Module:
+//      inboxbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Cross-thread send benchmark of the worker inbox the server uses with owned
+//      sessions (-o).  A number of producer threads, standing in for the tick
+//      thread and the workers of other sessions, push messages on the inbox of
+//      one consumer, the owning worker, in bursts.  The inbox is a lock-free
+//      stack any thread pushes on and the consumer takes whole; the consumer
+//      sleeps on an eventfd, which stands in for the completion port.
+//
+//      It is run twice.  Coalesced, only the push that finds no wakeup pending
+//      writes the eventfd, and the consumer clears the flag before it takes the
+//      inbox, as the server does.  Uncoalesced, every push writes the eventfd.
+//      Reported are the time per push, the wakeups written and taken, and the
+//      messages the consumer found per wakeup.  Every message must arrive once,
+//      and those of one producer in the order they were pushed, otherwise the
+//      exit code is 1.
+//
+//          inboxbench -p:4 -n:1000000 -b:64
+//
+//  Build:
+//      g++ -O2 -std=c++14 InboxBench.cpp -lpthread -o inboxbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+typedef struct _OPTIONS {
+	int nProducers;
+	int nMessages;                  // per producer
+	int nBurst;
+	int nPauseUs;                   // between bursts
+} OPTIONS;
+
+typedef struct _MESSAGE {
+	struct _MESSAGE* pNext;
+	uint32_t nProducer;
+	uint32_t nSequence;
+} MESSAGE;
+
+typedef struct _INBOX {
+	std::atomic<MESSAGE*> Head;     // newest first
+	alignas(64) std::atomic<int> bWakePending;
+	int hEvent;
+} INBOX;
+
+typedef struct _RESULT {
+	uint64_t nPushNs;               // summed over the producers
+	uint64_t nElapsedNs;
+	uint64_t nWakeupsPosted;        // eventfd writes
+	uint64_t nWakeupsTaken;         // eventfd reads that found work
+	uint64_t nMessages;
+	uint64_t nErrors;               // lost, duplicated or out of order
+} RESULT;
+
+static OPTIONS default_options = { 4, 1000000, 64, 20 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+//
+// InboxPost: push, and wake the consumer unless a wakeup is pending already
+//
+static void Post(INBOX* pInbox, MESSAGE* pMessage, bool bCoalesce, std::atomic<uint64_t>* pPosted) {
+	uint64_t nOne = 1;
+	MESSAGE* pHead = pInbox->Head.load(std::memory_order_relaxed);
+
+	do {
+		pMessage->pNext = pHead;
+	} while (!pInbox->Head.compare_exchange_weak(pHead, pMessage, std::memory_order_release,
+		std::memory_order_relaxed));
+
+	if (bCoalesce && pInbox->bWakePending.exchange(1))
+		return;
+	if (write(pInbox->hEvent, &nOne, sizeof(nOne)) == sizeof(nOne))
+		pPosted->fetch_add(1, std::memory_order_relaxed);
+}
+
+static void Producer(INBOX* pInbox, uint32_t nProducer, bool bCoalesce, std::vector<MESSAGE>* pMessages,
+	std::atomic<uint64_t>* pPushNs, std::atomic<uint64_t>* pPosted) {
+	uint64_t nNs = 0;
+
+	for (int i = 0; i < g_Options.nMessages; i += g_Options.nBurst) {
+		int nEnd = std::min(g_Options.nMessages, i + g_Options.nBurst);
+		uint64_t nStart = NowNs();
+
+		for (int m = i; m < nEnd; m++) {
+			(*pMessages)[m].nProducer = nProducer;
+			(*pMessages)[m].nSequence = (uint32_t)m;
+			Post(pInbox, &(*pMessages)[m], bCoalesce, pPosted);
+		}
+		nNs += NowNs() - nStart;
+		if (g_Options.nPauseUs)
+			std::this_thread::sleep_for(std::chrono::microseconds(g_Options.nPauseUs));
+	}
+	pPushNs->fetch_add(nNs);
+}
+
+//
+// InboxDrain: clear the flag, take everything, put it back in push order
+//
+static void Run(bool bCoalesce, RESULT* pResult) {
+	INBOX Inbox;
+	std::vector<std::vector<MESSAGE>> Messages(g_Options.nProducers);
+	std::vector<uint32_t> NextSequence(g_Options.nProducers, 0);
+	std::vector<std::thread> Threads;
+	std::atomic<uint64_t> nPushNs(0);
+	std::atomic<uint64_t> nPosted(0);
+	uint64_t nExpected = (uint64_t)g_Options.nProducers * g_Options.nMessages;
+	uint64_t nStart = 0;
+
+	memset(pResult, 0, sizeof(*pResult));
+	Inbox.Head.store(NULL);
+	Inbox.bWakePending.store(0);
+	Inbox.hEvent = eventfd(0, 0);
+	if (Inbox.hEvent < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	for (auto& Producer : Messages)
+		Producer.resize(g_Options.nMessages);
+
+	nStart = NowNs();
+	for (int p = 0; p < g_Options.nProducers; p++)
+		Threads.emplace_back(Producer, &Inbox, (uint32_t)p, bCoalesce, &Messages[p], &nPushNs, &nPosted);
+
+	while (pResult->nMessages < nExpected) {
+		uint64_t nCount = 0;
+		MESSAGE* pOldest = NULL;
+		MESSAGE* pMessage = NULL;
+
+		if (read(Inbox.hEvent, &nCount, sizeof(nCount)) != sizeof(nCount))
+			continue;
+		if (bCoalesce)
+			Inbox.bWakePending.store(0);
+		pMessage = Inbox.Head.exchange(NULL, std::memory_order_acquire);
+		if (pMessage)
+			pResult->nWakeupsTaken++;
+		while (pMessage) {
+			MESSAGE* pNext = pMessage->pNext;
+
+			pMessage->pNext = pOldest;
+			pOldest = pMessage;
+			pMessage = pNext;
+		}
+
+		for (pMessage = pOldest; pMessage; pMessage = pMessage->pNext) {
+			if (pMessage->nSequence != NextSequence[pMessage->nProducer])
+				pResult->nErrors++;
+			NextSequence[pMessage->nProducer] = pMessage->nSequence + 1;
+			pResult->nMessages++;
+		}
+	}
+	pResult->nElapsedNs = NowNs() - nStart;
+
+	for (auto& Thread : Threads)
+		Thread.join();
+	close(Inbox.hEvent);
+
+	for (int p = 0; p < g_Options.nProducers; p++) {
+		if (NextSequence[p] != (uint32_t)g_Options.nMessages)
+			pResult->nErrors++;
+	}
+	pResult->nPushNs = nPushNs.load();
+	pResult->nWakeupsPosted = nPosted.load();
+}
+
+static void Report(const char* szName, RESULT* pResult) {
+	printf("%-12s %6.1f ns per push  %9llu wakeups posted  %9llu taken  %8.1f messages per wakeup  %8.2f ms\n",
+		szName, pResult->nMessages ? (double)pResult->nPushNs / pResult->nMessages : 0.0,
+		(unsigned long long)pResult->nWakeupsPosted, (unsigned long long)pResult->nWakeupsTaken,
+		pResult->nWakeupsTaken ? (double)pResult->nMessages / pResult->nWakeupsTaken : 0.0,
+		pResult->nElapsedNs / 1e6);
+}
+
+int main(int argc, char* argv[]) {
+
+	RESULT Coalesced;
+	RESULT Uncoalesced;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	printf("producers: %d  messages: %d each  burst: %d  pause: %d us\n",
+		g_Options.nProducers, g_Options.nMessages, g_Options.nBurst, g_Options.nPauseUs);
+
+	Run(true, &Coalesced);
+	Report("coalesced", &Coalesced);
+	Run(false, &Uncoalesced);
+	Report("uncoalesced", &Uncoalesced);
+
+	if (Coalesced.nErrors || Uncoalesced.nErrors) {
+		printf("messages lost or out of order: coalesced %llu, uncoalesced %llu\n",
+			(unsigned long long)Coalesced.nErrors, (unsigned long long)Uncoalesced.nErrors);
+		nFailures++;
+	}
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'p':
+				if (strlen(argv[i]) > 3)
+					g_Options.nProducers = atoi(&argv[i][3]);
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nMessages = atoi(&argv[i][3]);
+				break;
+
+			case 'b':
+				if (strlen(argv[i]) > 3)
+					g_Options.nBurst = atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPauseUs = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nProducers < 1 || g_Options.nMessages < 1 || g_Options.nBurst < 1 ||
+		g_Options.nPauseUs < 0) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-p:#] [-n:#] [-b:#] [-s:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -p:#\t\tProducer threads (Def:%d)\n",
+		pOptions->nProducers);
+	printf("  -n:#\t\tMessages per producer (Def:%d)\n",
+		pOptions->nMessages);
+	printf("  -b:#\t\tMessages per burst (Def:%d)\n",
+		pOptions->nBurst);
+	printf("  -s:#\t\tMicroseconds between bursts (Def:%d)\n",
+		pOptions->nPauseUs);
+}
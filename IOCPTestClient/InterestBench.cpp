@@ -0,0 +1,315 @@
+//
+// Module:
+//      interestbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Area-of-interest benchmark of InterestGrid (NetworkLibrary).  A number of
+//      entities, some of them players, wander over a square map, all of them
+//      moving every tick.  Each tick moves every entity on the grid and then
+//      runs Update(), which reports what each player sees come into view, go
+//      out of it or move within it.  For comparison every tick is also checked
+//      the brute-force way, every player against every entity.
+//
+//      Reported are the cost per tick of moving and of updating, the events a
+//      tick produces against the updates sending everything to everyone would
+//      take.  At the end what every player sees is checked against the brute
+//      force: everything within view must be visible and nothing visible may be
+//      beyond the leave radius; the events are checked to add up to what is
+//      visible.  Otherwise the exit code is 1.
+//
+//          interestbench -n:10000 -p:1000
+//
+//  Build:
+//      g++ -O2 -std=c++14 -I../NetworkLibrary InterestBench.cpp ../NetworkLibrary/InterestGrid.cpp -o interestbench
+//
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "InterestGrid.h"
+
+typedef struct _OPTIONS {
+	int nEntities;
+	int nPlayers;
+	int nTicks;
+	float fMapSize;
+	float fViewRadius;
+	float fSpeed;
+} OPTIONS;
+
+typedef struct _WALKER {
+	float X;
+	float Y;
+	float DX;
+	float DY;
+} WALKER;
+
+static OPTIONS default_options = { 10000, 1000, 100, 4000.0f, 60.0f, 2.0f };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static uint32_t g_nSeed = 12345;
+
+static float Random(void) {
+	g_nSeed = g_nSeed * 1664525u + 1013904223u;
+	return((g_nSeed >> 8) * (1.0f / 16777216.0f));
+}
+
+//
+// one step of a walk that turns a little every tick and bounces off the edges
+//
+static void Step(WALKER* pWalker) {
+	float fTurn = (Random() - 0.5f) * 0.3f;
+	float fDX = pWalker->DX * cosf(fTurn) - pWalker->DY * sinf(fTurn);
+	float fDY = pWalker->DX * sinf(fTurn) + pWalker->DY * cosf(fTurn);
+
+	pWalker->DX = fDX;
+	pWalker->DY = fDY;
+	pWalker->X += fDX * g_Options.fSpeed;
+	pWalker->Y += fDY * g_Options.fSpeed;
+	if (pWalker->X < 0.0f || pWalker->X >= g_Options.fMapSize) {
+		pWalker->DX = -pWalker->DX;
+		pWalker->X = fminf(fmaxf(pWalker->X, 0.0f), g_Options.fMapSize - 1.0f);
+	}
+	if (pWalker->Y < 0.0f || pWalker->Y >= g_Options.fMapSize) {
+		pWalker->DY = -pWalker->DY;
+		pWalker->Y = fminf(fmaxf(pWalker->Y, 0.0f), g_Options.fMapSize - 1.0f);
+	}
+}
+
+//
+// what every player sees the brute-force way; returns how many pairs are in view
+//
+static uint64_t BruteForce(const std::vector<WALKER>& Walkers) {
+	float fRadius2 = g_Options.fViewRadius * g_Options.fViewRadius;
+	uint64_t nVisible = 0;
+
+	for (int p = 0; p < g_Options.nPlayers; p++) {
+		for (int e = 0; e < g_Options.nEntities; e++) {
+			float fDX = Walkers[e].X - Walkers[p].X;
+			float fDY = Walkers[e].Y - Walkers[p].Y;
+
+			if (e != p && fDX * fDX + fDY * fDY <= fRadius2)
+				nVisible++;
+		}
+	}
+	return(nVisible);
+}
+
+int main(int argc, char* argv[]) {
+
+	InterestGrid Grid;
+	std::vector<WALKER> Walkers;
+	std::vector<InterestEvent> Events;
+	std::vector<int64_t> Seen;
+	uint64_t nMoveNs = 0;
+	uint64_t nUpdateNs = 0;
+	uint64_t nBruteNs = 0;
+	uint64_t nEvents[3] = { 0, 0, 0 };
+	uint64_t nBruteVisible = 0;
+	float fLeaveRadius = 0.0f;
+	int nFailures = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	//
+	// the players are entities 0 .. nPlayers - 1
+	//
+	fLeaveRadius = g_Options.fViewRadius * 1.1f;
+	nRet = Grid.Init((uint32_t)g_Options.nEntities, g_Options.fViewRadius, g_Options.fViewRadius, fLeaveRadius);
+	if (nRet != 0) {
+		printf("InterestGrid::Init() failed: %d\n", nRet);
+		return(1);
+	}
+
+	Walkers.resize(g_Options.nEntities);
+	Seen.assign(g_Options.nPlayers, 0);
+	for (int e = 0; e < g_Options.nEntities; e++) {
+		float fAngle = Random() * 6.2831853f;
+
+		Walkers[e].X = Random() * g_Options.fMapSize;
+		Walkers[e].Y = Random() * g_Options.fMapSize;
+		Walkers[e].DX = cosf(fAngle);
+		Walkers[e].DY = sinf(fAngle);
+		Grid.Add((uint32_t)e, Walkers[e].X, Walkers[e].Y, e < g_Options.nPlayers);
+	}
+
+	printf("entities: %d  players: %d  ticks: %d  map: %.0f  view: %.0f (leave %.0f)  speed: %.1f\n",
+		g_Options.nEntities, g_Options.nPlayers, g_Options.nTicks, g_Options.fMapSize,
+		g_Options.fViewRadius, fLeaveRadius, g_Options.fSpeed);
+
+	for (int t = 0; t < g_Options.nTicks; t++) {
+		uint64_t nStart = NowNs();
+		for (int e = 0; e < g_Options.nEntities; e++) {
+			Step(&Walkers[e]);
+			Grid.Move((uint32_t)e, Walkers[e].X, Walkers[e].Y);
+		}
+		uint64_t nMoved = NowNs();
+		Events.clear();
+		Grid.Update(Events);
+		nUpdateNs += NowNs() - nMoved;
+		nMoveNs += nMoved - nStart;
+
+		for (const InterestEvent& Event : Events) {
+			nEvents[Event.type]++;
+			if (Event.type == InterestEnter)
+				Seen[Event.observer]++;
+			else if (Event.type == InterestLeave)
+				Seen[Event.observer]--;
+		}
+
+		nStart = NowNs();
+		nBruteVisible = BruteForce(Walkers);
+		nBruteNs += NowNs() - nStart;
+	}
+
+	printf("grid move               %8.1f us per tick\n", nMoveNs / 1e3 / g_Options.nTicks);
+	printf("grid update             %8.1f us per tick  (%.1f ns per player)\n",
+		nUpdateNs / 1e3 / g_Options.nTicks, (double)nUpdateNs / g_Options.nTicks / g_Options.nPlayers);
+	printf("brute force             %8.1f us per tick\n", nBruteNs / 1e3 / g_Options.nTicks);
+	printf("events per tick         %8.0f enter  %8.0f leave  %8.0f update\n",
+		(double)nEvents[InterestEnter] / g_Options.nTicks, (double)nEvents[InterestLeave] / g_Options.nTicks,
+		(double)nEvents[InterestUpdate] / g_Options.nTicks);
+	printf("everything to everyone  %8.0f updates per tick\n",
+		(double)g_Options.nPlayers * (g_Options.nEntities - 1));
+
+	//
+	// what the grid says every player sees against the brute force
+	//
+	for (int p = 0; p < g_Options.nPlayers && nFailures < 10; p++) {
+		const std::vector<uint32_t>& Visible = Grid.Visible((uint32_t)p);
+		std::vector<char> bVisible(g_Options.nEntities, 0);
+
+		if ((int64_t)Visible.size() != Seen[p]) {
+			printf("player %d: %zu visible, events add up to %lld\n", p, Visible.size(), (long long)Seen[p]);
+			nFailures++;
+		}
+		for (uint32_t e : Visible) {
+			float fDX = Walkers[e].X - Walkers[p].X;
+			float fDY = Walkers[e].Y - Walkers[p].Y;
+
+			bVisible[e] = 1;
+			if (fDX * fDX + fDY * fDY > fLeaveRadius * fLeaveRadius) {
+				printf("player %d: entity %u visible beyond the leave radius\n", p, e);
+				nFailures++;
+			}
+		}
+		for (int e = 0; e < g_Options.nEntities; e++) {
+			float fDX = Walkers[e].X - Walkers[p].X;
+			float fDY = Walkers[e].Y - Walkers[p].Y;
+
+			if (e != p && !bVisible[e] && fDX * fDX + fDY * fDY <= g_Options.fViewRadius * g_Options.fViewRadius) {
+				printf("player %d: entity %d in view but not visible\n", p, e);
+				nFailures++;
+			}
+		}
+	}
+	printf("in view at the end      %8llu pairs (brute force)\n", (unsigned long long)nBruteVisible);
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nEntities = atoi(&argv[i][3]);
+				break;
+
+			case 'p':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPlayers = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nTicks = atoi(&argv[i][3]);
+				break;
+
+			case 'm':
+				if (strlen(argv[i]) > 3)
+					g_Options.fMapSize = (float)atof(&argv[i][3]);
+				break;
+
+			case 'v':
+				if (strlen(argv[i]) > 3)
+					g_Options.fViewRadius = (float)atof(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.fSpeed = (float)atof(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nEntities < 1 || g_Options.nPlayers < 0 || g_Options.nPlayers > g_Options.nEntities ||
+		g_Options.nTicks < 1 || !(g_Options.fMapSize > 0.0f) || !(g_Options.fViewRadius > 0.0f)) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-n:#] [-p:#] [-t:#] [-m:#] [-v:#] [-s:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -n:#\t\tEntities on the map (Def:%d)\n",
+		pOptions->nEntities);
+	printf("  -p:#\t\tPlayers among them, which observe (Def:%d)\n",
+		pOptions->nPlayers);
+	printf("  -t:#\t\tTicks (Def:%d)\n",
+		pOptions->nTicks);
+	printf("  -m:#\t\tWidth of the square map (Def:%.0f)\n",
+		pOptions->fMapSize);
+	printf("  -v:#\t\tView radius, also the cell size (Def:%.0f)\n",
+		pOptions->fViewRadius);
+	printf("  -s:#\t\tDistance an entity moves per tick (Def:%.1f)\n",
+		pOptions->fSpeed);
+}
@@ -0,0 +1,303 @@
+//
+// Module:
+//      jobbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Parallel-for scaling benchmark of JobSystem (NetworkLibrary).  A loop over
+//      a number of items, each costing a fixed amount of work, is run serially
+//      and then as a parallel-for on 1, 2, 4 ... job threads up to one per
+//      hardware thread.  Each run is started from the main thread the way an I/O
+//      handler would: the loop is fanned out and the main thread only learns it
+//      is done from a continuation, so the job threads are the only ones working.
+//      Reported are the time per run and the speedup over the serial loop.
+//
+//      A second run with no work per item and a grain of 1 measures what the
+//      scheduler itself costs per job.  Every run must produce the same results
+//      as the serial loop, and a Wait() on a job with children must see all of
+//      them finished, otherwise the exit code is 1.
+//
+//          jobbench -n:1000000 -u:200
+//
+//  Build:
+//      g++ -O2 -std=c++17 -I../NetworkLibrary JobBench.cpp ../NetworkLibrary/JobSystem.cpp -lpthread -o jobbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "JobSystem.h"
+
+typedef struct _OPTIONS {
+	int nItems;
+	int nWorkUnits;
+	int nGrain;
+	int nRuns;
+	int nMaxThreads;
+} OPTIONS;
+
+typedef struct _LOOP {
+	std::vector<uint64_t>* pResults;
+	int nWorkUnits;
+} LOOP;
+
+//
+// what the continuation of a run signals the main thread with
+//
+typedef struct _DONE {
+	std::mutex Lock;
+	std::condition_variable Cond;
+	bool bDone;
+} DONE;
+
+static OPTIONS default_options = { 1000000, 200, 1024, 5, 0 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static void Work(uint32_t nBegin, uint32_t nEnd, void* pContext) {
+	LOOP* pLoop = (LOOP*)pContext;
+
+	for (uint32_t i = nBegin; i < nEnd; i++) {
+		uint64_t x = i + 1;
+
+		for (int u = 0; u < pLoop->nWorkUnits; u++)
+			x = x * 6364136223846793005ull + 1442695040888963407ull;
+		(*pLoop->pResults)[i] = x;
+	}
+}
+
+static void Signal(JobSystem& Jobs, Job* pJob, void* pData) {
+	DONE* pDone = *(DONE**)pData;
+	std::lock_guard<std::mutex> Lock(pDone->Lock);
+
+	(void)Jobs;
+	(void)pJob;
+
+	pDone->bDone = true;
+	pDone->Cond.notify_one();
+}
+
+//
+// fan the loop out and sleep until the continuation says it is done
+//
+static uint64_t RunParallel(JobSystem& Jobs, LOOP* pLoop, int nItems, int nGrain) {
+	DONE Done;
+	DONE* pDone = &Done;
+	uint64_t nStart = NowNs();
+	Job* pLoopJob = Jobs.CreateParallelFor((uint32_t)nItems, (uint32_t)nGrain, Work, pLoop);
+	Job* pSignal = Jobs.Create(Signal, &pDone, sizeof(pDone));
+
+	Done.bDone = false;
+	Jobs.AddContinuation(pLoopJob, pSignal);
+	Jobs.Run(pLoopJob);
+	Jobs.Release(pLoopJob);
+	Jobs.Release(pSignal);
+
+	std::unique_lock<std::mutex> Lock(Done.Lock);
+	Done.Cond.wait(Lock, [&] { return(Done.bDone); });
+	return(NowNs() - nStart);
+}
+
+static void Child(JobSystem& Jobs, Job* pJob, void* pData) {
+	std::atomic<int>* pCount = *(std::atomic<int>**)pData;
+
+	(void)Jobs;
+	(void)pJob;
+
+	std::this_thread::sleep_for(std::chrono::microseconds(100));
+	pCount->fetch_add(1);
+}
+
+static void Parent(JobSystem& Jobs, Job* pJob, void* pData) {
+	for (int i = 0; i < 64; i++) {
+		Job* pChild = Jobs.CreateChild(pJob, Child, pData, sizeof(void*));
+
+		Jobs.Run(pChild);
+		Jobs.Release(pChild);
+	}
+}
+
+int main(int argc, char* argv[]) {
+
+	std::vector<uint64_t> Serial;
+	std::vector<uint64_t> Results;
+	std::vector<int> ThreadCounts;
+	LOOP Loop;
+	uint64_t nSerialNs = ~0ull;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	if (g_Options.nMaxThreads == 0)
+		g_Options.nMaxThreads = std::max(1u, std::thread::hardware_concurrency());
+	for (int n = 1; n < g_Options.nMaxThreads; n *= 2)
+		ThreadCounts.push_back(n);
+	ThreadCounts.push_back(g_Options.nMaxThreads);
+
+	printf("items: %d  work: %d units  grain: %d  runs: %d  hardware threads: %u\n",
+		g_Options.nItems, g_Options.nWorkUnits, g_Options.nGrain, g_Options.nRuns,
+		std::thread::hardware_concurrency());
+
+	Serial.assign(g_Options.nItems, 0);
+	Loop.pResults = &Serial;
+	Loop.nWorkUnits = g_Options.nWorkUnits;
+	for (int r = 0; r < g_Options.nRuns; r++) {
+		uint64_t nStart = NowNs();
+		Work(0, (uint32_t)g_Options.nItems, &Loop);
+		nSerialNs = std::min(nSerialNs, NowNs() - nStart);
+	}
+	printf("serial            %9.2f ms\n", nSerialNs / 1e6);
+
+	Loop.pResults = &Results;
+	for (int nThreads : ThreadCounts) {
+		JobSystem Jobs;
+		uint64_t nBestNs = ~0ull;
+
+		if (Jobs.Init((unsigned)nThreads) != 0) {
+			printf("JobSystem::Init(%d) failed\n", nThreads);
+			return(1);
+		}
+		for (int r = 0; r < g_Options.nRuns; r++) {
+			Results.assign(g_Options.nItems, 0);
+			nBestNs = std::min(nBestNs, RunParallel(Jobs, &Loop, g_Options.nItems, g_Options.nGrain));
+			if (Results != Serial) {
+				printf("%d threads: results differ from the serial loop\n", nThreads);
+				nFailures++;
+			}
+		}
+		printf("%2d job threads    %9.2f ms   speedup %5.2f\n", nThreads, nBestNs / 1e6,
+			(double)nSerialNs / nBestNs);
+		Jobs.Exit();
+	}
+
+	//
+	// the scheduler's own cost: one job per item and nothing to do in it
+	//
+	{
+		JobSystem Jobs;
+		uint64_t nNs = 0;
+
+		Jobs.Init((unsigned)g_Options.nMaxThreads);
+		Loop.nWorkUnits = 0;
+		Results.assign(g_Options.nItems, 0);
+		nNs = RunParallel(Jobs, &Loop, g_Options.nItems, 1);
+		printf("empty jobs        %9.1f ns per job on %d threads\n",
+			(double)nNs / g_Options.nItems, g_Options.nMaxThreads);
+
+		//
+		// Wait() from a thread that is not a job thread, on a job whose
+		// children are still running when it returns
+		//
+		std::atomic<int> nCount(0);
+		std::atomic<int>* pCount = &nCount;
+		Job* pParent = Jobs.Create(Parent, &pCount, sizeof(pCount));
+
+		Jobs.Run(pParent);
+		Jobs.Wait(pParent);
+		if (nCount.load() != 64) {
+			printf("Wait() returned with %d of 64 children finished\n", nCount.load());
+			nFailures++;
+		}
+		Jobs.Exit();
+	}
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nItems = atoi(&argv[i][3]);
+				break;
+
+			case 'u':
+				if (strlen(argv[i]) > 3)
+					g_Options.nWorkUnits = atoi(&argv[i][3]);
+				break;
+
+			case 'g':
+				if (strlen(argv[i]) > 3)
+					g_Options.nGrain = atoi(&argv[i][3]);
+				break;
+
+			case 'r':
+				if (strlen(argv[i]) > 3)
+					g_Options.nRuns = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nMaxThreads = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nItems < 1 || g_Options.nWorkUnits < 0 || g_Options.nGrain < 1 ||
+		g_Options.nRuns < 1 || g_Options.nMaxThreads < 0) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-n:#] [-u:#] [-g:#] [-r:#] [-t:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -n:#\t\tItems in the loop (Def:%d)\n",
+		pOptions->nItems);
+	printf("  -u:#\t\tWork units per item (Def:%d)\n",
+		pOptions->nWorkUnits);
+	printf("  -g:#\t\tItems a job runs at most (Def:%d)\n",
+		pOptions->nGrain);
+	printf("  -r:#\t\tRuns per thread count, the best is reported (Def:%d)\n",
+		pOptions->nRuns);
+	printf("  -t:#\t\tMost job threads (Def: one per hardware thread)\n");
+}
@@ -0,0 +1,292 @@
+//
+// Module:
+//      logbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Hot path cost benchmark of BinaryLog (NetworkLibrary) against fprintf.
+//      A number of threads, standing in for the I/O workers, each log records
+//      with three arguments in bursts, the way a worker logs while it handles
+//      a batch of completions, and pause in between.  Reported is the time a
+//      log call takes on the calling thread: BinaryLog only stores the record in
+//      the thread's ring and leaves formatting and writing to its own thread,
+//      while fprintf formats and writes under the lock of the stream.
+//
+//      The log file is rotated at a size small enough that a run rotates it a
+//      few times.  Afterwards every file is read back: each record of every
+//      thread must be there once and in order, apart from those reported as
+//      dropped, otherwise the exit code is 1.
+//
+//          logbench -t:4 -n:100000 -b:1000
+//
+//  Build:
+//      g++ -O2 -std=c++14 -I../NetworkLibrary LogBench.cpp ../NetworkLibrary/BinaryLog.cpp -lpthread -o logbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BinaryLog.h"
+
+#define BENCH_FILE_COUNT    16              // enough that a run never deletes a file
+
+typedef struct _OPTIONS {
+	int nThreads;
+	int nRecords;                   // per thread
+	int nBurst;
+	int nPauseUs;                   // between bursts
+	int nFileMB;                    // size a log file is rotated at
+	const char* szPath;
+} OPTIONS;
+
+static OPTIONS default_options = { 4, 100000, 1000, 5000, 4, "/tmp/logbench.log" };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+//
+// both runs log the same record: a worker, a sequence number and a pointer
+//
+static void LogThread(BinaryLog* pLog, FILE* pFile, int nThread, std::atomic<uint64_t>* pNs) {
+	void* pSocket = pNs;
+	uint64_t nNs = 0;
+
+	for (int i = 0; i < g_Options.nRecords; i += g_Options.nBurst) {
+		int nEnd = std::min(g_Options.nRecords, i + g_Options.nBurst);
+		uint64_t nStart = NowNs();
+
+		if (pLog) {
+			for (int r = i; r < nEnd; r++)
+				LOG_INFO(*pLog, "WorkerThread %d: record %d of Socket(%p) handled", nThread, r, pSocket);
+		}
+		else {
+			for (int r = i; r < nEnd; r++)
+				fprintf(pFile, "WorkerThread %d: record %d of Socket(%p) handled\n", nThread, r, pSocket);
+		}
+		nNs += NowNs() - nStart;
+		if (g_Options.nPauseUs)
+			std::this_thread::sleep_for(std::chrono::microseconds(g_Options.nPauseUs));
+	}
+	pNs->fetch_add(nNs);
+}
+
+static uint64_t Run(BinaryLog* pLog, FILE* pFile) {
+	std::vector<std::thread> Threads;
+	std::atomic<uint64_t> nNs(0);
+
+	for (int t = 0; t < g_Options.nThreads; t++)
+		Threads.emplace_back(LogThread, pLog, pFile, t, &nNs);
+	for (auto& Thread : Threads)
+		Thread.join();
+	return(nNs.load());
+}
+
+//
+// read the rotated files oldest first, then the current one
+//
+static uint64_t Verify(uint64_t nDropped, int* pnFiles) {
+	std::vector<int> NextRecord(g_Options.nThreads, 0);
+	uint64_t nLines = 0;
+	uint64_t nErrors = 0;
+	char szLine[1024];
+
+	*pnFiles = 0;
+	for (int f = BENCH_FILE_COUNT - 1; f >= 0; f--) {
+		std::string Path = g_Options.szPath;
+		FILE* pFile = NULL;
+
+		if (f)
+			Path += "." + std::to_string(f);
+		pFile = fopen(Path.c_str(), "r");
+		if (pFile == NULL)
+			continue;
+		(*pnFiles)++;
+
+		while (fgets(szLine, sizeof(szLine), pFile)) {
+			const char* pMessage = strstr(szLine, "WorkerThread ");
+			int nThread = 0;
+			int nRecord = 0;
+
+			if (pMessage == NULL || sscanf(pMessage, "WorkerThread %d: record %d", &nThread, &nRecord) != 2)
+				continue;
+			nLines++;
+			if (nThread < 0 || nThread >= g_Options.nThreads || nRecord < NextRecord[nThread])
+				nErrors++;
+			else
+				NextRecord[nThread] = nRecord + 1;
+		}
+		fclose(pFile);
+	}
+
+	if (nLines + nDropped != (uint64_t)g_Options.nThreads * g_Options.nRecords) {
+		printf("%llu records read back, %llu dropped, %llu logged\n", (unsigned long long)nLines,
+			(unsigned long long)nDropped, (unsigned long long)g_Options.nThreads * g_Options.nRecords);
+		nErrors++;
+	}
+	return(nErrors);
+}
+
+static void RemoveFiles(void) {
+	for (int f = 0; f < BENCH_FILE_COUNT; f++) {
+		std::string Path = g_Options.szPath;
+
+		if (f)
+			Path += "." + std::to_string(f);
+		remove(Path.c_str());
+	}
+}
+
+int main(int argc, char* argv[]) {
+
+	BinaryLog Log;
+	FILE* pFile = NULL;
+	uint64_t nRecords = 0;
+	uint64_t nLogNs = 0;
+	uint64_t nPrintfNs = 0;
+	uint64_t nDropped = 0;
+	int nFiles = 0;
+	int nFailures = 0;
+	int nRet = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	nRecords = (uint64_t)g_Options.nThreads * g_Options.nRecords;
+	printf("threads: %d  records: %d each  burst: %d  pause: %d us  rotated at %d MB\n",
+		g_Options.nThreads, g_Options.nRecords, g_Options.nBurst, g_Options.nPauseUs, g_Options.nFileMB);
+
+	RemoveFiles();
+	nRet = Log.Init(g_Options.szPath, LogLevelInfo, (uint64_t)g_Options.nFileMB << 20, BENCH_FILE_COUNT);
+	if (nRet != 0) {
+		printf("BinaryLog::Init(%s) failed: %d\n", g_Options.szPath, nRet);
+		return(1);
+	}
+	nLogNs = Run(&Log, NULL);
+	Log.Exit();
+	nDropped = Log.Dropped();
+	printf("BinaryLog  %6.1f ns per call  (%llu dropped)\n", (double)nLogNs / nRecords,
+		(unsigned long long)nDropped);
+
+	if (Verify(nDropped, &nFiles)) {
+		printf("records lost or out of order in %s\n", g_Options.szPath);
+		nFailures++;
+	}
+	else
+		printf("           every record read back in order from %d files\n", nFiles);
+	RemoveFiles();
+
+	pFile = fopen(g_Options.szPath, "w");
+	if (pFile == NULL) {
+		printf("fopen(%s) failed\n", g_Options.szPath);
+		return(1);
+	}
+	nPrintfNs = Run(NULL, pFile);
+	fclose(pFile);
+	printf("fprintf    %6.1f ns per call\n", (double)nPrintfNs / nRecords);
+	RemoveFiles();
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nThreads = atoi(&argv[i][3]);
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nRecords = atoi(&argv[i][3]);
+				break;
+
+			case 'b':
+				if (strlen(argv[i]) > 3)
+					g_Options.nBurst = atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPauseUs = atoi(&argv[i][3]);
+				break;
+
+			case 'f':
+				if (strlen(argv[i]) > 3)
+					g_Options.nFileMB = atoi(&argv[i][3]);
+				break;
+
+			case 'o':
+				if (strlen(argv[i]) > 3)
+					g_Options.szPath = &argv[i][3];
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nThreads < 1 || g_Options.nRecords < 1 || g_Options.nBurst < 1 ||
+		g_Options.nPauseUs < 0 || g_Options.nFileMB < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-t:#] [-n:#] [-b:#] [-s:#] [-f:#] [-o:path]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -t:#\t\tLogging threads (Def:%d)\n",
+		pOptions->nThreads);
+	printf("  -n:#\t\tRecords per thread (Def:%d)\n",
+		pOptions->nRecords);
+	printf("  -b:#\t\tRecords per burst (Def:%d)\n",
+		pOptions->nBurst);
+	printf("  -s:#\t\tMicroseconds between bursts (Def:%d)\n",
+		pOptions->nPauseUs);
+	printf("  -f:#\t\tMB a log file is rotated at (Def:%d)\n",
+		pOptions->nFileMB);
+	printf("  -o:path\tLog file (Def:%s)\n",
+		pOptions->szPath);
+}
@@ -0,0 +1,283 @@
+//
+// Module:
+//      metricsbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Per-packet cost benchmark of the worker metrics the server keeps (-s, -m).
+//      A number of threads, standing in for the workers, each handle packets:
+//      for every one they count a completion and its bytes and record a latency
+//      in a LatencyHistogram (NetworkLibrary).  Meanwhile a scraper thread sums
+//      the counters and histograms of all of them every few milliseconds, as the
+//      metrics endpoint does.
+//
+//      It is run twice.  Per worker, every thread writes counters and a histogram
+//      of its own, on cache lines of its own, with plain increments, as the server
+//      does.  Shared, all threads add to one set of counters and one histogram
+//      with interlocked operations.  Reported is the time per packet.  The sums
+//      the scraper sees must never go down, and the final sums must account for
+//      every packet, otherwise the exit code is 1.
+//
+//          metricsbench -t:4 -n:10000000
+//
+//  Build:
+//      g++ -O2 -std=c++17 -I../NetworkLibrary MetricsBench.cpp ../NetworkLibrary/LatencyHistogram.cpp -lpthread -o metricsbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "LatencyHistogram.h"
+
+typedef struct _OPTIONS {
+	int nThreads;
+	int nPackets;                   // per thread
+	int nScrapeMs;                  // between scrapes
+} OPTIONS;
+
+//
+// what a worker keeps: only it writes, so plain increments do
+//
+struct alignas(64) WORKER_METRICS {
+	volatile uint64_t nCompletions;
+	volatile uint64_t nBytes;
+	LatencyHistogram Latency;
+};
+
+//
+// what every thread adds to in the shared run
+//
+struct SHARED_METRICS {
+	alignas(64) std::atomic<uint64_t> nCompletions;
+	std::atomic<uint64_t> nBytes;
+	alignas(64) std::atomic<uint64_t> Counts[LATENCY_BUCKETS];
+};
+
+typedef struct _RESULT {
+	uint64_t nPacketNs;             // summed over the threads
+	uint64_t nScrapes;
+	uint64_t nErrors;               // sums that went down or do not add up
+} RESULT;
+
+static OPTIONS default_options = { 4, 10000000, 5 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+//
+// a latency and a size that vary like those of real packets, without a clock read
+//
+static inline uint64_t NextValue(uint64_t* pState) {
+	*pState ^= *pState << 13;
+	*pState ^= *pState >> 7;
+	*pState ^= *pState << 17;
+	return(*pState);
+}
+
+static void Worker(WORKER_METRICS* pOwn, SHARED_METRICS* pShared, int nThread, std::atomic<uint64_t>* pNs) {
+	uint64_t nState = 0x9e3779b97f4a7c15ull * (nThread + 1);
+	uint64_t nStart = NowNs();
+
+	for (int i = 0; i < g_Options.nPackets; i++) {
+		uint64_t nValue = NextValue(&nState);
+		uint64_t nLatency = (nValue & 0xfffff) + 500;
+		uint64_t nBytes = (nValue >> 20) & 0x3ff;
+
+		if (pOwn) {
+			pOwn->nCompletions++;
+			pOwn->nBytes += nBytes;
+			pOwn->Latency.Record(nLatency);
+		}
+		else {
+			pShared->nCompletions.fetch_add(1);
+			pShared->nBytes.fetch_add(nBytes);
+			pShared->Counts[LatencyHistogram::Bucket(nLatency)].fetch_add(1);
+		}
+	}
+	pNs->fetch_add(NowNs() - nStart);
+}
+
+static void Run(bool bPerWorker, RESULT* pResult) {
+	std::unique_ptr<WORKER_METRICS[]> Own(new WORKER_METRICS[g_Options.nThreads]);
+	std::unique_ptr<SHARED_METRICS> Shared(new SHARED_METRICS);
+	std::vector<std::thread> Threads;
+	std::atomic<uint64_t> nNs(0);
+	std::atomic<int> nRunning(g_Options.nThreads);
+	uint64_t nLastCompletions = 0;
+	uint64_t nLastCount = 0;
+	uint64_t nTotal = (uint64_t)g_Options.nThreads * g_Options.nPackets;
+
+	memset(pResult, 0, sizeof(*pResult));
+	for (int t = 0; t < g_Options.nThreads; t++) {
+		Own[t].nCompletions = 0;
+		Own[t].nBytes = 0;
+	}
+	Shared->nCompletions.store(0);
+	Shared->nBytes.store(0);
+	for (auto& Count : Shared->Counts)
+		Count.store(0);
+
+	for (int t = 0; t < g_Options.nThreads; t++) {
+		Threads.emplace_back([&, t]() {
+			Worker(bPerWorker ? &Own[t] : NULL, Shared.get(), t, &nNs);
+			nRunning.fetch_sub(1);
+		});
+	}
+
+	//
+	// the scraper: sum everything afresh every time, as a scrape does
+	//
+	while (true) {
+		bool bLast = (nRunning.load() == 0);
+		uint64_t nCompletions = 0;
+		uint64_t nCount = 0;
+
+		if (bPerWorker) {
+			std::unique_ptr<LatencyHistogram> Latency(new LatencyHistogram);
+
+			for (int t = 0; t < g_Options.nThreads; t++) {
+				nCompletions += Own[t].nCompletions;
+				Latency->Add(Own[t].Latency);
+			}
+			nCount = Latency->Count();
+		}
+		else {
+			nCompletions = Shared->nCompletions.load();
+			for (auto& Count : Shared->Counts)
+				nCount += Count.load();
+		}
+
+		if (nCompletions < nLastCompletions || nCount < nLastCount)
+			pResult->nErrors++;
+		nLastCompletions = nCompletions;
+		nLastCount = nCount;
+		pResult->nScrapes++;
+
+		if (bLast)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(g_Options.nScrapeMs));
+	}
+
+	for (auto& Thread : Threads)
+		Thread.join();
+
+	if (nLastCompletions != nTotal || nLastCount != nTotal) {
+		printf("%llu completions and %llu latencies summed, %llu handled\n", (unsigned long long)nLastCompletions,
+			(unsigned long long)nLastCount, (unsigned long long)nTotal);
+		pResult->nErrors++;
+	}
+	pResult->nPacketNs = nNs.load();
+}
+
+static void Report(const char* szName, RESULT* pResult) {
+	printf("%-12s %6.2f ns per packet  %6llu scrapes\n", szName,
+		(double)pResult->nPacketNs / ((double)g_Options.nThreads * g_Options.nPackets),
+		(unsigned long long)pResult->nScrapes);
+}
+
+int main(int argc, char* argv[]) {
+
+	RESULT PerWorker;
+	RESULT Shared;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	printf("threads: %d  packets: %d each  scrape every %d ms\n",
+		g_Options.nThreads, g_Options.nPackets, g_Options.nScrapeMs);
+
+	Run(true, &PerWorker);
+	Report("per worker", &PerWorker);
+	Run(false, &Shared);
+	Report("shared", &Shared);
+
+	if (PerWorker.nErrors || Shared.nErrors) {
+		printf("sums went down or do not add up: per worker %llu, shared %llu\n",
+			(unsigned long long)PerWorker.nErrors, (unsigned long long)Shared.nErrors);
+		nFailures++;
+	}
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nThreads = atoi(&argv[i][3]);
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPackets = atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.nScrapeMs = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nThreads < 1 || g_Options.nPackets < 1 || g_Options.nScrapeMs < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-t:#] [-n:#] [-s:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -t:#\t\tWorker threads (Def:%d)\n",
+		pOptions->nThreads);
+	printf("  -n:#\t\tPackets per thread (Def:%d)\n",
+		pOptions->nPackets);
+	printf("  -s:#\t\tMilliseconds between scrapes (Def:%d)\n",
+		pOptions->nScrapeMs);
+}
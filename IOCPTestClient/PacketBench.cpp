@@ -0,0 +1,255 @@
+//
+// Module:
+//      packetbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Microbenchmark of the packet framing in NetworkLibrary.  It builds a stream
+//      of length-prefixed packets with random body sizes, then feeds it through a
+//      PacketRingBuffer in random sized pieces, the way recv completions split and
+//      coalesce a TCP stream, and takes every complete packet out again.  Every
+//      packet is checked against what was generated, so the run doubles as a test
+//      of the reassembly; any mismatch is reported and the exit code is 1.
+//
+//          packetbench -n:1000000 -b:64 -g:1460
+//
+//      The rate printed is packets parsed per second including the copy of every
+//      piece into the buffer, which stands in for the recv.
+//
+//  Build:
+//      g++ -O2 -std=c++17 -I../NetworkLibrary PacketBench.cpp ../NetworkLibrary/PacketRingBuffer.cpp -o packetbench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "PacketRingBuffer.h"
+
+#define SEGMENT_TABLE   4096
+
+typedef struct _OPTIONS {
+	int nPackets;
+	int nMaxBody;
+	int nMaxSegment;
+	int nRounds;
+	unsigned nSeed;
+} OPTIONS;
+
+static OPTIONS default_options = { 1000000, 64, 1460, 5, 1 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+static uint64_t RunRound(const char* pStream, size_t nStreamSize, const uint16_t* pBodyLength,
+	const int* pSegments, uint64_t* pMismatches);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+int main(int argc, char* argv[]) {
+
+	char* pStream = NULL;
+	size_t nStreamSize = 0;
+	uint16_t* pBodyLength = NULL;
+	int Segments[SEGMENT_TABLE];
+	uint64_t nBestNs = 0;
+	uint64_t nMismatches = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	srand(g_Options.nSeed);
+
+	//
+	// generate the stream up front so the timed loop only frames
+	//
+	pBodyLength = (uint16_t*)malloc(g_Options.nPackets * sizeof(uint16_t));
+	pStream = (char*)malloc((size_t)g_Options.nPackets * (PACKET_HEADER_SIZE + g_Options.nMaxBody));
+	if (pBodyLength == NULL || pStream == NULL) {
+		printf("malloc() failed\n");
+		return(1);
+	}
+
+	for (int i = 0; i < g_Options.nPackets; i++) {
+		pBodyLength[i] = (uint16_t)(rand() % (g_Options.nMaxBody + 1));
+		PacketWriteHeader(pStream + nStreamSize, (uint16_t)i, pBodyLength[i]);
+		memset(pStream + nStreamSize + PACKET_HEADER_SIZE, (unsigned char)i, pBodyLength[i]);
+		nStreamSize += PACKET_HEADER_SIZE + pBodyLength[i];
+	}
+
+	for (int i = 0; i < SEGMENT_TABLE; i++)
+		Segments[i] = 1 + rand() % g_Options.nMaxSegment;
+
+	for (int r = 0; r < g_Options.nRounds; r++) {
+		uint64_t nNs = RunRound(pStream, nStreamSize, pBodyLength, Segments, &nMismatches);
+		if (nBestNs == 0 || nNs < nBestNs)
+			nBestNs = nNs;
+	}
+
+	printf("packets: %d  body: 0-%d bytes  recv pieces: 1-%d bytes  rounds: %d\n",
+		g_Options.nPackets, g_Options.nMaxBody, g_Options.nMaxSegment, g_Options.nRounds);
+	printf("packets/s: %.0f  throughput: %.2f MB/s  (%.1f ns per packet, best round)\n",
+		g_Options.nPackets / (nBestNs / 1e9),
+		nStreamSize / (nBestNs / 1e9) / (1024 * 1024),
+		(double)nBestNs / g_Options.nPackets);
+
+	if (nMismatches) {
+		printf("%llu packets did not match what was sent\n", (unsigned long long)nMismatches);
+		return(1);
+	}
+
+	free(pStream);
+	free(pBodyLength);
+	return(0);
+}
+
+//
+// Abstract:
+//      Feed the whole stream through a fresh PacketRingBuffer once and return the
+//      time it took.  Packets are compared by id, length and the first and last
+//      byte of the body.
+//
+static uint64_t RunRound(const char* pStream, size_t nStreamSize, const uint16_t* pBodyLength,
+	const int* pSegments, uint64_t* pMismatches) {
+
+	PacketRingBuffer Ring;
+	PacketView View;
+	size_t nOffset = 0;
+	size_t nPiece = 0;
+	int nSegment = 0;
+	int nPacket = 0;
+	int nRet = 0;
+	uint64_t nStart = 0;
+
+	if (Ring.Init() != 0) {
+		printf("PacketRingBuffer::Init() failed\n");
+		exit(1);
+	}
+
+	nStart = NowNs();
+	while (nOffset < nStreamSize) {
+		char* pWrite = Ring.WritePtr();
+
+		nPiece = pSegments[nSegment++ % SEGMENT_TABLE];
+		if (nPiece > nStreamSize - nOffset)
+			nPiece = nStreamSize - nOffset;
+		if (nPiece > Ring.WritableSize())
+			nPiece = Ring.WritableSize();
+
+		memcpy(pWrite, pStream + nOffset, nPiece);
+		Ring.Commit(nPiece);
+		nOffset += nPiece;
+
+		while ((nRet = Ring.Next(&View)) == 1) {
+			uint16_t nLength = pBodyLength[nPacket];
+
+			if (View.id != (uint16_t)nPacket || View.bodyLength != nLength ||
+				(nLength && ((unsigned char)View.body[0] != (unsigned char)nPacket ||
+					(unsigned char)View.body[nLength - 1] != (unsigned char)nPacket)))
+				(*pMismatches)++;
+			nPacket++;
+		}
+		if (nRet < 0) {
+			printf("PacketRingBuffer::Next() failed: %d at packet %d\n", nRet, nPacket);
+			exit(1);
+		}
+	}
+
+	nStart = NowNs() - nStart;
+
+	//
+	// packets lost or left over count as one mismatch
+	//
+	if (nPacket != g_Options.nPackets || Ring.Pending())
+		(*pMismatches)++;
+
+	return(nStart);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'b':
+				if (strlen(argv[i]) > 3)
+					g_Options.nMaxBody = atoi(&argv[i][3]);
+				break;
+
+			case 'g':
+				if (strlen(argv[i]) > 3)
+					g_Options.nMaxSegment = atoi(&argv[i][3]);
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPackets = atoi(&argv[i][3]);
+				break;
+
+			case 'r':
+				if (strlen(argv[i]) > 3)
+					g_Options.nRounds = atoi(&argv[i][3]);
+				break;
+
+			case 's':
+				if (strlen(argv[i]) > 3)
+					g_Options.nSeed = (unsigned)atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nPackets < 1 || g_Options.nMaxBody < 0 ||
+		g_Options.nMaxBody > MAX_PACKET_SIZE - PACKET_HEADER_SIZE ||
+		g_Options.nMaxSegment < 1 || g_Options.nRounds < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-b:#] [-g:#] [-n:#] [-r:#] [-s:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -b:#\t\tLargest packet body in bytes (Def:%d, max:%d)\n",
+		pOptions->nMaxBody, MAX_PACKET_SIZE - PACKET_HEADER_SIZE);
+	printf("  -g:#\t\tLargest piece handed to the buffer at once (Def:%d)\n",
+		pOptions->nMaxSegment);
+	printf("  -n:#\t\tNumber of packets in the stream (Def:%d)\n",
+		pOptions->nPackets);
+	printf("  -r:#\t\tRounds, the best one is reported (Def:%d)\n",
+		pOptions->nRounds);
+	printf("  -s:#\t\tRandom seed (Def:%u)\n",
+		pOptions->nSeed);
+}
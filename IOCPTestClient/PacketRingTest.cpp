@@ -0,0 +1,256 @@
+//
+// Module:
+//      packetringtest.cpp
+//
+// Abstract:
+//      Unit tests of the packet framing in NetworkLibrary, PacketRingBuffer,
+//      for the boundary cases a random stream (packetbench) only hits by chance:
+//
+//          a packet that runs into the end of the buffer, which moves the unread
+//          bytes back to the start,
+//          a header split where the buffer is about to wrap, with two of its
+//          four bytes before the move and the rest after it,
+//          lengths outside [PACKET_HEADER_SIZE, MAX_PACKET_SIZE], and the
+//          bounds themselves,
+//          partial packets, a header that is not whole, a body that is not,
+//          a buffer that unread packets fill, and an empty body.
+//
+//      Every failed check is printed with its line and the exit code is 1.
+//
+//          packetringtest
+//
+//  Build:
+//      g++ -O2 -std=c++17 -I../NetworkLibrary PacketRingTest.cpp ../NetworkLibrary/PacketRingBuffer.cpp -o packetringtest
+//
+//      PacketRingBuffer.cpp includes pch.h, which only the Visual Studio build
+//      has; an empty pch.h on the include path does.
+//
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "PacketRingBuffer.h"
+
+static int g_nChecks = 0;
+static int g_nFailures = 0;
+
+#define CHECK(x) \
+	do { \
+		g_nChecks++; \
+		if (!(x)) { \
+			printf("  line %d: %s\n", __LINE__, #x); \
+			g_nFailures++; \
+		} \
+	} while (0)
+
+//
+// a packet of nBody bytes, every byte of the body derived from id and position
+//
+static size_t BuildPacket(char* pDst, uint16_t nId, uint16_t nBody) {
+	PacketWriteHeader(pDst, nId, nBody);
+	for (uint16_t i = 0; i < nBody; i++)
+		pDst[PACKET_HEADER_SIZE + i] = (char)(nId * 31 + i);
+	return(PACKET_HEADER_SIZE + nBody);
+}
+
+static bool BodyMatches(const PacketView* pView, uint16_t nId, uint16_t nBody) {
+	if (pView->id != nId || pView->bodyLength != nBody)
+		return(false);
+	for (uint16_t i = 0; i < nBody; i++)
+		if (pView->body[i] != (char)(nId * 31 + i))
+			return(false);
+	return(true);
+}
+
+//
+// copy nLength bytes into the buffer the way a recv does
+//
+static void Receive(PacketRingBuffer* pRing, const char* pData, size_t nLength) {
+	char* pWrite = pRing->WritePtr();
+
+	memcpy(pWrite, pData, nLength);
+	pRing->Commit(nLength);
+}
+
+static void TestInit(void) {
+	PacketRingBuffer Ring;
+
+	CHECK(Ring.Init(2 * MAX_PACKET_SIZE - 1) == -EINVAL);
+	CHECK(Ring.Init(2 * MAX_PACKET_SIZE) == 0);
+	CHECK(Ring.Pending() == 0);
+	CHECK(Ring.WritableSize() == 2 * MAX_PACKET_SIZE);
+}
+
+static void TestPartialPacket(void) {
+	PacketRingBuffer Ring;
+	PacketView View;
+	char Packet[MAX_PACKET_SIZE];
+	size_t nLength = BuildPacket(Packet, 7, 100);
+
+	CHECK(Ring.Init() == 0);
+
+	//
+	// one byte of the header, then the rest of it, then the body in two pieces
+	//
+	Receive(&Ring, Packet, 1);
+	CHECK(Ring.Next(&View) == 0);
+	Receive(&Ring, Packet + 1, PACKET_HEADER_SIZE - 1);
+	CHECK(Ring.Next(&View) == 0);
+	Receive(&Ring, Packet + PACKET_HEADER_SIZE, 50);
+	CHECK(Ring.Next(&View) == 0);
+	CHECK(Ring.Pending() == PACKET_HEADER_SIZE + 50);
+	Receive(&Ring, Packet + PACKET_HEADER_SIZE + 50, nLength - PACKET_HEADER_SIZE - 50);
+	CHECK(Ring.Next(&View) == 1);
+	CHECK(BodyMatches(&View, 7, 100));
+	CHECK(Ring.Next(&View) == 0);
+	CHECK(Ring.Pending() == 0);
+}
+
+static void TestEmptyBody(void) {
+	PacketRingBuffer Ring;
+	PacketView View;
+	char Packets[3 * PACKET_HEADER_SIZE];
+
+	CHECK(Ring.Init() == 0);
+	for (int i = 0; i < 3; i++)
+		BuildPacket(Packets + i * PACKET_HEADER_SIZE, (uint16_t)i, 0);
+	Receive(&Ring, Packets, sizeof(Packets));
+
+	for (int i = 0; i < 3; i++) {
+		CHECK(Ring.Next(&View) == 1);
+		CHECK(View.id == i && View.bodyLength == 0);
+	}
+	CHECK(Ring.Next(&View) == 0);
+}
+
+static void TestLengthBounds(void) {
+	PacketRingBuffer Ring;
+	PacketView View;
+	char Packet[MAX_PACKET_SIZE];
+	char Header[PACKET_HEADER_SIZE];
+	static const uint16_t BadLengths[] = { 0, 1, PACKET_HEADER_SIZE - 1, MAX_PACKET_SIZE + 1, 0xffff };
+
+	//
+	// the largest packet there may be is taken whole
+	//
+	CHECK(Ring.Init() == 0);
+	Receive(&Ring, Packet, BuildPacket(Packet, 1, MAX_PACKET_SIZE - PACKET_HEADER_SIZE));
+	CHECK(Ring.Next(&View) == 1);
+	CHECK(BodyMatches(&View, 1, MAX_PACKET_SIZE - PACKET_HEADER_SIZE));
+
+	//
+	// a length outside the bounds is an error as soon as the header is whole,
+	// however little of the packet has arrived, and stays one
+	//
+	for (size_t i = 0; i < sizeof(BadLengths) / sizeof(BadLengths[0]); i++) {
+		Ring.Reset();
+		Header[0] = (char)(BadLengths[i] & 0xff);
+		Header[1] = (char)(BadLengths[i] >> 8);
+		Header[2] = Header[3] = 0;
+		Receive(&Ring, Header, PACKET_HEADER_SIZE - 1);
+		CHECK(Ring.Next(&View) == 0);
+		Receive(&Ring, Header + PACKET_HEADER_SIZE - 1, 1);
+		CHECK(Ring.Next(&View) == -EBADMSG);
+		CHECK(Ring.Next(&View) == -EBADMSG);
+	}
+}
+
+//
+// Packets that fill the buffer up to less than MAX_PACKET_SIZE from its end,
+// so the next WritePtr() moves what is unread back to the start.  nTail is how
+// many bytes of the packet after them arrived before the move.
+//
+static void TestWrap(size_t nTail) {
+	PacketRingBuffer Ring;
+	PacketView View;
+	char Packet[MAX_PACKET_SIZE];
+	const size_t nCapacity = 2 * MAX_PACKET_SIZE;
+	const uint16_t nBody = 1000;
+	size_t nLength = 0;
+	size_t nFilled = 0;
+	uint16_t nId = 0;
+	uint16_t nNext = 0;
+	char* pStart = NULL;
+
+	CHECK(Ring.Init(nCapacity) == 0);
+	pStart = Ring.WritePtr();
+
+	//
+	// whole packets until less than MAX_PACKET_SIZE is left at the end, taken
+	// out as they arrive
+	//
+	while (nCapacity - nFilled >= MAX_PACKET_SIZE) {
+		nLength = BuildPacket(Packet, nId, nBody);
+		Receive(&Ring, Packet, nLength);
+		nFilled += nLength;
+		CHECK(Ring.Next(&View) == 1);
+		CHECK(BodyMatches(&View, nId, nBody));
+		nId++;
+	}
+
+	//
+	// the start of one more, then the move, then the rest of it and one after it
+	//
+	nNext = nId;
+	nLength = BuildPacket(Packet, nNext, nBody);
+	Receive(&Ring, Packet, nTail);
+	CHECK(Ring.Next(&View) == 0);
+	CHECK(Ring.WritePtr() == pStart + nTail);
+	CHECK(Ring.Pending() == nTail);
+	CHECK(Ring.WritableSize() == nCapacity - nTail);
+	Receive(&Ring, Packet + nTail, nLength - nTail);
+	Receive(&Ring, Packet, BuildPacket(Packet, (uint16_t)(nNext + 1), 3));
+	CHECK(Ring.Next(&View) == 1);
+	CHECK(BodyMatches(&View, nNext, nBody));
+	CHECK(View.body == pStart + PACKET_HEADER_SIZE);
+	CHECK(Ring.Next(&View) == 1);
+	CHECK(BodyMatches(&View, (uint16_t)(nNext + 1), 3));
+	CHECK(Ring.Next(&View) == 0);
+	CHECK(Ring.Pending() == 0);
+}
+
+//
+// Unread packets that fill the buffer leave no room to write; once they are
+// taken the buffer starts over from the beginning.
+//
+static void TestFull(void) {
+	PacketRingBuffer Ring;
+	PacketView View;
+	char Packet[MAX_PACKET_SIZE];
+	const size_t nCapacity = 2 * MAX_PACKET_SIZE;
+
+	CHECK(Ring.Init(nCapacity) == 0);
+	Receive(&Ring, Packet, BuildPacket(Packet, 1, MAX_PACKET_SIZE - PACKET_HEADER_SIZE));
+	Receive(&Ring, Packet, BuildPacket(Packet, 2, MAX_PACKET_SIZE - PACKET_HEADER_SIZE));
+	CHECK(Ring.WritableSize() == 0);
+	CHECK(Ring.Next(&View) == 1);
+	CHECK(BodyMatches(&View, 1, MAX_PACKET_SIZE - PACKET_HEADER_SIZE));
+	CHECK(Ring.Next(&View) == 1);
+	CHECK(BodyMatches(&View, 2, MAX_PACKET_SIZE - PACKET_HEADER_SIZE));
+	Ring.WritePtr();
+	CHECK(Ring.WritableSize() == nCapacity);
+}
+
+int main(void) {
+
+	TestInit();
+	TestPartialPacket();
+	TestEmptyBody();
+	TestLengthBounds();
+
+	//
+	// nothing of the next packet, part of its header (split across the end),
+	// all of the header, and part of the body
+	//
+	TestWrap(0);
+	TestWrap(1);
+	TestWrap(PACKET_HEADER_SIZE / 2);
+	TestWrap(PACKET_HEADER_SIZE);
+	TestWrap(PACKET_HEADER_SIZE + 500);
+	TestFull();
+
+	printf("%d checks, %d failed\n", g_nChecks, g_nFailures);
+	return(g_nFailures ? 1 : 0);
+}
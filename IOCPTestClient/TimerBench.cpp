@@ -0,0 +1,287 @@
+//
+// Module:
+//      timerbench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Per-session timer benchmark of TimerWheel (NetworkLibrary) against a
+//      std::priority_queue.  Every session runs an idle timer that is pushed
+//      back whenever the session receives a packet, the way a server kicks a
+//      connection that stays silent too long.  Each tick a number of the
+//      sessions receive, and the clock advances one millisecond tick; a session
+//      whose timer fires is kicked and a new one takes its place.
+//
+//      A priority queue cannot take an entry out, so restarting a timer there
+//      pushes a new entry and the stale one is skipped when it surfaces, which
+//      is what a heap based timer usually does.  Both run the same sessions
+//      from the same random sequence; the timers that fire must be the same,
+//      on the tick they were due, otherwise the exit code is 1.
+//
+//          timerbench -n:100000 -t:60000
+//
+//  Build:
+//      g++ -O2 -std=c++14 -I../NetworkLibrary TimerBench.cpp ../NetworkLibrary/TimerWheel.cpp -o timerbench
+//
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <queue>
+#include <vector>
+
+#include "TimerWheel.h"
+
+typedef struct _OPTIONS {
+	int nSessions;
+	int nTicks;
+	int nIdleTicks;
+	int nActive;
+} OPTIONS;
+
+typedef struct _SESSION {
+	TimerWheelEntry IdleTimer;
+	uint64_t nExpires;              // for the priority queue
+} SESSION;
+
+typedef struct _HEAP_ENTRY {
+	uint64_t nExpires;
+	uint32_t nSession;
+
+	bool operator<(const _HEAP_ENTRY& Other) const { return(nExpires > Other.nExpires); }
+} HEAP_ENTRY;
+
+typedef struct _RESULT {
+	uint64_t nRestarts;
+	uint64_t nFired;
+	uint64_t nLate;                 // fired on another tick than it was due
+	uint64_t nChecksum;             // of session and tick of every firing
+	uint64_t nRestartNs;
+	uint64_t nAdvanceNs;
+} RESULT;
+
+static OPTIONS default_options = { 100000, 60000, 5000, 20 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static uint32_t g_nSeed;
+
+static uint32_t Random(void) {
+	g_nSeed = g_nSeed * 1664525u + 1013904223u;
+	return(g_nSeed >> 8);
+}
+
+//
+// the sessions that receive on a tick, the same for both runs
+//
+static void PickActive(std::vector<uint32_t>& Active) {
+	Active.clear();
+	for (int i = 0; i < g_Options.nActive; i++)
+		Active.push_back(Random() % g_Options.nSessions);
+}
+
+static void Fired(RESULT* pResult, uint32_t nSession, uint64_t nTick, uint64_t nExpires) {
+	pResult->nFired++;
+	if (nTick != nExpires)
+		pResult->nLate++;
+	pResult->nChecksum += ((uint64_t)nSession * 2654435761u) ^ nTick;
+}
+
+static void RunWheel(RESULT* pResult) {
+	std::vector<SESSION> Sessions(g_Options.nSessions);
+	std::vector<uint32_t> Active;
+	TimerWheel Wheel;
+	uint64_t nStart = 0;
+
+	memset(pResult, 0, sizeof(*pResult));
+	g_nSeed = 12345;
+	Wheel.Init(0);
+	for (int s = 0; s < g_Options.nSessions; s++) {
+		TimerWheel::InitEntry(&Sessions[s].IdleTimer);
+		Wheel.Schedule(&Sessions[s].IdleTimer, 1 + Random() % g_Options.nIdleTicks);
+	}
+
+	for (uint64_t nTick = 1; nTick <= (uint64_t)g_Options.nTicks; nTick++) {
+		PickActive(Active);
+
+		nStart = NowNs();
+		for (uint32_t s : Active)
+			Wheel.Schedule(&Sessions[s].IdleTimer, nTick + g_Options.nIdleTicks);
+		pResult->nRestartNs += NowNs() - nStart;
+		pResult->nRestarts += Active.size();
+
+		nStart = NowNs();
+		TimerWheelEntry* pEntry = Wheel.Advance(nTick);
+		while (pEntry) {
+			TimerWheelEntry* pNext = pEntry->next;
+			uint32_t s = (uint32_t)((SESSION*)((char*)pEntry - offsetof(SESSION, IdleTimer)) - &Sessions[0]);
+
+			Fired(pResult, s, nTick, pEntry->expires);
+			Wheel.Schedule(pEntry, nTick + g_Options.nIdleTicks);
+			pEntry = pNext;
+		}
+		pResult->nAdvanceNs += NowNs() - nStart;
+	}
+}
+
+static void RunHeap(RESULT* pResult) {
+	std::vector<SESSION> Sessions(g_Options.nSessions);
+	std::vector<uint32_t> Active;
+	std::priority_queue<HEAP_ENTRY> Heap;
+	uint64_t nStart = 0;
+
+	memset(pResult, 0, sizeof(*pResult));
+	g_nSeed = 12345;
+	for (int s = 0; s < g_Options.nSessions; s++) {
+		Sessions[s].nExpires = 1 + Random() % g_Options.nIdleTicks;
+		Heap.push({ Sessions[s].nExpires, (uint32_t)s });
+	}
+
+	for (uint64_t nTick = 1; nTick <= (uint64_t)g_Options.nTicks; nTick++) {
+		PickActive(Active);
+
+		nStart = NowNs();
+		for (uint32_t s : Active) {
+			Sessions[s].nExpires = nTick + g_Options.nIdleTicks;
+			Heap.push({ Sessions[s].nExpires, s });
+		}
+		pResult->nRestartNs += NowNs() - nStart;
+		pResult->nRestarts += Active.size();
+
+		//
+		// an entry that no longer matches its session was restarted since
+		//
+		nStart = NowNs();
+		while (!Heap.empty() && Heap.top().nExpires <= nTick) {
+			HEAP_ENTRY Entry = Heap.top();
+
+			Heap.pop();
+			if (Sessions[Entry.nSession].nExpires != Entry.nExpires)
+				continue;
+			Fired(pResult, Entry.nSession, nTick, Entry.nExpires);
+			Sessions[Entry.nSession].nExpires = nTick + g_Options.nIdleTicks;
+			Heap.push({ Sessions[Entry.nSession].nExpires, Entry.nSession });
+		}
+		pResult->nAdvanceNs += NowNs() - nStart;
+	}
+}
+
+static void Report(const char* szName, RESULT* pResult) {
+	printf("%-16s %6.1f ns per restart  %7.2f us per tick advance  %6.1f ns per timer fired  (%llu fired)\n",
+		szName, pResult->nRestarts ? (double)pResult->nRestartNs / pResult->nRestarts : 0.0,
+		pResult->nAdvanceNs / 1e3 / g_Options.nTicks,
+		pResult->nFired ? (double)pResult->nAdvanceNs / pResult->nFired : 0.0,
+		(unsigned long long)pResult->nFired);
+}
+
+int main(int argc, char* argv[]) {
+
+	RESULT Wheel;
+	RESULT Heap;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	printf("timers: %d  ticks: %d  idle timeout: %d ticks  restarted per tick: %d\n",
+		g_Options.nSessions, g_Options.nTicks, g_Options.nIdleTicks, g_Options.nActive);
+
+	RunWheel(&Wheel);
+	Report("timing wheel", &Wheel);
+	RunHeap(&Heap);
+	Report("priority_queue", &Heap);
+
+	if (Wheel.nFired != Heap.nFired || Wheel.nChecksum != Heap.nChecksum || Wheel.nLate || Heap.nLate) {
+		printf("timers fired differently: wheel %llu (%llu late), heap %llu (%llu late)\n",
+			(unsigned long long)Wheel.nFired, (unsigned long long)Wheel.nLate,
+			(unsigned long long)Heap.nFired, (unsigned long long)Heap.nLate);
+		nFailures++;
+	}
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nSessions = atoi(&argv[i][3]);
+				break;
+
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nTicks = atoi(&argv[i][3]);
+				break;
+
+			case 'i':
+				if (strlen(argv[i]) > 3)
+					g_Options.nIdleTicks = atoi(&argv[i][3]);
+				break;
+
+			case 'a':
+				if (strlen(argv[i]) > 3)
+					g_Options.nActive = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nSessions < 1 || g_Options.nTicks < 1 || g_Options.nIdleTicks < 1 ||
+		g_Options.nActive < 0) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-n:#] [-t:#] [-i:#] [-a:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -n:#\t\tSessions, one timer each (Def:%d)\n",
+		pOptions->nSessions);
+	printf("  -t:#\t\tTicks to run (Def:%d)\n",
+		pOptions->nTicks);
+	printf("  -i:#\t\tIdle timeout in ticks (Def:%d)\n",
+		pOptions->nIdleTicks);
+	printf("  -a:#\t\tSessions that receive each tick (Def:%d)\n",
+		pOptions->nActive);
+}
@@ -0,0 +1,317 @@
+//
+// Module:
+//      tracebench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Cost and consistency benchmark of the packet trace the server keeps with
+//      PACKET_TRACE=1 (-x).  First it times the clock reads a span is made of,
+//      the TSC that PacketTrace uses against the steady clock.  Then a number of
+//      threads, standing in for the workers, each write spans into a PacketTrace
+//      as fast as they can, while a dumper thread dumps it every few milliseconds,
+//      as /trace does.
+//
+//      Every span a writer writes holds its packet id, a value of three times
+//      the id and a name that says whether the id is odd, so a span that was
+//      dumped while it was being overwritten shows up as one that does not add
+//      up.  Every dump must parse, hold only whole spans, and list the spans of
+//      every thread in the order they were written, otherwise the exit code is 1.
+//      Reported is the time per span, in processor time of the writers, and the
+//      spans and time per dump.
+//
+//          tracebench -t:4 -n:10000000
+//
+//  Build:
+//      g++ -O2 -std=c++17 -DPACKET_TRACE=1 -I../NetworkLibrary TraceBench.cpp ../NetworkLibrary/PacketTrace.cpp -lpthread -o tracebench
+//
+//      PacketTrace.cpp includes pch.h, which only the Visual Studio build has;
+//      an empty pch.h on the include path does.
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PacketTrace.h"
+
+#if !PACKET_TRACE
+#error build with -DPACKET_TRACE=1
+#endif
+
+typedef struct _OPTIONS {
+	int nThreads;
+	int nSpans;                     // per thread
+	int nDumpMs;                    // between dumps
+} OPTIONS;
+
+typedef struct _RESULT {
+	uint64_t nSpanNs;               // run time of the writers, summed
+	uint64_t nDumps;
+	uint64_t nDumpedSpans;          // over every dump
+	uint64_t nDumpNs;
+	uint64_t nErrors;               // torn spans, spans out of order, dumps that do not parse
+} RESULT;
+
+static OPTIONS default_options = { 4, 10000000, 5 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+//
+// the time this thread ran, so writers that share processors are not charged
+// for each other
+//
+static uint64_t ThreadNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+//
+// the nanoseconds one clock read takes, the best of a few rounds
+//
+template <typename CLOCK>
+static double ClockNs(CLOCK Read) {
+	const int nReads = 10000000;
+	double dBest = 1e9;
+	uint64_t nSink = 0;
+
+	for (int r = 0; r < 3; r++) {
+		uint64_t nStart = NowNs();
+
+		for (int i = 0; i < nReads; i++)
+			nSink += Read();
+		dBest = std::min(dBest, (double)(NowNs() - nStart) / nReads);
+	}
+	if (nSink == 42)
+		printf(" ");
+	return(dBest);
+}
+
+static void Writer(PacketTrace* pTrace, std::atomic<uint64_t>* pNs) {
+	uint64_t nStart = ThreadNs();
+
+	for (int i = 0; i < g_Options.nSpans; i++) {
+		uint64_t nId = pTrace->NextId();
+		uint64_t nBegin = TRACE_NOW();
+
+		TRACE_SPAN(*pTrace, (nId & 1) ? "odd" : "even", nBegin, TRACE_NOW(), nId, nId * 3);
+	}
+	pNs->fetch_add(ThreadNs() - nStart);
+}
+
+//
+// Check one dump: every span whole, and the ids of every thread rising.  A
+// thread's ids are (thread + 1) << 40 | n, so rising ids are spans in order.
+//
+static uint64_t CheckDump(const std::string& Json, uint64_t* pnSpans) {
+	std::vector<uint64_t> LastIds;
+	uint64_t nErrors = 0;
+	const char* pLine = Json.c_str();
+
+	*pnSpans = 0;
+	if (strncmp(pLine, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 38) != 0 ||
+		Json.size() < 4 || Json.compare(Json.size() - 4, 4, "\n]}\n") != 0)
+		return(1);
+
+	while ((pLine = strchr(pLine, '\n')) != NULL) {
+		char szLine[512];
+		char szName[16];
+		unsigned nTid = 0;
+		double dTs = 0;
+		double dDur = 0;
+		unsigned long long nId = 0;
+		unsigned long long nValue = 0;
+
+		pLine++;
+		if (*pLine == '\0')
+			break;
+		if (*pLine == '\n')
+			continue;
+		if (strncmp(pLine, "{\"name\":\"thread_name\"", 21) == 0 || strncmp(pLine, "]}", 2) == 0)
+			continue;
+
+		//
+		// sscanf takes the length of what it reads first, so it gets one line
+		//
+		snprintf(szLine, sizeof(szLine), "%.*s", (int)(strcspn(pLine, "\n") % sizeof(szLine)), pLine);
+		if (sscanf(szLine, "{\"name\":\"%15[^\"]\",\"cat\":\"packet\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lf,\"dur\":%lf,"
+			"\"args\":{\"packet\":\"0x%llx\",\"value\":%llu}}", szName, &nTid, &dTs, &dDur, &nId, &nValue) != 6) {
+			nErrors++;
+			continue;
+		}
+
+		if (nValue != nId * 3 || strcmp(szName, (nId & 1) ? "odd" : "even") != 0 || dDur < 0)
+			nErrors++;
+		if (nTid >= LastIds.size())
+			LastIds.resize(nTid + 1, 0);
+		if (nId <= LastIds[nTid] || (nId >> 40) != nTid + 1)
+			nErrors++;
+		LastIds[nTid] = nId;
+		(*pnSpans)++;
+	}
+
+	return(nErrors);
+}
+
+static void Run(RESULT* pResult) {
+	std::unique_ptr<PacketTrace> Trace(new PacketTrace);
+	std::vector<std::thread> Threads;
+	std::atomic<uint64_t> nNs(0);
+	std::atomic<int> nRunning(g_Options.nThreads);
+	std::string Json;
+	uint64_t nSpans = 0;
+
+	memset(pResult, 0, sizeof(*pResult));
+	Trace->Init(1);
+
+	for (int t = 0; t < g_Options.nThreads; t++) {
+		Threads.emplace_back([&]() {
+			Writer(Trace.get(), &nNs);
+			nRunning.fetch_sub(1);
+		});
+	}
+
+	//
+	// the dumper: one whole dump every time, as /trace does
+	//
+	while (true) {
+		bool bLast = (nRunning.load() == 0);
+		uint64_t nStart = NowNs();
+
+		Json.clear();
+		Trace->Dump(&Json);
+		pResult->nDumpNs += NowNs() - nStart;
+		pResult->nErrors += CheckDump(Json, &nSpans);
+		pResult->nDumpedSpans += nSpans;
+		pResult->nDumps++;
+
+		if (bLast) {
+			uint64_t nExpected = (uint64_t)g_Options.nThreads *
+				std::min<uint64_t>(g_Options.nSpans, TRACE_RING_SIZE - 1);
+
+			if (nSpans != nExpected) {
+				printf("the last dump has %llu spans, %llu expected\n", (unsigned long long)nSpans,
+					(unsigned long long)nExpected);
+				pResult->nErrors++;
+			}
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(g_Options.nDumpMs));
+	}
+
+	for (auto& Thread : Threads)
+		Thread.join();
+	pResult->nSpanNs = nNs.load();
+}
+
+int main(int argc, char* argv[]) {
+
+	RESULT Result;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	printf("threads: %d  spans: %d each  dump every %d ms\n",
+		g_Options.nThreads, g_Options.nSpans, g_Options.nDumpMs);
+
+	printf("TSC read     %6.2f ns\n", ClockNs([]() { return(PacketTrace::Now()); }));
+	printf("steady clock %6.2f ns\n", ClockNs([]() {
+		return((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count()); }));
+
+	Run(&Result);
+	printf("span         %6.2f ns  (two TSC reads, an id and a ring write)\n",
+		(double)Result.nSpanNs / ((double)g_Options.nThreads * g_Options.nSpans));
+	printf("dumps        %6llu  %llu spans and %.2f ms each\n", (unsigned long long)Result.nDumps,
+		(unsigned long long)(Result.nDumpedSpans / Result.nDumps), (double)Result.nDumpNs / Result.nDumps / 1e6);
+
+	if (Result.nErrors) {
+		printf("%llu spans torn, out of order or unreadable\n", (unsigned long long)Result.nErrors);
+		nFailures++;
+	}
+
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 't':
+				if (strlen(argv[i]) > 3)
+					g_Options.nThreads = atoi(&argv[i][3]);
+				break;
+
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nSpans = atoi(&argv[i][3]);
+				break;
+
+			case 'd':
+				if (strlen(argv[i]) > 3)
+					g_Options.nDumpMs = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nThreads < 1 || g_Options.nSpans < 1 || g_Options.nDumpMs < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-t:#] [-n:#] [-d:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -t:#\t\tWriter threads (Def:%d)\n",
+		pOptions->nThreads);
+	printf("  -n:#\t\tSpans per thread (Def:%d)\n",
+		pOptions->nSpans);
+	printf("  -d:#\t\tMilliseconds between dumps (Def:%d)\n",
+		pOptions->nDumpMs);
+}
@@ -0,0 +1,272 @@
+//
+// Module:
+//      wirebench.cpp
+//
+// Abstract:
+//      Use the -? commandline switch to determine available options.
+//
+//      Encode and decode microbenchmark of the flat wire format (WireSchema.h)
+//      for the small position and state packets the server sends every tick.
+//      Encoding builds the packets with their Builder straight into one send
+//      buffer; decoding walks that buffer and reads every field through a Reader
+//      in place.  For comparison the position packets are also decoded the usual
+//      way, into an object allocated per packet.  Everything decoded is checked
+//      against what was encoded, otherwise the exit code is 1.
+//
+//          wirebench -n:1000000
+//
+//  Build:
+//      g++ -O2 -std=c++14 -I../NetworkLibrary WireBench.cpp ../NetworkLibrary/PacketRingBuffer.cpp -o wirebench
+//
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "WireSchema.h"
+
+typedef struct _OPTIONS {
+	int nPackets;
+	int nRounds;
+} OPTIONS;
+
+//
+// what a decoder that builds objects would produce for a PositionUpdate
+//
+typedef struct _POSITION_OBJECT {
+	uint32_t nEntityId;
+	uint32_t nTick;
+	float X;
+	float Y;
+	float Z;
+	float Yaw;
+} POSITION_OBJECT;
+
+static OPTIONS default_options = { 1000000, 5 };
+static OPTIONS g_Options;
+
+static bool ValidOptions(char* argv[], int argc);
+static void Usage(char* szProgramname, OPTIONS* pOptions);
+
+static uint64_t NowNs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+static void EncodePositions(char* pBuffer, int nPackets) {
+	for (int i = 0; i < nPackets; i++) {
+		PositionUpdate::Builder(pBuffer + (size_t)i * PositionUpdate::PacketSize)
+			.SetEntityId((uint32_t)i)
+			.SetTick((uint32_t)i >> 4)
+			.SetX((float)i)
+			.SetY((float)i * 0.5f)
+			.SetZ(1.0f)
+			.SetYaw((float)(i & 0xff));
+	}
+}
+
+static void EncodeStates(char* pBuffer, int nPackets) {
+	for (int i = 0; i < nPackets; i++) {
+		StateUpdate::Builder(pBuffer + (size_t)i * StateUpdate::PacketSize)
+			.SetEntityId((uint32_t)i)
+			.SetTick((uint32_t)i >> 4)
+			.SetHp((uint16_t)i)
+			.SetMaxHp(1000)
+			.SetAnimationId((uint16_t)(i & 0x3f))
+			.SetState((uint8_t)(i & 7))
+			.SetFlags((uint8_t)i);
+	}
+}
+
+//
+// The decoders walk the buffer by the length in every header, the way packets
+// come out of a PacketRingBuffer, and fold every field into a checksum.
+//
+static double DecodePositions(const char* pBuffer, size_t nSize) {
+	double dSum = 0.0;
+
+	for (size_t nOffset = 0; nOffset < nSize; ) {
+		PositionUpdate::Reader Reader(pBuffer + nOffset + PACKET_HEADER_SIZE);
+
+		dSum += Reader.EntityId() + Reader.Tick() + Reader.X() + Reader.Y() + Reader.Z() + Reader.Yaw();
+		nOffset += WireLoad<uint16_t>(pBuffer + nOffset);
+	}
+	return(dSum);
+}
+
+static double DecodeStates(const char* pBuffer, size_t nSize) {
+	double dSum = 0.0;
+
+	for (size_t nOffset = 0; nOffset < nSize; ) {
+		StateUpdate::Reader Reader(pBuffer + nOffset + PACKET_HEADER_SIZE);
+
+		dSum += Reader.EntityId() + Reader.Tick() + Reader.Hp() + Reader.MaxHp() +
+			Reader.AnimationId() + Reader.State() + Reader.Flags();
+		nOffset += WireLoad<uint16_t>(pBuffer + nOffset);
+	}
+	return(dSum);
+}
+
+static double DecodePositionObjects(const char* pBuffer, size_t nSize) {
+	double dSum = 0.0;
+
+	for (size_t nOffset = 0; nOffset < nSize; ) {
+		PositionUpdate::Reader Reader(pBuffer + nOffset + PACKET_HEADER_SIZE);
+		POSITION_OBJECT* pObject = new POSITION_OBJECT;
+
+		pObject->nEntityId = Reader.EntityId();
+		pObject->nTick = Reader.Tick();
+		pObject->X = Reader.X();
+		pObject->Y = Reader.Y();
+		pObject->Z = Reader.Z();
+		pObject->Yaw = Reader.Yaw();
+		dSum += pObject->nEntityId + pObject->nTick + pObject->X + pObject->Y + pObject->Z + pObject->Yaw;
+		delete pObject;
+
+		nOffset += WireLoad<uint16_t>(pBuffer + nOffset);
+	}
+	return(dSum);
+}
+
+//
+// time one pass of Pass over the buffer, keeping the best of g_Options.nRounds
+//
+template <typename Pass>
+static uint64_t BestOf(Pass pass) {
+	uint64_t nBestNs = 0;
+
+	for (int r = 0; r < g_Options.nRounds; r++) {
+		uint64_t nStart = NowNs();
+		pass();
+		uint64_t nNs = NowNs() - nStart;
+		if (nBestNs == 0 || nNs < nBestNs)
+			nBestNs = nNs;
+	}
+	return(nBestNs);
+}
+
+static void Report(const char* szName, int nPacketSize, uint64_t nNs) {
+	printf("%-24s %2d bytes  %6.2f ns per packet  (%.0f packets/s)\n",
+		szName, nPacketSize, (double)nNs / g_Options.nPackets, g_Options.nPackets / (nNs / 1e9));
+}
+
+int main(int argc, char* argv[]) {
+
+	char* pPositions = NULL;
+	char* pStates = NULL;
+	size_t nPositionSize = 0;
+	size_t nStateSize = 0;
+	double dExpected = 0.0;
+	double dPositionSum = 0.0;
+	double dStateSum = 0.0;
+	double dObjectSum = 0.0;
+	int nFailures = 0;
+
+	if (!ValidOptions(argv, argc))
+		return(1);
+
+	nPositionSize = (size_t)g_Options.nPackets * PositionUpdate::PacketSize;
+	nStateSize = (size_t)g_Options.nPackets * StateUpdate::PacketSize;
+	pPositions = (char*)malloc(nPositionSize);
+	pStates = (char*)malloc(nStateSize);
+	if (pPositions == NULL || pStates == NULL) {
+		printf("malloc() failed\n");
+		return(1);
+	}
+
+	printf("packets: %d  rounds: %d\n", g_Options.nPackets, g_Options.nRounds);
+
+	Report("encode PositionUpdate", PositionUpdate::PacketSize,
+		BestOf([&] { EncodePositions(pPositions, g_Options.nPackets); }));
+	Report("decode PositionUpdate", PositionUpdate::PacketSize,
+		BestOf([&] { dPositionSum = DecodePositions(pPositions, nPositionSize); }));
+	Report("encode StateUpdate", StateUpdate::PacketSize,
+		BestOf([&] { EncodeStates(pStates, g_Options.nPackets); }));
+	Report("decode StateUpdate", StateUpdate::PacketSize,
+		BestOf([&] { dStateSum = DecodeStates(pStates, nStateSize); }));
+	Report("decode to heap objects", PositionUpdate::PacketSize,
+		BestOf([&] { dObjectSum = DecodePositionObjects(pPositions, nPositionSize); }));
+
+	//
+	// the same sums computed from the values that were encoded
+	//
+	for (int i = 0; i < g_Options.nPackets; i++)
+		dExpected += (uint32_t)i + ((uint32_t)i >> 4) + (float)i + (float)i * 0.5f + 1.0f + (float)(i & 0xff);
+	if (dPositionSum != dExpected || dObjectSum != dExpected) {
+		printf("PositionUpdate decoded %f, expected %f\n", dPositionSum, dExpected);
+		nFailures++;
+	}
+
+	dExpected = 0.0;
+	for (int i = 0; i < g_Options.nPackets; i++)
+		dExpected += (uint32_t)i + ((uint32_t)i >> 4) + (uint16_t)i + 1000 + (i & 0x3f) + (i & 7) + (uint8_t)i;
+	if (dStateSum != dExpected) {
+		printf("StateUpdate decoded %f, expected %f\n", dStateSum, dExpected);
+		nFailures++;
+	}
+
+	free(pPositions);
+	free(pStates);
+	return(nFailures ? 1 : 0);
+}
+
+static bool ValidOptions(char* argv[], int argc) {
+
+	g_Options = default_options;
+
+	for (int i = 1; i < argc; i++) {
+		if ((argv[i][0] == '-') || (argv[i][0] == '/')) {
+			switch (tolower(argv[i][1])) {
+			case 'n':
+				if (strlen(argv[i]) > 3)
+					g_Options.nPackets = atoi(&argv[i][3]);
+				break;
+
+			case 'r':
+				if (strlen(argv[i]) > 3)
+					g_Options.nRounds = atoi(&argv[i][3]);
+				break;
+
+			case '?':
+				Usage(argv[0], &default_options);
+				return(false);
+
+			default:
+				printf("  unknown options flag %s\n", argv[i]);
+				Usage(argv[0], &default_options);
+				return(false);
+			}
+		}
+		else {
+			printf("  unknown option %s\n", argv[i]);
+			Usage(argv[0], &default_options);
+			return(false);
+		}
+	}
+
+	if (g_Options.nPackets < 1 || g_Options.nRounds < 1) {
+		Usage(argv[0], &default_options);
+		return(false);
+	}
+
+	return(true);
+}
+
+//
+// Abstract:
+//      Print out usage table for the program
+//
+static void Usage(char* szProgramname, OPTIONS* pOptions) {
+
+	printf("usage:\n%s [-n:#] [-r:#]\n", szProgramname);
+	printf("%s -?\n", szProgramname);
+	printf("  -?\t\tDisplay this help\n");
+	printf("  -n:#\t\tNumber of packets of each kind (Def:%d)\n",
+		pOptions->nPackets);
+	printf("  -r:#\t\tRounds, the best one is reported (Def:%d)\n",
+		pOptions->nRounds);
+}
@@ -0,0 +1,436 @@
+﻿#include "pch.h"
+#include "BinaryLog.h"
+
+#include <errno.h>
+#include <time.h>
+
+#include <new>
+#include <system_error>
+
+#define LOG_LINE_MAX        1024            // longest formatted line, longer ones are cut
+#define LOG_FILE_BUFFER     (1u << 20)      // stdio buffer of the log file
+
+thread_local BinaryLog::ThreadLog BinaryLog::t_log = { NULL, NULL };
+
+static const char g_logLevels[] = { 'D', 'I', 'W', 'E' };
+
+static FILE* LogOpen(const char* path)
+{
+#ifdef _MSC_VER
+    FILE* file = NULL;
+
+    if (fopen_s(&file, path, "ab") != 0)
+        return(NULL);
+    return(file);
+#else
+    return(fopen(path, "ab"));
+#endif
+}
+
+static void LogLocalTime(time_t seconds, struct tm* local)
+{
+#ifdef _MSC_VER
+    localtime_s(local, &seconds);
+#else
+    localtime_r(&seconds, local);
+#endif
+}
+
+static int64_t LogNow(std::chrono::system_clock::time_point now)
+{
+    return(std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count());
+}
+
+BinaryLog::BinaryLog()
+    : m_running(false), m_level(LogLevelInfo), m_stop(false)
+    , m_file(NULL), m_fileBytes(0), m_fileLimit(LOG_FILE_BYTES), m_fileCount(LOG_FILE_COUNT)
+    , m_wallBase(0), m_steadyBase(0), m_stampSecond(-1)
+{
+    m_stamp[0] = 0;
+}
+
+//
+// Rings are only freed here, not on Exit(), since every thread that logged
+// still points at its own
+//
+BinaryLog::~BinaryLog()
+{
+    Exit();
+    for (LogRing* ring : m_rings) {
+        void* allocation = ring->allocation;
+
+        ring->~LogRing();
+        ::operator delete(allocation);
+    }
+}
+
+int BinaryLog::Init(const char* path, LogLevel level, uint64_t fileBytes, unsigned fileCount)
+{
+    if (m_writer.joinable())
+        return(-EBUSY);
+
+    m_path = path;
+    m_level = level;
+    m_fileLimit = fileBytes;
+    m_fileCount = fileCount ? fileCount : 1;
+    m_line.resize(LOG_LINE_MAX);
+    if (!Open())
+        return(errno ? -errno : -EIO);
+
+    //
+    // records carry the steady clock, which never jumps; this pair turns it into
+    // the time of day when they are written out
+    //
+    m_steadyBase = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    m_wallBase = LogNow(std::chrono::system_clock::now());
+
+    m_stop = false;
+    m_running.store(true);
+    try {
+        m_writer = std::thread(&BinaryLog::WriterMain, this);
+    }
+    catch (const std::system_error&) {
+        m_running.store(false);
+        fclose(m_file);
+        m_file = NULL;
+        return(-EAGAIN);
+    }
+    return(0);
+}
+
+void BinaryLog::Exit()
+{
+    m_running.store(false);
+    {
+        std::lock_guard<std::mutex> lock(m_stopLock);
+
+        m_stop = true;
+        m_stopWake.notify_all();
+    }
+
+    if (m_writer.joinable())
+        m_writer.join();
+
+    if (m_file) {
+        fclose(m_file);
+        m_file = NULL;
+    }
+}
+
+uint64_t BinaryLog::Dropped()
+{
+    std::lock_guard<std::mutex> lock(m_ringLock);
+    uint64_t dropped = 0;
+
+    for (LogRing* ring : m_rings)
+        dropped += ring->dropped.load(std::memory_order_relaxed);
+    return(dropped);
+}
+
+//
+// The first record of a thread gives it a ring; the only lock a thread ever
+// takes to log.  The ring is aligned by hand, new does not align to a cache
+// line before C++17.
+//
+void BinaryLog::Register()
+{
+    void* allocation = ::operator new(sizeof(LogRing) + alignof(LogRing));
+    LogRing* ring = new ((void*)(((uintptr_t)allocation + alignof(LogRing) - 1) &
+        ~(uintptr_t)(alignof(LogRing) - 1))) LogRing();
+    std::lock_guard<std::mutex> lock(m_ringLock);
+
+    ring->allocation = allocation;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped.store(0, std::memory_order_relaxed);
+    ring->reported = 0;
+    ring->thread = (uint32_t)m_rings.size();
+    m_rings.push_back(ring);
+
+    t_log.owner = this;
+    t_log.ring = ring;
+}
+
+void BinaryLog::WriterMain()
+{
+    std::unique_lock<std::mutex> lock(m_stopLock);
+
+    while (!m_stop) {
+        lock.unlock();
+        bool wrote = Drain();
+        lock.lock();
+
+        if (!wrote)
+            m_stopWake.wait_for(lock, std::chrono::milliseconds(LOG_IDLE_MS));
+    }
+    lock.unlock();
+
+    //
+    // what was logged before Exit() still goes out
+    //
+    while (Drain())
+        ;
+}
+
+//
+// Write out what every ring holds now, oldest first across all of them.
+// Returns true if anything was written.
+//
+bool BinaryLog::Drain()
+{
+    std::vector<LogRing*> rings;
+    std::vector<uint64_t> heads;
+    bool wrote = false;
+
+    {
+        std::lock_guard<std::mutex> lock(m_ringLock);
+
+        rings = m_rings;
+    }
+
+    for (LogRing* ring : rings) {
+        uint64_t dropped = ring->dropped.load(std::memory_order_relaxed);
+
+        heads.push_back(ring->head.load(std::memory_order_acquire));
+        if (dropped != ring->reported) {
+            int length = snprintf(m_line.data(), m_line.size(), "[%u] W %llu records dropped, the ring was full\n",
+                ring->thread, (unsigned long long)(dropped - ring->reported));
+
+            Emit(m_line.data(), (size_t)length);
+            ring->reported = dropped;
+            wrote = true;
+        }
+    }
+
+    while (true) {
+        LogRing* oldest = NULL;
+        const LogRecord* record = NULL;
+
+        for (size_t i = 0; i < rings.size(); i++) {
+            uint64_t tail = rings[i]->tail.load(std::memory_order_relaxed);
+            const LogRecord* next = NULL;
+
+            if (tail == heads[i])
+                continue;
+            next = &rings[i]->records[tail & (LOG_RING_SIZE - 1)];
+            if (record == NULL || next->time < record->time) {
+                oldest = rings[i];
+                record = next;
+            }
+        }
+        if (record == NULL)
+            break;
+
+        Format(record);
+        oldest->tail.store(oldest->tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        wrote = true;
+    }
+
+    if (wrote && m_file)
+        fflush(m_file);
+    return(wrote);
+}
+
+//
+// One record as a line: local time to the microsecond, thread, level, message
+//
+void BinaryLog::Format(const LogRecord* record)
+{
+    char* line = m_line.data();
+    size_t size = m_line.size() - 1;        // room for the newline
+    size_t length = 0;
+    int64_t wall = m_wallBase + (record->time - m_steadyBase);
+    const char* format = record->site->format;
+    unsigned arg = 0;
+
+    //
+    // the date and time change once a second, far less often than lines are written
+    //
+    if (wall / 1000000000 != m_stampSecond) {
+        struct tm local;
+
+        m_stampSecond = wall / 1000000000;
+        LogLocalTime((time_t)m_stampSecond, &local);
+        snprintf(m_stamp, sizeof(m_stamp), "%04d-%02d-%02d %02d:%02d:%02d",
+            local.tm_year % 10000 + 1900, (local.tm_mon + 1) % 100, local.tm_mday % 100,
+            local.tm_hour % 100, local.tm_min % 100, local.tm_sec % 100);
+    }
+    length = (size_t)snprintf(line, size, "%s.%06d [%u] %c ", m_stamp,
+        (int)(wall % 1000000000 / 1000), record->thread, g_logLevels[record->site->level]);
+
+    while (*format && length < size) {
+        char spec[32];
+        size_t specLength = 0;
+        char conversion = 0;
+        LogArgType type = LogArgInt;
+        uint64_t value = 0;
+        int written = 0;
+
+        if (*format != '%') {
+            line[length++] = *format++;
+            continue;
+        }
+        if (format[1] == '%') {
+            line[length++] = '%';
+            format += 2;
+            continue;
+        }
+
+        //
+        // keep flags, width and precision, drop the length modifier, and put
+        // back the one for a 64-bit value
+        //
+        spec[specLength++] = *format++;
+        while (*format && strchr("-+ #0123456789.", *format) && specLength < sizeof(spec) - 4)
+            spec[specLength++] = *format++;
+        while (*format && strchr("hljztLIq", *format)) {
+            if (format[0] == 'I' && ((format[1] == '6' && format[2] == '4') || (format[1] == '3' && format[2] == '2')))
+                format += 2;
+            format++;
+        }
+        conversion = *format;
+        if (conversion)
+            format++;
+
+        if (arg < record->count) {
+            type = (LogArgType)((record->types >> (3 * arg)) & 7);
+            value = record->args[arg];
+            arg++;
+        }
+        else {
+            written = snprintf(line + length, size - length, "<missing>");
+            length += written > 0 ? (size_t)written : 0;
+            continue;
+        }
+
+        switch (conversion) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            spec[specLength++] = 'l';
+            spec[specLength++] = 'l';
+            spec[specLength++] = conversion;
+            spec[specLength] = 0;
+            if (type == LogArgDouble) {
+                double d;
+
+                memcpy(&d, &value, sizeof(d));
+                value = (uint64_t)(int64_t)d;
+            }
+            written = snprintf(line + length, size - length, spec, (long long)value);
+            break;
+
+        case 'c':
+            spec[specLength++] = 'c';
+            spec[specLength] = 0;
+            written = snprintf(line + length, size - length, spec, (int)value);
+            break;
+
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double d;
+
+            if (type == LogArgDouble)
+                memcpy(&d, &value, sizeof(d));
+            else if (type == LogArgInt)
+                d = (double)(int64_t)value;
+            else
+                d = (double)value;
+            spec[specLength++] = conversion;
+            spec[specLength] = 0;
+            written = snprintf(line + length, size - length, spec, d);
+            break;
+        }
+
+        case 'p':
+            written = snprintf(line + length, size - length, "%p", (void*)(uintptr_t)value);
+            break;
+
+        case 's':
+            spec[specLength++] = 's';
+            spec[specLength] = 0;
+            if (type == LogArgString)
+                written = snprintf(line + length, size - length, spec,
+                    value ? (const char*)(uintptr_t)value : "(null)");
+            else
+                written = snprintf(line + length, size - length, "%llu", (unsigned long long)value);
+            break;
+
+        default:
+            written = snprintf(line + length, size - length, "<bad format>");
+            break;
+        }
+
+        if (written > 0)
+            length += (size_t)written;
+    }
+
+    //
+    // snprintf reports what it would have written; a line that did not fit
+    // is cut
+    //
+    if (length > size)
+        length = size;
+    line[length++] = '\n';
+    Emit(line, length);
+}
+
+void BinaryLog::Emit(const char* text, size_t length)
+{
+    if (m_file == NULL)
+        return;
+
+    fwrite(text, 1, length, m_file);
+    m_fileBytes += length;
+    if (m_fileBytes >= m_fileLimit)
+        Rotate();
+}
+
+bool BinaryLog::Open()
+{
+    m_file = LogOpen(m_path.c_str());
+    if (m_file == NULL)
+        return(false);
+
+    setvbuf(m_file, NULL, _IOFBF, LOG_FILE_BUFFER);
+    fseek(m_file, 0, SEEK_END);
+    m_fileBytes = (uint64_t)ftell(m_file);
+    return(true);
+}
+
+//
+// name.1 becomes name.2 and so on, the oldest goes, and the current file
+// becomes name.1
+//
+void BinaryLog::Rotate()
+{
+    fclose(m_file);
+    m_file = NULL;
+
+    if (m_fileCount > 1) {
+        std::string oldest = m_path + "." + std::to_string(m_fileCount - 1);
+
+        remove(oldest.c_str());
+        for (unsigned i = m_fileCount - 1; i > 1; i--) {
+            std::string from = m_path + "." + std::to_string(i - 1);
+            std::string to = m_path + "." + std::to_string(i);
+
+            rename(from.c_str(), to.c_str());
+        }
+        rename(m_path.c_str(), (m_path + ".1").c_str());
+    }
+    else
+        remove(m_path.c_str());
+
+    Open();
+}
@@ -0,0 +1,257 @@
+﻿#pragma once
+
+//
+// Asynchronous binary logger for the I/O paths, where console output would
+// serialize every worker behind one lock and a system call.
+//
+// A log call does not format anything.  It writes a fixed-size record into a
+// ring of the calling thread: a pointer to the static call site, which holds
+// the printf-style format and the level, a timestamp, and up to LOG_MAX_ARGS
+// arguments as raw 64-bit values.  Only the calling thread writes its ring and
+// only the writer thread reads it, so a call takes no lock and makes no system
+// call.  When a ring is full the record is dropped and counted rather than
+// making the caller wait.
+//
+// The writer thread takes what every ring holds, in timestamp order across
+// threads, formats it and appends it to the log file.  A file that grows past
+// its limit is renamed to name.1, the previous name.1 to name.2 and so on, and
+// a new file is started; the oldest is deleted.
+//
+// Arguments are integers, floating point numbers, pointers and strings.  Only
+// the pointer of a string is kept, so it must still be valid when the writer
+// formats it: literals and other static strings only.  Length modifiers in the
+// format (l, ll, z, I64 ...) are accepted and ignored, since every value is kept
+// at 64 bits anyway.
+//
+//     LOG_ERROR(g_log, "WSASend() failed: %d", WSAGetLastError());
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define LOG_MAX_ARGS        5
+#define LOG_RING_SIZE       8192            // records a thread's ring holds, a power of 2
+#define LOG_FILE_BYTES      (64u << 20)     // size a file is rotated at
+#define LOG_FILE_COUNT      4               // files kept, the current one included
+#define LOG_IDLE_MS         1               // writer sleep when every ring is empty
+
+enum LogLevel
+{
+    LogLevelDebug,
+    LogLevelInfo,
+    LogLevelWarning,
+    LogLevelError
+};
+
+enum LogArgType
+{
+    LogArgInt,
+    LogArgUnsigned,
+    LogArgDouble,
+    LogArgPointer,
+    LogArgString
+};
+
+struct LogSite
+{
+    const char* format;
+    LogLevel level;
+};
+
+struct alignas(64) LogRecord
+{
+    const LogSite* site;
+    int64_t time;                           // steady clock, in nanoseconds
+    uint32_t thread;                        // order the thread first logged in
+    uint16_t types;                         // LogArgType of every argument, 3 bits each
+    uint16_t count;
+    uint64_t args[LOG_MAX_ARGS];
+};
+
+//
+// One thread's records.  Only the owning thread moves head and only the writer
+// moves tail.
+//
+struct LogRing
+{
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+    uint64_t reported;                      // dropped records the writer has logged
+    uint32_t thread;
+    void* allocation;                       // what was allocated for the ring, see Register
+    LogRecord records[LOG_RING_SIZE];
+};
+
+class BinaryLog
+{
+public:
+    BinaryLog();
+    ~BinaryLog();
+
+    BinaryLog(const BinaryLog&) = delete;
+    BinaryLog& operator=(const BinaryLog&) = delete;
+
+    //
+    // Open path for appending and start the writer thread.  Records below level
+    // are not written.  Returns 0 on success or a negative errno.
+    //
+    int Init(const char* path, LogLevel level = LogLevelInfo,
+        uint64_t fileBytes = LOG_FILE_BYTES, unsigned fileCount = LOG_FILE_COUNT);
+
+    //
+    // Write out what the rings still hold, stop the writer and close the file.
+    // No thread may be logging any more.
+    //
+    void Exit();
+
+    bool Enabled(LogLevel level) const { return(m_running.load(std::memory_order_relaxed) && level >= m_level); }
+
+    //
+    // Log one record; use the LOG_ macros, which supply a static site.  Returns
+    // false if the record was filtered out or dropped.
+    //
+    template <typename... Args>
+    bool Write(const LogSite* site, Args... args)
+    {
+        static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many arguments for one log record");
+
+        if (!Enabled(site->level))
+            return(false);
+
+        LogRing* ring = Ring();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+        if (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SIZE) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            return(false);
+        }
+
+        LogRecord* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+
+        record->site = site;
+        record->time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        record->thread = ring->thread;
+        record->types = 0;
+        record->count = (uint16_t)sizeof...(Args);
+        Store(record, 0, args...);
+
+        ring->head.store(head + 1, std::memory_order_release);
+        return(true);
+    }
+
+    //
+    // records dropped so far because a ring was full
+    //
+    uint64_t Dropped();
+
+private:
+    LogRing* Ring()
+    {
+        if (t_log.owner != this)
+            Register();
+        return(t_log.ring);
+    }
+    void Register();
+
+    static void Store(LogRecord* /*record*/, unsigned /*index*/) {}
+
+    template <typename T, typename... Rest>
+    static void Store(LogRecord* record, unsigned index, T value, Rest... rest)
+    {
+        Encode(record, index, value);
+        Store(record, index + 1, rest...);
+    }
+
+    static void Set(LogRecord* record, unsigned index, LogArgType type, uint64_t value)
+    {
+        record->args[index] = value;
+        record->types |= (uint16_t)(type << (3 * index));
+    }
+
+    template <typename T>
+    static typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+        Encode(LogRecord* record, unsigned index, T value)
+    {
+        if (std::is_unsigned<T>::value)
+            Set(record, index, LogArgUnsigned, (uint64_t)value);
+        else
+            Set(record, index, LogArgInt, (uint64_t)(int64_t)value);
+    }
+    static void Encode(LogRecord* record, unsigned index, double value)
+    {
+        uint64_t bits;
+
+        memcpy(&bits, &value, sizeof(bits));
+        Set(record, index, LogArgDouble, bits);
+    }
+    static void Encode(LogRecord* record, unsigned index, const char* value)
+    {
+        Set(record, index, LogArgString, (uint64_t)(uintptr_t)value);
+    }
+    static void Encode(LogRecord* record, unsigned index, const void* value)
+    {
+        Set(record, index, LogArgPointer, (uint64_t)(uintptr_t)value);
+    }
+
+    void WriterMain();
+    bool Drain();
+    void Format(const LogRecord* record);
+    void Emit(const char* text, size_t length);
+    bool Open();
+    void Rotate();
+
+    struct ThreadLog
+    {
+        BinaryLog* owner;
+        LogRing* ring;
+    };
+    static thread_local ThreadLog t_log;
+
+    std::mutex m_ringLock;
+    std::vector<LogRing*> m_rings;
+
+    std::atomic<bool> m_running;
+    LogLevel m_level;
+    std::thread m_writer;
+    std::mutex m_stopLock;
+    std::condition_variable m_stopWake;
+    bool m_stop;
+
+    //
+    // writer thread only
+    //
+    std::string m_path;
+    FILE* m_file;
+    uint64_t m_fileBytes;
+    uint64_t m_fileLimit;
+    unsigned m_fileCount;
+    int64_t m_wallBase;                     // wall clock at Init, in nanoseconds since 1970
+    int64_t m_steadyBase;                   // steady clock at the same moment
+    int64_t m_stampSecond;                  // second m_stamp was formatted for
+    char m_stamp[32];                       // its date and time, formatted once per second
+    std::vector<char> m_line;
+};
+
+#define LOG_WRITE(log, level, format, ...)                                      \
+    do {                                                                        \
+        static const LogSite logSite = { format, level };                       \
+        (log).Write(&logSite, ##__VA_ARGS__);                                   \
+    } while (0)
+
+#define LOG_DEBUG(log, format, ...)     LOG_WRITE(log, LogLevelDebug, format, ##__VA_ARGS__)
+#define LOG_INFO(log, format, ...)      LOG_WRITE(log, LogLevelInfo, format, ##__VA_ARGS__)
+#define LOG_WARNING(log, format, ...)   LOG_WRITE(log, LogLevelWarning, format, ##__VA_ARGS__)
+#define LOG_ERROR(log, format, ...)     LOG_WRITE(log, LogLevelError, format, ##__VA_ARGS__)
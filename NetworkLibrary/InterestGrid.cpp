@@ -0,0 +1,227 @@
+﻿#include "pch.h"
+#include "InterestGrid.h"
+
+#include <errno.h>
+#include <math.h>
+
+#include <algorithm>
+
+//
+// cell coordinates are packed into one key, y in the high half
+//
+static inline uint64_t CellKey(int32_t cx, int32_t cy)
+{
+    return(((uint64_t)(uint32_t)cy << 32) | (uint32_t)cx);
+}
+
+InterestGrid::InterestGrid()
+    : m_invCellSize(0.0f), m_viewRadius2(0.0f), m_leaveRadius(0.0f), m_leaveRadius2(0.0f)
+{
+}
+
+InterestGrid::~InterestGrid()
+{
+    Exit();
+}
+
+int InterestGrid::Init(uint32_t maxEntities, float cellSize, float viewRadius, float leaveRadius)
+{
+    if (maxEntities == 0 || !(cellSize > 0.0f) || !(viewRadius > 0.0f) || leaveRadius < viewRadius)
+        return(-EINVAL);
+
+    Entity entity = {};
+
+    entity.cell = NO_CELL;
+    m_entities.assign(maxEntities, entity);
+    m_observers.clear();
+    m_observers.reserve(maxEntities);
+    m_invCellSize = 1.0f / cellSize;
+    m_viewRadius2 = viewRadius * viewRadius;
+    m_leaveRadius = leaveRadius;
+    m_leaveRadius2 = leaveRadius * leaveRadius;
+    return(0);
+}
+
+void InterestGrid::Exit()
+{
+    m_entities.clear();
+    m_cells.clear();
+    m_cellIndex.clear();
+    m_observers.clear();
+    m_candidates.clear();
+    m_next.clear();
+}
+
+int InterestGrid::Add(uint32_t entity, float x, float y, bool observer)
+{
+    if (entity >= m_entities.size() || m_entities[entity].cell != NO_CELL)
+        return(-EINVAL);
+
+    Entity& e = m_entities[entity];
+
+    e.x = x;
+    e.y = y;
+    e.observer = observer;
+    e.moved = false;
+    e.visible.clear();
+    if (observer) {
+        e.observerSlot = (uint32_t)m_observers.size();
+        m_observers.push_back(entity);
+    }
+    CellInsert(entity, CellAt(CellCoord(x), CellCoord(y)));
+    return(0);
+}
+
+void InterestGrid::Remove(uint32_t entity)
+{
+    if (!Contains(entity))
+        return;
+
+    Entity& e = m_entities[entity];
+
+    CellErase(entity);
+    if (e.observer) {
+        uint32_t last = m_observers.back();
+
+        m_observers[e.observerSlot] = last;
+        m_entities[last].observerSlot = e.observerSlot;
+        m_observers.pop_back();
+        e.visible.clear();
+        e.observer = false;
+    }
+}
+
+void InterestGrid::Move(uint32_t entity, float x, float y)
+{
+    Entity& e = m_entities[entity];
+    uint32_t cell = 0;
+
+    e.x = x;
+    e.y = y;
+    e.moved = true;
+
+    cell = CellAt(CellCoord(x), CellCoord(y));
+    if (cell != e.cell) {
+        CellErase(entity);
+        CellInsert(entity, cell);
+    }
+}
+
+void InterestGrid::Update(std::vector<InterestEvent>& events)
+{
+    for (uint32_t observer : m_observers) {
+        std::vector<uint32_t>& visible = m_entities[observer].visible;
+        size_t i = 0;
+        size_t j = 0;
+
+        Gather(observer, m_candidates);
+        std::sort(m_candidates.begin(), m_candidates.end());
+
+        //
+        // both lists are sorted by entity id, so one merge walk finds what came
+        // into view, what stayed and what went out of it
+        //
+        m_next.clear();
+        while (i < m_candidates.size() || j < visible.size()) {
+            if (j == visible.size() || (i < m_candidates.size() && m_candidates[i].entity < visible[j])) {
+                if (m_candidates[i].inner) {
+                    events.push_back({ observer, m_candidates[i].entity, InterestEnter });
+                    m_next.push_back(m_candidates[i].entity);
+                }
+                i++;
+            }
+            else if (i == m_candidates.size() || visible[j] < m_candidates[i].entity) {
+                events.push_back({ observer, visible[j], InterestLeave });
+                j++;
+            }
+            else {
+                if (m_entities[visible[j]].moved)
+                    events.push_back({ observer, visible[j], InterestUpdate });
+                m_next.push_back(visible[j]);
+                i++;
+                j++;
+            }
+        }
+        visible.swap(m_next);
+    }
+
+    for (Entity& e : m_entities)
+        e.moved = false;
+}
+
+int32_t InterestGrid::CellCoord(float v) const
+{
+    return((int32_t)floorf(v * m_invCellSize));
+}
+
+//
+// the cell at cx, cy, created the first time anything is filed there.  Cells
+// are kept once created, the map only has so many places entities go.
+//
+uint32_t InterestGrid::CellAt(int32_t cx, int32_t cy)
+{
+    auto it = m_cellIndex.find(CellKey(cx, cy));
+
+    if (it != m_cellIndex.end())
+        return(it->second);
+
+    m_cells.emplace_back();
+    m_cellIndex.emplace(CellKey(cx, cy), (uint32_t)(m_cells.size() - 1));
+    return((uint32_t)(m_cells.size() - 1));
+}
+
+void InterestGrid::CellInsert(uint32_t entity, uint32_t cell)
+{
+    std::vector<uint32_t>& members = m_cells[cell].members;
+
+    m_entities[entity].cell = cell;
+    m_entities[entity].cellSlot = (uint32_t)members.size();
+    members.push_back(entity);
+}
+
+//
+// take an entity out of its cell; the last member of the cell takes its slot
+//
+void InterestGrid::CellErase(uint32_t entity)
+{
+    Entity& e = m_entities[entity];
+    std::vector<uint32_t>& members = m_cells[e.cell].members;
+    uint32_t last = members.back();
+
+    members[e.cellSlot] = last;
+    m_entities[last].cellSlot = e.cellSlot;
+    members.pop_back();
+    e.cell = NO_CELL;
+}
+
+//
+// every entity within leaveRadius of an observer, itself excluded, from the
+// cells that square overlaps
+//
+void InterestGrid::Gather(uint32_t observer, std::vector<Candidate>& candidates)
+{
+    const Entity& o = m_entities[observer];
+    int32_t cx0 = CellCoord(o.x - m_leaveRadius);
+    int32_t cx1 = CellCoord(o.x + m_leaveRadius);
+    int32_t cy0 = CellCoord(o.y - m_leaveRadius);
+    int32_t cy1 = CellCoord(o.y + m_leaveRadius);
+
+    candidates.clear();
+    for (int32_t cy = cy0; cy <= cy1; cy++) {
+        for (int32_t cx = cx0; cx <= cx1; cx++) {
+            auto it = m_cellIndex.find(CellKey(cx, cy));
+
+            if (it == m_cellIndex.end())
+                continue;
+
+            for (uint32_t entity : m_cells[it->second].members) {
+                float dx = m_entities[entity].x - o.x;
+                float dy = m_entities[entity].y - o.y;
+                float d2 = dx * dx + dy * dy;
+
+                if (entity != observer && d2 <= m_leaveRadius2)
+                    candidates.push_back({ entity, d2 <= m_viewRadius2 });
+            }
+        }
+    }
+}
@@ -0,0 +1,145 @@
+﻿#pragma once
+
+//
+// Area-of-interest tracking on a uniform spatial hash grid.
+//
+// Every entity on the map has a position; entities that belong to a player are
+// also observers, which see every entity within viewRadius of them.  The map is
+// cut into square cells of cellSize, kept in a hash by cell coordinates so the
+// map needs no bounds, and an entity is filed in the cell its position falls
+// in.  An observer only ever looks at the cells its view overlaps, so a tick
+// costs what the observers can see instead of every entity times every player.
+//
+// Once per tick, after the entities moved, Update() works out for every
+// observer what it sees now against what it saw at the last Update() and
+// reports only the difference:
+//
+//     InterestEnter    the entity came into view, send it in full
+//     InterestLeave    the entity went out of view or was removed
+//     InterestUpdate   the entity stayed in view and moved, send its position
+//
+// An entity that is in view only leaves it beyond leaveRadius, a little further
+// out than viewRadius, so one walking along the edge does not flicker in and
+// out every tick.
+//
+// Entities are numbered densely from 0 by the caller, like session table slots.
+// The id of a removed entity must not be reused before the next Update(), so
+// its observers get their InterestLeave for it.  An InterestGrid is used from
+// one thread, the one that runs the tick.
+//
+// Nothing in the servers uses it yet: iocpserverex echoes packets and keeps
+// no map, so there are no positions to file.  It is here for a game server
+// built on NetworkLibrary to drive from its tick, and interestbench
+// (IOCPTestClient) measures it on its own.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <unordered_map>
+#include <vector>
+
+enum InterestEventType : uint8_t
+{
+    InterestEnter,
+    InterestLeave,
+    InterestUpdate
+};
+
+struct InterestEvent
+{
+    uint32_t observer;
+    uint32_t entity;
+    InterestEventType type;
+};
+
+class InterestGrid
+{
+public:
+    InterestGrid();
+    ~InterestGrid();
+
+    InterestGrid(const InterestGrid&) = delete;
+    InterestGrid& operator=(const InterestGrid&) = delete;
+
+    //
+    // Make room for entity ids below maxEntities.  cellSize is best about
+    // viewRadius: an observer then looks at 3 x 3 cells.  Returns 0 on success
+    // or a negative errno.
+    //
+    int Init(uint32_t maxEntities, float cellSize, float viewRadius, float leaveRadius);
+    void Exit();
+
+    //
+    // Put an entity on the map, or take it off.  Add returns -EINVAL for an id
+    // out of range or already on the map.  A new entity is seen by its
+    // observers, and a new observer sees, from the next Update() on.
+    //
+    int Add(uint32_t entity, float x, float y, bool observer);
+    void Remove(uint32_t entity);
+
+    void Move(uint32_t entity, float x, float y);
+
+    //
+    // Append the events of this tick to events, grouped by observer.
+    //
+    void Update(std::vector<InterestEvent>& events);
+
+    //
+    // What an observer saw at the last Update(), sorted by entity id.
+    //
+    const std::vector<uint32_t>& Visible(uint32_t observer) const { return(m_entities[observer].visible); }
+
+    bool Contains(uint32_t entity) const { return(entity < m_entities.size() && m_entities[entity].cell != NO_CELL); }
+    float X(uint32_t entity) const { return(m_entities[entity].x); }
+    float Y(uint32_t entity) const { return(m_entities[entity].y); }
+
+private:
+    static const uint32_t NO_CELL = 0xffffffff;
+
+    struct Entity
+    {
+        float x;
+        float y;
+        uint32_t cell;              // index into m_cells, NO_CELL while not on the map
+        uint32_t cellSlot;          // index in the cell's members
+        uint32_t observerSlot;      // index in m_observers, for observers
+        bool observer;
+        bool moved;                 // since the last Update()
+        std::vector<uint32_t> visible;
+    };
+
+    struct Cell
+    {
+        std::vector<uint32_t> members;
+    };
+
+    //
+    // a candidate found in the cells around an observer; inner is set when it
+    // is within viewRadius, otherwise it is only within leaveRadius
+    //
+    struct Candidate
+    {
+        uint32_t entity;
+        bool inner;
+
+        bool operator<(const Candidate& other) const { return(entity < other.entity); }
+    };
+
+    int32_t CellCoord(float v) const;
+    uint32_t CellAt(int32_t cx, int32_t cy);
+    void CellInsert(uint32_t entity, uint32_t cell);
+    void CellErase(uint32_t entity);
+    void Gather(uint32_t observer, std::vector<Candidate>& candidates);
+
+    std::vector<Entity> m_entities;
+    std::vector<Cell> m_cells;
+    std::unordered_map<uint64_t, uint32_t> m_cellIndex;    // packed cell coordinates to m_cells
+    std::vector<uint32_t> m_observers;
+    std::vector<Candidate> m_candidates;                    // scratch for Update()
+    std::vector<uint32_t> m_next;                           // scratch for Update()
+    float m_invCellSize;
+    float m_viewRadius2;
+    float m_leaveRadius;
+    float m_leaveRadius2;
+};
@@ -0,0 +1,417 @@
+﻿#include "pch.h"
+#include "IoUring.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define IoUringLoadAcquire(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define IoUringStoreRelease(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+IoUring::IoUring()
+    : m_ringFd(-1)
+    , m_sqRingPtr(MAP_FAILED), m_sqRingSize(0)
+    , m_cqRingPtr(MAP_FAILED), m_cqRingSize(0)
+    , m_sqes((io_uring_sqe*)MAP_FAILED), m_sqesSize(0)
+    , m_sqHead(NULL), m_sqTail(NULL), m_sqFlags(NULL)
+    , m_sqMask(0), m_sqEntries(0), m_sqeHead(0), m_sqeTail(0)
+    , m_cqHead(NULL), m_cqTail(NULL), m_cqMask(0), m_cqes(NULL)
+{
+}
+
+IoUring::~IoUring()
+{
+    Exit();
+}
+
+int IoUring::Init(unsigned entries, unsigned flags)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return(-errno);
+
+    m_ringFd = fd;
+
+    m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    //
+    // Newer kernels map both rings with a single mmap.
+    //
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (m_cqRingSize > m_sqRingSize)
+            m_sqRingSize = m_cqRingSize;
+        m_cqRingSize = m_sqRingSize;
+    }
+
+    m_sqRingPtr = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (m_sqRingPtr == MAP_FAILED) {
+        int err = -errno;
+        Exit();
+        return(err);
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRingPtr = m_sqRingPtr;
+    }
+    else {
+        m_cqRingPtr = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (m_cqRingPtr == MAP_FAILED) {
+            int err = -errno;
+            Exit();
+            return(err);
+        }
+    }
+
+    m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    m_sqes = (io_uring_sqe*)mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        int err = -errno;
+        Exit();
+        return(err);
+    }
+
+    char* sq = (char*)m_sqRingPtr;
+    m_sqHead = (unsigned*)(sq + params.sq_off.head);
+    m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+    m_sqFlags = (unsigned*)(sq + params.sq_off.flags);
+    m_sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    m_sqEntries = *(unsigned*)(sq + params.sq_off.ring_entries);
+
+    //
+    // The submission array is an indirection we do not need, so map every
+    // slot to the entry with the same index once and for all.
+    //
+    unsigned* sqArray = (unsigned*)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < m_sqEntries; i++)
+        sqArray[i] = i;
+
+    char* cq = (char*)m_cqRingPtr;
+    m_cqHead = (unsigned*)(cq + params.cq_off.head);
+    m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+    m_cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    m_sqeHead = m_sqeTail = *m_sqTail;
+
+    return(0);
+}
+
+void IoUring::Exit()
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqesSize);
+    if (m_cqRingPtr != MAP_FAILED && m_cqRingPtr != m_sqRingPtr)
+        munmap(m_cqRingPtr, m_cqRingSize);
+    if (m_sqRingPtr != MAP_FAILED)
+        munmap(m_sqRingPtr, m_sqRingSize);
+    if (m_ringFd >= 0)
+        close(m_ringFd);
+
+    m_sqes = (io_uring_sqe*)MAP_FAILED;
+    m_cqRingPtr = MAP_FAILED;
+    m_sqRingPtr = MAP_FAILED;
+    m_ringFd = -1;
+}
+
+io_uring_sqe* IoUring::GetSqe()
+{
+    if (m_sqeTail - IoUringLoadAcquire(m_sqHead) >= m_sqEntries) {
+
+        //
+        // the submission queue is full, let the kernel consume what is pending
+        //
+        if (Submit() < 0)
+            return(NULL);
+        if (m_sqeTail - IoUringLoadAcquire(m_sqHead) >= m_sqEntries)
+            return(NULL);
+    }
+
+    io_uring_sqe* sqe = &m_sqes[m_sqeTail & m_sqMask];
+    m_sqeTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return(sqe);
+}
+
+int IoUring::Enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    int nRet;
+
+    do {
+        nRet = (int)syscall(__NR_io_uring_enter, m_ringFd, toSubmit, minComplete, flags, NULL, 0);
+    } while (nRet < 0 && errno == EINTR);
+
+    return(nRet < 0 ? -errno : nRet);
+}
+
+int IoUring::Submit()
+{
+    return(SubmitAndWait(0));
+}
+
+int IoUring::SubmitAndWait(unsigned waitNr)
+{
+    unsigned toSubmit = m_sqeTail - m_sqeHead;
+
+    if (toSubmit) {
+        IoUringStoreRelease(m_sqTail, m_sqeTail);
+        m_sqeHead = m_sqeTail;
+    }
+
+    if (toSubmit == 0 && waitNr == 0)
+        return(0);
+
+    return(Enter(toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0));
+}
+
+io_uring_cqe* IoUring::PeekCqe()
+{
+    unsigned head = *m_cqHead;
+
+    if (head == IoUringLoadAcquire(m_cqTail))
+        return(NULL);
+
+    return(&m_cqes[head & m_cqMask]);
+}
+
+unsigned IoUring::PeekBatchCqe(io_uring_cqe** cqes, unsigned count)
+{
+    unsigned head = *m_cqHead;
+    unsigned ready = IoUringLoadAcquire(m_cqTail) - head;
+
+    if (ready > count)
+        ready = count;
+
+    for (unsigned i = 0; i < ready; i++)
+        cqes[i] = &m_cqes[(head + i) & m_cqMask];
+
+    return(ready);
+}
+
+int IoUring::WaitCqe(io_uring_cqe** ppCqe)
+{
+    while ((*ppCqe = PeekCqe()) == NULL) {
+        int nRet = SubmitAndWait(1);
+        if (nRet < 0 && nRet != -EAGAIN && nRet != -EBUSY)
+            return(nRet);
+    }
+
+    return(0);
+}
+
+void IoUring::CqeSeen(unsigned count)
+{
+    IoUringStoreRelease(m_cqHead, *m_cqHead + count);
+}
+
+int IoUring::RegisterBufRing(void* ringAddr, unsigned entries, unsigned short bgid)
+{
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ringAddr;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+
+    if (syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return(-errno);
+    return(0);
+}
+
+int IoUring::UnregisterBufRing(unsigned short bgid)
+{
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = bgid;
+
+    if (syscall(__NR_io_uring_register, m_ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1) < 0)
+        return(-errno);
+    return(0);
+}
+
+//
+// The kernel header declares bufs as a flexible array inside a union, which a C++
+// compiler places after an empty struct of size 1, i.e. at the wrong offset.  The
+// ring is simply an array of io_uring_buf whose first entry also holds the tail.
+//
+static inline io_uring_buf* IoUringBufRingEntry(io_uring_buf_ring* br, unsigned index)
+{
+    return((io_uring_buf*)br + index);
+}
+
+IoUringBufRing::IoUringBufRing()
+    : m_bufRing((io_uring_buf_ring*)MAP_FAILED), m_bufRingSize(0)
+    , m_buffers((char*)MAP_FAILED), m_buffersSize(0)
+    , m_mask(0), m_bufSize(0), m_bgid(0), m_tail(0)
+{
+}
+
+IoUringBufRing::~IoUringBufRing()
+{
+    Exit();
+}
+
+int IoUringBufRing::Init(IoUring& ring, unsigned entries, unsigned bufSize, unsigned short bgid)
+{
+    if (entries == 0 || entries > 32768 || (entries & (entries - 1)) != 0)
+        return(-EINVAL);
+
+    //
+    // The ring has to be page aligned, so both parts come straight from mmap.
+    // Buffer pages are only backed by memory once data has been received into them.
+    //
+    m_bufRingSize = entries * sizeof(io_uring_buf);
+    m_bufRing = (io_uring_buf_ring*)mmap(NULL, m_bufRingSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_bufRing == MAP_FAILED) {
+        int err = -errno;
+        Exit();
+        return(err);
+    }
+
+    m_buffersSize = (size_t)entries * bufSize;
+    m_buffers = (char*)mmap(NULL, m_buffersSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m_buffers == MAP_FAILED) {
+        int err = -errno;
+        Exit();
+        return(err);
+    }
+
+    m_mask = entries - 1;
+    m_bufSize = bufSize;
+    m_bgid = bgid;
+
+    for (unsigned i = 0; i < entries; i++) {
+        io_uring_buf* buf = IoUringBufRingEntry(m_bufRing, i);
+        buf->addr = (uint64_t)(uintptr_t)Buffer((unsigned short)i);
+        buf->len = bufSize;
+        buf->bid = (unsigned short)i;
+    }
+    m_tail = (unsigned short)entries;
+    IoUringStoreRelease(&m_bufRing->tail, m_tail);
+
+    int ret = ring.RegisterBufRing(m_bufRing, entries, bgid);
+    if (ret < 0) {
+        Exit();
+        return(ret);
+    }
+
+    return(0);
+}
+
+void IoUringBufRing::Exit()
+{
+    if (m_buffers != MAP_FAILED)
+        munmap(m_buffers, m_buffersSize);
+    if (m_bufRing != MAP_FAILED)
+        munmap(m_bufRing, m_bufRingSize);
+    m_buffers = (char*)MAP_FAILED;
+    m_bufRing = (io_uring_buf_ring*)MAP_FAILED;
+}
+
+void IoUringBufRing::Recycle(unsigned short bid)
+{
+    io_uring_buf* buf = IoUringBufRingEntry(m_bufRing, m_tail & m_mask);
+    buf->addr = (uint64_t)(uintptr_t)Buffer(bid);
+    buf->len = m_bufSize;
+    buf->bid = bid;
+
+    m_tail++;
+    IoUringStoreRelease(&m_bufRing->tail, m_tail);
+}
+
+void IoUringPrepNop(io_uring_sqe* sqe, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_NOP;
+    sqe->fd = -1;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepAccept(io_uring_sqe* sqe, int fd, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepMultishotAccept(io_uring_sqe* sqe, int fd, uint64_t userData)
+{
+    IoUringPrepAccept(sqe, fd, userData);
+    sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+void IoUringPrepRecvSelect(io_uring_sqe* sqe, int fd, unsigned short bgid, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepRecv(io_uring_sqe* sqe, int fd, void* buf, unsigned len, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepSend(io_uring_sqe* sqe, int fd, const void* buf, unsigned len, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepSendMsg(io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepTimeout(io_uring_sqe* sqe, const __kernel_timespec* ts, uint64_t userData)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)ts;
+    sqe->len = 1;
+    sqe->user_data = userData;
+}
+
+void IoUringPrepMsgRing(io_uring_sqe* sqe, int targetRingFd, int res, uint64_t targetUserData)
+{
+    sqe->opcode = IORING_OP_MSG_RING;
+    sqe->fd = targetRingFd;
+    sqe->addr = IORING_MSG_DATA;
+    sqe->len = (unsigned)res;
+    sqe->off = targetUserData;
+
+    //
+    // the sender does not care about its own completion
+    //
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+#endif // __linux__
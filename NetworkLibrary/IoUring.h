@@ -0,0 +1,190 @@
+﻿#pragma once
+
+//
+// Minimal io_uring wrapper used by the Linux server backends.
+//
+// This talks to the kernel through the raw io_uring_setup/io_uring_enter
+// system calls and the shared ring mappings, so no liburing is required on
+// the build host.  Only the handful of operations the servers need are
+// provided.  One IoUring instance must only be used from one thread, the same
+// way a thread owns the completion packets it dequeued from an IOCP.
+//
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    //
+    // Create the ring.  Returns 0 on success or a negative errno.
+    //
+    int Init(unsigned entries, unsigned flags = 0);
+    void Exit();
+
+    int Fd() const { return m_ringFd; }
+
+    //
+    // Get a zeroed submission entry.  When the submission queue is full the
+    // pending entries are flushed to the kernel first, so this only returns
+    // NULL if the kernel rejects the submission.
+    //
+    io_uring_sqe* GetSqe();
+
+    //
+    // Hand all pending submission entries to the kernel and optionally block
+    // until at least waitNr completions are available.  Returns the number of
+    // entries submitted or a negative errno.
+    //
+    int Submit();
+    int SubmitAndWait(unsigned waitNr);
+
+    //
+    // Return the next completion without blocking, or NULL if the completion
+    // queue is empty.  The entry stays valid until CqeSeen() is called.
+    //
+    io_uring_cqe* PeekCqe();
+
+    //
+    // Fill cqes with up to count available completions without blocking and
+    // return how many were stored.  Release them with CqeSeen(n) once handled.
+    //
+    unsigned PeekBatchCqe(io_uring_cqe** cqes, unsigned count);
+
+    //
+    // Submit pending entries and block until a completion is available.
+    // Returns 0 and stores the completion in *ppCqe, or a negative errno.
+    //
+    int WaitCqe(io_uring_cqe** ppCqe);
+
+    void CqeSeen(unsigned count = 1);
+
+    //
+    // Register or remove a provided-buffer ring for buffer group bgid.  Returns
+    // 0 on success or a negative errno.
+    //
+    int RegisterBufRing(void* ringAddr, unsigned entries, unsigned short bgid);
+    int UnregisterBufRing(unsigned short bgid);
+
+private:
+    int Enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+
+    int m_ringFd;
+
+    void* m_sqRingPtr;
+    size_t m_sqRingSize;
+    void* m_cqRingPtr;
+    size_t m_cqRingSize;
+    io_uring_sqe* m_sqes;
+    size_t m_sqesSize;
+
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned* m_sqFlags;
+    unsigned m_sqMask;
+    unsigned m_sqEntries;
+    unsigned m_sqeHead;     // first entry not yet handed to the kernel
+    unsigned m_sqeTail;     // next free entry
+
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned m_cqMask;
+    io_uring_cqe* m_cqes;
+};
+
+//
+// A group of equally sized receive buffers shared by every socket of one ring.
+//
+// A recv prepared with IoUringPrepRecvSelect holds no memory while it waits; the
+// kernel picks a buffer from the group only when data arrives and reports its id
+// in the completion flags.  The owner hands the buffer back with Recycle() once
+// it is done with the data.  When the group is empty such a recv completes with
+// -ENOBUFS.
+//
+class IoUringBufRing
+{
+public:
+    IoUringBufRing();
+    ~IoUringBufRing();
+
+    IoUringBufRing(const IoUringBufRing&) = delete;
+    IoUringBufRing& operator=(const IoUringBufRing&) = delete;
+
+    //
+    // Allocate entries buffers of bufSize bytes and register them with the ring
+    // as group bgid.  entries must be a power of two.  Returns 0 on success or a
+    // negative errno.
+    //
+    int Init(IoUring& ring, unsigned entries, unsigned bufSize, unsigned short bgid);
+    void Exit();
+
+    unsigned short Group() const { return m_bgid; }
+    unsigned BufferSize() const { return m_bufSize; }
+    char* Buffer(unsigned short bid) const { return m_buffers + (size_t)bid * m_bufSize; }
+
+    //
+    // Return the buffer id carried by a completion with IORING_CQE_F_BUFFER set.
+    //
+    static unsigned short BufferId(const io_uring_cqe* cqe) { return (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT); }
+
+    void Recycle(unsigned short bid);
+
+private:
+    io_uring_buf_ring* m_bufRing;
+    size_t m_bufRingSize;
+    char* m_buffers;
+    size_t m_buffersSize;
+    unsigned m_mask;
+    unsigned m_bufSize;
+    unsigned short m_bgid;
+    unsigned short m_tail;
+};
+
+//
+// Helpers to fill in submission entries.
+//
+void IoUringPrepNop(io_uring_sqe* sqe, uint64_t userData);
+void IoUringPrepAccept(io_uring_sqe* sqe, int fd, uint64_t userData);
+void IoUringPrepRecv(io_uring_sqe* sqe, int fd, void* buf, unsigned len, uint64_t userData);
+void IoUringPrepSend(io_uring_sqe* sqe, int fd, const void* buf, unsigned len, uint64_t userData);
+
+//
+// Gathered send of every iovec msg points at.  A send that has to wait for room
+// reads msg and its iovecs again, so they must stay valid until it completes.
+//
+void IoUringPrepSendMsg(io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t userData);
+
+//
+// Accept that stays armed: every incoming connection posts its own completion
+// with IORING_CQE_F_MORE set.  A completion without IORING_CQE_F_MORE means the
+// kernel dropped the request and it has to be prepared again.
+//
+void IoUringPrepMultishotAccept(io_uring_sqe* sqe, int fd, uint64_t userData);
+
+//
+// Receive into a buffer the kernel picks from the given buffer group.
+//
+void IoUringPrepRecvSelect(io_uring_sqe* sqe, int fd, unsigned short bgid, uint64_t userData);
+
+//
+// Complete after the time in ts has passed, with -ETIME.  ts is read when the
+// entry is submitted, so it must stay valid until then.
+//
+void IoUringPrepTimeout(io_uring_sqe* sqe, const __kernel_timespec* ts, uint64_t userData);
+
+//
+// Post a completion with the given user data and result to another ring.
+// This is the io_uring counterpart of PostQueuedCompletionStatus.
+//
+void IoUringPrepMsgRing(io_uring_sqe* sqe, int targetRingFd, int res, uint64_t targetUserData);
+
+#endif // __linux__
@@ -0,0 +1,505 @@
+﻿#include "pch.h"
+#include "JobSystem.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <new>
+#include <system_error>
+
+#define JOB_CACHE_BATCH     256             // jobs moved between a thread and the depot at once
+#define JOB_SPIN_ROUNDS     64              // empty looks before a job thread sleeps
+
+struct JobWorker
+{
+    JobDeque deque;
+    JobSystem* system;
+    unsigned index;
+    uint32_t seed;                          // picks the first thread to steal from
+    void* allocation;                       // what was allocated for it, see Init
+};
+
+//
+// Free jobs.  Every thread keeps a list of its own; one that frees more than it
+// allocates, a job thread finishing what I/O threads start, hands batches to the
+// depot, and one that runs dry takes a batch from there before it carves a new
+// chunk.  Chunks are kept for the life of the process.
+//
+struct JobCache
+{
+    Job* head;
+    uint32_t count;
+
+    ~JobCache();
+};
+
+static std::mutex g_jobDepotLock;
+static std::vector<Job*> g_jobDepot;        // batches of JOB_CACHE_BATCH chained through next
+static thread_local JobCache t_jobCache = { NULL, 0 };
+static thread_local JobWorker* t_jobWorker = NULL;
+
+static Job* JobCacheDetach(JobCache* cache, uint32_t count)
+{
+    Job* head = cache->head;
+    Job* last = head;
+
+    for (uint32_t i = 1; i < count; i++)
+        last = last->next;
+    cache->head = last->next;
+    cache->count -= count;
+    last->next = NULL;
+    return(head);
+}
+
+JobCache::~JobCache()
+{
+    std::lock_guard<std::mutex> lock(g_jobDepotLock);
+
+    while (count >= JOB_CACHE_BATCH)
+        g_jobDepot.push_back(JobCacheDetach(this, JOB_CACHE_BATCH));
+    if (count)
+        g_jobDepot.push_back(JobCacheDetach(this, count));
+}
+
+static Job* JobAllocate()
+{
+    JobCache* cache = &t_jobCache;
+    Job* job = NULL;
+
+    if (cache->head == NULL) {
+        std::lock_guard<std::mutex> lock(g_jobDepotLock);
+
+        if (!g_jobDepot.empty()) {
+            cache->head = g_jobDepot.back();
+            g_jobDepot.pop_back();
+            for (job = cache->head; job; job = job->next)
+                cache->count++;
+        }
+    }
+
+    if (cache->head == NULL) {
+        char* chunk = (char*)::operator new(JOB_CACHE_BATCH * sizeof(Job) + alignof(Job));
+        Job* jobs = (Job*)(((uintptr_t)chunk + alignof(Job) - 1) & ~(uintptr_t)(alignof(Job) - 1));
+
+        for (uint32_t i = 0; i < JOB_CACHE_BATCH; i++) {
+            new (&jobs[i]) Job();
+            jobs[i].next = cache->head;
+            cache->head = &jobs[i];
+        }
+        cache->count = JOB_CACHE_BATCH;
+    }
+
+    job = cache->head;
+    cache->head = job->next;
+    cache->count--;
+    return(job);
+}
+
+static void JobFree(Job* job)
+{
+    JobCache* cache = &t_jobCache;
+
+    job->next = cache->head;
+    cache->head = job;
+    cache->count++;
+
+    if (cache->count >= 2 * JOB_CACHE_BATCH) {
+        Job* batch = JobCacheDetach(cache, JOB_CACHE_BATCH);
+        std::lock_guard<std::mutex> lock(g_jobDepotLock);
+
+        g_jobDepot.push_back(batch);
+    }
+}
+
+JobDeque::JobDeque()
+    : m_top(0), m_bottom(0)
+{
+    for (size_t i = 0; i < JOB_DEQUE_SIZE; i++)
+        m_jobs[i].store(NULL, std::memory_order_relaxed);
+}
+
+//
+// Le, Pop, Cohen and Zappa Nardelli, "Correct and efficient work-stealing for
+// weak memory models".  Returns false when the deque is full.
+//
+bool JobDeque::Push(Job* job)
+{
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+    int64_t top = m_top.load(std::memory_order_acquire);
+
+    if (bottom - top >= JOB_DEQUE_SIZE)
+        return(false);
+
+    m_jobs[bottom & (JOB_DEQUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    return(true);
+}
+
+Job* JobDeque::Pop()
+{
+    int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+    int64_t top = 0;
+    Job* job = NULL;
+
+    m_bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    top = m_top.load(std::memory_order_relaxed);
+
+    if (top > bottom) {
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        return(NULL);
+    }
+
+    job = m_jobs[bottom & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (top == bottom) {
+
+        //
+        // the last job; a thief may be taking it at the same time
+        //
+        if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            job = NULL;
+        m_bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return(job);
+}
+
+Job* JobDeque::Steal()
+{
+    int64_t top = m_top.load(std::memory_order_acquire);
+    int64_t bottom = 0;
+    Job* job = NULL;
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bottom = m_bottom.load(std::memory_order_acquire);
+    if (top >= bottom)
+        return(NULL);
+
+    job = m_jobs[top & (JOB_DEQUE_SIZE - 1)].load(std::memory_order_relaxed);
+    if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return(NULL);
+    return(job);
+}
+
+JobSystem::JobSystem()
+    : m_sharedCount(0), m_queued(0), m_sleepers(0), m_stop(false)
+{
+}
+
+JobSystem::~JobSystem()
+{
+    Exit();
+}
+
+int JobSystem::Init(unsigned threads)
+{
+    if (!m_threads.empty())
+        return(-EBUSY);
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    m_stop = false;
+    //
+    // The deque keeps its ends on cache lines of their own, which only holds if
+    // the worker starts on one.  It is aligned by hand, new does not align to a
+    // cache line before C++17.
+    //
+    for (unsigned i = 0; i < threads; i++) {
+        void* allocation = ::operator new(sizeof(JobWorker) + alignof(JobWorker));
+        JobWorker* worker = new ((void*)(((uintptr_t)allocation + alignof(JobWorker) - 1) &
+            ~(uintptr_t)(alignof(JobWorker) - 1))) JobWorker();
+
+        worker->allocation = allocation;
+        worker->system = this;
+        worker->index = i;
+        worker->seed = 2654435761u * (i + 1);
+        m_workers.push_back(worker);
+    }
+
+    //
+    // every worker exists before the first thread looks for one to steal from
+    //
+    try {
+        for (unsigned i = 0; i < threads; i++)
+            m_threads.emplace_back(&JobSystem::ThreadMain, this, i);
+    }
+    catch (const std::system_error&) {
+        Exit();
+        return(-EAGAIN);
+    }
+    return(0);
+}
+
+void JobSystem::Exit()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepLock);
+
+        m_stop = true;
+        m_wake.notify_all();
+    }
+
+    for (std::thread& thread : m_threads)
+        thread.join();
+    m_threads.clear();
+
+    for (JobWorker* worker : m_workers) {
+        void* allocation = worker->allocation;
+
+        worker->~JobWorker();
+        ::operator delete(allocation);
+    }
+    m_workers.clear();
+}
+
+Job* JobSystem::Create(JobFunction function, const void* data, size_t size)
+{
+    Job* job = NULL;
+
+    if (size > JOB_DATA_SIZE)
+        return(NULL);
+
+    job = JobAllocate();
+    job->function = function;
+    job->parent = NULL;
+    job->unfinished.store(1, std::memory_order_relaxed);
+    job->refs.store(1, std::memory_order_relaxed);
+    job->continuationCount = 0;
+    job->next = NULL;
+    if (size)
+        memcpy(job->data, data, size);
+    return(job);
+}
+
+Job* JobSystem::CreateChild(Job* parent, JobFunction function, const void* data, size_t size)
+{
+    Job* job = Create(function, data, size);
+
+    if (job == NULL)
+        return(NULL);
+
+    parent->unfinished.fetch_add(1, std::memory_order_relaxed);
+    job->parent = parent;
+    return(job);
+}
+
+bool JobSystem::AddContinuation(Job* job, Job* continuation)
+{
+    if (job->continuationCount == JOB_MAX_CONTINUATIONS)
+        return(false);
+
+    //
+    // the job holds the continuation until it starts it, so the creator may
+    // release its handle right away
+    //
+    continuation->refs.fetch_add(1, std::memory_order_relaxed);
+    job->continuations[job->continuationCount++] = continuation;
+    return(true);
+}
+
+void JobSystem::Run(Job* job)
+{
+    JobWorker* worker = t_jobWorker;
+
+    job->refs.fetch_add(1, std::memory_order_relaxed);
+
+    //
+    // counted before it can be taken, so the count never goes below zero
+    //
+    m_queued.fetch_add(1);
+
+    if (worker && worker->system == this) {
+        if (!worker->deque.Push(job)) {
+
+            //
+            // the deque is full, which only a runaway split gets to; run it here
+            //
+            m_queued.fetch_sub(1);
+            Execute(job);
+            return;
+        }
+    }
+    else {
+        std::lock_guard<std::mutex> lock(m_sharedLock);
+
+        m_shared.push_back(job);
+        m_sharedCount.fetch_add(1, std::memory_order_release);
+    }
+
+    if (m_sleepers.load() > 0) {
+        std::lock_guard<std::mutex> lock(m_sleepLock);
+
+        m_wake.notify_one();
+    }
+}
+
+void JobSystem::Wait(Job* job)
+{
+    JobWorker* worker = (t_jobWorker && t_jobWorker->system == this) ? t_jobWorker : NULL;
+
+    while (!Finished(job)) {
+        Job* next = Take(worker);
+
+        if (next)
+            Execute(next);
+        else
+            std::this_thread::yield();
+    }
+    Release(job);
+}
+
+void JobSystem::Release(Job* job)
+{
+    if (job->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        JobFree(job);
+}
+
+int JobSystem::ThreadIndex() const
+{
+    return((t_jobWorker && t_jobWorker->system == this) ? (int)t_jobWorker->index : -1);
+}
+
+//
+// the calling thread's own newest job, else the oldest started from outside,
+// else the oldest of another thread, trying the others from a random one on
+//
+Job* JobSystem::Take(JobWorker* worker)
+{
+    Job* job = worker ? worker->deque.Pop() : NULL;
+
+    if (job == NULL && m_sharedCount.load(std::memory_order_acquire) > 0) {
+        std::lock_guard<std::mutex> lock(m_sharedLock);
+
+        if (!m_shared.empty()) {
+            job = m_shared.front();
+            m_shared.pop_front();
+            m_sharedCount.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    if (job == NULL && !m_workers.empty()) {
+        size_t count = m_workers.size();
+        size_t first = 0;
+
+        if (worker) {
+            worker->seed = worker->seed * 1664525u + 1013904223u;
+            first = (worker->seed >> 8) % count;
+        }
+        for (size_t i = 0; i < count && job == NULL; i++) {
+            JobWorker* victim = m_workers[(first + i) % count];
+
+            if (victim != worker)
+                job = victim->deque.Steal();
+        }
+    }
+
+    if (job)
+        m_queued.fetch_sub(1);
+    return(job);
+}
+
+void JobSystem::Execute(Job* job)
+{
+    job->function(*this, job, job->data);
+    Finish(job);
+}
+
+//
+// the job returned or a child finished; the last of them finishes the job,
+// starts its continuations and lets its parent know.  The started reference
+// keeps the job valid until here, whatever the creator does once it finished.
+//
+void JobSystem::Finish(Job* job)
+{
+    Job* parent = job->parent;
+
+    if (job->unfinished.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    for (uint32_t i = 0; i < job->continuationCount; i++) {
+        Run(job->continuations[i]);
+        Release(job->continuations[i]);
+    }
+    if (parent)
+        Finish(parent);
+    Release(job);
+}
+
+void JobSystem::ThreadMain(unsigned index)
+{
+    JobWorker* worker = m_workers[index];
+    unsigned idle = 0;
+
+    t_jobWorker = worker;
+
+    while (!m_stop.load(std::memory_order_relaxed)) {
+        Job* job = Take(worker);
+
+        if (job) {
+            Execute(job);
+            idle = 0;
+            continue;
+        }
+
+        if (++idle < JOB_SPIN_ROUNDS) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        //
+        // Run() looks at m_sleepers after counting its job, and this thread
+        // looks at the count after counting itself, so one of them sees the other
+        //
+        std::unique_lock<std::mutex> lock(m_sleepLock);
+
+        m_sleepers.fetch_add(1);
+        m_wake.wait(lock, [this] { return(m_queued.load() > 0 || m_stop.load()); });
+        m_sleepers.fetch_sub(1);
+        idle = 0;
+    }
+
+    t_jobWorker = NULL;
+}
+
+struct ParallelForData
+{
+    void (*function)(uint32_t begin, uint32_t end, void* context);
+    void* context;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t grain;
+};
+
+//
+// split off the upper half as a child until the range is down to the grain,
+// then run what is left here
+//
+static void ParallelForJob(JobSystem& jobs, Job* job, void* data)
+{
+    ParallelForData* range = (ParallelForData*)data;
+
+    while (range->end - range->begin > range->grain) {
+        ParallelForData upper = *range;
+        Job* child = NULL;
+
+        upper.begin = range->begin + (range->end - range->begin) / 2;
+        child = jobs.CreateChild(job, ParallelForJob, &upper, sizeof(upper));
+        jobs.Run(child);
+        jobs.Release(child);
+        range->end = upper.begin;
+    }
+
+    if (range->end > range->begin)
+        range->function(range->begin, range->end, range->context);
+}
+
+Job* JobSystem::CreateParallelFor(uint32_t count, uint32_t grain,
+    void (*function)(uint32_t begin, uint32_t end, void* context), void* context)
+{
+    ParallelForData range = { function, context, 0, count, grain ? grain : 1 };
+
+    return(Create(ParallelForJob, &range, sizeof(range)));
+}
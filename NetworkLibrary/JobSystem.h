@@ -0,0 +1,168 @@
+﻿#pragma once
+
+//
+// Work-stealing job scheduler for game logic that should not run on the I/O
+// threads: pathfinding, combat resolution, serializing state for persistence.
+//
+// A job is a function and up to JOB_DATA_SIZE bytes of data for it.  Every job
+// thread has a deque of its own: the jobs it starts go on the bottom and it takes
+// the newest from there, so what it just split up is still in its cache, while
+// an idle thread steals the oldest from the top of another's deque, which tends
+// to be the largest piece of work left.  Jobs started from any other thread, an
+// I/O worker for instance, go on a shared queue the job threads also take from.
+//
+// A job can have children.  It counts as finished only once it has returned and
+// every child has finished, so a job that splits its work in children finishes
+// when all of the work is done.  Jobs can also be given continuations, started
+// the moment the job finishes: a handler on an I/O thread fans the work out and
+// returns at once, and the continuation sends the result when it is ready.
+// Wait() also works, and helps by running jobs meanwhile.
+//
+// Every job is created with a handle its creator owns; the creator gives it up
+// with Wait() or Release(), whichever comes first, and must not touch the job
+// after that.  Children must be added before the parent finishes, so from its
+// own function or before it is started, and continuations before it is started.
+// Jobs are recycled through per-thread free lists, like the server's contexts.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define JOB_DATA_SIZE           64
+#define JOB_MAX_CONTINUATIONS   4
+#define JOB_DEQUE_SIZE          4096            // jobs a thread's deque holds, a power of 2
+
+class JobSystem;
+struct Job;
+struct JobWorker;
+
+typedef void (*JobFunction)(JobSystem& jobs, Job* job, void* data);
+
+struct alignas(64) Job
+{
+    JobFunction function;
+    Job* parent;
+    std::atomic<int32_t> unfinished;        // itself and every child not yet finished
+    std::atomic<int32_t> refs;              // the creator's handle, one while started, and
+                                            // one while a continuation of another job
+    Job* continuations[JOB_MAX_CONTINUATIONS];
+    uint32_t continuationCount;
+    Job* next;                              // on a free list
+    alignas(16) unsigned char data[JOB_DATA_SIZE];
+};
+
+//
+// Chase-Lev deque.  Only the owning thread pushes and pops, at the bottom; any
+// thread steals from the top.
+//
+class JobDeque
+{
+public:
+    JobDeque();
+
+    bool Push(Job* job);
+    Job* Pop();
+    Job* Steal();
+
+private:
+    std::atomic<int64_t> m_top;
+    alignas(64) std::atomic<int64_t> m_bottom;
+    std::atomic<Job*> m_jobs[JOB_DEQUE_SIZE];
+};
+
+class JobSystem
+{
+public:
+    JobSystem();
+    ~JobSystem();
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    //
+    // Start threads job threads, 0 for one per hardware thread.  Returns 0 on
+    // success or a negative errno.
+    //
+    int Init(unsigned threads);
+
+    //
+    // Stop the job threads.  Every job must have finished.
+    //
+    void Exit();
+
+    //
+    // Create a job, or a child of parent, that runs function with a copy of size
+    // bytes of data.  Returns NULL if size is over JOB_DATA_SIZE.  The job does
+    // not run until it is started.
+    //
+    Job* Create(JobFunction function, const void* data, size_t size);
+    Job* CreateChild(Job* parent, JobFunction function, const void* data, size_t size);
+
+    //
+    // Start continuation once job finishes.  continuation must not be started by
+    // anyone else.  Returns false if job has JOB_MAX_CONTINUATIONS already.
+    //
+    bool AddContinuation(Job* job, Job* continuation);
+
+    //
+    // Start a job.  From a job thread it goes on that thread's deque, from any
+    // other thread on the shared queue.
+    //
+    void Run(Job* job);
+
+    //
+    // Run jobs until job has finished, then give up the handle.
+    //
+    void Wait(Job* job);
+
+    //
+    // Give up the handle without waiting.
+    //
+    void Release(Job* job);
+
+    static bool Finished(const Job* job) { return(job->unfinished.load(std::memory_order_acquire) == 0); }
+
+    //
+    // A job that calls function(begin, end, context) over [0, count) in ranges
+    // of at most grain, split in halves as children so idle threads steal the
+    // larger halves.  Not yet started; add continuations, then Run() it.
+    //
+    Job* CreateParallelFor(uint32_t count, uint32_t grain,
+        void (*function)(uint32_t begin, uint32_t end, void* context), void* context);
+
+    unsigned Threads() const { return((unsigned)m_threads.size()); }
+
+    //
+    // index of the calling job thread, or -1 on any other thread
+    //
+    int ThreadIndex() const;
+
+private:
+    Job* Take(JobWorker* worker);
+    void Execute(Job* job);
+    void Finish(Job* job);
+    void ThreadMain(unsigned index);
+
+    std::vector<JobWorker*> m_workers;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_sharedLock;
+    std::deque<Job*> m_shared;              // jobs started from other threads
+    std::atomic<int32_t> m_sharedCount;     // looked at before taking the lock
+
+    //
+    // jobs started and not yet taken; threads only sleep while there are none
+    //
+    std::atomic<int64_t> m_queued;
+    std::atomic<int32_t> m_sleepers;
+    std::mutex m_sleepLock;
+    std::condition_variable m_wake;
+    std::atomic<bool> m_stop;
+};
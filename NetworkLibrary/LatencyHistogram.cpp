@@ -0,0 +1,83 @@
+﻿#include "pch.h"
+#include "LatencyHistogram.h"
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Add(const LatencyHistogram& other)
+{
+    uint64_t count = 0;
+
+    //
+    // the count is what was copied, not what other counted, which may already
+    // include values whose bucket was read before they got there
+    //
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        uint64_t value = other.m_counts[i].load(std::memory_order_relaxed);
+
+        if (value) {
+            Bump(m_counts[i], value);
+            count += value;
+        }
+    }
+    Bump(m_count, count);
+    Bump(m_sum, other.Sum());
+    if (other.Max() > Max())
+        m_max.store(other.Max(), std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset()
+{
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+        m_counts[i].store(0, std::memory_order_relaxed);
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Percentile(double q) const
+{
+    uint64_t count = Count();
+    uint64_t rank = 0;
+    uint64_t seen = 0;
+
+    if (count == 0)
+        return(0);
+
+    //
+    // the rank of the value wanted, from 1; q = 0 finds the smallest
+    //
+    rank = (uint64_t)(q * (double)count);
+    if ((double)rank < q * (double)count)
+        rank++;
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += m_counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t high = BucketLow(i + 1) - 1;
+
+            return(high < Max() ? high : Max());
+        }
+    }
+    return(Max());
+}
+
+uint64_t LatencyHistogram::CountBelow(uint64_t bound) const
+{
+    uint64_t count = 0;
+    unsigned end = 0;
+
+    if (bound >> LATENCY_MAX_BITS)
+        return(Count());
+
+    end = Bucket(bound);
+    for (unsigned i = 0; i < end; i++)
+        count += m_counts[i].load(std::memory_order_relaxed);
+    return(count);
+}
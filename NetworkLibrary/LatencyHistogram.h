@@ -0,0 +1,137 @@
+﻿#pragma once
+
+//
+// Latency histogram in the manner of HdrHistogram: buckets are linear below
+// 2 * LATENCY_SUB_BUCKETS and from there on every power of two is split into
+// LATENCY_SUB_BUCKETS equal buckets, so a value is known to within 1/32 of
+// itself whatever its magnitude, and a fixed array covers nanoseconds to minutes.
+//
+// One thread records into a histogram; any other thread may read it, or Add it
+// into a histogram of its own, at any time.  Record only loads and stores, no
+// locked instruction, so a worker keeps a histogram of its own at the cost of
+// an increment, and a reader sums the histograms of all of them on demand.  A
+// reader may see a value in its bucket but not yet in the sum; Add counts what
+// it copied, so a copy is always consistent with itself.
+//
+//     g_stats[worker].latency.Record(ns);
+//     ...
+//     LatencyHistogram all;
+//     for (...) all.Add(g_stats[i].latency);
+//     all.Percentile(0.99);
+//
+
+#include <stdint.h>
+
+#include <atomic>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define LATENCY_SUB_BITS    5               // 32 buckets per power of two, within 1/32
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS    40              // values from 2^40 (18 minutes in ns) share the last bucket
+#define LATENCY_BUCKETS     ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    //
+    // the owning thread only
+    //
+    void Record(uint64_t value)
+    {
+        Bump(m_counts[Bucket(value)], 1);
+        Bump(m_count, 1);
+        Bump(m_sum, value);
+        if (value > m_max.load(std::memory_order_relaxed))
+            m_max.store(value, std::memory_order_relaxed);
+    }
+
+    //
+    // add what other holds now to this one, which no other thread records into
+    //
+    void Add(const LatencyHistogram& other);
+    void Reset();
+
+    uint64_t Count() const { return(m_count.load(std::memory_order_relaxed)); }
+    uint64_t Sum() const { return(m_sum.load(std::memory_order_relaxed)); }
+    uint64_t Max() const { return(m_max.load(std::memory_order_relaxed)); }
+
+    //
+    // the value at or below which the fraction q of the values are, 0 <= q <= 1,
+    // as the highest value of its bucket; 0 if nothing was recorded
+    //
+    uint64_t Percentile(double q) const;
+
+    //
+    // values below bound; exact when bound is a bucket boundary, as every power
+    // of two is
+    //
+    uint64_t CountBelow(uint64_t bound) const;
+
+    static unsigned Bucket(uint64_t value)
+    {
+        unsigned bit = 0;
+
+        if (value < 2 * LATENCY_SUB_BUCKETS)
+            return((unsigned)value);
+        if (value >> LATENCY_MAX_BITS)
+            value = (1ull << LATENCY_MAX_BITS) - 1;
+
+        bit = HighestBit(value);
+        return((bit - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+            (unsigned)(value >> (bit - LATENCY_SUB_BITS)) - LATENCY_SUB_BUCKETS);
+    }
+
+    //
+    // lowest value of a bucket; the bucket ends where the next one starts
+    //
+    static uint64_t BucketLow(unsigned bucket)
+    {
+        unsigned bit = 0;
+
+        if (bucket < 2 * LATENCY_SUB_BUCKETS)
+            return(bucket);
+
+        bit = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+        return((uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (bit - LATENCY_SUB_BITS));
+    }
+
+private:
+    static void Bump(std::atomic<uint64_t>& counter, uint64_t value)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    static unsigned HighestBit(uint64_t value)
+    {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+        unsigned long index;
+
+        _BitScanReverse64(&index, value);
+        return((unsigned)index);
+#elif defined(_MSC_VER)
+        unsigned long index;
+
+        if (value >> 32) {
+            _BitScanReverse(&index, (unsigned long)(value >> 32));
+            return((unsigned)index + 32);
+        }
+        _BitScanReverse(&index, (unsigned long)value);
+        return((unsigned)index);
+#else
+        return(63 - (unsigned)__builtin_clzll(value));
+#endif
+    }
+
+    std::atomic<uint64_t> m_counts[LATENCY_BUCKETS];
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_sum;
+    std::atomic<uint64_t> m_max;
+};
@@ -0,0 +1,161 @@
+﻿#pragma once
+
+//
+// Compile-time packet dispatch.
+//
+// Every packet payload is a struct that names its packet id as a static member
+// Id, and is bound to the function that handles it with PacketBind.
+// MakePacketDispatchTable builds, at compile time, a dense array of function
+// pointers indexed by packet id, so dispatching a packet is a bounds check and
+// one indirect call: no virtual call, no hashing and no std::function.
+//
+//     struct MovePacket { static const uint16_t Id = 3; float x; float y; };
+//     bool OnMove(Session& session, const MovePacket& packet);
+//
+//     static constexpr auto g_Dispatch = MakePacketDispatchTable<Session,
+//         PacketBind<MovePacket, Session, OnMove>,
+//         PacketBind<ChatPacket, Session, OnChat>>();
+//
+//     g_Dispatch.Dispatch(session, view);
+//
+// Messages of the flat wire format are bound with PacketBindReader instead and
+// their handlers read the fields in place.
+//
+// Binding a handler whose parameter is not the bound payload type, or two
+// handlers to the same id, does not compile.  The table has one entry per id up
+// to the largest one bound, so ids should be kept small and dense.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#include "PacketRingBuffer.h"
+
+template <typename Context>
+using PacketHandler = bool (*)(Context& context, const PacketView& view);
+
+template <typename Context, size_t Size>
+class PacketDispatchTable
+{
+public:
+    constexpr PacketDispatchTable() : m_handlers() {}
+
+    constexpr void Bind(uint16_t id, PacketHandler<Context> handler) { m_handlers[id] = handler; }
+
+    //
+    // Call the handler bound to view.id.  Returns false for an id nothing is
+    // bound to, and otherwise what the handler returned.
+    //
+    bool Dispatch(Context& context, const PacketView& view) const
+    {
+        if (view.id >= Size || m_handlers[view.id] == nullptr)
+            return(false);
+        return(m_handlers[view.id](context, view));
+    }
+
+    static constexpr size_t Count() { return(Size); }
+
+private:
+    PacketHandler<Context> m_handlers[Size];
+};
+
+//
+// Bind payload type Packet to Handler.  The payload is copied out of the receive
+// buffer, where it has no particular alignment, into a local before the call,
+// and a packet whose body is not exactly sizeof(Packet) bytes is refused.
+//
+template <typename Packet, typename Context, bool (*Handler)(Context& context, const Packet& packet)>
+struct PacketBind
+{
+    static_assert(std::is_trivially_copyable<Packet>::value,
+        "packet payloads are copied out of the receive buffer and must be trivially copyable");
+    static_assert(sizeof(Packet) <= MAX_PACKET_SIZE - PACKET_HEADER_SIZE,
+        "packet payload does not fit in a packet");
+
+    typedef Packet PacketType;
+    typedef Context ContextType;
+    static const uint16_t Id = Packet::Id;
+
+    static bool Invoke(Context& context, const PacketView& view)
+    {
+        Packet packet;
+
+        if (view.bodyLength != sizeof(Packet))
+            return(false);
+        memcpy(&packet, view.body, sizeof(Packet));
+        return(Handler(context, packet));
+    }
+};
+
+//
+// Bind a WIRE_MESSAGE (see WireFormat.h) to Handler.  The handler gets a Reader
+// over the body in the receive buffer, nothing is copied.  A body shorter than
+// the message is refused; a longer one comes from a newer sender and is read.
+//
+template <typename Message, typename Context, bool (*Handler)(Context& context, const typename Message::Reader& reader)>
+struct PacketBindReader
+{
+    typedef Message PacketType;
+    typedef Context ContextType;
+    static const uint16_t Id = Message::Id;
+
+    static bool Invoke(Context& context, const PacketView& view)
+    {
+        if (view.bodyLength < Message::Size)
+            return(false);
+        return(Handler(context, typename Message::Reader(view.body)));
+    }
+};
+
+template <typename... Bindings>
+constexpr uint16_t PacketMaxId()
+{
+    const uint16_t ids[] = { Bindings::Id... };
+    uint16_t maxId = 0;
+
+    for (size_t i = 0; i < sizeof...(Bindings); i++)
+        if (ids[i] > maxId)
+            maxId = ids[i];
+    return(maxId);
+}
+
+template <typename... Bindings>
+constexpr bool PacketIdsUnique()
+{
+    const uint16_t ids[] = { Bindings::Id... };
+
+    for (size_t i = 0; i < sizeof...(Bindings); i++)
+        for (size_t j = i + 1; j < sizeof...(Bindings); j++)
+            if (ids[i] == ids[j])
+                return(false);
+    return(true);
+}
+
+template <typename Context, typename... Bindings>
+constexpr bool PacketContextsMatch()
+{
+    const bool same[] = { std::is_same<Context, typename Bindings::ContextType>::value... };
+
+    for (size_t i = 0; i < sizeof...(Bindings); i++)
+        if (!same[i])
+            return(false);
+    return(true);
+}
+
+template <typename Context, typename... Bindings>
+constexpr PacketDispatchTable<Context, PacketMaxId<Bindings...>() + 1> MakePacketDispatchTable()
+{
+    static_assert(sizeof...(Bindings) > 0, "no packet handlers bound");
+    static_assert(PacketIdsUnique<Bindings...>(), "two handlers bound to the same packet id");
+    static_assert(PacketContextsMatch<Context, Bindings...>(), "handler bound for a different context type");
+
+    PacketDispatchTable<Context, PacketMaxId<Bindings...>() + 1> table;
+    const uint16_t ids[] = { Bindings::Id... };
+    const PacketHandler<Context> handlers[] = { &Bindings::Invoke... };
+
+    for (size_t i = 0; i < sizeof...(Bindings); i++)
+        table.Bind(ids[i], handlers[i]);
+    return(table);
+}
@@ -0,0 +1,99 @@
+﻿#include "pch.h"
+#include "PacketRingBuffer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// The header is read byte by byte, so it is little-endian on any host and
+// needs no alignment.
+//
+static inline uint16_t PacketLoad16(const char* p)
+{
+    return((uint16_t)((uint8_t)p[0] | ((uint8_t)p[1] << 8)));
+}
+
+void PacketWriteHeader(char* dst, uint16_t id, uint16_t bodyLength)
+{
+    uint16_t length = (uint16_t)(bodyLength + PACKET_HEADER_SIZE);
+
+    dst[0] = (char)(length & 0xff);
+    dst[1] = (char)(length >> 8);
+    dst[2] = (char)(id & 0xff);
+    dst[3] = (char)(id >> 8);
+}
+
+PacketRingBuffer::PacketRingBuffer()
+    : m_buffer(NULL), m_capacity(0), m_read(0), m_write(0)
+{
+}
+
+PacketRingBuffer::~PacketRingBuffer()
+{
+    Exit();
+}
+
+int PacketRingBuffer::Init(size_t capacity)
+{
+    if (capacity < 2 * MAX_PACKET_SIZE)
+        return(-EINVAL);
+
+    m_buffer = (char*)malloc(capacity);
+    if (m_buffer == NULL)
+        return(-ENOMEM);
+
+    m_capacity = capacity;
+    m_read = m_write = 0;
+    return(0);
+}
+
+void PacketRingBuffer::Exit()
+{
+    free(m_buffer);
+    m_buffer = NULL;
+    m_capacity = 0;
+    m_read = m_write = 0;
+}
+
+char* PacketRingBuffer::WritePtr()
+{
+    if (m_read == m_write) {
+        m_read = m_write = 0;
+    }
+    else if (m_capacity - m_write < MAX_PACKET_SIZE && m_read) {
+        memmove(m_buffer, m_buffer + m_read, m_write - m_read);
+        m_write -= m_read;
+        m_read = 0;
+    }
+
+    return(m_buffer + m_write);
+}
+
+void PacketRingBuffer::Commit(size_t bytes)
+{
+    m_write += bytes;
+}
+
+int PacketRingBuffer::Next(PacketView* pView)
+{
+    size_t pending = m_write - m_read;
+    const char* packet = m_buffer + m_read;
+    uint16_t length = 0;
+
+    if (pending < PACKET_HEADER_SIZE)
+        return(0);
+
+    length = PacketLoad16(packet);
+    if (length < PACKET_HEADER_SIZE || length > MAX_PACKET_SIZE)
+        return(-EBADMSG);
+
+    if (pending < length)
+        return(0);
+
+    pView->id = PacketLoad16(packet + 2);
+    pView->bodyLength = (uint16_t)(length - PACKET_HEADER_SIZE);
+    pView->body = packet + PACKET_HEADER_SIZE;
+    m_read += length;
+    return(1);
+}
@@ -0,0 +1,87 @@
+﻿#pragma once
+
+//
+// Length-prefixed packet framing.
+//
+// Every packet starts with a PACKET_HEADER_SIZE byte header: the length of the
+// whole packet, header included, followed by the packet id, both 16-bit
+// little-endian.  TCP delivers a stream, so one recv can end in the middle of a
+// packet or carry several of them; PacketRingBuffer collects the stream of one
+// session and hands out every complete packet as a view into its own storage.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACKET_HEADER_SIZE  4
+#define MAX_PACKET_SIZE     8192    // header included
+
+//
+// A complete packet.  body points into the PacketRingBuffer that produced it
+// and stays valid until the next call to WritePtr() on that buffer.
+//
+struct PacketView
+{
+    uint16_t id;
+    uint16_t bodyLength;
+    const char* body;
+};
+
+//
+// Append a packet header for a body of bodyLength bytes to dst, which must have
+// room for PACKET_HEADER_SIZE bytes.
+//
+void PacketWriteHeader(char* dst, uint16_t id, uint16_t bodyLength);
+
+//
+// Receive buffer of one session.  The caller receives straight into WritePtr(),
+// reports the byte count with Commit() and then takes packets out with Next()
+// until it reports that more data is needed.
+//
+// Packets are never split around the end of the buffer: when the room left at
+// the end gets shorter than MAX_PACKET_SIZE, WritePtr() first moves the unread
+// bytes, at most one partial packet once the complete ones were taken, back to
+// the start.  That way every packet is contiguous and is handed out without a
+// copy or an allocation.
+//
+class PacketRingBuffer
+{
+public:
+    PacketRingBuffer();
+    ~PacketRingBuffer();
+
+    PacketRingBuffer(const PacketRingBuffer&) = delete;
+    PacketRingBuffer& operator=(const PacketRingBuffer&) = delete;
+
+    //
+    // Allocate capacity bytes, at least 2 * MAX_PACKET_SIZE.  Returns 0 on
+    // success or a negative errno.
+    //
+    int Init(size_t capacity = 4 * MAX_PACKET_SIZE);
+    void Exit();
+
+    //
+    // Where the next recv goes, and how much it may write there.  WritableSize()
+    // is 0 when unread packets fill the buffer.
+    //
+    char* WritePtr();
+    size_t WritableSize() const { return(m_capacity - m_write); }
+    void Commit(size_t bytes);
+
+    //
+    // Take the next complete packet.  Returns 1 and fills *pView, 0 if the
+    // packet is not complete yet, or -EBADMSG if the header carries a length
+    // outside [PACKET_HEADER_SIZE, MAX_PACKET_SIZE]; the stream can not be
+    // resynchronized after that and the session should be closed.
+    //
+    int Next(PacketView* pView);
+
+    size_t Pending() const { return(m_write - m_read); }
+    void Reset() { m_read = m_write = 0; }
+
+private:
+    char* m_buffer;
+    size_t m_capacity;
+    size_t m_read;      // first byte not handed out
+    size_t m_write;     // first byte not received
+};
@@ -0,0 +1,193 @@
+﻿#include "pch.h"
+#include "PacketTrace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <new>
+
+thread_local PacketTrace::ThreadTrace PacketTrace::t_trace = { NULL, NULL };
+
+//
+// a span as Dump copied it out of a ring
+//
+struct TraceCopy
+{
+    const char* name;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t id;
+    uint64_t value;
+    bool async;
+};
+
+static int64_t TraceSteadyNow()
+{
+    return(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+//
+// JSON string content; names are ours, but a thread name may hold anything
+//
+static void TraceAppendEscaped(std::string* json, const char* text)
+{
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\')
+            json->push_back('\\');
+        if ((unsigned char)*text >= 0x20)
+            json->push_back(*text);
+    }
+}
+
+PacketTrace::PacketTrace()
+    : m_sampleRate(0), m_tscBase(Now()), m_steadyBase(TraceSteadyNow())
+{
+}
+
+//
+// Rings are only freed here, since every thread that traced still points at
+// its own
+//
+PacketTrace::~PacketTrace()
+{
+    for (size_t i = 0; i < m_rings.size(); i++) {
+        m_rings[i]->~TraceRing();
+        ::operator delete(m_allocations[i]);
+    }
+}
+
+void PacketTrace::Init(unsigned sampleRate)
+{
+    m_sampleRate = sampleRate;
+    m_tscBase = Now();
+    m_steadyBase = TraceSteadyNow();
+}
+
+//
+// The first span of a thread gives it a ring; the only lock a thread ever takes
+// to trace.  The ring is aligned by hand, new does not align to a cache line
+// before C++17.
+//
+void PacketTrace::Register()
+{
+    void* allocation = ::operator new(sizeof(TraceRing) + 64);
+    TraceRing* ring = new ((void*)(((uintptr_t)allocation + 63) & ~(uintptr_t)63)) TraceRing();
+    std::lock_guard<std::mutex> lock(m_ringLock);
+
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->sampled = 0;
+    ring->ids = 0;
+    ring->thread = (uint32_t)m_rings.size();
+    snprintf(ring->name, sizeof(ring->name), "Thread %u", ring->thread);
+    m_rings.push_back(ring);
+    m_allocations.push_back(allocation);
+
+    t_trace.owner = this;
+    t_trace.ring = ring;
+}
+
+void PacketTrace::NameThread(const char* name)
+{
+    TraceRing* ring = Ring();
+    std::lock_guard<std::mutex> lock(m_ringLock);
+
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+size_t PacketTrace::Dump(std::string* json)
+{
+    std::vector<TraceRing*> rings;
+    std::vector<std::string> names;
+    std::vector<TraceCopy> copies(TRACE_RING_SIZE);
+    uint64_t tscNow = Now();
+    int64_t steadyNow = TraceSteadyNow();
+    double nsPerTick = 1.0;
+    size_t count = 0;
+    char event[512];
+
+    {
+        std::lock_guard<std::mutex> lock(m_ringLock);
+
+        rings = m_rings;
+        for (TraceRing* ring : rings)
+            names.push_back(ring->name);
+    }
+
+    //
+    // the rate of the TSC, measured over everything since Init, so the longer
+    // the trace the more exact
+    //
+#if TRACE_HAVE_TSC
+    if (tscNow > m_tscBase && steadyNow > m_steadyBase)
+        nsPerTick = (double)(steadyNow - m_steadyBase) / (double)(tscNow - m_tscBase);
+#endif
+
+    json->append("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    for (size_t r = 0; r < rings.size(); r++) {
+        TraceRing* ring = rings[r];
+        uint64_t head = ring->head.load(std::memory_order_acquire);
+        uint64_t first = head >= TRACE_RING_SIZE ? head - TRACE_RING_SIZE + 1 : 0;
+        uint64_t after = 0;
+
+        json->append(r ? ",\n" : "");
+        snprintf(event, sizeof(event), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"",
+            ring->thread);
+        json->append(event);
+        TraceAppendEscaped(json, names[r].c_str());
+        json->append("\"}}");
+
+        for (uint64_t p = first; p < head; p++) {
+            TraceSpan* span = &ring->spans[p & (TRACE_RING_SIZE - 1)];
+            TraceCopy* copy = &copies[p - first];
+
+            copy->name = span->name.load(std::memory_order_relaxed);
+            copy->begin = span->begin.load(std::memory_order_relaxed);
+            copy->end = span->end.load(std::memory_order_relaxed);
+            copy->id = span->id.load(std::memory_order_relaxed);
+            copy->value = span->value.load(std::memory_order_relaxed);
+            copy->async = span->async.load(std::memory_order_relaxed);
+        }
+
+        //
+        // The writer moves head past a span before it starts on the span that
+        // overwrites it, so any span the writer got to while it was copied is at
+        // or below after - TRACE_RING_SIZE and left out.  The oldest slot is
+        // always the next one written, which is why it was not even copied.
+        //
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = ring->head.load(std::memory_order_relaxed);
+
+        for (uint64_t p = first; p < head; p++) {
+            const TraceCopy* copy = &copies[p - first];
+            double begin = (double)(int64_t)(copy->begin - m_tscBase) * nsPerTick / 1000.0;
+            double duration = (double)(int64_t)(copy->end - copy->begin) * nsPerTick / 1000.0;
+
+            if (p + TRACE_RING_SIZE <= after || copy->name == NULL)
+                continue;
+
+            //
+            // an async span is a begin and an end event with the packet as id
+            //
+            if (copy->async)
+                snprintf(event, sizeof(event),
+                    ",\n{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"b\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,"
+                    "\"args\":{\"value\":%llu}},\n"
+                    "{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"e\",\"id\":\"0x%llx\",\"pid\":1,\"tid\":%u,\"ts\":%.3f}",
+                    copy->name, (unsigned long long)copy->id, ring->thread, begin, (unsigned long long)copy->value,
+                    copy->name, (unsigned long long)copy->id, ring->thread, begin + (duration > 0 ? duration : 0.0));
+            else
+                snprintf(event, sizeof(event),
+                    ",\n{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"args\":{\"packet\":\"0x%llx\",\"value\":%llu}}",
+                    copy->name, ring->thread, begin, duration > 0 ? duration : 0.0,
+                    (unsigned long long)copy->id, (unsigned long long)copy->value);
+            json->append(event);
+            count++;
+        }
+    }
+
+    json->append("\n]}\n");
+    return(count);
+}
@@ -0,0 +1,200 @@
+﻿#pragma once
+
+//
+// Sampled per-packet tracing, to see where the time of a slow packet went:
+// waiting in the kernel, in the completion queue, in its handler or in the
+// send.  Compiled in only with PACKET_TRACE=1; otherwise the TRACE_ macros
+// are empty and nothing of it is left on the I/O paths.
+//
+// A span is a named stage of one packet, with a begin and an end read from the
+// time stamp counter (TSC), which costs a few nanoseconds where a clock read of
+// the system costs tens.  The TSC is taken to be invariant, ticking at one rate
+// on every core, as it does on every x86 processor of the last decade; it is
+// converted to time only when the spans are dumped.
+//
+// Every thread writes its spans into a ring of its own, without a lock; when
+// the ring is full the oldest are overwritten.  Only one in every sampleRate
+// packets is traced, so tracing can be left on under load.  Dump writes what
+// every ring holds in the Chrome trace event format, which chrome://tracing
+// and https://ui.perfetto.dev load, at any time, while the rings are written:
+// a span overwritten while it was being read is left out.
+//
+// A span is shown on the track of the thread that wrote it, so it must lie
+// within the time the thread spent on the packet.  A span that began on
+// another thread, or while the thread did other work, such as the time a send
+// spent in the kernel, is written with TRACE_ASYNC_SPAN instead and is shown on
+// a track of the packet.
+//
+//     if (TRACE_SAMPLE(g_trace))
+//         id = g_trace.NextId();
+//     ...
+//     TRACE_SPAN(g_trace, "handler", begin, TRACE_NOW(), id, bytes);
+//
+
+#ifndef PACKET_TRACE
+#define PACKET_TRACE        0
+#endif
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TRACE_HAVE_TSC      1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_HAVE_TSC      1
+#else
+#define TRACE_HAVE_TSC      0
+#endif
+
+#define TRACE_RING_SIZE     16384           // spans a thread keeps, and one, a power of 2
+#define TRACE_SAMPLE_RATE   1024            // packets per traced one, by default
+#define TRACE_THREAD_NAME   32
+
+//
+// The fields are atomics only so a dump may read them while they are written;
+// every access is relaxed and costs what a plain one does.
+//
+struct TraceSpan
+{
+    std::atomic<const char*> name;          // a static string
+    std::atomic<uint64_t> begin;            // TSC
+    std::atomic<uint64_t> end;
+    std::atomic<uint64_t> id;               // the packet
+    std::atomic<uint64_t> value;            // bytes, or whatever the stage counts
+    std::atomic<bool> async;                // shown on a track of the packet, not the thread
+};
+
+//
+// One thread's spans.  Only the owning thread writes it.
+//
+struct TraceRing
+{
+    std::atomic<uint64_t> head;             // spans written so far
+    uint64_t sampled;                       // packets offered to Sample
+    uint64_t ids;                           // ids handed out by NextId
+    uint32_t thread;                        // order the thread first traced in
+    char name[TRACE_THREAD_NAME];
+    TraceSpan spans[TRACE_RING_SIZE];
+};
+
+class PacketTrace
+{
+public:
+    PacketTrace();
+    ~PacketTrace();
+
+    PacketTrace(const PacketTrace&) = delete;
+    PacketTrace& operator=(const PacketTrace&) = delete;
+
+    //
+    // Trace one packet in every sampleRate, 0 for none.  Called once, before
+    // any thread traces.
+    //
+    void Init(unsigned sampleRate = TRACE_SAMPLE_RATE);
+
+    static uint64_t Now()
+    {
+#if TRACE_HAVE_TSC
+        return(__rdtsc());
+#else
+        return((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+    }
+
+    //
+    // whether to trace the packet at hand, true for every sampleRate-th one
+    //
+    bool Sample()
+    {
+        TraceRing* ring = NULL;
+
+        if (m_sampleRate == 0)
+            return(false);
+        ring = Ring();
+        return(++ring->sampled % m_sampleRate == 0);
+    }
+
+    //
+    // an id for a sampled packet, unique across threads, never 0
+    //
+    uint64_t NextId()
+    {
+        TraceRing* ring = Ring();
+
+        return(((uint64_t)(ring->thread + 1) << 40) | ++ring->ids);
+    }
+
+    void Span(const char* name, uint64_t begin, uint64_t end, uint64_t id, uint64_t value, bool async = false)
+    {
+        TraceRing* ring = Ring();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        TraceSpan* span = &ring->spans[head & (TRACE_RING_SIZE - 1)];
+
+        //
+        // whoever reads what this overwrites sees head moved past it, see Dump
+        //
+        std::atomic_thread_fence(std::memory_order_release);
+        span->name.store(name, std::memory_order_relaxed);
+        span->begin.store(begin, std::memory_order_relaxed);
+        span->end.store(end, std::memory_order_relaxed);
+        span->id.store(id, std::memory_order_relaxed);
+        span->value.store(value, std::memory_order_relaxed);
+        span->async.store(async, std::memory_order_relaxed);
+        ring->head.store(head + 1, std::memory_order_release);
+    }
+
+    //
+    // the name the calling thread is shown with
+    //
+    void NameThread(const char* name);
+
+    //
+    // Append every span the rings hold to json, as a Chrome trace.  Any thread
+    // may call it at any time.  Returns the number of spans.
+    //
+    size_t Dump(std::string* json);
+
+private:
+    TraceRing* Ring()
+    {
+        if (t_trace.owner != this)
+            Register();
+        return(t_trace.ring);
+    }
+    void Register();
+
+    struct ThreadTrace
+    {
+        PacketTrace* owner;
+        TraceRing* ring;
+    };
+    static thread_local ThreadTrace t_trace;
+
+    std::mutex m_ringLock;
+    std::vector<TraceRing*> m_rings;
+    std::vector<void*> m_allocations;       // what was allocated for every ring
+
+    unsigned m_sampleRate;
+    uint64_t m_tscBase;                     // TSC at Init
+    int64_t m_steadyBase;                   // steady clock at the same moment, in ns
+};
+
+#if PACKET_TRACE
+#define TRACE_NOW()                                 PacketTrace::Now()
+#define TRACE_SAMPLE(trace)                         (trace).Sample()
+#define TRACE_SPAN(trace, name, begin, end, id, value)  (trace).Span(name, begin, end, id, value)
+#define TRACE_ASYNC_SPAN(trace, name, begin, end, id, value)    (trace).Span(name, begin, end, id, value, true)
+#else
+#define TRACE_NOW()                                 ((uint64_t)0)
+#define TRACE_SAMPLE(trace)                         false
+#define TRACE_SPAN(trace, name, begin, end, id, value)  ((void)0)
+#define TRACE_ASYNC_SPAN(trace, name, begin, end, id, value)    ((void)0)
+#endif
@@ -0,0 +1,161 @@
+﻿#include "pch.h"
+#include "TimerWheel.h"
+
+static inline void TimerListInit(TimerWheelEntry* head)
+{
+    head->next = head->prev = head;
+}
+
+static inline void TimerListAdd(TimerWheelEntry* head, TimerWheelEntry* entry)
+{
+    entry->next = head;
+    entry->prev = head->prev;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void TimerListUnlink(TimerWheelEntry* entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry->prev = NULL;
+}
+
+TimerWheel::TimerWheel()
+    : m_now(0), m_count(0)
+{
+    Init(0);
+}
+
+TimerWheel::~TimerWheel()
+{
+}
+
+void TimerWheel::Init(uint64_t now)
+{
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        for (unsigned slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+            TimerListInit(&m_slots[level][slot]);
+    m_now = now;
+    m_count = 0;
+}
+
+void TimerWheel::Schedule(TimerWheelEntry* entry, uint64_t expires)
+{
+    if (entry->prev)
+        TimerListUnlink(entry);
+    else
+        m_count++;
+
+    entry->expires = expires;
+    Place(entry, m_now + 1);
+}
+
+void TimerWheel::Cancel(TimerWheelEntry* entry)
+{
+    if (entry->prev == NULL)
+        return;
+
+    TimerListUnlink(entry);
+    m_count--;
+}
+
+TimerWheelEntry* TimerWheel::Advance(uint64_t now)
+{
+    TimerWheelEntry* expired = NULL;
+    TimerWheelEntry** tail = &expired;
+
+    //
+    // nothing to find on the way when no timer runs
+    //
+    if (m_count == 0 && now > m_now)
+        m_now = now;
+
+    while (m_now < now) {
+        unsigned slot = 0;
+        TimerWheelEntry* head = NULL;
+
+        m_now++;
+        slot = (unsigned)(m_now & (TIMER_WHEEL_SLOTS - 1));
+        if (slot == 0)
+            Cascade(1);
+
+        head = &m_slots[0][slot];
+        while (head->next != head) {
+            TimerWheelEntry* entry = head->next;
+
+            TimerListUnlink(entry);
+            m_count--;
+            *tail = entry;
+            tail = &entry->next;
+        }
+        *tail = NULL;
+
+        if (m_count == 0 && now > m_now)
+            m_now = now;
+    }
+
+    return(expired);
+}
+
+//
+// file a timer in the finest wheel that reaches its expiry, or tick first if it
+// is due earlier
+//
+void TimerWheel::Place(TimerWheelEntry* entry, uint64_t first)
+{
+    uint64_t expires = entry->expires;
+    uint64_t delta = 0;
+    unsigned level = 0;
+
+    if (expires < first)
+        expires = first;
+    delta = expires - m_now;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+        if (delta < ((uint64_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+            break;
+
+    //
+    // beyond the reach of the top wheel the timer waits in its furthest slot,
+    // and is placed again when that slot comes round
+    //
+    if (delta >= ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+        expires = m_now + ((uint64_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+    TimerListAdd(&m_slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)], entry);
+}
+
+//
+// the wheel below completed a turn: spread the next slot of this one over it,
+// after cascading the wheel above if this one completed a turn as well.  This
+// runs before the slot of tick m_now is handed out, so m_now is still on time.
+//
+void TimerWheel::Cascade(unsigned level)
+{
+    unsigned slot = (unsigned)((m_now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    TimerWheelEntry* head = &m_slots[level][slot];
+    TimerWheelEntry list;
+
+    if (slot == 0 && level + 1 < TIMER_WHEEL_LEVELS)
+        Cascade(level + 1);
+
+    if (head->next == head)
+        return;
+
+    //
+    // take the whole slot off first, a timer may land in it again
+    //
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    TimerListInit(head);
+
+    while (list.next != &list) {
+        TimerWheelEntry* entry = list.next;
+
+        TimerListUnlink(entry);
+        Place(entry, m_now);
+    }
+}
@@ -0,0 +1,87 @@
+﻿#pragma once
+
+//
+// Hierarchical timing wheel.
+//
+// Holds any number of timers and starts, cancels and restarts each in O(1), so
+// every session can keep its own idle, heartbeat and resend timers and reset
+// them on every packet.  Time is counted in ticks of whatever length the owner
+// picks; the owner calls Advance() from its loop with the current tick and gets
+// back the timers that came due.
+//
+// There are TIMER_WHEEL_LEVELS wheels of TIMER_WHEEL_SLOTS slots.  A slot of the
+// first wheel is one tick, a slot of every next wheel spans a whole turn of the
+// one below.  A timer goes into the finest wheel that reaches its expiry, and
+// whenever a wheel completes a turn the next slot of the wheel above is spread
+// out over the one below, so a timer moves down at most once per level and
+// fires on the very tick it is due.  Timers further out than the wheels reach
+// wait in the top wheel and are placed again as time gets closer.
+//
+// The timer itself is a TimerWheelEntry embedded in the object it belongs to,
+// so nothing is allocated.  A TimerWheel is used from one thread, the one
+// whose loop drives it, like an IoUring.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_BITS    8
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+
+struct TimerWheelEntry
+{
+    TimerWheelEntry* next;
+    TimerWheelEntry* prev;          // NULL while the timer is not running
+    uint64_t expires;               // tick it fires on
+};
+
+class TimerWheel
+{
+public:
+    TimerWheel();
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    //
+    // Start the clock at tick now.  Timers still running are dropped.
+    //
+    void Init(uint64_t now);
+
+    //
+    // Start entry to fire on tick expires, or move it there if it is running.
+    // A tick that has already passed fires on the next Advance().
+    //
+    void Schedule(TimerWheelEntry* entry, uint64_t expires);
+
+    //
+    // Stop entry if it is running.
+    //
+    void Cancel(TimerWheelEntry* entry);
+
+    static bool Pending(const TimerWheelEntry* entry) { return(entry->prev != NULL); }
+    static void InitEntry(TimerWheelEntry* entry) { entry->next = entry->prev = NULL; entry->expires = 0; }
+
+    //
+    // Move the clock forward to tick now and return every timer that came due,
+    // chained through next and no longer running.  Take next before scheduling
+    // an entry again from the list.
+    //
+    TimerWheelEntry* Advance(uint64_t now);
+
+    uint64_t Now() const { return(m_now); }
+    size_t Count() const { return(m_count); }
+
+private:
+    void Place(TimerWheelEntry* entry, uint64_t first);
+    void Cascade(unsigned level);
+
+    //
+    // every slot is a circular list through a sentinel
+    //
+    TimerWheelEntry m_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t m_now;                 // last tick handed out by Advance()
+    size_t m_count;
+};
@@ -0,0 +1,120 @@
+﻿#pragma once
+
+//
+// Flat little-endian wire format.
+//
+// A message is a fixed sequence of scalar fields packed back to back with no
+// padding, in the order the schema lists them, each stored little-endian.  The
+// schema of a message is a list macro naming its fields; WIRE_MESSAGE expands it
+// into a struct with the packet id, the body size and two views:
+//
+//     #define POSITION_FIELDS(FIELD) FIELD(uint32_t, EntityId) FIELD(float, X) FIELD(float, Y)
+//     WIRE_MESSAGE(Position, 3, POSITION_FIELDS)
+//
+//     Position::Reader reader(view.body);         // reads fields in place
+//     float x = reader.X();
+//
+//     Position::Builder(sendBuffer)               // writes header and body in place
+//         .SetEntityId(7).SetX(1.0f).SetY(2.0f);
+//
+// A Reader only holds a pointer into the receive buffer and loads a field when
+// it is asked for; a Builder writes the packet header and every field straight
+// into the buffer it is given, which needs Position::PacketSize bytes.  Nothing
+// is decoded into an object and nothing is allocated.  Fields may only ever be
+// appended to a message, and readers accept bodies longer than they know, so
+// an old reader keeps working against a newer sender.
+//
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+#include "PacketRingBuffer.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define WIRE_BIG_ENDIAN_HOST    1
+#else
+#define WIRE_BIG_ENDIAN_HOST    0
+#endif
+
+//
+// Load and store one scalar at an unaligned little-endian address.  On the
+// little-endian hosts we build for this is a plain unaligned load or store.
+//
+template <typename T>
+inline T WireLoad(const char* src)
+{
+    static_assert(std::is_arithmetic<T>::value, "wire fields must be scalars");
+
+    T value;
+#if WIRE_BIG_ENDIAN_HOST
+    char swapped[sizeof(T)];
+    for (size_t i = 0; i < sizeof(T); i++)
+        swapped[i] = src[sizeof(T) - 1 - i];
+    memcpy(&value, swapped, sizeof(T));
+#else
+    memcpy(&value, src, sizeof(T));
+#endif
+    return(value);
+}
+
+template <typename T>
+inline void WireStore(char* dst, T value)
+{
+    static_assert(std::is_arithmetic<T>::value, "wire fields must be scalars");
+
+#if WIRE_BIG_ENDIAN_HOST
+    char swapped[sizeof(T)];
+    memcpy(swapped, &value, sizeof(T));
+    for (size_t i = 0; i < sizeof(T); i++)
+        dst[i] = swapped[sizeof(T) - 1 - i];
+#else
+    memcpy(dst, &value, sizeof(T));
+#endif
+}
+
+//
+// Field expanders used by WIRE_MESSAGE.  Layout lays the fields out as byte
+// arrays, which have no alignment, so offsetof gives the packed wire offset.
+//
+#define WIRE_FIELD_LAYOUT(type, name) \
+    char name[sizeof(type)];
+
+#define WIRE_FIELD_GET(type, name) \
+    type name() const { return(WireLoad<type>(m_data + offsetof(Layout, name))); }
+
+#define WIRE_FIELD_SET(type, name) \
+    Builder& Set##name(type value) { WireStore<type>(m_data + offsetof(Layout, name), value); return(*this); }
+
+#define WIRE_MESSAGE(Name, PacketId, FIELDS)                                        \
+    struct Name                                                                     \
+    {                                                                               \
+        struct Layout { FIELDS(WIRE_FIELD_LAYOUT) };                                \
+                                                                                    \
+        static const uint16_t Id = PacketId;                                        \
+        static const uint16_t Size = (uint16_t)sizeof(Layout);                      \
+        static const uint16_t PacketSize = (uint16_t)(PACKET_HEADER_SIZE + sizeof(Layout)); \
+                                                                                    \
+        class Reader                                                                \
+        {                                                                           \
+        public:                                                                     \
+            explicit Reader(const char* body) : m_data(body) {}                     \
+            FIELDS(WIRE_FIELD_GET)                                                  \
+        private:                                                                    \
+            const char* m_data;                                                     \
+        };                                                                          \
+                                                                                    \
+        class Builder                                                               \
+        {                                                                           \
+        public:                                                                     \
+            explicit Builder(char* packet) : m_data(packet + PACKET_HEADER_SIZE)    \
+            {                                                                       \
+                PacketWriteHeader(packet, Id, Size);                                \
+            }                                                                       \
+            FIELDS(WIRE_FIELD_SET)                                                  \
+        private:                                                                    \
+            char* m_data;                                                           \
+        };                                                                          \
+    };                                                                              \
+    static_assert(Name::PacketSize <= MAX_PACKET_SIZE, #Name " does not fit in a packet")
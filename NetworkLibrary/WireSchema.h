@@ -0,0 +1,35 @@
+﻿#pragma once
+
+//
+// Messages exchanged with the game client.  Every message is one WIRE_MESSAGE;
+// see WireFormat.h for the rules.  Packet ids are indexes into the dispatch
+// table, so keep them small and dense, and never reuse or reorder fields of a
+// message that has shipped: append new ones at the end.
+//
+
+#include "WireFormat.h"
+
+//
+// where an entity is, sent every tick it moved
+//
+#define POSITION_UPDATE_FIELDS(FIELD)   \
+    FIELD(uint32_t, EntityId)           \
+    FIELD(uint32_t, Tick)               \
+    FIELD(float, X)                     \
+    FIELD(float, Y)                     \
+    FIELD(float, Z)                     \
+    FIELD(float, Yaw)
+WIRE_MESSAGE(PositionUpdate, 1, POSITION_UPDATE_FIELDS);
+
+//
+// what an entity is doing, sent when it changes
+//
+#define STATE_UPDATE_FIELDS(FIELD)      \
+    FIELD(uint32_t, EntityId)           \
+    FIELD(uint32_t, Tick)               \
+    FIELD(uint16_t, Hp)                 \
+    FIELD(uint16_t, MaxHp)              \
+    FIELD(uint16_t, AnimationId)        \
+    FIELD(uint8_t, State)               \
+    FIELD(uint8_t, Flags)
+WIRE_MESSAGE(StateUpdate, 2, STATE_UPDATE_FIELDS);